@@ -0,0 +1,62 @@
+// The chunked body decoder in fetch_response_bytes(), fed 16K reads of an endless
+// body of small (31 byte) or large (4K) chunks. The decoded body is thrown away.
+#define _GNU_SOURCE
+#include "micro.h"
+#include "lib/fetch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define READ_SIZE (16 * 1024)
+
+struct corpus {
+    struct fetch_state *st;
+    char *wire;                 // whole chunks only, so it can be fed again and again
+    size_t len;
+    size_t off;
+};
+
+static ssize_t discard(void *c, const char *buf, size_t n) {
+    (void) c, (void) buf;
+    return n;
+}
+
+static void op(void *ctx, long long i, size_t *bytes) {
+    (void) i;
+    struct corpus *c = ctx;
+    size_t n = c->len - c->off < READ_SIZE ? c->len - c->off : READ_SIZE;
+    *bytes += fetch_response_bytes(c->st, c->wire + c->off, n);
+    c->off = c->off + n == c->len ? 0 : c->off + n;
+}
+
+static void run(const char *name, size_t chunk_size) {
+    struct corpus c = {0};
+    FILE *out = open_memstream(&c.wire, &c.len);
+    char *payload = malloc(chunk_size);
+    memset(payload, 'x', chunk_size);
+    for (size_t total = 0; total < 4 * 1024 * 1024; total += chunk_size) {
+        fprintf(out, "%zx\r\n", chunk_size);
+        fwrite(payload, 1, chunk_size, out);
+        fputs("\r\n", out);
+    }
+    fclose(out);
+    free(payload);
+
+    cookie_io_functions_t io = { .write = discard };
+    FILE *sink = fopencookie(NULL, "w", io);
+    setvbuf(sink, NULL, _IONBF, 0);
+    c.st = fetch_state_new("http://localhost/", (const char *[4]) {0}, sink);
+
+    const char head[] = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n";
+    fetch_response_bytes(c.st, head, sizeof(head) - 1);
+    micro_run(name, op, &c, 50 * 1000);
+
+    fetch_state_free(c.st);
+    free(c.wire);
+}
+
+int main(void) {
+    run("chunked/31_byte_chunks", 31);
+    run("chunked/4k_chunks", 4096);
+}
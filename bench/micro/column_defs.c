@@ -0,0 +1,36 @@
+// parse_column_defs(): a 12 column declaration with defaults and generated columns.
+#include "micro.h"
+#include "lib/sql.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static const char *const ARGV[] = {
+    "vttp", "main", "patients",
+    "url text default 'https://r4.smarthealthit.org/Patient'",
+    "headers text default 'Accept: application/fhir+json'",
+    "id text",
+    "\"resourceType\" text",
+    "gender text",
+    "\"birthDate\" text",
+    "version text generated always as (meta->'versionId')",
+    "updated text generated always as (meta->'lastUpdated')",
+    "status text generated always as (text->'status')",
+    "name text",
+    "address text",
+    "telecom text",
+};
+#define ARGC ((int) (sizeof(ARGV) / sizeof(ARGV[0])))
+
+static void op(void *ctx, long long i, size_t *bytes) {
+    (void) ctx, (void) i;
+    size_t n = 0;
+    struct column_def *defs = parse_column_defs(ARGC, ARGV, &n);
+    for (size_t c = NUM_HIDDEN_COLUMNS; c < n; c++)
+        *bytes += len(defs[c].name) + len(defs[c].typename);
+    column_defs_free(defs, n);
+}
+
+int main(void) {
+    micro_run("column_defs/12_columns", op, NULL, 200 * 1000);
+}
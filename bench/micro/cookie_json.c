@@ -0,0 +1,56 @@
+// COOKIE_JSON: a response body written in and its rows read back out, the way
+// fetch_drain() does it, one 16K write at a time.
+#define _GNU_SOURCE
+#include "micro.h"
+#include "lib/cookie.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define ROWS 1000
+#define WRITE_SIZE (16 * 1024)
+
+struct corpus {
+    char *body;
+    size_t len;
+};
+
+/** Read every row STREAM has ready the way handoff_fill() does, adding their bytes to BYTES. */
+static void drain(FILE *stream, size_t *bytes) {
+    static char buf[WRITE_SIZE];
+    fflush(stream);
+    clearerr(stream);
+    size_t got;
+    while ((got = fread(buf, 1, sizeof(buf), stream)) > 0)
+        *bytes += got;
+    clearerr(stream);
+}
+
+static void op(void *ctx, long long i, size_t *bytes) {
+    (void) i;
+    struct corpus *c = ctx;
+    FILE *stream = cookie(&COOKIE_JSON, NULL);
+    for (size_t off = 0; off < c->len; off += WRITE_SIZE) {
+        size_t n = c->len - off < WRITE_SIZE ? c->len - off : WRITE_SIZE;
+        fwrite8(c->body + off, n, stream);
+        *bytes += n;
+        drain(stream, bytes);
+    }
+    fclose(stream);
+}
+
+int main(void) {
+    struct corpus c = {0};
+    FILE *out = open_memstream(&c.body, &c.len);
+    fputc('[', out);
+    for (int id = 0; id < ROWS; id++) {
+        fprintf(out, "%s{\"id\":%d,\"name\":\"user %d\",\"tags\":[\"a\",\"b\"],"
+                "\"address\":{\"city\":\"Springfield\",\"zip\":\"%05d\"},\"active\":%s}",
+                id ? "," : "", id, id, id, id % 2 ? "true" : "false");
+    }
+    fputc(']', out);
+    fclose(out);
+
+    micro_run("cookie_json/1000_rows", op, &c, 200);
+    free(c.body);
+}
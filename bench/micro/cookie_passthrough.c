@@ -0,0 +1,34 @@
+// COOKIE_PASSTHROUGH: bytes written in and read straight back out, 16K at a time.
+#include "micro.h"
+#include "lib/cookie.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define WRITE_SIZE (16 * 1024)
+#define BODY_SIZE (1024 * 1024)
+
+static void op(void *ctx, long long i, size_t *bytes) {
+    (void) i;
+    const char *body = ctx;
+    static char buf[WRITE_SIZE];
+    FILE *stream = cookie(&COOKIE_PASSTHROUGH, NULL);
+    for (size_t off = 0; off < BODY_SIZE; off += WRITE_SIZE) {
+        fwrite8(body + off, WRITE_SIZE, stream);
+        fflush(stream);
+        clearerr(stream);
+        size_t got;
+        while ((got = fread(buf, 1, sizeof(buf), stream)) > 0)
+            *bytes += got;
+        clearerr(stream);
+    }
+    fclose(stream);
+}
+
+int main(void) {
+    char *body = malloc(BODY_SIZE);
+    memset(body, 'x', BODY_SIZE);
+    micro_run("cookie_passthrough/1M", op, body, 200);
+    free(body);
+}
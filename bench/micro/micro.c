@@ -0,0 +1,78 @@
+#include "micro.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* glibc's own allocator, which the wrappers below count calls into */
+extern void *__libc_malloc(size_t n);
+extern void *__libc_calloc(size_t count, size_t n);
+extern void *__libc_realloc(void *p, size_t n);
+extern void *__libc_memalign(size_t align, size_t n);
+
+static long long allocs;
+
+#define COUNT() __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED)
+
+void *malloc(size_t n) {
+    COUNT();
+    return __libc_malloc(n);
+}
+
+void *calloc(size_t count, size_t n) {
+    COUNT();
+    return __libc_calloc(count, n);
+}
+
+void *realloc(void *p, size_t n) {
+    COUNT();
+    return __libc_realloc(p, n);
+}
+
+void *aligned_alloc(size_t align, size_t n) {
+    COUNT();
+    return __libc_memalign(align, n);
+}
+
+int posix_memalign(void **p, size_t align, size_t n) {
+    COUNT();
+    *p = __libc_memalign(align, n);
+    return *p ? 0 : 12; // ENOMEM
+}
+
+long long micro_allocs(void) {
+    return __atomic_load_n(&allocs, __ATOMIC_RELAXED);
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void micro_run(const char *name, micro_op *op, void *ctx, long long ops) {
+    const char *scale = getenv("MICRO_SCALE");
+    if (scale && atof(scale) > 0)
+        ops = (long long) (ops * atof(scale));
+    if (ops < 1)
+        ops = 1;
+
+    size_t bytes = 0;
+    for (long long i = 0; i < ops / 10; i++)
+        op(ctx, i, &bytes);
+
+    bytes = 0;
+    long long allocs_before = micro_allocs();
+    double started = now_ns();
+    for (long long i = 0; i < ops; i++)
+        op(ctx, i, &bytes);
+    double elapsed = now_ns() - started;
+    long long allocated = micro_allocs() - allocs_before;
+
+    printf("{\"bench\":\"%s\",\"ops\":%lld,\"ns_per_op\":%.1f,"
+           "\"allocs_per_op\":%.3f,\"bytes_per_op\":%.1f}\n",
+           name, ops, elapsed / ops, (double) allocated / ops, (double) bytes / ops);
+    fflush(stdout);
+}
+
+#undef COUNT
@@ -0,0 +1,30 @@
+/**
+ * @file micro.h
+ * @brief A tiny harness for the microbenchmarks in bench/micro, one executable per
+ * layer, each timing a fixed corpus without a network.
+ *
+ * Linking micro.c replaces `malloc()` and friends with counting wrappers around
+ * glibc's, so every allocation in the process is counted, inside shared libraries
+ * too.
+ */
+#pragma once
+#include <stddef.h>
+
+/**
+ * @brief Operation I of a benchmark on CTX, adding the bytes it moved through the
+ * layer under test to BYTES.
+ */
+typedef void micro_op(void *ctx, long long i, size_t *bytes);
+
+/**
+ * @brief Time OPS calls of OP on CTX, after a tenth as many to warm up, and print a
+ * JSON line with NAME and its ns, allocations and bytes per op.
+ *
+ * `MICRO_SCALE=0.1` in the environment scales OPS, for a quick run.
+ */
+void micro_run(const char *name, micro_op *op, void *ctx, long long ops);
+
+/**
+ * @brief Allocations made in the process so far.
+ */
+long long micro_allocs(void);
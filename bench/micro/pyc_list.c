@@ -0,0 +1,19 @@
+// struct list: building a 16 node list tail first, counting and freeing it, the way
+// a GENERATED ALWAYS AS path is.
+#include "micro.h"
+#include "lib/pyc.h"
+
+#define NODES 16
+
+static void op(void *ctx, long long i, size_t *bytes) {
+    (void) ctx, (void) i;
+    struct list *ls = list(STR("entry"));
+    for (int n = 1; n < NODES; n++)
+        insert(ls, STR("resource"));
+    *bytes += len(ls) * sizeof(struct str);
+    done(ls);
+}
+
+int main(void) {
+    micro_run("pyc_list/build_16", op, NULL, 1000 * 1000);
+}
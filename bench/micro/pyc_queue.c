@@ -0,0 +1,33 @@
+// struct queue: one insert and one pop, with the queue holding a steady backlog.
+#include "micro.h"
+#include "lib/pyc.h"
+
+#define BACKLOG 64
+
+static void op(void *ctx, long long i, size_t *bytes) {
+    (void) i;
+    struct queue *q = ctx;
+    insert(q, STR("row"));
+    struct str s = next(q);
+    *bytes += s.length;
+}
+
+static void fill_and_drain(void *ctx, long long i, size_t *bytes) {
+    (void) ctx, (void) i;
+    struct queue *q = queue();
+    for (int n = 0; n < 1000; n++)
+        insert(q, STR("row"));
+    while (len(q) > 0)
+        *bytes += next(q).length;
+    done(q);
+}
+
+int main(void) {
+    struct queue *q = queue();
+    for (int i = 0; i < BACKLOG; i++)
+        insert(q, STR("row"));
+    micro_run("pyc_queue/insert_pop", op, q, 10 * 1000 * 1000);
+    done(q);
+
+    micro_run("pyc_queue/fill_drain_1000", fill_and_drain, NULL, 10 * 1000);
+}
@@ -0,0 +1,70 @@
+// make bench: scan the local stand-in server (server.mjs) with libvttp.so through
+// every scenario, printing one JSON line per run.
+//
+//   BENCH_RUNS=3        runs of each scenario
+//   BENCH_FILTER=regex  only the scenarios whose name matches
+import { execFileSync, spawn } from "node:child_process";
+import { access } from "node:fs/promises";
+import { createInterface } from "node:readline";
+import { exit } from "node:process";
+
+const FLAT = "id int, name text, email text, score int, active int";
+const WIDE = ["id int", ...Array.from({ length: 39 }, (_, i) => `field_${i} text`)].join(", ");
+const FHIR = `id text,
+    "resourceType" text,
+    gender text,
+    "birthDate" text,
+    version text generated always as (meta->'versionId'),
+    updated text generated always as (meta->'lastUpdated'),
+    status text generated always as (text->'status'),
+    name text,
+    address text,
+    telecom text`;
+
+const SCENARIOS = [
+    { name: "flat", server: "http", params: { n: 100000 }, columns: FLAT },
+    { name: "flat-https", server: "https", params: { n: 100000 }, columns: FLAT },
+    { name: "flat-h2", server: "h2", params: { n: 100000 }, columns: FLAT },
+    { name: "flat-gzip", server: "http", params: { n: 100000, gzip: 1 }, columns: FLAT },
+    { name: "flat-small-chunks", server: "http", params: { n: 100000, chunk: 512 }, columns: FLAT },
+    { name: "flat-padded", server: "http", params: { n: 20000, pad: 1000 }, columns: FLAT },
+    { name: "flat-latency", server: "http", params: { n: 1000, latency: 50 }, columns: FLAT },
+    { name: "wide", server: "http", params: { n: 20000 }, columns: WIDE },
+    { name: "fhir", server: "http", params: { n: 20000, shape: "fhir" }, columns: FHIR },
+    { name: "fhir-h2", server: "h2", params: { n: 20000, shape: "fhir" }, columns: FHIR },
+];
+
+const runs = Number(process.env.BENCH_RUNS ?? 3);
+const filter = new RegExp(process.env.BENCH_FILTER ?? "");
+
+const built = await access("./libvttp.so").then(() => true).catch(() => false);
+if (!built) {
+    console.error("build libvttp.so first");
+    exit(1);
+}
+
+const server = spawn("node", [new URL("./server.mjs", import.meta.url).pathname], {
+    stdio: ["ignore", "pipe", "inherit"],
+});
+const ports = JSON.parse(await new Promise((resolve) => {
+    createInterface({ input: server.stdout }).once("line", resolve);
+}));
+
+try {
+    for (const scenario of SCENARIOS.filter((s) => filter.test(s.name))) {
+        const scheme = scenario.server === "http" ? "http" : "https";
+        const query = new URLSearchParams({ shape: "flat", ...scenario.params });
+        const url = `${scheme}://127.0.0.1:${ports[scenario.server]}/rows?${query}`;
+
+        for (let run = 0; run < runs; run++) {
+            const out = execFileSync("node", [
+                new URL("./scan.mjs", import.meta.url).pathname,
+                JSON.stringify(scenario),
+                url,
+            ], { encoding: "utf8", stdio: ["ignore", "pipe", "inherit"] });
+            console.log(JSON.stringify({ scenario: scenario.name, run, ...JSON.parse(out) }));
+        }
+    }
+} finally {
+    server.kill();
+}
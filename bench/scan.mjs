@@ -0,0 +1,44 @@
+// One benchmark run in a process of its own, so its peak RSS and CPU time are its
+// alone: node scan.mjs '<scenario json>' <url>. Prints one JSON result line.
+import Database from "better-sqlite3";
+import { hrtime, resourceUsage } from "node:process";
+
+const scenario = JSON.parse(process.argv[2]);
+const url = process.argv[3];
+
+const db = new Database().loadExtension("./libvttp");
+db.exec(`create virtual table bench using vttp (
+    url text default '${url}',
+    ${scenario.columns}
+);`);
+const bodyBytes = db.prepare(`select value from vttp_stats where name = 'body_bytes'`).pluck();
+
+const baselineRss = resourceUsage().maxRSS;
+const cpuBefore = resourceUsage();
+const bytesBefore = bodyBytes.get();
+const started = hrtime.bigint();
+
+let rows = 0;
+let firstRow = null;
+for (const _ of db.prepare(scenario.query ?? "select * from bench").iterate()) {
+    if (rows++ === 0)
+        firstRow = hrtime.bigint();
+}
+
+const seconds = Number(hrtime.bigint() - started) / 1e9;
+const cpuAfter = resourceUsage();
+const cpuUs = (cpuAfter.userCPUTime - cpuBefore.userCPUTime)
+    + (cpuAfter.systemCPUTime - cpuBefore.systemCPUTime);
+const bytes = bodyBytes.get() - bytesBefore;
+
+console.log(JSON.stringify({
+    rows,
+    bytes,
+    seconds: Number(seconds.toFixed(4)),
+    rows_per_sec: Math.round(rows / seconds),
+    mb_per_sec: Number((bytes / 1e6 / seconds).toFixed(2)),
+    ttfr_ms: firstRow === null ? null : Number((Number(firstRow - started) / 1e6).toFixed(2)),
+    peak_rss_kb: cpuAfter.maxRSS,
+    baseline_rss_kb: baselineRss,
+    cpu_ns_per_row: rows ? Math.round(cpuUs * 1000 / rows) : null,
+}));
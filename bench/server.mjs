@@ -0,0 +1,144 @@
+// Stand-in API for the benchmarks: serves synthetic JSON over HTTP, HTTPS and HTTP/2.
+//
+// GET /rows?n=1000&shape=flat&pad=0&chunk=16384&latency=0&gzip=0
+//   n        rows in the top level array
+//   shape    flat (5 fields), wide (40 fields) or fhir (nested Patient resources)
+//   pad      extra characters in every string field
+//   chunk    bytes per write, each one a chunk of the chunked body
+//   latency  milliseconds to wait before the headers go out
+//   gzip     1 to send the body gzipped
+//
+// Prints {"http":port,"https":port,"h2":port} once it's listening, then serves until
+// it's killed.
+import { execSync } from "node:child_process";
+import { mkdtempSync, readFileSync, rmSync } from "node:fs";
+import { createServer } from "node:http";
+import { createServer as createHttpsServer } from "node:https";
+import { createSecureServer } from "node:http2";
+import { tmpdir } from "node:os";
+import path from "node:path";
+import { gzipSync } from "node:zlib";
+
+/** The same rows every run, so results compare across commits. */
+function seeded(seed) {
+    return () => {
+        seed = (seed * 1103515245 + 12345) % 2147483648;
+        return seed / 2147483648;
+    };
+}
+
+const SHAPES = {
+    flat(id, pad, rand) {
+        return {
+            id,
+            name: `user ${id}${pad}`,
+            email: `user${id}@example.com`,
+            score: Math.floor(rand() * 100000),
+            active: rand() < 0.5,
+        };
+    },
+
+    wide(id, pad, rand) {
+        const row = { id };
+        for (let i = 0; i < 39; i++)
+            row[`field_${i}`] = i % 3 === 0 ? Math.floor(rand() * 1e6) : `value ${i}${pad}`;
+        return row;
+    },
+
+    fhir(id, pad, rand) {
+        return {
+            resourceType: "Patient",
+            id: `patient-${id}`,
+            meta: { versionId: String(1 + (id % 7)), lastUpdated: "2024-01-01T00:00:00Z" },
+            text: { status: "generated", div: `<div>Patient ${id}${pad}</div>` },
+            identifier: [{ system: "urn:oid:1.2.36.146.595.217.0.1", value: String(id) }],
+            name: [{ use: "official", family: `Family${id}`, given: [`Given${id}`, "Middle"] }],
+            telecom: [{ system: "phone", value: `555-${id}`, use: "home" }],
+            gender: rand() < 0.5 ? "female" : "male",
+            birthDate: "1970-01-01",
+            address: [{
+                use: "home",
+                line: [`${id} Main St${pad}`],
+                city: "Springfield",
+                postalCode: String(10000 + (id % 90000)),
+            }],
+        };
+    },
+};
+
+const bodies = new Map();
+
+/** The JSON body for N rows of SHAPE, built once per set of params. */
+function body(n, shape, padLen, gzip) {
+    const key = `${n}/${shape}/${padLen}/${gzip}`;
+    if (!bodies.has(key)) {
+        const rand = seeded(42);
+        const pad = "x".repeat(padLen);
+        const rows = Array.from({ length: n }, (_, id) => SHAPES[shape](id, pad, rand));
+        const json = Buffer.from(JSON.stringify(rows));
+        bodies.set(key, gzip ? gzipSync(json) : json);
+    }
+    return bodies.get(key);
+}
+
+function handler(req, res) {
+    const url = new URL(req.url, "http://localhost");
+    const param = (name, fallback) => Number(url.searchParams.get(name) ?? fallback);
+    const shape = url.searchParams.get("shape") ?? "flat";
+    if (url.pathname !== "/rows" || !SHAPES[shape]) {
+        res.writeHead(404).end();
+        return;
+    }
+
+    const gzip = param("gzip", 0) === 1;
+    const data = body(param("n", 1000), shape, param("pad", 0), gzip);
+    const chunk = Math.max(1, param("chunk", 16384));
+
+    setTimeout(() => {
+        res.writeHead(200, {
+            "content-type": "application/json",
+            ...(gzip ? { "content-encoding": "gzip" } : {}),
+        });
+        let off = 0;
+        const write = () => {
+            while (off < data.length) {
+                const end = Math.min(off + chunk, data.length);
+                const more = res.write(data.subarray(off, end));
+                off = end;
+                if (!more) {
+                    res.once("drain", write);
+                    return;
+                }
+            }
+            res.end();
+        };
+        write();
+    }, param("latency", 0));
+}
+
+const dir = mkdtempSync(path.join(tmpdir(), "vttp-bench-"));
+execSync(
+    `openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=localhost \
+        -keyout key.pem -out cert.pem`,
+    { cwd: dir, stdio: "ignore" },
+);
+const tls = {
+    key: readFileSync(path.join(dir, "key.pem")),
+    cert: readFileSync(path.join(dir, "cert.pem")),
+};
+rmSync(dir, { recursive: true });
+
+const servers = {
+    http: createServer(handler),
+    https: createHttpsServer(tls, handler),
+    h2: createSecureServer(tls, handler),
+};
+
+const ports = {};
+await Promise.all(Object.entries(servers).map(([name, server]) => new Promise((resolve) => {
+    server.listen(0, "127.0.0.1", () => {
+        ports[name] = server.address().port;
+        resolve();
+    });
+})));
+console.log(JSON.stringify(ports));
@@ -0,0 +1,44 @@
+//! [fetch_start usage]
+#define _GNU_SOURCE
+#include <vapi.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+
+static const char *URLS[] = {
+    "https://jsonplaceholder.typicode.com/todos",
+    "https://jsonplaceholder.typicode.com/users",
+    "https://jsonplaceholder.typicode.com/albums",
+};
+#define N (sizeof(URLS) / sizeof(URLS[0]))
+
+int main(void) {
+    struct fetch_handle *handles[N] = {0};
+    struct pollfd fds[N] = {0};
+    for (size_t i = 0; i < N; i++) {
+        handles[i] = fetch_start(URLS[i], NULL, NULL);
+        fds[i] = (struct pollfd) { .fd = handles[i] ? fetch_fd(handles[i]) : -1, .events = POLLIN };
+    }
+
+    size_t open = N;
+    while (open > 0 && poll(fds, N, -1) > 0) {
+        for (size_t i = 0; i < N; i++) {
+            if (!(fds[i].revents & (POLLIN | POLLHUP)))
+                continue;
+
+            const char *row = NULL;
+            size_t len = 0;
+            int rc;
+            while ((rc = fetch_next_row(handles[i], &row, &len)) == 1)
+                printf("%s: %s\n", URLS[i], row);
+
+            if (rc == 0 || errno != EAGAIN) {
+                fetch_close(handles[i]);
+                fds[i].fd = -1; // poll() skips it from now on
+                open--;
+            }
+        }
+    }
+    return 0;
+}
+//! [fetch_start usage]
@@ -0,0 +1,192 @@
+#include "batch.h"
+#include "debug.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int batch_format_of(const char *name, size_t n) {
+    if (n == 5 && strncmp(name, "array", 5) == 0)
+        return BATCH_ARRAY;
+    if (n == 4 && strncmp(name, "fhir", 4) == 0)
+        return BATCH_FHIR;
+    return -1;
+}
+
+const char *batch_content_type(enum batch_format format) {
+    return format == BATCH_FHIR ? "application/fhir+json" : "application/json";
+}
+
+/** BINDING as JSON if it parses as JSON, otherwise as a string. NULL if out of memory. */
+static yyjson_mut_val *binding_val(yyjson_mut_doc *doc, const char *binding) {
+    yyjson_doc *parsed = yyjson_read(binding, strlen(binding), 0);
+    if (!parsed)
+        return yyjson_mut_strcpy(doc, binding);
+
+    yyjson_mut_val *val = yyjson_val_mut_copy(doc, yyjson_doc_get_root(parsed));
+    yyjson_doc_free(parsed);
+    return val;
+}
+
+/** The FHIR Bundle entry that looks up BINDING. NULL if out of memory. */
+static yyjson_mut_val *fhir_entry(yyjson_mut_doc *doc, const char *binding) {
+    yyjson_mut_val *val = binding_val(doc, binding);
+    if (!val || yyjson_mut_is_obj(val))
+        return val; // already a whole entry
+
+    yyjson_mut_val *request = yyjson_mut_obj(doc);
+    yyjson_mut_val *entry = yyjson_mut_obj(doc);
+    if (!request || !entry
+        || !yyjson_mut_obj_add_str(doc, request, "method", "GET")
+        || !yyjson_mut_obj_add_strcpy(doc, request, "url", binding)
+        || !yyjson_mut_obj_add_val(doc, entry, "request", request))
+    {
+        return NULL;
+    }
+    return entry;
+}
+
+char *batch_request(enum batch_format format, const char *const *bindings, size_t n,
+                    size_t *len)
+{
+    yyjson_mut_doc *doc = yyjson_mut_doc_new(NULL);
+    yyjson_mut_val *list = doc ? yyjson_mut_arr(doc) : NULL;
+    if (!list)
+        goto nomem;
+
+    for (size_t i = 0; i < n; i++) {
+        yyjson_mut_val *val = format == BATCH_FHIR
+            ? fhir_entry(doc, bindings[i])
+            : binding_val(doc, bindings[i]);
+        if (!val || !yyjson_mut_arr_append(list, val))
+            goto nomem;
+    }
+
+    yyjson_mut_val *root = list;
+    if (format == BATCH_FHIR) {
+        root = yyjson_mut_obj(doc);
+        if (!root
+            || !yyjson_mut_obj_add_str(doc, root, "resourceType", "Bundle")
+            || !yyjson_mut_obj_add_str(doc, root, "type", "batch")
+            || !yyjson_mut_obj_add_val(doc, root, "entry", list))
+        {
+            goto nomem;
+        }
+    }
+    yyjson_mut_doc_set_root(doc, root);
+
+    char *body = yyjson_mut_write(doc, 0, len);
+    yyjson_mut_doc_free(doc);
+    if (!body)
+        return enomem(NULL);
+    return body;
+
+nomem:
+    yyjson_mut_doc_free(doc);
+    return enomem(NULL);
+}
+
+/** Growable list of #batch_row. */
+struct rows {
+    struct batch_row *hd;
+    size_t len;
+    size_t cap;
+};
+
+static bool rows_push(struct rows *rows, size_t binding, yyjson_val *val) {
+    if (!yyjson_is_obj(val))
+        return true; // only objects have columns
+
+    if (rows->len == rows->cap) {
+        size_t cap = rows->cap ? rows->cap * 2 : 64;
+        struct batch_row *hd = realloc(rows->hd, cap * sizeof(struct batch_row));
+        if (!hd)
+            return enomem(false);
+        rows->hd = hd;
+        rows->cap = cap;
+    }
+    rows->hd[rows->len++] = (struct batch_row) { .binding = binding, .val = val };
+    return true;
+}
+
+/** Push VAL as BINDING's rows: each element if it's an array, or VAL itself. */
+static bool rows_push_all(struct rows *rows, size_t binding, yyjson_val *val) {
+    if (!yyjson_is_arr(val))
+        return rows_push(rows, binding, val);
+
+    size_t idx, max;
+    yyjson_val *row;
+    yyjson_arr_foreach(val, idx, max, row) {
+        if (!rows_push(rows, binding, row))
+            return false;
+    }
+    return true;
+}
+
+/** Did the FHIR batch-response ENTRY succeed? Entries without a status are taken as OK. */
+static bool fhir_entry_ok(yyjson_val *entry) {
+    const char *status = yyjson_get_str(
+        yyjson_obj_get(yyjson_obj_get(entry, "response"), "status"));
+    return !status || status[0] == '2';
+}
+
+/** Push the resources of FHIR searchset BUNDLE as BINDING's rows. */
+static bool rows_push_bundle(struct rows *rows, size_t binding, yyjson_val *bundle) {
+    size_t idx, max;
+    yyjson_val *entry;
+    yyjson_arr_foreach(yyjson_obj_get(bundle, "entry"), idx, max, entry) {
+        if (!rows_push(rows, binding, yyjson_obj_get(entry, "resource")))
+            return false;
+    }
+    return true;
+}
+
+ssize_t batch_rows(enum batch_format format, yyjson_doc *response, size_t n,
+                   struct batch_row **rows_out)
+{
+    yyjson_val *root = yyjson_doc_get_root(response);
+    yyjson_val *entries = format == BATCH_FHIR ? yyjson_obj_get(root, "entry") : root;
+    if (format == BATCH_FHIR && !yyjson_is_obj(root)) {
+        fprintf(stderr, "batch response isn't a FHIR Bundle\n");
+        return -1;
+    }
+    if (entries && !yyjson_is_arr(entries)) {
+        fprintf(stderr, "batch response isn't a list of entries\n");
+        return -1;
+    }
+    if (yyjson_arr_size(entries) < n) {
+        fprintf(stderr, "batch response only answered %zu of %zu lookups\n",
+                yyjson_arr_size(entries), n);
+    }
+
+    struct rows rows = {0};
+    size_t idx, max;
+    yyjson_val *entry;
+    yyjson_arr_foreach(entries, idx, max, entry) {
+        if (idx >= n)
+            break;
+
+        bool ok = true;
+        if (format == BATCH_FHIR) {
+            yyjson_val *resource = yyjson_obj_get(entry, "resource");
+            const char *type = yyjson_get_str(yyjson_obj_get(resource, "resourceType"));
+            if (!fhir_entry_ok(entry))
+                continue;
+            if (type && strcmp(type, "Bundle") == 0)
+                ok = rows_push_bundle(&rows, idx, resource);
+            else
+                ok = rows_push(&rows, idx, resource);
+        } else {
+            ok = rows_push_all(&rows, idx, entry);
+        }
+
+        if (!ok) {
+            free(rows.hd);
+            return -1;
+        }
+    }
+
+    *rows_out = rows.hd;
+    return rows.len;
+}
@@ -0,0 +1,81 @@
+/**
+ * @file batch.h
+ * @brief Coalesce many lookups into one batched request, and route the entries
+ * of its response back to the lookup that asked for each of them.
+ *
+ * A lookup is a single `body` binding. N of them go out as one request, so N
+ * lookups cost one round trip instead of N.
+ */
+#pragma once
+#include <stddef.h>
+#include <sys/types.h>
+#include <yyjson.h>
+
+/**
+ * @brief How a batch of lookups is written into a request, and how the response
+ * answers each of them.
+ */
+enum batch_format {
+    BATCH_NONE = 0,
+
+    /**
+     * POST a JSON array of the bindings, each one embedded as JSON if it parses as
+     * JSON or as a string otherwise. The response is an array whose element I answers
+     * binding I, either with an array of rows or with a single row.
+     */
+    BATCH_ARRAY,
+
+    /**
+     * POST a FHIR `batch` Bundle with one entry per binding. A binding that's a JSON
+     * object is used as the entry itself, anything else is the URL of a GET entry
+     * (e.g. `Patient?family=Smith`). Entry I of the `batch-response` answers binding I,
+     * and a `Bundle` resource in it (a searchset) answers with its own entries.
+     */
+    BATCH_FHIR,
+};
+
+/** Lookups per batched request when the table doesn't say. */
+#define BATCH_SIZE_DEFAULT 50
+
+/**
+ * @brief The #batch_format named by the N bytes of NAME (`array` or `fhir`).
+ *
+ * @retval -1 Unknown format.
+ */
+int batch_format_of(const char *name, size_t n);
+
+/**
+ * @brief The `Content-Type` of a batch request body in FORMAT.
+ */
+const char *batch_content_type(enum batch_format format);
+
+/**
+ * @brief Write the N BINDINGS into one request body in FORMAT, writing its length
+ * out to LEN.
+ *
+ * @retval NULL Error, out of memory.
+ * @retval NOT_NULL OK - free with `free()`.
+ */
+char *batch_request(enum batch_format format, const char *const *bindings, size_t n,
+                    size_t *len);
+
+/**
+ * @brief One row of a batch response, and the index of the binding it answers.
+ */
+struct batch_row {
+    size_t binding;
+    yyjson_val *val;
+};
+
+/**
+ * @brief Split the RESPONSE to a batch of N bindings in FORMAT into its rows, in
+ * binding order. The rows point into RESPONSE, so free it after them.
+ *
+ * Entries past the N-th are ignored, and an entry that failed or is missing
+ * just answers with no rows.
+ *
+ * @retval -1 Error, RESPONSE isn't a batch response in FORMAT, or out of memory.
+ * @retval x>=0 OK - x rows written out to ROWS, free with `free()`.
+ */
+ssize_t batch_rows(enum batch_format format, yyjson_doc *response, size_t n,
+                   struct batch_row **rows);
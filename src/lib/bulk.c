@@ -0,0 +1,166 @@
+#define _GNU_SOURCE
+#include "bulk.h"
+#include "debug.h"
+
+#include <curl/curl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static char *strdup_or_null(const char *s) {
+    return s ? strdup(s) : NULL;
+}
+
+static void write_free(struct bulk_write *write) {
+    free(write->url);
+    free(write->headers);
+    free(write->key);
+    free(write->json);
+}
+
+bool bulk_push(struct bulk *bulk, enum bulk_op op, const char *url, const char *headers,
+               const char *key, char *json)
+{
+    if (bulk->len == bulk->cap) {
+        size_t cap = bulk->cap ? bulk->cap * 2 : 64;
+        struct bulk_write *hd = realloc(bulk->hd, cap * sizeof(struct bulk_write));
+        if (!hd) {
+            free(json);
+            return enomem(false);
+        }
+        bulk->hd = hd;
+        bulk->cap = cap;
+    }
+
+    struct bulk_write write = {
+        .op = op,
+        .url = strdup(url),
+        .headers = strdup_or_null(headers),
+        .key = strdup_or_null(key),
+        .json = json,
+    };
+    if (!write.url || (headers && !write.headers) || (key && !write.key)) {
+        write_free(&write);
+        return enomem(false);
+    }
+    bulk->hd[bulk->len++] = write;
+    return true;
+}
+
+void bulk_clear(struct bulk *bulk) {
+    for (size_t i = 0; i < bulk->len; i++)
+        write_free(&bulk->hd[i]);
+    bulk->len = 0;
+}
+
+void bulk_free(struct bulk *bulk) {
+    bulk_clear(bulk);
+    free(bulk->hd);
+    *bulk = (struct bulk) {0};
+}
+
+static bool same_str(const char *a, const char *b) {
+    return a == b || (a && b && strcmp(a, b) == 0);
+}
+
+size_t bulk_run(const struct bulk *bulk, size_t off, size_t max) {
+    const struct bulk_write *first = &bulk->hd[off];
+    if (first->op != BULK_INSERT)
+        return 1;
+
+    size_t n = 1;
+    while (n < max && off + n < bulk->len) {
+        const struct bulk_write *next = &bulk->hd[off + n];
+        if (next->op != BULK_INSERT
+            || strcmp(next->url, first->url) != 0
+            || !same_str(next->headers, first->headers))
+        {
+            break;
+        }
+        n += 1;
+    }
+    return n;
+}
+
+/**
+ * URL with KEY percent-encoded as its last path segment, ahead of any query string
+ * or fragment, NULL if out of memory.
+ */
+static char *key_url(const char *url, const char *key) {
+    char *escaped = curl_easy_escape(NULL, key, 0);
+    if (!escaped)
+        return enomem(NULL);
+
+    // "/todos?x=1" takes key 7 as "/todos/7?x=1"
+    int path_len = (int) strcspn(url, "?#");
+    bool slash = path_len > 0 && url[path_len - 1] == '/';
+    char *out = NULL;
+    if (asprintf(&out, "%.*s%s%s%s", path_len, url, slash ? "" : "/", escaped, url + path_len) < 0)
+        out = enomem(NULL);
+    curl_free(escaped);
+    return out;
+}
+
+/** The N inserted rows from OFF as one JSON array, NULL if out of memory. */
+static char *insert_body(const struct bulk *bulk, size_t off, size_t n, size_t *len) {
+    size_t total = 2;
+    for (size_t i = off; i < off + n; i++)
+        total += strlen(bulk->hd[i].json) + 1;
+
+    char *body = malloc(total + 1);
+    if (!body)
+        return enomem(NULL);
+
+    char *p = body;
+    *p++ = '[';
+    for (size_t i = off; i < off + n; i++) {
+        if (i > off)
+            *p++ = ',';
+        size_t row_len = strlen(bulk->hd[i].json);
+        memcpy(p, bulk->hd[i].json, row_len);
+        p += row_len;
+    }
+    *p++ = ']';
+    *p = '\0';
+    *len = p - body;
+    return body;
+}
+
+bool bulk_request(const struct bulk *bulk, size_t off, size_t n, char **url,
+                  char **body, size_t *len)
+{
+    const struct bulk_write *first = &bulk->hd[off];
+    *body = NULL;
+    *len = 0;
+
+    switch (first->op) {
+    case BULK_INSERT:
+        *url = strdup(first->url);
+        *body = *url ? insert_body(bulk, off, n, len) : NULL;
+        break;
+    case BULK_UPDATE:
+        *url = key_url(first->url, first->key);
+        *body = *url ? strdup(first->json) : NULL;
+        *len = *body ? strlen(*body) : 0;
+        break;
+    case BULK_DELETE:
+        *url = key_url(first->url, first->key);
+        return *url != NULL;
+    }
+
+    if (!*url || !*body) {
+        free(*url);
+        free(*body);
+        return enomem(false);
+    }
+    return true;
+}
+
+const char *bulk_method(enum bulk_op op) {
+    switch (op) {
+    case BULK_INSERT: return "POST";
+    case BULK_UPDATE: return "PUT";
+    case BULK_DELETE: return "DELETE";
+    }
+    return NULL;
+}
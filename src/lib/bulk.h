@@ -0,0 +1,86 @@
+/**
+ * @file bulk.h
+ * @brief Queue the rows written to a table during a transaction, and turn them into
+ * as few requests as possible once it commits.
+ *
+ * Consecutive inserts into the same URL go out together as one JSON array, so N
+ * inserted rows cost N / bulk_size round trips instead of N. Updates and deletes
+ * address a single row each, so they stay one request per row.
+ */
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+
+/** What a #bulk_write does to its row, and the method it's sent with. */
+enum bulk_op {
+    BULK_INSERT,    ///< `POST url` with the row, coalesced into a JSON array
+    BULK_UPDATE,    ///< `PUT url/key` with the row
+    BULK_DELETE,    ///< `DELETE url/key`
+};
+
+/** Inserted rows per bulk request when the table doesn't say. */
+#define BULK_SIZE_DEFAULT 500
+
+/** Most requests of a flush that are in flight at once. */
+#define BULK_IN_FLIGHT 8
+
+/**
+ * @brief One written row waiting for the transaction to commit.
+ */
+struct bulk_write {
+    enum bulk_op op;
+    char *url;
+    char *headers;      ///< NULL for none
+    char *key;          ///< the row's key, NULL for inserts
+    char *json;         ///< the row as a JSON object, NULL for deletes
+};
+
+/**
+ * @brief The writes of a transaction, in the order they were made.
+ */
+struct bulk {
+    struct bulk_write *hd;
+    size_t len;
+    size_t cap;
+};
+
+/**
+ * @brief Queue a write of OP onto BULK. Everything but JSON is copied, JSON is taken
+ * over and freed along with BULK, even on error.
+ *
+ * @retval false Error, out of memory.
+ */
+bool bulk_push(struct bulk *bulk, enum bulk_op op, const char *url, const char *headers,
+               const char *key, char *json);
+
+/**
+ * @brief Drop every queued write of BULK, keeping its buffer for the next transaction.
+ */
+void bulk_clear(struct bulk *bulk);
+
+/**
+ * @brief Free BULK and every queued write in it.
+ */
+void bulk_free(struct bulk *bulk);
+
+/**
+ * @brief The number of writes from index OFF of BULK that go out in one request:
+ * up to MAX consecutive inserts into the same URL with the same headers, or 1.
+ */
+size_t bulk_run(const struct bulk *bulk, size_t off, size_t max);
+
+/**
+ * @brief The request for the N writes from index OFF of BULK, as counted by
+ * #bulk_run(). Writes its URL out to URL and its body out to BODY and LEN, or NULL
+ * to BODY if it has none.
+ *
+ * @retval false Error, out of memory.
+ * @retval true OK - free URL and BODY with `free()`.
+ */
+bool bulk_request(const struct bulk *bulk, size_t off, size_t n, char **url,
+                  char **body, size_t *len);
+
+/**
+ * @brief The method #bulk_request() is sent with for OP.
+ */
+const char *bulk_method(enum bulk_op op);
@@ -1,15 +1,20 @@
+#define _GNU_SOURCE
 #include "debug.h"
 #include "pyc.h"
+#include "stats.h"
 
 #include <errno.h>
 #include <stdlib.h>
-#define _GNU_SOURCE
+#include <string.h>
 #include <yyjson.h>
 #include <yajl/yajl_parse.h>
 
 /** Fixed number of JSON object levels to traverse before returning. */
 #define MAX_DEPTH 64
 
+/** Starting size of the in-memory record ring. It grows if a single response outpaces it. */
+#define RING_INIT_SIZE (64 * 1024)
+
 #define push(cur, field, value) ((cur->field[cur->current_depth]) = value)
 
 struct cookie {
@@ -19,34 +24,54 @@ struct cookie {
     void  (*destroy)(void *);     // free backend state
 };
 
+/**
+ * Append S to R, growing R when it's full. Both ends of a cookie ring live on
+ * the same thread, so growing in place is safe here.
+ */
+static bool ring_append(struct ring *r, struct str s) {
+    while (!insert(r, s)) {
+        size_t need = len(r) + s.length + 2 * sizeof(uint32_t);
+        if (!ring_grow(r, need * 2))
+            return false;
+    }
+    stats_peak(STAT_ROW_BACKLOG, len(r));
+    return true;
+}
+
 struct passthrough {
-    struct queue *queue;
+    struct ring *ring;
+    size_t offset;  // bytes of the front record already read
 };
 
 static ssize_t passthrough_write(void *c, const char *buf, size_t n) {
     struct passthrough *st = c;
-    char *copy = malloc(n);
-    memcpy(copy, buf, n);
-    struct str copy_str = strn(copy, n);
-    insert(st->queue, copy_str);
+    if (!ring_append(st->ring, strn((char *) buf, n)))
+        return enomem(0);
     return n;
 }
 
 static ssize_t passthrough_read(void *c, char *buf, size_t n) {
     struct passthrough *st = c;
-    struct str front = next(st->queue);
+    struct str front = hd(st->ring);
     if (!front.hd)
         return 0;
-    size_t out = len(front) < n ? len(front) : n;
-    memcpy(buf, front.hd, out);
-    free(front.hd);
+
+    size_t remaining = len(front) - st->offset;
+    size_t out = remaining < n ? remaining : n;
+    memcpy(buf, front.hd + st->offset, out);
+
+    st->offset += out;
+    if (st->offset == len(front)) {
+        ring_pop(st->ring);
+        st->offset = 0;
+    }
     return out;
 }
 
 static int passthrough_close(void *c) {
     struct passthrough *st = c;
-    if (st->queue)
-        done(st->queue);
+    if (st->ring)
+        done(st->ring);
     free(st);
     return 0;
 }
@@ -56,8 +81,8 @@ static void *passthrough_make(void *_) {
     if (!st)
         return NULL;
 
-    st->queue = calloc(1, sizeof(struct queue *));
-    if (!st->queue) {
+    st->ring = ring(RING_INIT_SIZE);
+    if (!st->ring) {
         free(st);
         return NULL;
     }
@@ -70,8 +95,8 @@ static void passthrough_destroy(void *state) {
     if (!st)
         return;
 
-    if (st->queue)
-        done(st->queue);
+    if (st->ring)
+        done(st->ring);
 
     free(st);
 }
@@ -92,7 +117,7 @@ struct json_writable {
     struct list *path;
     struct list *path_parent;
     unsigned int current_depth;
-    struct queue *queue;
+    struct ring *ring;
 
     // JSON property names memory
     char **keys;
@@ -103,12 +128,15 @@ struct json_writable {
     yyjson_mut_doc *doc_root;
     yyjson_mut_val *object_stack[MAX_DEPTH];
     unsigned int pp_flags;
+    bool keep_docs;     // rows go into RING as documents, see COOKIE_JSON_DOCS
+
+    // Reused backing memory for serializing each finished row
+    char *scratch;
+    size_t scratch_cap;
 };
 
 struct json_readable {
-    struct queue *queue;
-    char *current;
-    size_t length;
+    struct ring *ring;
     size_t offset;
     bool emit_newline;
 };
@@ -291,6 +319,33 @@ static int handle_map_key(void *ctx,
     return 1;
 }
 
+/**
+ * Serialize the finished row in CUR into its scratch buffer, writing out the
+ * length to LEN. The returned buffer is only valid until the next row.
+ */
+static char *write_row(struct json_writable *cur, size_t *len) {
+    if (!cur->scratch) {
+        cur->scratch_cap = 4096;
+        cur->scratch = malloc(cur->scratch_cap);
+    }
+
+    while (cur->scratch) {
+        yyjson_alc alc;
+        yyjson_alc_pool_init(&alc, cur->scratch, cur->scratch_cap);
+
+        char *json = yyjson_mut_write_opts(cur->doc_root, cur->pp_flags, &alc, len, NULL);
+        if (json)
+            return json;
+
+        // pool was too small for this row, so double it and try again
+        free(cur->scratch);
+        cur->scratch_cap *= 2;
+        cur->scratch = malloc(cur->scratch_cap);
+    }
+
+    return enomem(NULL);
+}
+
 static int handle_end_map(void *ctx) {
     struct json_writable *cur = ctx;
     if (cur->path) {return 1;}
@@ -300,12 +355,14 @@ static int handle_end_map(void *ctx) {
         // so that any nested object child can recursively push its own
         // node to the key / parent stack
 
-        yyjson_doc *final =
-            yyjson_mut_doc_imut_copy(cur->doc_root, NULL);
-        if (!final) {
-            fprintf(stderr, "could not copy to immutable doc\n");
-            return 0;
-        }
+        size_t json_len = 0;
+        char *json = NULL;
+        yyjson_mut_doc *doc = NULL;
+        if (cur->keep_docs)
+            // the keys are freed below, so the row takes copies of its own
+            doc = yyjson_mut_doc_mut_copy(cur->doc_root, NULL);
+        else
+            json = write_row(cur, &json_len);
         yyjson_mut_doc_free(cur->doc_root);
 
         if (cur->keys) {
@@ -316,12 +373,17 @@ static int handle_end_map(void *ctx) {
         }
         cur->keys_size = 0;
 
-        char *json = yyjson_write(final, cur->pp_flags, NULL);
-        struct str json_str = {.hd=json,.length=strlen(json)};
-        // we push to queue
-        insert(cur->queue, json_str);
+        if (!json && !doc) {
+            fprintf(stderr, "could not serialize row\n");
+            return 0;
+        }
+        struct str row = doc ? strn((char *) &doc, sizeof(doc)) : strn(json, json_len);
+        if (!ring_append(cur->ring, row)) {
+            yyjson_mut_doc_free(doc);
+            return enomem(0);
+        }
+        stats_add(STAT_ROWS, 1);
 
-        yyjson_doc_free(final);
         cur->path = cur->path_parent;
     }
     cur->current_depth--;
@@ -365,9 +427,9 @@ static struct json_writable *use_state(void) {
         return enomem(NULL);
     }
 
-    // IMPORTANT: do NOT allocate st->queue here.
-    // It must be set by stream_writable() to point to caller's queue.
-    st->queue = NULL;
+    // IMPORTANT: do NOT allocate st->ring here.
+    // It must be set by stream_writable() to point to caller's ring.
+    st->ring = NULL;
     return st;
 }
 
@@ -395,7 +457,9 @@ size_t fwrite8(const char *src, size_t n, FILE *dst)
 
 static ssize_t json_fwrite(void *__cookie, const char *buf, size_t size) {
     json_t *cookie = __cookie;
+    long long started = stats_now_us();
     yajl_parse(cookie->writable.parser, (const unsigned char *)buf, size);
+    stats_time(STAT_PARSE_US, stats_now_us() - started);
     return size;
 }
 
@@ -413,12 +477,14 @@ static int json_fclose(void *__cookie) {
     if (cookie->writable.keys) {
         free(cookie->writable.keys);
     }
+    free(cookie->writable.scratch);
 
-    /// cleanup queue
-    if (!cookie->readable.queue) { 
+    /// cleanup ring, unless it's the caller's
+    if (!cookie->readable.ring) { 
         rc += 1;
     }
-    done(cookie->readable.queue);
+    if (!cookie->writable.keep_docs)
+        done(cookie->readable.ring);
 
     free(cookie);
     return 0;
@@ -441,33 +507,25 @@ static ssize_t json_fread(void *__cookie, char *buf, size_t size)
             return out;   // return immediately (stream semantics)
         }
 
-        /* Load next JSON object if needed */
-        if (!cookie->readable.current) {
-            struct str front = next(cookie->readable.queue);
-            if (!front.hd)
-                return out;
-            cookie->readable.current = front.hd;
-
-            cookie->readable.length = len(front);
-            cookie->readable.offset = 0;
-        }
+        /* Peek the next JSON object, it stays in the ring until fully read */
+        struct str front = hd(cookie->readable.ring);
+        if (!front.hd)
+            return out;
 
         /* Emit JSON bytes */
-        size_t remaining = cookie->readable.length - cookie->readable.offset;
+        size_t remaining = len(front) - cookie->readable.offset;
         size_t to_copy = remaining < (size - out)
             ? remaining
             : (size - out);
 
-        memcpy(buf + out, cookie->readable.current + cookie->readable.offset, to_copy);
+        memcpy(buf + out, front.hd + cookie->readable.offset, to_copy);
 
         cookie->readable.offset += to_copy;
         out += to_copy;
 
-        if (cookie->readable.offset == cookie->readable.length) {
-            if (cookie->readable.current)
-                free(cookie->readable.current);
-
-            cookie->readable.current = NULL;
+        if (cookie->readable.offset == len(front)) {
+            ring_pop(cookie->readable.ring);
+            cookie->readable.offset = 0;
             cookie->readable.emit_newline = true;
         }
 
@@ -479,7 +537,11 @@ static ssize_t json_fread(void *__cookie, char *buf, size_t size)
     return out;
 }
 
-static void *json_make(void *__path) {
+/**
+ * State for a JSON cookie parsing the rows at PATH into DOCS, or into a ring of its
+ * own as text if DOCS is NULL.
+ */
+static struct json *json_new(struct list *path, struct ring *docs) {
     struct json *jc = calloc(1, sizeof *jc);
     if (!jc)
         return NULL;
@@ -490,14 +552,14 @@ static void *json_make(void *__path) {
     if (!jc->writable.keys)
         goto fail;
 
-    /* queue */
-    jc->writable.queue = jc->readable.queue =
-        calloc(1, sizeof(struct queue *));
-    if (!jc->readable.queue)
+    /* ring */
+    jc->writable.keep_docs = docs != NULL;
+    jc->writable.ring = jc->readable.ring = docs ? docs : ring(RING_INIT_SIZE);
+    if (!jc->readable.ring)
         goto fail;
 
     /* body path */
-    jc->writable.path = __path;
+    jc->writable.path = path;
     jc->writable.path_parent = NULL;
 
     /* yajl parser */
@@ -510,12 +572,26 @@ static void *json_make(void *__path) {
 
 fail:
     if (jc->writable.parser) yajl_free(jc->writable.parser);
-    if (jc->readable.queue) done(jc->readable.queue);
+    if (jc->readable.ring && !docs) done(jc->readable.ring);
     free(jc->writable.keys);
     free(jc);
     return NULL;
 }
 
+static void *json_make(void *__path) {
+    return json_new(__path, NULL);
+}
+
+static void *json_docs_make(void *docs) {
+    return docs ? json_new(NULL, docs) : NULL;
+}
+
+/** There's no text to read, the rows are in the caller's ring. */
+static ssize_t json_docs_fread(void *__cookie, char *buf, size_t size) {
+    (void) __cookie, (void) buf, (void) size;
+    return 0;
+}
+
 static void json_destroy(void *state) {
     struct json *jc = state;
     if (!jc)
@@ -531,10 +607,11 @@ static void json_destroy(void *state) {
             free(jc->writable.keys[i]);
         free(jc->writable.keys);
     }
+    free(jc->writable.scratch);
 
-    /* queue */
-    if (jc->readable.queue)
-        done(jc->readable.queue);
+    /* ring, unless it's the caller's */
+    if (jc->readable.ring && !jc->writable.keep_docs)
+        done(jc->readable.ring);
 
     free(jc);
 }
@@ -550,6 +627,17 @@ const struct cookie COOKIE_JSON = {
     .destroy = json_destroy
 };
 
+const struct cookie COOKIE_JSON_DOCS = {
+    .f = {
+        .write = json_fwrite,
+        .close = json_fclose,
+        .read  = json_docs_fread,
+        .seek  = NULL,
+    },
+    .make = json_docs_make,
+    .destroy = json_destroy
+};
+
 FILE *cookie(const struct cookie *cfns, void *ctx) {
     if (!cfns || !cfns->make)
         return NULL;
@@ -573,4 +661,5 @@ FILE *cookie(const struct cookie *cfns, void *ctx) {
 }
 
 #undef push
+#undef RING_INIT_SIZE
 #undef MAX_DEPTH
@@ -28,6 +28,15 @@ extern const struct cookie COOKIE_PASSTHROUGH;
  */
 extern const struct cookie COOKIE_JSON;
 
+/**
+ * #COOKIE_JSON, but each row stays the `yyjson_mut_doc` it was parsed into instead
+ * of turning into a line of text. The rows go into CTX, a `struct ring` of the
+ * caller's, as records the size of a pointer to one: take them with `hd()` and
+ * `ring_pop()`, and free each with `yyjson_mut_doc_free()`, even after the stream is
+ * closed. Reading the stream itself gives nothing.
+ */
+extern const struct cookie COOKIE_JSON_DOCS;
+
 /**
  * `fwrite()` on N bytes of data from SRC buffer to DST stream.
  */
@@ -0,0 +1,183 @@
+#include "decode.h"
+#include "cookie.h"
+#include "debug.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+#include <zstd.h>
+
+#define DECODE_CHUNK (16 * 1024)
+
+enum coding {
+    CODING_GZIP,
+    CODING_DEFLATE,
+    CODING_ZSTD,
+};
+
+struct decoder {
+    enum coding coding;
+    bool failed;
+
+    /* gzip + deflate */
+    z_stream z;
+    bool raw_deflate;           // server sent deflate without the zlib wrapper
+
+    /* zstd */
+    ZSTD_DCtx *zstd;
+
+    char out[DECODE_CHUNK];
+};
+
+/** Does the N byte header value ENCODING name the coding TOKEN? */
+static bool is_coding(const char *encoding, size_t n, const char *token) {
+    size_t len = strlen(token);
+    return n == len && strncasecmp(encoding, token, len) == 0;
+}
+
+struct decoder *decoder(const char *encoding, size_t n) {
+    // trim the header value
+    while (n > 0 && (*encoding == ' ' || *encoding == '\t')) {
+        encoding++;
+        n--;
+    }
+    while (n > 0 && (encoding[n - 1] == ' ' || encoding[n - 1] == '\t'
+                     || encoding[n - 1] == '\r'))
+        n--;
+
+    enum coding coding;
+    if (is_coding(encoding, n, "gzip") || is_coding(encoding, n, "x-gzip"))
+        coding = CODING_GZIP;
+    else if (is_coding(encoding, n, "deflate"))
+        coding = CODING_DEFLATE;
+    else if (is_coding(encoding, n, "zstd"))
+        coding = CODING_ZSTD;
+    else {
+        errno = 0;
+        return NULL;
+    }
+
+    struct decoder *d = calloc(1, sizeof(struct decoder));
+    if (!d) {
+        errno = ENOMEM;
+        return enomem(NULL);
+    }
+    d->coding = coding;
+
+    switch (coding) {
+    case CODING_GZIP:
+        // 16 + MAX_WBITS only takes the gzip wrapper
+        if (inflateInit2(&d->z, 16 + MAX_WBITS) != Z_OK) {
+            free(d);
+            errno = ENOMEM;
+            return enomem(NULL);
+        }
+        break;
+    case CODING_DEFLATE:
+        // "deflate" is supposed to be zlib wrapped, see decode_zlib() for when it isn't
+        if (inflateInit2(&d->z, MAX_WBITS) != Z_OK) {
+            free(d);
+            errno = ENOMEM;
+            return enomem(NULL);
+        }
+        break;
+    case CODING_ZSTD:
+        d->zstd = ZSTD_createDCtx();
+        if (!d->zstd) {
+            free(d);
+            errno = ENOMEM;
+            return enomem(NULL);
+        }
+        break;
+    }
+    return d;
+}
+
+static int decode_zlib(struct decoder *d, const char *src, size_t n, FILE *dst) {
+    d->z.next_in = (Bytef *) src;
+    d->z.avail_in = n;
+
+    // a full output buffer means inflate may still be holding output back
+    do {
+        d->z.next_out = (Bytef *) d->out;
+        d->z.avail_out = sizeof(d->out);
+
+        int rc = inflate(&d->z, Z_NO_FLUSH);
+        size_t have = sizeof(d->out) - d->z.avail_out;
+        if (have > 0 && fwrite8(d->out, have, dst) != have)
+            return -1;
+
+        if (rc == Z_DATA_ERROR && d->coding == CODING_DEFLATE
+            && !d->raw_deflate && d->z.total_out == 0)
+        {
+            // plenty of servers send a bare deflate stream, so start over without the wrapper
+            d->raw_deflate = true;
+            if (inflateReset2(&d->z, -MAX_WBITS) != Z_OK)
+                return -1;
+            d->z.next_in = (Bytef *) src;
+            d->z.avail_in = n;
+            continue;
+        }
+
+        if (rc == Z_STREAM_END) {
+            if (d->z.avail_in == 0)
+                break;
+            // gzip bodies can be several members back to back
+            if (inflateReset(&d->z) != Z_OK)
+                return -1;
+            continue;
+        }
+
+        if (rc == Z_BUF_ERROR && have == 0)
+            break;  // needs more input
+        if (rc != Z_OK && rc != Z_BUF_ERROR)
+            return -1;
+    } while (d->z.avail_in > 0 || d->z.avail_out == 0);
+    return 0;
+}
+
+static int decode_zstd(struct decoder *d, const char *src, size_t n, FILE *dst) {
+    ZSTD_inBuffer in = { .src = src, .size = n, .pos = 0 };
+
+    // keep going past the input while the output fills up, there may be more buffered
+    for (;;) {
+        ZSTD_outBuffer out = { .dst = d->out, .size = sizeof(d->out), .pos = 0 };
+        size_t rc = ZSTD_decompressStream(d->zstd, &out, &in);
+        if (ZSTD_isError(rc))
+            return -1;
+
+        if (out.pos > 0 && fwrite8(d->out, out.pos, dst) != out.pos)
+            return -1;
+
+        if (in.pos == in.size && out.pos < out.size)
+            return 0;
+    }
+}
+
+int decoder_fwrite(struct decoder *d, const char *src, size_t n, FILE *dst) {
+    if (d->failed)
+        return -1;
+
+    int rc = d->coding == CODING_ZSTD
+        ? decode_zstd(d, src, n, dst)
+        : decode_zlib(d, src, n, dst);
+    if (rc < 0)
+        d->failed = true;
+    return rc;
+}
+
+void decoder_free(struct decoder *d) {
+    if (!d)
+        return;
+
+    if (d->coding == CODING_ZSTD)
+        ZSTD_freeDCtx(d->zstd);
+    else
+        inflateEnd(&d->z);
+    free(d);
+}
+
+#undef DECODE_CHUNK
@@ -0,0 +1,44 @@
+/**
+ * @file decode.h
+ * @brief Streaming `Content-Encoding` decoders (gzip, deflate, zstd).
+ *
+ * Compressed bytes go in as they come off the wire, and whatever they decode to
+ * is written straight to a stream, so the whole body is never held in memory.
+ */
+#pragma once
+#include <stdio.h>
+
+/**
+ * @brief Value sent in `Accept-Encoding`. Every coding in it has a #decoder.
+ */
+#define DECODE_ACCEPT_ENCODING "gzip, deflate, zstd"
+
+/**
+ * @brief Decompression state for a single response body.
+ */
+struct decoder;
+
+/**
+ * @brief Allocate a decoder for the N byte `Content-Encoding` header value ENCODING.
+ *
+ * @retval NULL ENCODING is `identity` or something we never asked for, so the body
+ * should be written as is. `errno` is set to ENOMEM if allocation failed instead.
+ * @retval NOT_NULL OK - free with #decoder_free().
+ */
+struct decoder *decoder(const char *encoding, size_t n);
+
+/**
+ * @brief Decompress N bytes from SRC and write everything they decode to into DST.
+ *
+ * SRC doesn't need to line up with anything in the compressed format, so it's
+ * fine to pass whatever a single `recv()` returned.
+ *
+ * @retval -1 Corrupt input, nothing more should be fed to D.
+ * @retval 0 OK
+ */
+int decoder_fwrite(struct decoder *d, const char *src, size_t n, FILE *dst);
+
+/**
+ * @brief Free D. A NULL D is a no-op.
+ */
+void decoder_free(struct decoder *d);
@@ -0,0 +1,404 @@
+#define _GNU_SOURCE
+
+#include "dns.h"
+#include "debug.h"
+#include "pyc.h"
+#include "stats.h"
+
+#include <ares.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+/** Sockets a single lookup can have open at once (one per nameserver and protocol). */
+#define DNS_MAX_SOCKS 16
+
+/** Cached answers kept at most, expired ones are dropped first. */
+#define DNS_CACHE_MAX 256
+
+/** One cached answer for "hostname:port". */
+struct dns_entry {
+    char *key;
+    struct addrinfo *addrinfo;  // NULL while resolving or if the lookup failed
+    int status;                 // ARES_SUCCESS or why the lookup failed
+    bool resolving;             // someone is querying it right now
+    long long resolved_at;      // CLOCK_MONOTONIC ms
+    long long expires;
+    struct dns_entry *next;
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_resolved = PTHREAD_COND_INITIALIZER;
+static struct dns_entry *cache = NULL;
+static size_t cache_len = 0;
+
+static pthread_once_t ares_once = PTHREAD_ONCE_INIT;
+static int ares_init_status = ARES_SUCCESS;
+
+static void ares_init_once() {
+    ares_init_status = ares_library_init(ARES_LIB_INIT_ALL);
+}
+
+static long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void dns_freeaddrinfo(struct addrinfo *addr) {
+    while (addr) {
+        struct addrinfo *next = addr->ai_next;
+        free(addr); // the address lives in the same allocation
+        addr = next;
+    }
+}
+
+/** Copy ADDR into a list that owns its addresses, or NULL if out of memory. */
+static struct addrinfo *addrinfo_copy(const struct addrinfo *addr) {
+    struct addrinfo *head = NULL, **tail = &head;
+    for (; addr; addr = addr->ai_next) {
+        struct addrinfo *copy = malloc(sizeof(struct addrinfo) + addr->ai_addrlen);
+        if (!copy) {
+            dns_freeaddrinfo(head);
+            return enomem(NULL);
+        }
+        *copy = *addr;
+        copy->ai_canonname = NULL;
+        copy->ai_addr = (struct sockaddr *) (copy + 1);
+        memcpy(copy->ai_addr, addr->ai_addr, addr->ai_addrlen);
+        copy->ai_next = NULL;
+
+        *tail = copy;
+        tail = &copy->ai_next;
+    }
+    return head;
+}
+
+/* LOOKUP */
+
+/** A single c-ares query and the sockets it's waiting on. */
+struct lookup {
+    struct pollfd socks[DNS_MAX_SOCKS];
+    nfds_t nsocks;
+
+    bool done;
+    int status;
+    struct addrinfo *addrinfo;
+    int ttl;                    // seconds, shortest among the answers
+};
+
+static void on_sock_state(void *data, ares_socket_t fd, int readable, int writable) {
+    struct lookup *l = data;
+    short events = (readable ? POLLIN : 0) | (writable ? POLLOUT : 0);
+
+    for (nfds_t i = 0; i < l->nsocks; i++) {
+        if (l->socks[i].fd != fd)
+            continue;
+        if (events)
+            l->socks[i].events = events;
+        else
+            l->socks[i] = l->socks[--l->nsocks];
+        return;
+    }
+    if (events && l->nsocks < DNS_MAX_SOCKS)
+        l->socks[l->nsocks++] = (struct pollfd) { .fd = fd, .events = events };
+}
+
+static void on_addrinfo(void *arg, int status, int timeouts, struct ares_addrinfo *result) {
+    (void) timeouts; // how many times c-ares retried, it's done either way
+    struct lookup *l = arg;
+    l->done = true;
+    l->status = status;
+    if (status != ARES_SUCCESS || !result) {
+        if (result)
+            ares_freeaddrinfo(result);
+        return;
+    }
+
+    // same list shape as getaddrinfo(), so the rest of the client doesn't care where it came from
+    struct addrinfo *head = NULL, **tail = &head;
+    l->ttl = -1;
+    for (struct ares_addrinfo_node *node = result->nodes; node; node = node->ai_next) {
+        struct addrinfo ai = {
+            .ai_flags = node->ai_flags,
+            .ai_family = node->ai_family,
+            .ai_socktype = node->ai_socktype,
+            .ai_protocol = node->ai_protocol,
+            .ai_addrlen = node->ai_addrlen,
+            .ai_addr = node->ai_addr,
+        };
+        struct addrinfo *copy = addrinfo_copy(&ai);
+        if (!copy) {
+            l->status = ARES_ENOMEM;
+            break;
+        }
+        *tail = copy;
+        tail = &copy->ai_next;
+
+        if (l->ttl < 0 || node->ai_ttl < l->ttl)
+            l->ttl = node->ai_ttl;
+    }
+    ares_freeaddrinfo(result);
+
+    if (l->status != ARES_SUCCESS || !head) {
+        dns_freeaddrinfo(head);
+        if (l->status == ARES_SUCCESS)
+            l->status = ARES_ENODATA;
+        return;
+    }
+    l->addrinfo = head;
+}
+
+/**
+ * Query HOSTNAME and PORT, polling c-ares' sockets on the calling thread until it
+ * answers, or until DEADLINE (CLOCK_MONOTONIC ms, 0 for none) with ARES_ETIMEOUT.
+ */
+static void lookup(struct lookup *l, const char *hostname, const char *port, long long deadline) {
+    pthread_once(&ares_once, ares_init_once);
+    if (ares_init_status != ARES_SUCCESS) {
+        l->status = ares_init_status;
+        return;
+    }
+
+    ares_channel channel;
+    struct ares_options opts = {
+        .sock_state_cb = on_sock_state,
+        .sock_state_cb_data = l,
+    };
+    int optmask = ARES_OPT_SOCK_STATE_CB;
+#ifdef ARES_OPT_HOSTS_FILE
+    opts.hosts_path = getenv(DNS_HOSTS_ENV);
+    if (opts.hosts_path && *opts.hosts_path)
+        optmask |= ARES_OPT_HOSTS_FILE;
+#endif
+    int rc = ares_init_options(&channel, &opts, optmask);
+    if (rc != ARES_SUCCESS) {
+        l->status = rc;
+        return;
+    }
+
+    struct ares_addrinfo_hints hints = {
+        .ai_flags = ARES_AI_ADDRCONFIG | ARES_AI_NUMERICSERV,
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+    };
+    ares_getaddrinfo(channel, hostname, port, &hints, on_addrinfo, l);
+
+    bool timed_out = false;
+    while (!l->done) {
+        struct timeval tv;
+        struct timeval *timeout = ares_timeout(channel, NULL, &tv);
+        int ms = timeout ? (int) (tv.tv_sec * 1000 + tv.tv_usec / 1000) : -1;
+        if (deadline) {
+            long long left = deadline - now_ms();
+            if ((timed_out = left <= 0))
+                break;
+            if (ms < 0 || left < ms)
+                ms = (int) left;
+        }
+
+        // the callbacks below can change l->socks, so poll a copy
+        struct pollfd ready[DNS_MAX_SOCKS];
+        nfds_t n = l->nsocks;
+        memcpy(ready, l->socks, n * sizeof(struct pollfd));
+
+        int nready = poll(ready, n, ms);
+        if (nready < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (nready == 0) {
+            // nothing to read, but c-ares still has to notice the timeout
+            ares_process_fd(channel, ARES_SOCKET_BAD, ARES_SOCKET_BAD);
+            continue;
+        }
+        for (nfds_t i = 0; i < n; i++) {
+            if (!ready[i].revents)
+                continue;
+            bool readable = ready[i].revents & (POLLIN | POLLERR | POLLHUP);
+            bool writable = ready[i].revents & POLLOUT;
+            ares_process_fd(channel,
+                            readable ? ready[i].fd : ARES_SOCKET_BAD,
+                            writable ? ready[i].fd : ARES_SOCKET_BAD);
+        }
+    }
+
+    ares_destroy(channel); // fails whatever's still pending with ARES_EDESTRUCTION
+    if (timed_out)
+        l->status = ARES_ETIMEOUT;
+}
+
+/* CACHE */
+
+static struct dns_entry *cache_find(const char *key) {
+    for (struct dns_entry *e = cache; e; e = e->next) {
+        if (strcmp(e->key, key) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+static void cache_unlink(struct dns_entry *e) {
+    struct dns_entry **link = &cache;
+    while (*link && *link != e)
+        link = &(*link)->next;
+    if (*link) {
+        *link = e->next;
+        cache_len -= 1;
+    }
+    dns_freeaddrinfo(e->addrinfo);
+    free(e->key);
+    free(e);
+}
+
+/** Make room for one more entry, dropping expired ones first and then the oldest. */
+static void cache_evict(long long now) {
+    struct dns_entry *oldest = NULL;
+    for (struct dns_entry *e = cache, *next; e; e = next) {
+        next = e->next;
+        if (e->resolving)
+            continue;
+        if (e->expires <= now)
+            cache_unlink(e);
+        else if (!oldest || e->resolved_at < oldest->resolved_at)
+            oldest = e;
+    }
+    if (cache_len >= DNS_CACHE_MAX && oldest)
+        cache_unlink(oldest);
+}
+
+/**
+ * Wait for someone else's lookup to finish, until DEADLINE (CLOCK_MONOTONIC ms, 0 for
+ * none). The caller holds the cache lock.
+ *
+ * @retval false DEADLINE passed.
+ */
+static bool cache_wait(long long deadline) {
+    if (!deadline) {
+        pthread_cond_wait(&cache_resolved, &cache_lock);
+        return true;
+    }
+    long long left = deadline - now_ms();
+    if (left <= 0)
+        return false;
+    // the condition variable's clock is CLOCK_REALTIME
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    long long ns = until.tv_nsec + left * 1000000;
+    until.tv_sec += ns / 1000000000;
+    until.tv_nsec = ns % 1000000000;
+    pthread_cond_timedwait(&cache_resolved, &cache_lock, &until);
+    return true;
+}
+
+int dns_getaddrinfo(const char *hostname, const char *port, long timeout_ms,
+                    struct addrinfo **addr)
+{
+    if (!hostname || !port || !addr) {
+        fprintf(stderr, "HOSTNAME, PORT, or ADDR is NULL\n");
+        return EINVAL;
+    }
+
+    size_t key_len = strlen(hostname) + 1 + strlen(port);
+    char *key = dsnprintf(&key_len, "%s:%s", hostname, port);
+    if (!key)
+        return enomem(ARES_ENOMEM);
+
+    long long asked_at = now_ms();
+    long long deadline = timeout_ms > 0 ? asked_at + timeout_ms : 0;
+    pthread_mutex_lock(&cache_lock);
+    struct dns_entry *e = cache_find(key);
+
+    // someone's already asking, so take their answer, even if its TTL is 0
+    while (e && e->resolving) {
+        if (!cache_wait(deadline)) {
+            pthread_mutex_unlock(&cache_lock);
+            free(key);
+            *addr = NULL;
+            return ARES_ETIMEOUT;
+        }
+        e = cache_find(key);
+    }
+
+    if (e && (e->expires > now_ms() || e->resolved_at >= asked_at)) {
+        stats_add(STAT_DNS_HITS, 1);
+        int status = e->status;
+        *addr = status == ARES_SUCCESS ? addrinfo_copy(e->addrinfo) : NULL;
+        pthread_mutex_unlock(&cache_lock);
+        free(key);
+        if (status == ARES_SUCCESS && !*addr)
+            return ARES_ENOMEM;
+        if (status != ARES_SUCCESS)
+            fprintf(stderr, "dns_getaddrinfo(hostname=%s, port=%s): %s\n",
+                    hostname, port, ares_strerror(status));
+        return status;
+    }
+
+    // we're the one asking
+    if (e) {
+        dns_freeaddrinfo(e->addrinfo);
+        e->addrinfo = NULL;
+    } else {
+        cache_evict(now_ms());
+        e = calloc(1, sizeof(struct dns_entry));
+        if (!e) {
+            pthread_mutex_unlock(&cache_lock);
+            free(key);
+            return enomem(ARES_ENOMEM);
+        }
+        e->key = key;
+        key = NULL;
+        e->next = cache;
+        cache = e;
+        cache_len += 1;
+    }
+    e->resolving = true;
+    pthread_mutex_unlock(&cache_lock);
+    free(key);
+
+    stats_add(STAT_DNS_MISSES, 1);
+    struct lookup l = { .status = ARES_ECANCELLED };
+    lookup(&l, hostname, port, deadline);
+    stats_time(STAT_DNS_MS, now_ms() - asked_at);
+
+    pthread_mutex_lock(&cache_lock);
+    long long now = now_ms();
+    e->resolving = false;
+    if (l.status == ARES_ETIMEOUT && deadline && now >= deadline) {
+        // out of this caller's time, which says nothing about the host, so nothing's cached
+        cache_unlink(e);
+        pthread_cond_broadcast(&cache_resolved);
+        pthread_mutex_unlock(&cache_lock);
+        *addr = NULL;
+        return ARES_ETIMEOUT;
+    }
+    e->status = l.status;
+    e->addrinfo = l.addrinfo;
+    e->resolved_at = now;
+    if (l.status == ARES_SUCCESS) {
+        long long ttl_ms = (long long) l.ttl * 1000;
+        e->expires = now + (ttl_ms > DNS_MIN_TTL_MS ? ttl_ms : DNS_MIN_TTL_MS);
+    } else {
+        e->expires = now + DNS_NEGATIVE_TTL_MS;
+    }
+    *addr = l.status == ARES_SUCCESS ? addrinfo_copy(e->addrinfo) : NULL;
+    pthread_cond_broadcast(&cache_resolved);
+    pthread_mutex_unlock(&cache_lock);
+
+    if (l.status != ARES_SUCCESS) {
+        fprintf(stderr, "dns_getaddrinfo(hostname=%s, port=%s): %s\n",
+                hostname, port, ares_strerror(l.status));
+        return l.status;
+    }
+    return *addr ? 0 : ARES_ENOMEM;
+}
+
+#undef DNS_CACHE_MAX
+#undef DNS_MAX_SOCKS
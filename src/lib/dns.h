@@ -0,0 +1,53 @@
+/**
+ * @file dns.h
+ * @brief Hostname resolution with an in-process cache that honors record TTLs.
+ *
+ * Lookups go through [c-ares](https://c-ares.org/), so the TTL of every answer
+ * is known and nothing blocks inside the system resolver. Concurrent lookups of
+ * the same host and port share a single query.
+ *
+ */
+#pragma once
+#include <netdb.h>
+
+/**
+ * @brief Environment variable naming a hosts file to read instead of `/etc/hosts`.
+ *
+ * Needs a c-ares with `ARES_OPT_HOSTS_FILE`, older ones always read `/etc/hosts`.
+ */
+#define DNS_HOSTS_ENV "VTTP_HOSTS"
+
+/**
+ * @brief Answers are cached at least this long, even with a TTL of 0 (hosts file
+ * entries, literal addresses).
+ */
+#define DNS_MIN_TTL_MS 1000
+
+/**
+ * @brief Failed lookups are cached this long so a burst of fetches fails together.
+ */
+#define DNS_NEGATIVE_TTL_MS 1000
+
+/**
+ * @brief Resolve HOSTNAME and PORT into a list of stream socket candidates at ADDR,
+ * same as `getaddrinfo()` with `AF_UNSPEC` and `AI_ADDRCONFIG`.
+ *
+ * Answers are copied out of the cache until the shortest TTL among them runs
+ * out. If another thread is already looking up HOSTNAME and PORT, this waits
+ * for its answer instead of sending another query.
+ *
+ * Neither the query nor the wait for someone else's takes longer than TIMEOUT_MS,
+ * 0 leaves it to c-ares' own timeouts. Running out of it isn't cached.
+ *
+ * @retval 0 OK - free ADDR with #dns_freeaddrinfo(), NOT `freeaddrinfo()`.
+ * @retval EINVAL One of HOSTNAME, PORT or ADDR is NULL.
+ * @retval ARES_ETIMEOUT TIMEOUT_MS ran out.
+ * @retval ANYTHING_ELSE Error, an `ARES_E*` status from c-ares.
+ */
+int dns_getaddrinfo(const char *hostname, const char *port, long timeout_ms,
+                    struct addrinfo **addr);
+
+/**
+ * @brief Free ADDR from #dns_getaddrinfo(). A NULL ADDR is a no-op.
+ */
+void dns_freeaddrinfo(struct addrinfo *addr);
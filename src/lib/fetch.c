@@ -1,21 +1,34 @@
 #define _GNU_SOURCE
 
 #include "debug.h"
+#include "dns.h"
 #include "tcp.h"
 #include "fetch.h"
 #include "cookie.h"
+#include "limit.h"
+#include "stats.h"
 
+#include <ares.h>
 #include <netdb.h>
 #include <openssl/types.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <pthread.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <string.h>
 #include <curl/curl.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <ctype.h>
+#include <poll.h>
+#include <time.h>
 
 void url_free(struct url *url) {
     if (!url) {
@@ -26,26 +39,31 @@ void url_free(struct url *url) {
     done(url->protocol);
     done(url->hostname);
     free(url->pathname);
+    free(url->search);
     done(url->port);
 }
 
 void dispatch_free(struct dispatch *dispatch) {
-    // CALLER frees sockfd
     if (!dispatch) return;
     url_free(&dispatch->url);
 
     if (dispatch->addrinfo) {
-        freeaddrinfo(dispatch->addrinfo);
+        dns_freeaddrinfo(dispatch->addrinfo);
         dispatch->addrinfo = NULL;
     }
+    tcp_tls_free(dispatch->ssl, dispatch->ctx);
+    if (dispatch->sockfd >= 0)
+        close(dispatch->sockfd);
     free(dispatch);
 }
 
-static struct url *url_of_string(const char *url);
-struct dispatch *fetch_socket(const char *url, const char *init[4]) {
+struct dispatch *fetch_socket(const char *url, long timeout_ms) {
     struct dispatch *disp = calloc(1, sizeof(struct dispatch));
     if (!disp)
         return enomem(NULL);
+    disp->sockfd = -1;
+    disp->started_us = stats_now_us();
+    disp->timeout_ms = timeout_ms > 0 ? timeout_ms : FETCH_CONNECT_TIMEOUT_MS;
 
     struct url *URL = url_of_string(url);
     if (!URL) {
@@ -53,192 +71,738 @@ struct dispatch *fetch_socket(const char *url, const char *init[4]) {
         return NULL;
     }
     disp->url = *URL;
+    // just free the head, we need to keep the values alive
+    // in dispatch
+    free(URL);
 
     char *hostname = hd(disp->url.hostname);
     char *port = hd(disp->url.port);
-    if (tcp_getaddrinfo(hostname, port, &disp->addrinfo)) {
-        dispatch_free(disp);
-        return NULL;
-    }
-
-    disp->sockfd = tcp_socket(disp->addrinfo);
-    if (disp->sockfd < 0) {
+    int rc = dns_getaddrinfo(hostname, port, disp->timeout_ms, &disp->addrinfo);
+    if (rc) {
         dispatch_free(disp);
+        errno = rc == ARES_ETIMEOUT ? ETIMEDOUT : EHOSTUNREACH;
         return NULL;
     }
-    // just free the head, we need to keep the values alive
-    // in dispatch
-    free(URL);
     return disp;
 }
 
-static int set_nonblocking(int fd) {
-    int flags = fcntl(fd, F_GETFL, 0);
-    return fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0;
+/** What's left of DISPATCH's connect timeout, at least 1ms so it still fails as a timeout. */
+static long connect_left_ms(const struct dispatch *dispatch) {
+    long long left = dispatch->timeout_ms - (stats_now_us() - dispatch->started_us) / 1000;
+    return left > 0 ? (long) left : 1;
 }
 
-#define HTTP_MAX_REQUEST (16 * 1024)
-static char *http_request(const char *method, const char *pathname, 
-                          const char *host, size_t *request_len)
+/** Request body bytes handed to `SSL_write()` at a time, one full TLS record. */
+#define FETCH_UPLOAD_CHUNK (16 * 1024)
+
+bool fetch_next_header(const char **cursor, const char **name, size_t *name_len,
+                       const char **value, size_t *value_len)
 {
-    char *request = calloc(HTTP_MAX_REQUEST, sizeof(char));
-    int len = snprintf(
-        request,
-        HTTP_MAX_REQUEST,
-        "%s %s HTTP/1.1\r\n"
+    const char *line = *cursor;
+    if (!line || !*line)
+        return false;
+
+    // fetch_state_new() left every line as "name: value\r\n"
+    const char *colon = strchr(line, ':');
+    const char *eol = strstr(colon, "\r\n");
+    *name = line, *name_len = colon - line;
+    *value = colon + 2, *value_len = eol - (colon + 2);
+    *cursor = eol + 2;
+    return true;
+}
+
+/** Did the user set header NAME themselves in HEADERS? */
+static bool has_header(const char *headers, const char *name) {
+    const char *hname, *value;
+    size_t hname_len, value_len;
+    while (fetch_next_header(&headers, &hname, &hname_len, &value, &value_len)) {
+        if (hname_len == strlen(name) && strncasecmp(hname, name, hname_len) == 0)
+            return true;
+    }
+    return false;
+}
+
+/** RFC 9110 `tchar`, what methods and header names are made of. */
+static bool is_tchar(int c) {
+    return isalnum(c) || (c && strchr("!#$%&'*+-.^_`|~", c));
+}
+
+/**
+ * Copy the user's HEADERS into "name: value\r\n" lines, lowercasing the names so
+ * they go out as-is over HTTP/2 too. Blank lines are skipped.
+ *
+ * @retval NULL Error, `errno` is EINVAL for a malformed line.
+ */
+static char *request_headers(const char *headers) {
+    size_t n = strlen(headers);
+    // each line grows by at most ": " and "\r\n" over its shortest form "a:"
+    char *out = malloc(2 * n + 4);
+    if (!out)
+        return enomem(NULL);
+
+    size_t len = 0;
+    for (const char *line = headers; *line; ) {
+        size_t line_len = strcspn(line, "\n");
+        const char *next = line + line_len + (line[line_len] == '\n');
+        while (line_len > 0 && isspace((unsigned char) line[line_len - 1]))
+            line_len--;
+        if (line_len == 0) {
+            line = next;
+            continue;
+        }
+
+        size_t name_len = 0;
+        while (name_len < line_len && is_tchar((unsigned char) line[name_len]))
+            name_len++;
+        if (name_len == 0 || name_len == line_len || line[name_len] != ':')
+            goto malformed;
+
+        const char *value = line + name_len + 1;
+        size_t value_len = line_len - name_len - 1;
+        while (value_len > 0 && (*value == ' ' || *value == '\t'))
+            value++, value_len--;
+        for (size_t i = 0; i < value_len; i++) {
+            // no smuggling a second request in through a stray CR
+            if (iscntrl((unsigned char) value[i]) && value[i] != '\t')
+                goto malformed;
+        }
+
+        for (size_t i = 0; i < name_len; i++)
+            out[len++] = tolower((unsigned char) line[i]);
+        memcpy(out + len, ": ", 2), len += 2;
+        memcpy(out + len, value, value_len), len += value_len;
+        memcpy(out + len, "\r\n", 2), len += 2;
+        line = next;
+    }
+    out[len] = '\0';
+    return out;
+
+malformed:
+    fprintf(stderr, "malformed request header: %.*s\n", (int) strcspn(headers, "\n"), headers);
+    free(out);
+    errno = EINVAL;
+    return NULL;
+}
+
+/**
+ * Copy the method, headers and body from the #fetch() INIT slots into ST.
+ *
+ * @retval 0 OK
+ * @retval -1 Error, check `errno`.
+ */
+static int request_init(struct fetch_state *st, const char *init[4]) {
+    const char *method = init ? init[FETCH_INIT_METHOD] : NULL;
+    const char *headers = init ? init[FETCH_INIT_HEADERS] : NULL;
+    const char *body = init ? init[FETCH_INIT_BODY] : NULL;
+
+    if (body && *body) {
+        st->body_len = strlen(body);
+        st->body = malloc(st->body_len);
+        if (!st->body)
+            return enomem(-1);
+        memcpy(st->body, body, st->body_len);
+    }
+
+    if (!method || !*method)
+        method = st->body ? "POST" : "GET";
+    st->method = strdup(method);
+    if (!st->method)
+        return enomem(-1);
+    for (char *c = st->method; *c; c++) {
+        if (!is_tchar((unsigned char) *c)) {
+            fprintf(stderr, "malformed request method: %s\n", method);
+            errno = EINVAL;
+            return -1;
+        }
+        *c = toupper((unsigned char) *c);
+    }
+
+    if (headers && *headers && !(st->headers = request_headers(headers)))
+        return -1;
+    return 0;
+}
+
+/** Does METHOD expect a body, so that even an empty one needs a Content-Length? */
+static bool method_has_body(const char *method) {
+    return strcmp(method, "POST") == 0 || strcmp(method, "PUT") == 0
+        || strcmp(method, "PATCH") == 0;
+}
+
+/**
+ * Format ST's request line and header block for URL, without the body.
+ *
+ * @retval NULL Error, out of memory.
+ */
+static char *http_request(struct fetch_state *st, const struct url *url, size_t *request_len) {
+    const char *headers = st->headers ? st->headers : "";
+    char content_length[48] = "";
+    if (st->body || method_has_body(st->method))
+        snprintf(content_length, sizeof(content_length), "Content-Length: %zu\r\n", st->body_len);
+
+    char *request = NULL;
+    int len = asprintf(
+        &request,
+        "%s %s%s HTTP/1.1\r\n"
         "Host: %s\r\n"
-        "User-Agent: vttp/1.0\r\n"
-        "Accept: */*\r\n"
-        "Connection: close\r\n"
+        "%s"
+        "%s"
+        "Accept-Encoding: " DECODE_ACCEPT_ENCODING "\r\n"
+        "Connection: %s\r\n"
+        "%s"
+        "%s"
         "\r\n",
-        method,
-        pathname,
-        host
+        st->method,
+        *url->pathname ? url->pathname : "/",
+        url->search,
+        url->host,
+        has_header(headers, "user-agent") ? "" : "User-Agent: vttp/1.0\r\n",
+        has_header(headers, "accept") ? "" : "Accept: */*\r\n",
+        st->keep_alive ? "keep-alive" : "close",
+        content_length,
+        headers
     );
+    if (len < 0)
+        return enomem(NULL);
 
-    if (len <= 0) { /* TODO: Handle ERROR */ }
     if (request_len)
         *request_len = len;
     return request;
 }
 
-int use_fetch(int fds[4], struct dispatch *dispatch) {
+/**
+ * Block until FD is ready for EVENTS, or until one of ST's #fetch_timeouts runs out.
+ *
+ * @retval 0 OK
+ * @retval -1 Error, check `errno`. ETIMEDOUT if ST ran out of time, see #fetch_expire().
+ */
+static int wait_fd(struct fetch_state *st, int fd, short events) {
+    struct pollfd pfd = { .fd = fd, .events = events };
+    for (;;) {
+        int ready = poll(&pfd, 1, fetch_deadline_ms(st, stats_now_us()));
+        if (ready > 0)
+            return 0;
+        if (ready < 0 && errno != EINTR)
+            return -1;
+        if (ready == 0 && fetch_expire(st, stats_now_us())) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+}
+
+/**
+ * Write all N buffers in IOV to the nonblocking connection at FD, through SSL if it
+ * isn't NULL, waiting whenever the socket is full, for as long as ST's
+ * #fetch_timeouts allow. Plain sockets take them in as few `sendmsg()` calls as the
+ * kernel allows, TLS takes them #FETCH_UPLOAD_CHUNK bytes at a time.
+ *
+ * @retval 0 OK
+ * @retval -1 Error, check `errno`.
+ */
+static int send_all(struct fetch_state *st, int fd, SSL *ssl, struct iovec *iov, int n) {
+    while (n > 0 && iov->iov_len == 0)
+        iov++, n--;
+
+    while (n > 0) {
+        ssize_t sent;
+        if (ssl) {
+            int piece = iov->iov_len < FETCH_UPLOAD_CHUNK ? iov->iov_len : FETCH_UPLOAD_CHUNK;
+            ERR_clear_error();
+            sent = SSL_write(ssl, iov->iov_base, piece);
+            if (sent <= 0) {
+                int err = SSL_get_error(ssl, sent);
+                if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ) {
+                    if (wait_fd(st, fd, err == SSL_ERROR_WANT_WRITE ? POLLOUT : POLLIN))
+                        return -1;
+                    continue;
+                }
+                if (err != SSL_ERROR_SYSCALL)
+                    errno = ECONNRESET;
+                return -1;
+            }
+        } else {
+            struct msghdr msg = { .msg_iov = iov, .msg_iovlen = n };
+            sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+            if (sent < 0) {
+                if (errno == EINTR)
+                    continue;
+                if ((errno == EAGAIN || errno == EWOULDBLOCK) && !wait_fd(st, fd, POLLOUT))
+                    continue;
+                return -1;
+            }
+        }
+
+        // skip past what went out
+        st->sending_us = stats_now_us();
+        while (n > 0 && (size_t) sent >= iov->iov_len) {
+            sent -= iov->iov_len;
+            iov++, n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *) iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+    return 0;
+}
+
+int fetch_send(struct fetch_state *st, const struct url *url, int fd, SSL *ssl) {
+    size_t request_len = 0;
+    char *request = http_request(st, url, &request_len);
+    if (!request)
+        return -1;
+
+    // the body goes out straight from ST, never copied in behind the headers
+    struct iovec iov[2] = {
+        { .iov_base = request, .iov_len = request_len },
+        { .iov_base = st->body, .iov_len = st->body_len },
+    };
+    st->sending_us = stats_now_us();
+    int sent = send_all(st, fd, ssl, iov, 2);
+    int err = errno;
+    free(request);
+    st->sending_us = 0;
+    st->sent_us = stats_now_us();
+    errno = err;
+    return sent;
+}
+
+/** The positive byte count in environment variable NAME, 0 if it's unset or isn't one. */
+static int env_bytes(const char *name) {
+    const char *env = getenv(name);
+    long long bytes = env ? strtoll(env, NULL, 10) : 0;
+    return bytes > 0 && bytes <= INT_MAX ? (int) bytes : 0;
+}
+
+/** Apply #FETCH_RCVBUF_ENV and #FETCH_RCVLOWAT_ENV to ST's plaintext connection. */
+static void tune_socket(struct fetch_state *st) {
+    int rcvbuf = env_bytes(FETCH_RCVBUF_ENV);
+    if (rcvbuf && setsockopt(st->netfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)))
+        perror("setsockopt(SO_RCVBUF)");
+
+    int lowat = st->keep_alive ? 0 : env_bytes(FETCH_RCVLOWAT_ENV);
+    if (lowat && setsockopt(st->netfd, SOL_SOCKET, SO_RCVLOWAT, &lowat, sizeof(lowat)))
+        perror("setsockopt(SO_RCVLOWAT)");
+}
+
+/** Say in INFO why its response was cut short, unless it already says. */
+static void info_fail(struct fetch_info *info, const char *fmt, ...) {
+    if (!info)
+        return;
+    va_list args;
+    va_start(args, fmt);
+    pthread_mutex_lock(&info->lock);
+    if (!info->error && vasprintf(&info->error, fmt, args) < 0)
+        info->error = NULL;
+    pthread_mutex_unlock(&info->lock);
+    va_end(args);
+}
+
+/** FETCH_STATE's connect timeout of TIMEOUT_MS ran out. */
+static void connect_timed_out(struct fetch_state *st, long timeout_ms) {
+    stats_add(STAT_TIMEOUTS, 1);
+    info_fail(st->info, "connect timeout of %ldms ran out for %s", timeout_ms, st->url);
+    errno = ETIMEDOUT;
+}
+
+int use_fetch(struct fetch_state *st, struct dispatch *dispatch) {
+    if (!dispatch) {
+        if (errno == ETIMEDOUT)
+            connect_timed_out(st, st->timeouts.connect_ms ? st->timeouts.connect_ms : FETCH_CONNECT_TIMEOUT_MS);
+        return -1;
+    }
+
     char *protocol = hd(dispatch->url.protocol);
     bool is_tls = strncmp(protocol, "https:", 6) == 0;
     SSL **ssl = is_tls ? &dispatch->ssl : NULL;
     SSL_CTX **ctx = is_tls ? &dispatch->ctx : NULL;
-    const char *hostname = is_tls ? hd(dispatch->url.hostname) : NULL;
-    if (tcp_connect(
-        dispatch->sockfd, dispatch->addrinfo->ai_addr, dispatch->addrinfo->ai_addrlen,
-        ssl, ctx, hostname) < 0)
-    {
-        close(dispatch->sockfd);
-        dispatch_free(dispatch);
+    const char *hostname = hd(dispatch->url.hostname);
+
+    dispatch->sockfd = tcp_connect(dispatch->addrinfo, ssl, ctx, is_tls ? hostname : NULL,
+                                   !st->h1_only, connect_left_ms(dispatch));
+    if (dispatch->sockfd < 0) {
+        if (errno == ETIMEDOUT)
+            connect_timed_out(st, dispatch->timeout_ms);
         return -1;
     }
 
-    // make recv() nonblocking
-    if (set_nonblocking(dispatch->sockfd) < 0) {
-        close(dispatch->sockfd);
-        dispatch_free(dispatch);
-        return -1;
+    if (is_tls && tcp_is_h2(*ssl)) {
+        return FETCH_H2;
     }
 
-    size_t request_len = 0;
-    char *GET = http_request("GET", dispatch->url.pathname, dispatch->url.host, &request_len);
-    if (!GET || request_len <= 0) { /* HANDLEME */ }
+    // ST owns the connection from here on
+    st->netfd = dispatch->sockfd, dispatch->sockfd = -1;
+    st->ssl = dispatch->ssl, dispatch->ssl = NULL;
+    st->ssl_ctx = dispatch->ctx, dispatch->ctx = NULL;
+    free(st->hostname); // set already if this is another try
+    st->hostname = strdup(hostname);
+    if (!is_tls)
+        tune_socket(st);
 
-    if (tcp_send(dispatch->sockfd, GET, request_len, is_tls ? *ssl : NULL) < 0) {
-        close(dispatch->sockfd);
-        dispatch_free(dispatch);
+    if (fetch_send(st, &dispatch->url, st->netfd, st->ssl) < 0)
         return -1;
-    }
 
-    int sv[2] = {0};
-    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
-        fprintf(stderr, "couldn't open socketpair for url: %s\n", hd(dispatch->url.hostname));
-        close(dispatch->sockfd);
-        dispatch_free(dispatch);
+    st->ep = epoll_create1(0);
+    if (st->ep < 0)
         return -1;
-    }
-    int appfd = sv[0];
-    int fetchfd = sv[1];
-    if (set_nonblocking(fetchfd)) {
-        close(appfd);
-        close(fetchfd);
-        close(dispatch->sockfd);
-        dispatch_free(dispatch);
+    struct epoll_event ev = { .events=EPOLLIN, .data.fd=st->netfd };
+    if (epoll_ctl(st->ep, EPOLL_CTL_ADD, st->netfd, &ev))
         return -1;
+    return 0;
+}
+
+struct fetch_info *fetch_info_new(void) {
+    struct fetch_info *info = calloc(1, sizeof(struct fetch_info));
+    if (!info)
+        return enomem(NULL);
+    pthread_mutex_init(&info->lock, NULL);
+    info->refs = 1;
+    info->ttfb_ms = -1;
+    return info;
+}
+
+void fetch_info_release(struct fetch_info *info) {
+    if (!info)
+        return;
+    pthread_mutex_lock(&info->lock);
+    bool last = --info->refs == 0;
+    pthread_mutex_unlock(&info->lock);
+    if (!last)
+        return;
+
+    pthread_mutex_destroy(&info->lock);
+    free(info->headers);
+    free(info->error);
+    free(info);
+}
+
+struct fetch_state *fetch_state_new(const char *url, const char *init[4],
+                                    FILE *response_cookie)
+{
+    struct fetch_state *st = calloc(1, sizeof(struct fetch_state));
+    if (!st) {
+        fclose(response_cookie);
+        return enomem(NULL);
     }
+    st->netfd = -1, st->ep = -1, st->hedge_fd = -1;
+    st->stream = response_cookie;
+    st->started_us = stats_now_us();
 
-    int pollfd = epoll_create1(0);
-    if (pollfd < 0) {
-        close(appfd);
-        close(fetchfd);
-        close(dispatch->sockfd);
-        dispatch_free(dispatch);
+    st->url = strdup(url);
+    if (!st->url) {
+        fetch_state_free(st);
+        return enomem(NULL);
+    }
+    if (request_init(st, init) != 0) {
+        int err = errno;
+        fetch_state_free(st);
+        errno = err;
+        return NULL;
+    }
+    return st;
+}
+
+/**
+ * The second connection for a copy of a request, made on a thread of its own so the
+ * fetch's worker goes on reading the first one, and checking its deadlines, while
+ * it's resolved and connected. The worker and the thread hold a reference each.
+ */
+struct hedge_connect {
+    pthread_mutex_t lock;
+    int refs;
+    int ready_fd;               // eventfd, readable once the thread is done
+    char *url;
+    bool tls;                   // the first connection is, so the copy's is too
+    long timeout_ms;
+    struct dispatch *dispatch;  // connected, NULL until then or if it couldn't be
+};
+
+static void hedge_connect_release(struct hedge_connect *h) {
+    pthread_mutex_lock(&h->lock);
+    bool last = --h->refs == 0;
+    pthread_mutex_unlock(&h->lock);
+    if (!last)
+        return;
+
+    dispatch_free(h->dispatch);
+    if (h->ready_fd >= 0)
+        close(h->ready_fd);
+    free(h->url);
+    pthread_mutex_destroy(&h->lock);
+    free(h);
+}
+
+/** Close the connection ST sent a copy of its request over, if it has one. */
+static void hedge_close(struct fetch_state *st) {
+    if (st->hedge_connect) {
+        // the thread finishes connecting on its own and then drops it
+        if (st->ep >= 0)
+            epoll_ctl(st->ep, EPOLL_CTL_DEL, st->hedge_connect->ready_fd, NULL);
+        hedge_connect_release(st->hedge_connect);
+        st->hedge_connect = NULL;
+    }
+    if (st->hedge_fd < 0)
+        return;
+    tcp_tls_free(st->hedge_ssl, st->hedge_ctx);
+    close(st->hedge_fd);
+    st->hedge_fd = -1;
+    st->hedge_ssl = NULL;
+    st->hedge_ctx = NULL;
+}
+
+void fetch_state_free(struct fetch_state *st) {
+    if (!st)
+        return;
+
+    if (st->stream)
+        fclose(st->stream);
+    // the reader gets whatever's in OUT already, and then the end
+    handoff_release(st->out);
+
+    hedge_close(st);
+    tcp_tls_free(st->ssl, st->ssl_ctx);
+    if (st->netfd >= 0)
+        close(st->netfd);
+    if (st->ep >= 0)
+        close(st->ep);
+
+    if (st->headers_us)
+        stats_time(STAT_TRANSFER_MS, (stats_now_us() - st->headers_us) / 1000);
+    limit_release(st);
+
+    decoder_free(st->decoder);
+    headers_free(&st->head);
+    fetch_info_release(st->info);
+    free(st->span_buf);
+    free(st->recv_buf);
+    free(st->hostname);
+    free(st->url);
+    free(st->method);
+    free(st->headers);
+    free(st->body);
+    free(st);
+}
+
+static bool handle_http_response(struct fetch_state *st);
+
+/** Is ST's request safe to send more than once: a `GET` or `HEAD` without a body? */
+static bool idempotent(const struct fetch_state *st) {
+    return !st->body && (strcmp(st->method, "GET") == 0 || strcmp(st->method, "HEAD") == 0);
+}
+
+/** When ST sends a copy of its request if it has no response by then, 0 for never. */
+static long long hedge_at_us(const struct fetch_state *st) {
+    long ms = st->retry.hedge_ms;
+    if (!ms || !idempotent(st))
+        return 0;
+
+    if (ms == FETCH_HEDGE_P95) {
+        struct stats stats;
+        stats_read(&stats);
+        const struct stat_histogram *ttfb = &stats.timers[STAT_TTFB_MS];
+        if (ttfb->count < FETCH_HEDGE_MIN_SAMPLES)
+            return 0;
+        ms = stats_percentile(ttfb, 0.95);
+    }
+    return st->started_us + ms * 1000LL;
+}
+
+/** Milliseconds from NOW_US until ST sends a copy of its request, -1 for never. */
+static int hedge_due_ms(const struct fetch_state *st, long long now_us) {
+    if (!st->hedge_at_us || st->recv_us || st->canceled)
         return -1;
+    if (st->hedge_at_us <= now_us)
+        return 0;
+    long long ms = (st->hedge_at_us - now_us + 999) / 1000;
+    return ms < INT_MAX ? (int) ms : INT_MAX;
+}
+
+/** Resolve and connect the #hedge_connect ARG, and wake its worker up either way. */
+static void *hedge_connect_run(void *arg) {
+    struct hedge_connect *h = arg;
+    stats_origin(h->url);
+    struct dispatch *dispatch = fetch_socket(h->url, h->timeout_ms);
+    if (dispatch) {
+        dispatch->sockfd = tcp_connect(dispatch->addrinfo,
+                                       h->tls ? &dispatch->ssl : NULL,
+                                       h->tls ? &dispatch->ctx : NULL,
+                                       h->tls ? hd(dispatch->url.hostname) : NULL,
+                                       true, connect_left_ms(dispatch));
+        // an HTTP/2 connection would be shared, and the copy needs one of its own
+        if (dispatch->sockfd < 0 || (h->tls && tcp_is_h2(dispatch->ssl))) {
+            dispatch_free(dispatch);
+            dispatch = NULL;
+        }
     }
-    struct epoll_event ev = { .events=EPOLLIN, .data.fd=dispatch->sockfd };
-    if (epoll_ctl(pollfd, EPOLL_CTL_ADD, dispatch->sockfd, &ev)) {
-        close(pollfd);
-        close(appfd);
-        close(fetchfd);
-        close(dispatch->sockfd);
+
+    pthread_mutex_lock(&h->lock);
+    h->dispatch = dispatch;
+    pthread_mutex_unlock(&h->lock);
+    eventfd_write(h->ready_fd, 1);
+    hedge_connect_release(h);
+    return NULL;
+}
+
+/**
+ * Start connecting a second connection to ST's origin for a copy of its request, on
+ * a thread of its own. #hedge_connected() sends the copy once it's up.
+ */
+static void hedge_send(struct fetch_state *st) {
+    st->hedge_at_us = 0; // one copy per try at most
+    if (!limit_try_copy(st))
+        return;
+    struct hedge_connect *h = calloc(1, sizeof(struct hedge_connect));
+    if (!h)
+        return;
+    pthread_mutex_init(&h->lock, NULL);
+    h->refs = 2;
+    h->tls = st->ssl != NULL;
+    h->timeout_ms = st->timeouts.connect_ms;
+    h->url = strdup(st->url);
+    h->ready_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    pthread_t tid = 0;
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = h->ready_fd };
+    if (!h->url || h->ready_fd < 0
+        || epoll_ctl(st->ep, EPOLL_CTL_ADD, h->ready_fd, &ev) != 0
+        || pthread_create(&tid, NULL, hedge_connect_run, h) != 0)
+    {
+        h->refs = 1;
+        hedge_connect_release(h); // closing READY_FD takes it out of the set
+        return;
+    }
+    pthread_detach(tid);
+    st->hedge_connect = h;
+}
+
+/** The thread connecting ST's second connection is done: send the copy over it. */
+static void hedge_connected(struct fetch_state *st) {
+    struct hedge_connect *h = st->hedge_connect;
+    st->hedge_connect = NULL;
+    epoll_ctl(st->ep, EPOLL_CTL_DEL, h->ready_fd, NULL);
+    pthread_mutex_lock(&h->lock);
+    struct dispatch *dispatch = h->dispatch;
+    h->dispatch = NULL;
+    pthread_mutex_unlock(&h->lock);
+    hedge_connect_release(h);
+
+    // the first connection may have answered in the meantime
+    if (!dispatch || st->recv_us || st->canceled) {
         dispatch_free(dispatch);
-        return -1;
+        return;
     }
 
-    fds[0] = dispatch->sockfd;
-    fds[1] = appfd;
-    fds[2] = fetchfd;
-    fds[3] = pollfd;
-    return 0;
+    // the first byte timeout still counts from the first copy
+    long long sent_us = st->sent_us;
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = dispatch->sockfd };
+    bool ok = fetch_send(st, &dispatch->url, dispatch->sockfd, dispatch->ssl) == 0
+        && epoll_ctl(st->ep, EPOLL_CTL_ADD, dispatch->sockfd, &ev) == 0;
+    st->sent_us = sent_us;
+
+    if (ok) {
+        stats_add(STAT_HEDGES, 1);
+        st->hedge_fd = dispatch->sockfd, dispatch->sockfd = -1;
+        st->hedge_ssl = dispatch->ssl, dispatch->ssl = NULL;
+        st->hedge_ctx = dispatch->ctx, dispatch->ctx = NULL;
+    }
+    dispatch_free(dispatch);
 }
 
-static bool handle_http_headers(struct fetch_state *st);
-static void handle_http_body_bytes(struct fetch_state *st,
-                                   const char *data,
-                                   size_t len);
-static void handle_http_body(struct fetch_state *st);
+/** Read ST's response off the other one of its two connections from here on. */
+static void hedge_swap(struct fetch_state *st) {
+    int fd = st->netfd;
+    SSL *ssl = st->ssl;
+    SSL_CTX *ctx = st->ssl_ctx;
+    st->netfd = st->hedge_fd, st->ssl = st->hedge_ssl, st->ssl_ctx = st->hedge_ctx;
+    st->hedge_fd = fd, st->hedge_ssl = ssl, st->hedge_ctx = ctx;
+    st->hedge_won = !st->hedge_won;
+}
 
-static bool flush_pending(struct fetch_state *st);
-static void flush_stream(struct fetch_state *st);
+/** Milliseconds ST's worker can wait for something to happen, -1 for as long as it takes. */
+static int fetcher_wait_ms(const struct fetch_state *st) {
+    long long now = stats_now_us();
+    int wait_ms = fetch_deadline_ms(st, now);
+    int hedge_ms = hedge_due_ms(st, now);
+    if (hedge_ms >= 0 && (wait_ms < 0 || hedge_ms < wait_ms))
+        wait_ms = hedge_ms;
+    return wait_ms;
+}
 
 void *fetcher(void *arg) {
     struct fetch_state *fs = arg;
     struct epoll_event events[4];
+    fetch_watch_reader(fs, fs->ep);
+    fs->hedge_at_us = hedge_at_us(fs);
 
     /* ---------------------------
        1. MAIN: Read HTTP response
        --------------------------- */
     while (!fs->http_done) {
-        int n = epoll_wait(fs->ep, events, 4, -1);
+        int n = epoll_wait(fs->ep, events, 4, fetcher_wait_ms(fs));
         if (n < 0) {
             if (errno == EINTR) continue;
             break;
         }
+        if (fetch_expire(fs, stats_now_us()))
+            break;
+        if (hedge_due_ms(fs, stats_now_us()) == 0)
+            hedge_send(fs);
 
+        /* The reader gave up, so the connection and parser go right away */
+        bool readable = false;
+        bool hedge_readable = false;
         for (int i = 0; i < n; i++) {
-            int fd = events[i].data.fd;
-            uint32_t ev = events[i].events;
-
-            /* New data from the network */
-            if (!fs->headers_done) {
-                handle_http_headers(fs);
+            if (events[i].data.fd == handoff_fd(fs->out)) {
+                if (fetch_reader_gone(fs))
+                    fs->http_done = true;
+            } else if (events[i].data.fd == fs->hedge_fd) {
+                hedge_readable = true;
+            } else if (fs->hedge_connect && events[i].data.fd == fs->hedge_connect->ready_fd) {
+                hedge_connected(fs);
             } else {
-                handle_http_body(fs);
+                readable = true;
             }
-
         }
-    }
-
-    /* Finish writes */
-    fflush(fs->stream);
-
-    /* REQUIRED: switch from write → read */
-    rewind(fs->stream);
+        if (fs->canceled)
+            break;
 
-    /* Drain parsed output */
-    flush_stream(fs);
+        /* Until a response comes in, read whichever connection has something */
+        if (hedge_readable && !readable && !fs->recv_us) {
+            hedge_swap(fs);
+            readable = true;
+        }
 
-    /* Close once */
-    fclose(fs->stream);
-    fs->stream = NULL;
+        /* New data from the network */
+        if (readable)
+            handle_http_response(fs);
 
-    tcp_tls_free(fs->ssl, fs->ssl_ctx);
+        /* The other connection lost the race, or never even got to run */
+        if (fs->recv_us && (fs->hedge_fd >= 0 || fs->hedge_connect)) {
+            if (fs->hedge_won)
+                stats_add(STAT_HEDGE_WINS, 1);
+            hedge_close(fs);
+        }
 
-    if (!fs->closed_outfd) {
-        close(fs->outfd);
-        fs->closed_outfd = true;
+        /* Hand off rows as they're parsed instead of holding the whole body */
+        if (fs->head.done)
+            fetch_drain(fs);
     }
 
-    close(fs->netfd);
-    close(fs->ep);
+    if (fetch_retry(fs))
+        return fs;
 
-    free(fs->hostname);
-    free(fs);
+    /* Drain parsed output, waiting on the reader whenever it's full */
+    if (!fs->canceled)
+        fetch_drain(fs);
+    while (!fs->out_ended && !fs->canceled) {
+        struct pollfd pfd = { .fd = handoff_fd(fs->out), .events = POLLIN };
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+            break;
+        if (!fetch_reader_gone(fs))
+            fetch_drain(fs);
+    }
 
+    fetch_state_free(fs);
     return NULL;
 }
 
@@ -260,7 +824,7 @@ static ssize_t read_full(int fd, void *buf, size_t len) {
     return off;
 }
 
-static struct url *url_of_string(const char *url) {
+struct url *url_of_string(const char *url) {
     CURLU *u = curl_url();
     if (!u) {
         errno = ENOMEM;
@@ -278,10 +842,12 @@ static struct url *url_of_string(const char *url) {
     bool is_tls = strncmp(url, "https://", 8) == 0;
     char *host_c = NULL;
     char *path_c = NULL;
+    char *query_c = NULL;
     char *port_c = NULL;
 
     curl_url_get(u, CURLUPART_HOST, &host_c, 0);
     curl_url_get(u, CURLUPART_PATH, &path_c, 0);
+    curl_url_get(u, CURLUPART_QUERY, &query_c, 0);
     curl_url_get(u, CURLUPART_PORT, &port_c, CURLU_DEFAULT_PORT);
 
     size_t host_len = strlen(host_c) + 1 + strlen(port_c);
@@ -289,328 +855,646 @@ static struct url *url_of_string(const char *url) {
 
     URL->hostname = str("%s", host_c);
 
-    size_t pathname_len = strlen(host_c);
+    size_t pathname_len = strlen(path_c);
     URL->pathname = dsnprintf(&pathname_len, "%s", path_c);
 
+    size_t search_len = query_c ? 1 + strlen(query_c) : 0;
+    URL->search = dsnprintf(&search_len, query_c ? "?%s" : "", query_c);
+
     URL->port = str("%s", port_c);
     URL->protocol = str("%s", is_tls ? "https:" : "http:");
 
     curl_free(host_c);
     curl_free(path_c);
+    curl_free(query_c);
     curl_free(port_c);
 
     curl_url_cleanup(u);
     return URL;
 }
 
+/** Read the status, framing and encoding of the response out of ST's header block. */
 static void parse_http_headers(struct fetch_state *st) {
-    // Null-terminate header buffer for string scanning
-    size_t len = st->header_len;
+    const struct headers *h = &st->head;
+
+    const char *ce = headers_get(h, "Content-Encoding");
+    if (ce)
+        st->decoder = decoder(ce, strlen(ce));
 
-    // Safety check
-    if (len >= sizeof(st->header_buf))
-        len = sizeof(st->header_buf) - 1;
+    // HTTP/1.0 closes after every response unless it says otherwise
+    if (headers_get(h, "Connection") ? headers_has_token(h, "Connection", "close") : h->minor == 0)
+        st->keep_alive = false;
 
-    st->header_buf[len] = '\0';
+    const char *cl = headers_get(h, "Content-Length");
+    bool no_body = strcmp(st->method, "HEAD") == 0
+        || (h->status >= 100 && h->status < 200)
+        || h->status == 204 || h->status == 304;
 
-    // Detect Transfer-Encoding: chunked
-    if (strcasestr(st->header_buf, "Transfer-Encoding: chunked")) {
+    if (no_body) {
+        st->http_done = true;
+    } else if (headers_has_token(h, "Transfer-Encoding", "chunked")) {
         st->chunked_mode = true;
-        return;
+    } else if (cl) {
+        st->content_length = strtoull(cl, NULL, 10);
+        st->http_done = st->content_length == 0;
+    } else {
+        // nothing says where the body ends but the connection closing
+        st->until_close = true;
+        st->keep_alive = false;
     }
+}
 
-    // Detect Content-Length
-    char *cl = strcasestr(st->header_buf, "Content-Length:");
-    if (cl) {
-        st->chunked_mode = false;
-        st->content_length = strtoul(cl + 15, NULL, 10);
+/**
+ * ST just finished parsing its final response headers: time them and hand them to
+ * its #fetch_info.
+ */
+static void publish_headers(struct fetch_state *st) {
+    st->headers_us = stats_now_us();
+    long ttfb_ms = (st->headers_us - st->started_us) / 1000;
+    stats_time(STAT_TTFB_MS, ttfb_ms);
+    if (!st->info)
         return;
-    }
 
-    // Fallback if neither header is found
-    // Many servers default to identity + Connection: close
-    st->chunked_mode = false;
-    st->content_length = 0;
+    char *json = headers_json(&st->head);
+
+    pthread_mutex_lock(&st->info->lock);
+    if (!st->info->headers) {
+        st->info->status = st->head.status;
+        st->info->headers = json;
+        st->info->ttfb_ms = ttfb_ms;
+        json = NULL;
+    }
+    pthread_mutex_unlock(&st->info->lock);
+    free(json);
 }
 
-static void handle_http_body_bytes(struct fetch_state *st,
-                                   const char *data,
-                                   size_t len)
-{
+/** The `Retry-After` of ST's response in milliseconds, -1 if it has none that parses. */
+static long retry_after_ms(const struct fetch_state *st) {
+    const char *value = headers_get(&st->head, "Retry-After");
+    if (!value)
+        return -1;
 
-    if (!st->chunked_mode && st->content_length > 0) {
-        size_t to_copy = len < st->content_length ? len : st->content_length;
-        st->content_length -= fwrite8(data, to_copy, st->stream);
-    } else {
-        size_t i = 0;
-        while (i < len) {
-            if (st->reading_chunk_size) {
-                char c = data[i++];
-
-                // Accumulate until CRLF
-                if (c == '\r') {
-                    continue; // skip
-                }
+    // either delay-seconds or an HTTP-date
+    char *end = NULL;
+    long long seconds = strtoll(value, &end, 10);
+    if (end != value && !*end)
+        return seconds < 0 ? -1 : seconds < INT_MAX / 1000 ? seconds * 1000 : INT_MAX;
 
-                if (c == '\n') {
-                    // End of chunk-size line
-                    st->chunk_line[st->chunk_line_len] = '\0';
+    struct tm tm = {0};
+    end = strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (!end || *end)
+        return -1;
+    long long ms = ((long long) timegm(&tm) - time(NULL)) * 1000;
+    return ms < 0 ? 0 : ms < INT_MAX ? ms : INT_MAX;
+}
 
-                    // Hex decode the chunk size
-                    st->current_chunk_size =
-                        strtoul(st->chunk_line, NULL, 16);
+/** A backoff before ST's next try, doubling with every try: half of it fixed, half random. */
+static long backoff_ms(const struct fetch_state *st) {
+    long ms = FETCH_RETRY_BASE_MS;
+    for (int i = 0; i < st->attempt && ms < FETCH_RETRY_MAX_MS; i++)
+        ms *= 2;
+    if (ms > FETCH_RETRY_MAX_MS)
+        ms = FETCH_RETRY_MAX_MS;
+    return ms / 2 + random() % (ms / 2 + 1);
+}
 
-                    st->chunk_line_len = 0;
+/** Can ST be tried again, after waiting DELAY_MS? */
+static bool can_retry(const struct fetch_state *st, long delay_ms) {
+    if (st->attempt >= st->retry.retries || st->delivered || st->canceled || !idempotent(st))
+        return false;
+    // a try that would start after the total timeout ran out is no try at all
+    long long start_us = stats_now_us() + delay_ms * 1000LL;
+    return !st->timeouts.total_ms || start_us < st->started_us + st->timeouts.total_ms * 1000LL;
+}
 
-                    if (st->current_chunk_size == 0) {
-                        st->http_done = true;
-                    } else {
-                        st->reading_chunk_size = false;
-                    }
+/**
+ * Whether ST's final response is a transient error that gets another try, marking
+ * it `retrying` if so.
+ */
+static bool retry_response(struct fetch_state *st) {
+    int status = st->head.status;
+    if (status != 429 && (status < 502 || status > 504))
+        return false;
+
+    long delay_ms = retry_after_ms(st);
+    if (status == 429) {
+        // every other fetch to the origin would only run into the same 429
+        long hold_ms = delay_ms < 0 ? backoff_ms(st) : delay_ms;
+        limit_hold(st, hold_ms < FETCH_RETRY_MAX_MS ? hold_ms : FETCH_RETRY_MAX_MS);
+    }
+    if (delay_ms > FETCH_RETRY_MAX_MS)
+        return false;
+    if (delay_ms < 0)
+        delay_ms = backoff_ms(st);
+    if (!can_retry(st, delay_ms))
+        return false;
+
+    st->retrying = true;
+    st->retry_delay_ms = delay_ms;
+    return true;
+}
 
-                    continue;
-                }
+/** Is STATUS an interim response (100 Continue, 103 Early Hints) with the real one to follow? */
+static bool is_interim(int status) {
+    return status >= 100 && status < 200 && status != 101;
+}
 
-                if (st->chunk_line_len < sizeof(st->chunk_line) - 1) {
-                    st->chunk_line[st->chunk_line_len++] = c;
-                }
+void fetch_add_header(struct fetch_state *st, const char *name, size_t name_len,
+                      const char *value, size_t value_len)
+{
+    st->recv_us = stats_now_us();
+    char *line = NULL;
+    int n = name_len == 7 && memcmp(name, ":status", 7) == 0
+        ? asprintf(&line, "HTTP/1.1 %.*s\r\n", (int) value_len, value)
+        : asprintf(&line, "%.*s: %.*s\r\n", (int) name_len, name, (int) value_len, value);
+    // a header that doesn't fit is only missing from the #fetch_info
+    if (n >= 0 && !st->head.done)
+        headers_feed(&st->head, line, n);
+    free(line);
+}
 
-                continue;
-            }
+void fetch_end_headers(struct fetch_state *st) {
+    if (headers_feed(&st->head, "\r\n", 2) != 2 || !st->head.done)
+        return;
+    if (is_interim(st->head.status))
+        headers_reset(&st->head);
+    else if (!retry_response(st))
+        publish_headers(st);
+}
 
-            /* 2. READ CHUNK PAYLOAD */
-            if (!st->reading_chunk_size && st->current_chunk_size > 0) {
-                size_t to_copy = len - i < st->current_chunk_size ? len - i : st->current_chunk_size;
-                size_t written = fwrite8(data + i, to_copy, st->stream);
-                i += written;
-                st->current_chunk_size -= written;
+void fetch_body_write(struct fetch_state *st, const char *src, size_t n) {
+    st->recv_us = stats_now_us();
+    stats_add(STAT_BODY_BYTES, n);
+    if (st->info) {
+        pthread_mutex_lock(&st->info->lock);
+        st->info->bytes += n;
+        pthread_mutex_unlock(&st->info->lock);
+    }
 
-                // If not enough bytes to finish payload, exit now
-                if (st->current_chunk_size > 0) {
-                    return;
-                }
+    // a pipelined connection reads the rest to stay in step, but nobody wants the rows
+    if (st->canceled || st->retrying)
+        return;
+    st->delivered = true;
 
-                // Payload exactly finished expect CRLF next
-                // so switch to CRLF-skip mode
-                if (st->current_chunk_size == 0) {
-                    // Next bytes should be "\r\n"
-                    st->reading_chunk_size = false; // momentary
-                    st->expecting_crlf = 2;
-                }
+    if (!st->decoder) {
+        fwrite8(src, n, st->stream);
+        return;
+    }
 
-                continue;
-            }
+    if (decoder_fwrite(st->decoder, src, n, st->stream) < 0 && !st->http_done) {
+        fprintf(stderr, "couldn't decompress response body from %s\n",
+                st->hostname ? st->hostname : "server");
+        st->http_done = true;
+    }
+}
 
-            /* 3. SKIP CRLF AFTER PAYLOAD */
-            if (st->expecting_crlf > 0) {
-                char c = data[i++];
-                if (c == '\r' || c == '\n') {
-                    st->expecting_crlf--;
-                    if (st->expecting_crlf == 0) {
-                        // Now start the next chunk-size line
-                        st->reading_chunk_size = true;
-                    }
-                }
-                continue;
-            }
+/**
+ * Chunk payloads found in one read. A lone span is written straight from the read
+ * buffer; as soon as there's a second one, they're gathered in `span_buf` so the
+ * parser still gets them in a single write.
+ */
+struct spans {
+    const char *data;
+    size_t len;
+    bool gathered;
+};
+
+static void spans_flush(struct fetch_state *st, struct spans *sp) {
+    if (sp->len > 0)
+        fetch_body_write(st, sp->gathered ? st->span_buf : sp->data, sp->len);
+    *sp = (struct spans) {0};
+}
+
+/** Add the N bytes at P to SP, which has room for TOTAL bytes of the read at most. */
+static void spans_add(struct fetch_state *st, struct spans *sp, const char *p, size_t n,
+                      size_t total)
+{
+    if (n == 0)
+        return;
+    if (sp->len == 0) {
+        sp->data = p;
+        sp->len = n;
+        return;
+    }
 
-            /* 1. READ THE CHUNK-SIZE LINE */
-            /* Should not reach here */
-            i++;
+    if (!sp->gathered) {
+        if (st->span_cap < total) {
+            char *buf = realloc(st->span_buf, total);
+            if (!buf) {
+                // no room to gather, so write them one by one
+                spans_flush(st, sp);
+                sp->data = p;
+                sp->len = n;
+                return;
+            }
+            st->span_buf = buf;
+            st->span_cap = total;
         }
+        memmove(st->span_buf, sp->data, sp->len);
+        sp->gathered = true;
     }
+    memcpy(st->span_buf + sp->len, p, n);
+    sp->len += n;
 }
 
-static bool handle_http_headers(struct fetch_state *st) {
-    char buf[4096];
+/**
+ * Feed LEN chunked body bytes in DATA through ST's framing, stopping at the end of
+ * the body. Size and trailer lines are found with `memchr()`, and the payloads in
+ * between go to the parser together.
+ *
+ * @return The number of bytes of DATA that were part of the body.
+ */
+static size_t handle_chunked_bytes(struct fetch_state *st, const char *data, size_t len) {
+    struct spans sp = {0};
+    size_t i = 0;
+
+    while (i < len && !st->http_done) {
+        /* 1. CHUNK PAYLOAD */
+        if (st->current_chunk_size > 0) {
+            size_t n = len - i < st->current_chunk_size ? len - i : st->current_chunk_size;
+            spans_add(st, &sp, data + i, n, len);
+            i += n;
+            st->current_chunk_size -= n;
+            if (st->current_chunk_size == 0)
+                st->expecting_crlf = 2; // "\r\n" comes next
+            continue;
+        }
 
-    for (;;) {
-        ssize_t n = tcp_recv(st->netfd, buf, sizeof(buf), st->ssl);
-        if (n > 0) {
-            // Append to header buffer
-            if (st->header_len + n > sizeof(st->header_buf)) {
-                // headers too big
-                // you can error out or realloc
-                return false;
+        /* 2. CRLF AFTER THE PAYLOAD */
+        if (st->expecting_crlf > 0) {
+            while (i < len && st->expecting_crlf > 0 && (data[i] == '\r' || data[i] == '\n')) {
+                st->expecting_crlf--;
+                i++;
             }
+            if (i < len)
+                st->expecting_crlf = 0; // tolerate a bare "\n"
+            continue;
+        }
 
-            memcpy(st->header_buf + st->header_len, buf, n);
-            st->header_len += n;
-
-            // Check if we have full header: "\r\n\r\n"
-            if (st->header_len >= 4) {
-                if (memmem(st->header_buf, st->header_len, "\r\n\r\n", 4)) {
-
-                    st->headers_done = true;
-                    // OPTIONAL: parse headers here
-                    parse_http_headers(st);
+        /* 3. SIZE OR TRAILER LINE, UP TO ITS '\n' */
+        const char *nl = memchr(data + i, '\n', len - i);
+        size_t end = nl ? (size_t) (nl - data) : len;
+        size_t seg = end - i;
+
+        if (st->reading_trailers) {
+            // only a blank line counts, so a "\r" on its own adds nothing
+            st->chunk_line_len += seg - (seg > 0 && data[end - 1] == '\r');
+        } else {
+            size_t room = sizeof(st->chunk_line) - 1 - st->chunk_line_len;
+            size_t n = seg < room ? seg : room;
+            memcpy(st->chunk_line + st->chunk_line_len, data + i, n);
+            st->chunk_line_len += n;
+        }
+        i = nl ? end + 1 : len;
+        if (!nl)
+            break;
 
-                    // Remove header bytes from stream:
-                    // find where the header ends
-                    char *ptr = memmem(st->header_buf, st->header_len, "\r\n\r\n", 4);
-                    size_t header_end = (ptr + 4) - st->header_buf;
+        if (st->reading_trailers) {
+            st->http_done = st->chunk_line_len == 0;
+        } else {
+            // the hex size stops at a "\r" or a ";" before chunk extensions
+            st->chunk_line[st->chunk_line_len] = '\0';
+            st->current_chunk_size = strtoul(st->chunk_line, NULL, 16);
+            // the last chunk, only trailers are left
+            st->reading_trailers = st->current_chunk_size == 0;
+        }
+        st->chunk_line_len = 0;
+    }
 
-                    // Move leftover bytes to body buffer
-                    size_t leftover = st->header_len - header_end;
+    spans_flush(st, &sp);
+    return i;
+}
 
-                    // For next step (body), we feed leftover directly
-                    if (leftover > 0) {
-                        // feed to body parser immediately
-                        handle_http_body_bytes(st,
-                                               st->header_buf + header_end, leftover);
-                    }
+/**
+ * Feed LEN body bytes in DATA through ST's framing, stopping at the end of the body.
+ *
+ * @return The number of bytes of DATA that were part of the body.
+ */
+static size_t handle_http_body_bytes(struct fetch_state *st,
+                                     const char *data,
+                                     size_t len)
+{
+    if (st->until_close) {
+        fetch_body_write(st, data, len);
+        return len;
+    }
 
-                    return true; // done with headers
-                }
-            }
+    if (st->chunked_mode)
+        return handle_chunked_bytes(st, data, len);
 
-            // CONTINUE LOOP — maybe more header bytes available in nonblocking recv
-            continue;
-        }
+    size_t to_copy = len < st->content_length ? len : st->content_length;
+    fetch_body_write(st, data, to_copy);
+    st->content_length -= to_copy;
+    if (st->content_length == 0)
+        st->http_done = true;
+    return to_copy;
+}
 
-        else if (n == 0) {
-            // Server closed unexpectedly before sending full headers
+size_t fetch_response_bytes(struct fetch_state *st, const char *data, size_t len) {
+    st->recv_us = stats_now_us();
+    size_t used = 0;
+    while (!st->head.done && used < len) {
+        long n = headers_feed(&st->head, data + used, len - used);
+        if (n < 0) {
+            fprintf(stderr, "bad response headers from %s: %s\n",
+                    st->hostname ? st->hostname : "server", strerror(errno));
+            st->keep_alive = false;
             st->http_done = true;
-            return false;
+            return len;
         }
+        used += n;
+        if (!st->head.done)
+            break;
 
-        else { // n < 0
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                // No more data NOW — epoll will wake us again
-                return false;
-            }
-            // real error
-            return false;
+        // an interim response has no body, and none of its headers are about the real one
+        if (is_interim(st->head.status)) {
+            headers_reset(&st->head);
+            continue;
         }
+        parse_http_headers(st);
+        if (!retry_response(st))
+            publish_headers(st);
     }
-}
 
-static void handle_http_body(struct fetch_state *st) {
-    char buf[4096];
+    if (st->head.done && !st->http_done && used < len)
+        used += handle_http_body_bytes(st, data + used, len - used);
+    return used;
+}
 
-    ssize_t n = tcp_recv(st->netfd, buf, sizeof(buf), st->ssl);
-    if (n > 0) {
-        // feed raw bytes to chunk/body parser
-        handle_http_body_bytes(st, buf, (size_t)n);
+/** Make room for a bigger read in ST's receive buffer, keeping the old one if that fails. */
+static void grow_recv_buf(struct fetch_state *st) {
+    size_t cap = st->recv_cap ? st->recv_cap * 2 : FETCH_RECV_MIN;
+    if (cap > FETCH_RECV_MAX)
         return;
-    }
+    char *buf = realloc(st->recv_buf, cap);
+    if (!buf)
+        return;
+    st->recv_buf = buf;
+    st->recv_cap = cap;
+}
 
-    if (n == 0) {
-        // TCP closed — if chunked, this could be abrupt
+/**
+ * Read whatever ST's connection has for it, up to #FETCH_RECV_BUDGET, and parse it
+ * as its response.
+ *
+ * @retval false Nothing came in, and ST's response isn't over either.
+ */
+static bool handle_http_response(struct fetch_state *st) {
+    if (!st->recv_buf)
+        grow_recv_buf(st);
+    if (!st->recv_buf) {
         st->http_done = true;
-        return;
+        return true;
     }
 
-    // n < 0: check errno
-    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+    // TLS may have decrypted more than was asked for, and epoll won't say so
+    size_t budget = FETCH_RECV_BUDGET;
+    while (!st->http_done && (budget > 0 || (st->ssl && SSL_pending(st->ssl) > 0))) {
+        ssize_t n = tcp_recv(st->netfd, st->recv_buf, st->recv_cap, st->ssl);
+        if (n > 0) {
+            fetch_response_bytes(st, st->recv_buf, (size_t)n);
+            budget = (size_t) n < budget ? budget - n : 0;
+            if ((size_t) n == st->recv_cap)
+                grow_recv_buf(st);
+            continue;
+        }
+
         // no data right now — epoll will tell us later
-        return;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return budget < FETCH_RECV_BUDGET;
+
+        // closed, which ends a body framed by the close, or a real error
+        if (!(st->head.done && st->until_close)) {
+            if (!st->recv_us && st->hedge_fd >= 0) {
+                // the copy of the request may still be answered
+                hedge_swap(st);
+                hedge_close(st);
+                return true;
+            }
+            fetch_broke(st, st->recv_us ? "connection closed halfway through the response"
+                                        : "connection closed before the response");
+        }
+        st->http_done = true;
     }
-
-    // real error
-    st->http_done = true;
+    return true;
 }
 
-static bool flush_pending(struct fetch_state *st) {
-    while (st->pending_len > 0) {
-        ssize_t n = send(st->outfd,
-                         st->pending_buf + st->pending_off,
-                         st->pending_len,
-                         0);
+bool fetch_read(struct fetch_state *st) {
+    return st->http_done || handle_http_response(st);
+}
 
-        if (n > 0) {
-            st->pending_off += (size_t)n;
-            st->pending_len -= (size_t)n;
-        }
-        else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-            return false; // still pending
-        }
-        else {
-            // real error — stop producing
-            st->http_done = true;
-            return false;
-        }
+void fetch_drain(struct fetch_state *st) {
+    // the stream is written and read from on the same thread,
+    // so switch it from write to read before draining it
+    fflush(st->stream);
+    clearerr(st->stream);
+    st->backlogged = !handoff_fill(st->out, st->stream);
+
+    // a response that gets another try isn't over for the reader
+    if (st->http_done && !st->backlogged && !st->out_ended && !st->retrying) {
+        handoff_end(st->out);
+        st->out_ended = true;
     }
+}
 
-    // pending complete: free and reset
-    free(st->pending_buf);
-    st->pending_buf = NULL;
-    st->pending_off = 0;
-    st->pending_len = 0;
+void fetch_watch_reader(struct fetch_state *st, int ep) {
+    bool watch = !st->out_ended && !st->canceled;
+    if (watch == st->out_watched)
+        return;
 
-    return true; // pending fully flushed
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = handoff_fd(st->out) };
+    epoll_ctl(ep, watch ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, ev.data.fd, &ev);
+    st->out_watched = watch;
 }
 
-static void flush_stream(struct fetch_state *st) {
-    FILE *rd = st->stream;
-    int out = st->outfd;
+void fetch_unwatch_reader(struct fetch_state *st, int ep) {
+    if (st->out_watched)
+        epoll_ctl(ep, EPOLL_CTL_DEL, handoff_fd(st->out), NULL);
+    st->out_watched = false;
+}
 
-    /* 1. Handle pending partial send */
-    if (st->pending_len > 0) {
-        ssize_t n = send(out,
-                         st->pending_buf + st->pending_off,
-                         st->pending_len - st->pending_off,
-                         MSG_NOSIGNAL);
+bool fetch_reader_gone(struct fetch_state *st) {
+    if (!handoff_gone(st->out))
+        return false;
+    st->canceled = true;
+    return true;
+}
 
-        if (n < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                return;
+int fetch_timeouts_parse(const char *spec, struct fetch_timeouts *timeouts) {
+    static const struct {
+        const char *name;
+        size_t offset;
+    } LIMITS[] = {
+        { "connect", offsetof(struct fetch_timeouts, connect_ms) },
+        { "first_byte", offsetof(struct fetch_timeouts, first_byte_ms) },
+        { "idle", offsetof(struct fetch_timeouts, idle_ms) },
+        { "total", offsetof(struct fetch_timeouts, total_ms) },
+    };
+
+    struct fetch_timeouts parsed = *timeouts;
+    const char *p = spec ? spec : "";
+    for (;;) {
+        while (*p == ' ' || *p == ',' || *p == '\t')
+            p++;
+        if (!*p)
+            break;
+
+        size_t name_len = strcspn(p, "= ,\t");
+        const char *value = p[name_len] == '=' ? p + name_len + 1 : p;
+        long *limit = &parsed.total_ms; // a bare number
+        if (value != p) {
+            limit = NULL;
+            for (size_t i = 0; i < sizeof(LIMITS) / sizeof(*LIMITS); i++) {
+                if (strlen(LIMITS[i].name) == name_len && strncmp(p, LIMITS[i].name, name_len) == 0)
+                    limit = (long *) ((char *) &parsed + LIMITS[i].offset);
             }
-            st->http_done = true;
-            return;
         }
 
-        st->pending_off += n;
-
-        if (st->pending_off < st->pending_len) {
-            return;
+        char *end = NULL;
+        long long ms = strtoll(value, &end, 10);
+        if (!limit || end == value || ms < 0 || ms > INT_MAX
+            || (*end && *end != ' ' && *end != ',' && *end != '\t'))
+        {
+            errno = EINVAL;
+            return -1;
         }
+        *limit = ms;
+        p = end;
+    }
+
+    *timeouts = parsed;
+    return 0;
+}
 
-        free(st->pending_buf);
-        st->pending_buf = NULL;
-        st->pending_len = 0;
-        st->pending_off = 0;
+/**
+ * When the next of ST's #fetch_timeouts runs out, 0 for none, writing out its name
+ * and limit to WHAT and LIMIT_MS.
+ */
+static long long next_deadline_us(const struct fetch_state *st, const char **what,
+                                  long *limit_ms)
+{
+    const struct fetch_timeouts *t = &st->timeouts;
+    long long next = 0;
+#define CONSIDER(armed, since_us, ms, name)                                       \
+    if ((armed) && (ms) > 0 && (!next || (since_us) + (ms) * 1000LL < next)) {    \
+        next = (since_us) + (ms) * 1000LL;                                        \
+        *what = (name), *limit_ms = (ms);                                         \
     }
+    CONSIDER(true, st->started_us, t->total_ms, "total");
+    CONSIDER(st->sent_us && !st->recv_us, st->sent_us, t->first_byte_ms, "first byte");
+    CONSIDER(st->recv_us, st->recv_us, t->idle_ms, "idle");
+    // a request body that stops going out is as stalled as a response that stops coming in
+    CONSIDER(st->sending_us, st->sending_us, t->idle_ms, "idle");
+#undef CONSIDER
+    return next;
+}
 
-    /* 2. Read NDJSON from Bassoon */
-    char *line = NULL;
-    size_t cap = 0;
-    ssize_t got;
+int fetch_deadline_ms(const struct fetch_state *st, long long now_us) {
+    const char *what = NULL;
+    long limit_ms = 0;
+    long long next = next_deadline_us(st, &what, &limit_ms);
+    if (!next || st->canceled)
+        return -1;
+    if (next <= now_us)
+        return 0;
+    long long ms = (next - now_us + 999) / 1000;
+    return ms < INT_MAX ? (int) ms : INT_MAX;
+}
 
+bool fetch_expire(struct fetch_state *st, long long now_us) {
+    const char *what = NULL;
+    long limit_ms = 0;
+    long long next = next_deadline_us(st, &what, &limit_ms);
+    if (!next || now_us < next || st->canceled)
+        return false;
+
+    stats_add(STAT_TIMEOUTS, 1);
+    info_fail(st->info, "%s timeout of %ldms ran out for %s", what, limit_ms, st->url);
+    st->canceled = true;
+    if (!st->out_ended) {
+        // whatever's still in the stream never makes it, the reader is told why instead
+        handoff_end(st->out);
+        st->out_ended = true;
+    }
+    return true;
+}
 
-    while ((got = getline(&line, &cap, rd)) != -1) {
+void fetch_broke(struct fetch_state *st, const char *why) {
+    if (st->canceled || st->retrying)
+        return;
 
-        ssize_t sent = send(out, line, got, MSG_NOSIGNAL);
+    long delay_ms = backoff_ms(st);
+    if (can_retry(st, delay_ms)) {
+        st->retrying = true;
+        st->retry_delay_ms = delay_ms;
+    } else if (why) {
+        info_fail(st->info, "%s from %s", why, st->url);
+    }
+}
 
-        if (sent < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                st->pending_buf = malloc(got);
-                memcpy(st->pending_buf, line, got);
-                st->pending_len = got;
-                st->pending_off = 0;
-                free(line);
-                return;
-            }
-            st->http_done = true;
-            free(line);
-            return;
-        }
+bool fetch_retry(struct fetch_state *st) {
+    if (!st->retrying || st->canceled)
+        return false;
+
+    hedge_close(st);
+    tcp_tls_free(st->ssl, st->ssl_ctx);
+    st->ssl = NULL, st->ssl_ctx = NULL;
+    if (st->netfd >= 0)
+        close(st->netfd);
+    st->netfd = -1;
+    if (st->ep >= 0) {
+        // closing it took OUT out of the set too
+        close(st->ep);
+        st->ep = -1;
+        st->out_watched = false;
+    }
 
-        if (sent < got) {
-            size_t rem = got - sent;
-            st->pending_buf = malloc(rem);
-            memcpy(st->pending_buf, line + sent, rem);
-            st->pending_len = rem;
-            st->pending_off = 0;
-            free(line);
-            return;
-        }
+    decoder_free(st->decoder);
+    st->decoder = NULL;
+    headers_reset(&st->head);
+    st->chunked_mode = false;
+    st->until_close = false;
+    st->content_length = 0;
+    st->chunk_line_len = 0;
+    st->current_chunk_size = 0;
+    st->expecting_crlf = 0;
+    st->reading_trailers = false;
+    st->http_done = false;
+    st->sent_us = 0;
+    st->recv_us = 0;
+    st->hedge_won = false;
+
+    // whatever went wrong before, this try may still work out
+    if (st->info) {
+        pthread_mutex_lock(&st->info->lock);
+        free(st->info->error);
+        st->info->error = NULL;
+        pthread_mutex_unlock(&st->info->lock);
     }
 
-    free(line);
+    st->retrying = false;
+    st->cleared = false; // the next try counts against the rate too
+    st->attempt += 1;
+    st->retry_at_us = stats_now_us() + st->retry_delay_ms * 1000LL;
+    stats_add(STAT_RETRIES, 1);
+    return true;
+}
 
-    if (feof(rd) && st->http_done && st->pending_len == 0 && !st->closed_outfd) {
-        close(out);
-        st->closed_outfd = true;
+bool fetch_backoff(struct fetch_state *st) {
+    for (;;) {
+        long long left_us = st->retry_at_us - stats_now_us();
+        if (left_us <= 0)
+            break;
+
+        struct pollfd pfd = { .fd = handoff_fd(st->out), .events = POLLIN };
+        int n = poll(&pfd, 1, (int) ((left_us + 999) / 1000));
+        if (n > 0 && fetch_reader_gone(st))
+            return false;
+        if (n < 0 && errno != EINTR)
+            break;
     }
+    st->retry_at_us = 0;
+    return true;
 }
+
+#undef FETCH_UPLOAD_CHUNK
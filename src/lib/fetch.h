@@ -4,9 +4,14 @@
  */
 
 #pragma once
+#include "decode.h"
+#include "handoff.h"
+#include "headers.h"
 #include "pyc.h"
 #include <openssl/types.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 
 /**
@@ -36,6 +41,14 @@ struct url {
      */
     char *pathname;
 
+    /**
+     * @brief A string containing a '?' followed by the parameters of the URL,
+     * or an empty string if it has none.
+     *
+     * {@link https://developer.mozilla.org/en-US/docs/Web/API/URL/search}
+     */
+    char *search;
+
     /**
      * @brief A string containing the port number of the URL.
      *
@@ -52,52 +65,432 @@ struct url {
 };
 void url_free(struct url *url);
 
+/**
+ * @brief Parse URL into a heap allocated #url. Free with #url_free() and then `free()`.
+ */
+struct url *url_of_string(const char *url);
+
+/**
+ * @brief Everything #use_fetch() needs to connect to a URL.
+ *
+ * SOCKFD, SSL and CTX are only set once connected, and #dispatch_free() closes
+ * them unless someone took them over and reset them to -1 / NULL.
+ */
 struct dispatch {
     int sockfd;
     SSL *ssl;
     SSL_CTX *ctx;
     struct url url;
     struct addrinfo *addrinfo;
+    long long started_us;       // when resolving started, the connect timeout counts from then
+    long timeout_ms;            // to resolve, connect and finish the TLS handshake in
 };
 void dispatch_free(struct dispatch *dispatch);
-struct dispatch *fetch_socket(const char *url, const char *init[4]);
-int use_fetch(int fds[4], struct dispatch *dispatch);
+
+/**
+ * @brief Parse URL and resolve its host into a #dispatch for #use_fetch().
+ *
+ * Resolution goes through the #dns_getaddrinfo() cache, but a miss still waits
+ * on the network, so call it from the worker thread. It shares TIMEOUT_MS, 0 for
+ * #FETCH_CONNECT_TIMEOUT_MS, with connecting.
+ *
+ * @retval NULL Error, `errno` is ETIMEDOUT if TIMEOUT_MS ran out.
+ */
+struct dispatch *fetch_socket(const char *url, long timeout_ms);
+
+/**
+ * #use_fetch() connected, but the server picked HTTP/2 over ALPN. Nothing was sent
+ * and DISPATCH still owns the connection, so hand it over to #h2_adopt().
+ */
+#define FETCH_H2 1
+
+/**
+ * Resolving, connecting and the TLS handshake together can't take longer than this,
+ * unless a #fetch_timeouts says otherwise.
+ */
+#define FETCH_CONNECT_TIMEOUT_MS (10 * 1000)
+
+/**
+ * @brief How long each part of a fetch may take, in milliseconds, 0 for no limit.
+ * A fetch that runs out of one ends early, see #fetch_expire().
+ */
+struct fetch_timeouts {
+    long connect_ms;        // resolving, connecting and the TLS handshake, 0 for #FETCH_CONNECT_TIMEOUT_MS
+    long first_byte_ms;     // from the request going out to the first byte of its response
+    long idle_ms;           // between two reads of the response
+    long total_ms;          // from #fetch() to the end of the response
+};
+
+/**
+ * @brief Read SPEC into TIMEOUTS: `name=ms` pairs separated by spaces or commas,
+ * named `connect`, `first_byte`, `idle` and `total`, e.g. `connect=2000 idle=10000`.
+ * A bare number is the total. Limits SPEC doesn't name are left alone, so SPEC
+ * can override some of them on top of others.
+ *
+ * @retval 0 OK - NULL and empty are too, they change nothing.
+ * @retval -1 Error, SPEC is malformed. `errno` is EINVAL.
+ */
+int fetch_timeouts_parse(const char *spec, struct fetch_timeouts *timeouts);
+
+/**
+ * @brief How a fetch is tried again, see #fetch_broke() and #fetch_retry(). Only a
+ * `GET` or `HEAD` without a body is, and only while none of its response has
+ * reached the reader.
+ */
+struct fetch_retry {
+    int retries;            // tries after the first, 0 for none
+    long hedge_ms;          // 0 for never, #FETCH_HEDGE_P95, or ms to wait for a response before sending a copy
+};
+
+/**
+ * A #fetch_retry `hedge_ms` that waits for the 95th percentile of every `ttfb_ms`
+ * timed so far, once there are #FETCH_HEDGE_MIN_SAMPLES of them.
+ */
+#define FETCH_HEDGE_P95 (-1)
+#define FETCH_HEDGE_MIN_SAMPLES 20
+
+/**
+ * @brief How hard a fetch may hit its origin, shared with every fetch to the same
+ * origin that has limits of its own, see limit.h. 0 is no limit for each.
+ */
+struct fetch_limit {
+    double rate;            // requests per second
+    int burst;              // requests that go out at once after a quiet spell, 0 for RATE (at least 1)
+    int max_in_flight;      // requests at once, sent and not yet answered in full
+};
+
+/**
+ * The first try again waits about #FETCH_RETRY_BASE_MS, each next one about twice
+ * as long as the last, up to #FETCH_RETRY_MAX_MS. A `Retry-After` longer than that
+ * isn't waited for at all.
+ */
+#define FETCH_RETRY_BASE_MS 100
+#define FETCH_RETRY_MAX_MS (30 * 1000)
+
+/**
+ * @brief Size of a fetch's first receive buffer. It doubles every time a read fills
+ * it, up to #FETCH_RECV_MAX, so a fast transfer takes fewer syscalls per byte.
+ */
+#define FETCH_RECV_MIN (16 * 1024)
+#define FETCH_RECV_MAX (256 * 1024)
+
+/**
+ * @brief Most bytes read per wakeup before the parsed rows are handed to the reader.
+ */
+#define FETCH_RECV_BUDGET (1024 * 1024)
+
+/**
+ * @brief Environment variables with the `SO_RCVBUF` and `SO_RCVLOWAT` bytes of
+ * plaintext connections, e.g. `VTTP_RCVBUF=4194304`. Unset leaves the kernel's
+ * defaults.
+ *
+ * A low-water mark only applies to responses that end with the connection closing,
+ * since the tail of one on a kept-alive connection could sit below it forever.
+ */
+#define FETCH_RCVBUF_ENV "VTTP_RCVBUF"
+#define FETCH_RCVLOWAT_ENV "VTTP_RCVLOWAT"
+
+struct fetch_state;
+struct hedge_connect;
+struct limit_origin;
+
+/**
+ * @brief Connect DISPATCH, send ST's request over it, and hand the connection to ST.
+ *
+ * DISPATCH is never freed here, that's up to the caller. A NULL one is the
+ * #fetch_socket() that failed, and counts as a connect timeout if `errno` says so.
+ *
+ * @retval 0 OK - ST is ready for #fetcher().
+ * @retval FETCH_H2 Connected over HTTP/2 instead, DISPATCH still owns the connection.
+ * @retval -1 Error
+ */
+int use_fetch(struct fetch_state *st, struct dispatch *dispatch);
+
+/**
+ * @brief Send ST's request for URL, body and all, over the connection at FD, through
+ * SSL if it isn't NULL. Waits whenever the nonblocking socket is full.
+ *
+ * @retval 0 OK
+ * @retval -1 Error, check `errno`.
+ */
+int fetch_send(struct fetch_state *st, const struct url *url, int fd, SSL *ssl);
+
+/**
+ * @brief Which of the #fetch() INIT slots is which.
+ */
+enum fetch_init {
+    FETCH_INIT_METHOD = 0,
+    FETCH_INIT_HEADERS,
+    FETCH_INIT_BODY,
+    FETCH_INIT_FRAME,
+};
+
+/**
+ * @brief What's known so far about the response to one #fetch_with_info() request,
+ * shared by the thread reading it and whoever asked for it. Read it under LOCK.
+ */
+struct fetch_info {
+    pthread_mutex_t lock;
+    int refs;
+
+    int status;                 // 0 until the final response's headers are in
+    char *headers;              // #headers_json() of them, set once along with STATUS
+    long ttfb_ms;               // from #fetch() to the headers being in, -1 until then
+    long long bytes;            // body bytes received so far, before decompression
+    char *error;                // why the response was cut short, NULL if it wasn't
+};
+
+/**
+ * @brief Allocate a #fetch_info with one reference, for the caller.
+ *
+ * @retval NULL Error, out of memory.
+ */
+struct fetch_info *fetch_info_new(void);
+
+/**
+ * @brief Drop a reference to INFO, freeing it with the last one. NULL is ignored.
+ */
+void fetch_info_release(struct fetch_info *info);
 
 struct fetch_state {
     /* FDs */
     int netfd;        // TCP socket (nonblocking)
-    int outfd;        // socketpair writer FD (nonblocking)
     int ep;           // epoll instance FD
 
+    char *url;
     char *hostname;
+
+    /* --- REQUEST --- */
+    char *method;               // uppercase, "GET" unless INIT said otherwise
+    char *headers;              // extra "name: value\r\n" lines, NULL for none
+    char *body;                 // NULL for no body
+    size_t body_len;
+    bool keep_alive;            // ask to keep the connection open, see h1.h
+    bool h1_only;               // never offer HTTP/2, the connection is read by #fetch_read()
+    long long started_us;       // when #fetch() was called, see #stats_now_us()
+    long long headers_us;       // when the final response headers came in, 0 until then
+    long long sent_us;          // when the request went out, 0 until then
+    long long sending_us;       // when the request last got further going out, 0 unless it's going out
+    long long recv_us;          // when the last bytes of the response came in, 0 until then
+    struct fetch_timeouts timeouts;
+    struct fetch_info *info;    // one reference, NULL if nobody asked
+
+    /* --- RETRIES --- */
+    struct fetch_retry retry;
+    int attempt;                // tries so far after the first
+    bool retrying;              // this try failed and gets another, its response is dropped
+    long retry_delay_ms;        // how long to wait before the next try, once RETRYING
+    long long retry_at_us;      // when the next try may start, 0 to start right away
+    bool delivered;             // some of the body reached the stream, so it can't be tried again
+
+    /* --- LIMITS, counted together with every fetch to the same origin --- */
+    struct fetch_limit limit;
+    struct limit_origin *origin;    // where LIMIT is counted, NULL until the first #limit_try()
+    bool in_flight;             // holds one of the origin's places in flight
+    bool cleared;               // the limits let this try go out
+
     SSL_CTX *ssl_ctx;
     SSL     *ssl;
 
-    /* --- HTTP HEADER PARSING --- */
-    bool headers_done;
-    char header_buf[8192];  // store header bytes
-    size_t header_len;
+    /* --- HEDGING, only on a connection of its own --- */
+    long long hedge_at_us;      // when to send a copy of the request if there's no response yet, 0 for never
+    struct hedge_connect *hedge_connect; // the copy's connection while it's being made, NULL for none
+    int hedge_fd;               // the copy's connection, -1 for none
+    SSL *hedge_ssl;
+    SSL_CTX *hedge_ctx;
+    bool hedge_won;             // NETFD is the copy's connection, since it answered first
+
+    char *recv_buf;             // grows from FETCH_RECV_MIN as reads fill it
+    size_t recv_cap;
 
+    /* --- HTTP HEADER PARSING --- */
+    struct headers head;        // status line and header block, parsed as they come in
     bool chunked_mode;
+    bool until_close;           // no framing, the body ends when the connection does
     size_t content_length;
+    struct decoder *decoder;    // NULL for an identity Content-Encoding
 
     /* --- CHUNKED DECODING STATE --- */
-    bool reading_chunk_size;    // true = reading hex size line
     char chunk_line[128];       // buffer for chunk-size line
     size_t chunk_line_len;      // how many chars collected
     size_t current_chunk_size;  // remaining bytes in current chunk
     int expecting_crlf;         // 2 -> expecting "\r\n"
+    bool reading_trailers;      // past the last chunk, skipping trailers up to a blank line
+    char *span_buf;             // payloads of several chunks, gathered into one write
+    size_t span_cap;
 
     FILE *stream;
 
-    /* --- NONBLOCKING SEND STATE FOR outfd --- */
-    char *pending_buf;         // partial write buffer (JSON object)
-    size_t pending_len;         // bytes left to send
-    size_t pending_off;         // current offset in pending_send
+    /* --- HANDING ROWS TO THE READER --- */
+    struct handoff *out;        // where the reader takes the rows parsed into STREAM from, NULL if it reads it itself
+    bool backlogged;            // OUT is full, so rows wait in STREAM until the reader makes room
+    bool out_watched;           // an epoll set watches #handoff_fd() of OUT
 
     /* --- TERMINATION STATE --- */
     bool http_done;             // reached end of chunked stream or TCP closed
-    bool closed_outfd;          // have we closed outfd yet?
+    bool out_ended;             // the reader was told there are no more rows
+    bool canceled;              // the reader hung up, or ST ran out of time
 };
 
+/**
+ * @brief Allocate the state for one request to URL, parsing its response body into
+ * RESPONSE_COOKIE.
+ *
+ * The method, headers and body in the #fetch() INIT slots are copied, so INIT can
+ * go away as soon as this returns. Headers are lines of `Name: value`, separated
+ * by `\n` or `\r\n`. A body with no method is POSTed.
+ *
+ * A reader on another thread needs a #handoff_new() as the state's `out` before
+ * it's started, and takes the rows out of that. Nothing is connected yet.
+ * RESPONSE_COOKIE belongs to the state from here on, even on error.
+ *
+ * @retval NULL Error, check `errno` (EINVAL for a malformed method or header).
+ * @retval NOT_NULL OK - free with #fetch_state_free().
+ */
+struct fetch_state *fetch_state_new(const char *url, const char *init[4],
+                                    FILE *response_cookie);
+
+/**
+ * @brief Step CURSOR through the #fetch_state headers, one header per call, pointing
+ * NAME and VALUE at its (lowercase) name and its value.
+ *
+ * Neither NAME nor VALUE is NUL terminated, so use NAME_LEN and VALUE_LEN.
+ *
+ * @retval false No headers left.
+ */
+bool fetch_next_header(const char **cursor, const char **name, size_t *name_len,
+                       const char **value, size_t *value_len);
+
+/**
+ * @brief Close everything ST still holds and free it.
+ */
+void fetch_state_free(struct fetch_state *st);
+
+/**
+ * @brief Read the response to ST's request off its connection until it's done,
+ * handing rows to the reader as they're parsed.
+ *
+ * A request with a #fetch_retry `hedge_ms` that's still waiting on its response by
+ * then is sent again over a second connection, and whichever answers first is read.
+ *
+ * @return ST, ready to be tried again, see #fetch_retry(). NULL once ST is freed.
+ */
 void *fetcher(void *arg);
+
+/**
+ * @brief Read whatever ST's nonblocking connection has for it right now, up to
+ * #FETCH_RECV_BUDGET, and parse it into ST's stream, for a caller that reads ST's
+ * response on its own loop instead of #fetcher(). Sets `http_done` once it's over.
+ *
+ * Nothing here waits or keeps time, so ST's #fetch_timeouts, retries and hedging
+ * are up to the caller.
+ *
+ * @retval true Something came in, or the response is over.
+ * @retval false Nothing yet, wait for `netfd` to turn readable.
+ */
+bool fetch_read(struct fetch_state *st);
+
+/**
+ * @brief Parse LEN bytes of the response to ST's request in DATA, headers first and
+ * then the body through its framing. Parsed rows are written into ST's stream.
+ *
+ * Sets `http_done` as soon as the response is complete, which might be before the
+ * end of DATA if another response was pipelined behind it. A response that's
+ * framed by the connection closing is only done once the caller says so.
+ *
+ * @return The number of bytes of DATA that belong to this response.
+ */
+size_t fetch_response_bytes(struct fetch_state *st, const char *data, size_t len);
+
+/**
+ * @brief Add a header of the HTTP/2 response to ST's header block, `:status` first,
+ * so it reads the same as an HTTP/1.1 one.
+ */
+void fetch_add_header(struct fetch_state *st, const char *name, size_t name_len,
+                      const char *value, size_t value_len);
+
+/**
+ * @brief The HTTP/2 response's headers that #fetch_add_header() added to ST are all
+ * in. An interim response's are dropped for the real one that follows.
+ */
+void fetch_end_headers(struct fetch_state *st);
+
+/**
+ * @brief Write N response body bytes from SRC into ST's stream, decompressing
+ * them first if the response had a `Content-Encoding`.
+ *
+ * A body that fails to decompress ends the response early.
+ */
+void fetch_body_write(struct fetch_state *st, const char *src, size_t n);
+
+/**
+ * @brief Move every parsed row buffered in ST's stream into its #handoff for the
+ * reader, as much as fits.
+ *
+ * What doesn't fit stays in the stream and ST is `backlogged` until the reader makes
+ * room. Once the response is done and all of it is handed off, the reader is told
+ * it's over.
+ */
+void fetch_drain(struct fetch_state *st);
+
+/**
+ * @brief Keep the epoll set EP watching #handoff_fd() of ST's `out` for as long as
+ * the reader can still hang up or make room, and not after.
+ *
+ * A reader that closes its end early, like a cursor after `LIMIT`, wakes the worker
+ * right away, so it doesn't go on downloading and parsing a response nobody reads.
+ * See #fetch_reader_gone().
+ */
+void fetch_watch_reader(struct fetch_state *st, int ep);
+
+/**
+ * @brief Take ST's `out` out of the epoll set EP, if #fetch_watch_reader() put it in.
+ */
+void fetch_unwatch_reader(struct fetch_state *st, int ep);
+
+/**
+ * @brief Whether ST's reader hung up, canceling ST if so. Call it whenever
+ * #handoff_fd() of ST's `out` turns readable.
+ */
+bool fetch_reader_gone(struct fetch_state *st);
+
+/**
+ * @brief Milliseconds from NOW_US until the next of ST's #fetch_timeouts runs out,
+ * for `epoll_wait()`: 0 if one ran out already, -1 for none.
+ */
+int fetch_deadline_ms(const struct fetch_state *st, long long now_us);
+
+/**
+ * @brief If one of ST's #fetch_timeouts ran out by NOW_US, cancel ST and end its
+ * `out`, so the reader sees the end of the response right away and its
+ * #fetch_info says why.
+ *
+ * @retval true ST ran out of time.
+ */
+bool fetch_expire(struct fetch_state *st, long long now_us);
+
+/**
+ * @brief ST's connection broke, or was never made, before its response was complete,
+ * because of WHY. If ST can be tried again it's marked `retrying`. Otherwise, and
+ * unless WHY is NULL, its #fetch_info says the response was cut short.
+ *
+ * A response with a 429, 502, 503 or 504 status is marked `retrying` the same way
+ * as soon as its headers are in, honoring its `Retry-After`.
+ */
+void fetch_broke(struct fetch_state *st, const char *why);
+
+/**
+ * @brief Get ST ready to be tried again from scratch if it's `retrying`: drop its
+ * connection and whatever it parsed of the response, and set `retry_at_us` to the
+ * end of its backoff. Start it again like a new fetch after #fetch_backoff().
+ *
+ * @retval false ST isn't `retrying`, or its reader hung up, and it's left as is.
+ */
+bool fetch_retry(struct fetch_state *st);
+
+/**
+ * @brief Wait until ST's `retry_at_us`, or until its reader hangs up.
+ *
+ * @retval false The reader hung up, so ST is canceled.
+ */
+bool fetch_backoff(struct fetch_state *st);
@@ -0,0 +1,575 @@
+#define _GNU_SOURCE
+
+#include "debug.h"
+#include "h1.h"
+#include "stats.h"
+#include "tcp.h"
+
+#include <errno.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/** How long a connection with nothing in flight stays open for the next fetch to its origin. */
+#define H1_IDLE_MS 5000
+
+/** Bytes read off the connection at a time. */
+#define H1_READ_BUF (16 * 1024)
+
+struct h1_req {
+    struct fetch_state *fs;
+    struct h1_req *next;
+};
+
+struct h1_conn {
+    char *origin;           // "protocol//hostname:port", so http and https stay apart
+    int sockfd;
+    SSL *ssl;
+    SSL_CTX *ctx;
+    int ep;
+    int wakefd;             // eventfd signaled for every new submission
+
+    /* only touched by the connection thread */
+    struct h1_req *inflight;        // sent, and answered in this order
+    struct h1_req **inflight_tail;
+    struct h1_req *finishing;       // answered, but the reader is still draining rows
+    bool closing;                   // a response said the connection closes after it
+    void (*requeue)(struct fetch_state *fs);   // from #h1_run()
+
+    pthread_mutex_t lock;           // guards everything below
+    struct h1_req *submitted;       // requests waiting for the connection thread
+    size_t active;                  // submitted + in flight
+    size_t depth;                   // most requests active at once
+    bool accepting;                 // false once retired
+
+    struct h1_conn *next;           // registry link, guarded by registry_lock
+};
+
+/** Every live connection. Lock order is registry_lock, then h1_conn.lock. */
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct h1_conn *registry = NULL;
+
+/** The #H1_PIPELINE_ENV depth, 0 for off. */
+static size_t pipeline_depth(void) {
+    const char *env = getenv(H1_PIPELINE_ENV);
+    if (!env || !*env)
+        return 0;
+    long long depth = strtoll(env, NULL, 10);
+    return depth > 0 ? depth : 0;
+}
+
+bool h1_pipelinable(const struct fetch_state *fs) {
+    return !fs->body && pipeline_depth() > 0
+        && (strcmp(fs->method, "GET") == 0 || strcmp(fs->method, "HEAD") == 0);
+}
+
+/** The origin of URL as "protocol//hostname:port", NULL if it doesn't parse. */
+static char *origin_of(const char *url) {
+    struct url *URL = url_of_string(url);
+    if (!URL)
+        return NULL;
+
+    char *origin = NULL;
+    if (asprintf(&origin, "%s//%s", hd(URL->protocol), URL->host) < 0)
+        origin = enomem(NULL);
+    url_free(URL);
+    free(URL);
+    return origin;
+}
+
+/** Append REQ to the requests CONN has sent. */
+static void inflight_push(struct h1_conn *conn, struct h1_req *req) {
+    req->next = NULL;
+    *conn->inflight_tail = req;
+    conn->inflight_tail = &req->next;
+}
+
+/** Take the oldest request off the ones CONN has sent. */
+static struct h1_req *inflight_pop(struct h1_conn *conn) {
+    struct h1_req *req = conn->inflight;
+    conn->inflight = req->next;
+    if (!conn->inflight)
+        conn->inflight_tail = &conn->inflight;
+    req->next = NULL;
+    return req;
+}
+
+static void req_free(struct h1_conn *conn, struct h1_req *req) {
+    fetch_unwatch_reader(req->fs, conn->ep);
+    fetch_state_free(req->fs);
+    free(req);
+}
+
+/**
+ * Hand parsed rows in REQ to its reader, waiting for it to make room whenever it's
+ * full.
+ */
+static void req_drain(struct h1_conn *conn, struct h1_req *req) {
+    struct fetch_state *fs = req->fs;
+    if (!fs->out_ended && !fs->canceled)
+        fetch_drain(fs);
+    fetch_watch_reader(fs, conn->ep);
+}
+
+/**
+ * Take CONN out of the registry so no new requests land on it. With ONLY_IF_IDLE,
+ * this is a no-op unless CONN has nothing in flight.
+ *
+ * @retval true CONN is retired, and the submissions it had left are appended to
+ * its requests in flight, unsent.
+ */
+static bool conn_retire(struct h1_conn *conn, bool only_if_idle) {
+    pthread_mutex_lock(&registry_lock);
+    pthread_mutex_lock(&conn->lock);
+
+    if (only_if_idle && conn->active > 0) {
+        pthread_mutex_unlock(&conn->lock);
+        pthread_mutex_unlock(&registry_lock);
+        return false;
+    }
+
+    struct h1_conn **link = &registry;
+    while (*link && *link != conn)
+        link = &(*link)->next;
+    if (*link)
+        *link = conn->next;
+
+    conn->accepting = false;
+    struct h1_req *queued = conn->submitted;
+    conn->submitted = NULL;
+
+    pthread_mutex_unlock(&conn->lock);
+    pthread_mutex_unlock(&registry_lock);
+
+    while (queued) {
+        struct h1_req *req = queued;
+        queued = queued->next;
+        inflight_push(conn, req);
+        fetch_watch_reader(req->fs, conn->ep);
+    }
+    return true;
+}
+
+/** Send every queued request of CONN. Runs on the connection thread. */
+static int take_submissions(struct h1_conn *conn) {
+    pthread_mutex_lock(&conn->lock);
+    struct h1_req *queued = conn->submitted;
+    conn->submitted = NULL;
+    pthread_mutex_unlock(&conn->lock);
+
+    int rc = 0;
+    while (queued) {
+        struct h1_req *req = queued;
+        queued = queued->next;
+        inflight_push(conn, req);
+        fetch_watch_reader(req->fs, conn->ep);
+        if (rc < 0)
+            continue; // never sent, so it's fetched again with the rest
+
+        struct url *URL = url_of_string(req->fs->url);
+        req->fs->keep_alive = true;
+        rc = URL ? fetch_send(req->fs, URL, conn->sockfd, conn->ssl) : -1;
+        if (rc < 0)
+            fprintf(stderr, "couldn't pipeline %s: %s\n", req->fs->url, strerror(errno));
+        url_free(URL);
+        free(URL);
+    }
+    return rc;
+}
+
+/**
+ * The oldest request in flight on CONN is answered, so move it on to finishing, or
+ * hand it back to be tried again if the answer was a transient error.
+ */
+static void conn_answered(struct h1_conn *conn) {
+    struct h1_req *req = inflight_pop(conn);
+
+    pthread_mutex_lock(&conn->lock);
+    conn->active -= 1;
+    pthread_mutex_unlock(&conn->lock);
+
+    if (conn->requeue && fetch_retry(req->fs)) {
+        fetch_unwatch_reader(req->fs, conn->ep);
+        conn->requeue(req->fs);
+        free(req);
+        return;
+    }
+
+    req_drain(conn, req);
+    if (req->fs->out_ended || req->fs->canceled) {
+        req_free(conn, req);
+        return;
+    }
+    req->next = conn->finishing;
+    conn->finishing = req;
+}
+
+/**
+ * Split N bytes read off CONN between the responses in flight, in order.
+ *
+ * @retval -1 CONN can't be used anymore, the server is done with it or broke it.
+ */
+static int conn_feed(struct h1_conn *conn, const char *buf, size_t n) {
+    size_t off = 0;
+    while (off < n) {
+        struct h1_req *head = conn->inflight;
+        if (!head) {
+            fprintf(stderr, "%s answered more than it was asked\n", conn->origin);
+            return -1;
+        }
+
+        struct fetch_state *fs = head->fs;
+        off += fetch_response_bytes(fs, buf + off, n - off);
+        if (fs->head.done && !fs->keep_alive && !conn->closing) {
+            // whatever comes after this response has to go somewhere else
+            conn->closing = true;
+            conn_retire(conn, false);
+        }
+
+        if (!fs->http_done) {
+            req_drain(conn, head);
+            continue;
+        }
+        conn_answered(conn);
+        if (conn->closing)
+            return -1;
+    }
+    return 0;
+}
+
+/** `recv()` through CONN's TLS if it has any, with `errno` EAGAIN when there's nothing yet. */
+static ssize_t conn_read(struct h1_conn *conn, char *buf, size_t len) {
+    if (!conn->ssl)
+        return recv(conn->sockfd, buf, len, 0);
+
+    ERR_clear_error();
+    int n = SSL_read(conn->ssl, buf, len);
+    if (n > 0)
+        return n;
+
+    int err = SSL_get_error(conn->ssl, n);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (err == SSL_ERROR_ZERO_RETURN)
+        return 0;
+    errno = ECONNRESET;
+    return -1;
+}
+
+/**
+ * Read everything CONN's socket has. Responses are never held back for a slow
+ * reader, since it might be waiting on a response further down the pipeline.
+ *
+ * @retval -1 CONN closed or broke.
+ */
+static int conn_recv(struct h1_conn *conn) {
+    char buf[H1_READ_BUF];
+
+    for (;;) {
+        ssize_t n = conn_read(conn, buf, sizeof(buf));
+        if (n > 0) {
+            if (conn_feed(conn, buf, n) < 0)
+                return -1;
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            return 0;
+
+        // closed, which ends a body framed by the close
+        struct h1_req *head = conn->inflight;
+        if (head && head->fs->until_close) {
+            head->fs->http_done = true;
+            conn_answered(conn);
+        } else if (head && head->fs->head.len > 0) {
+            fprintf(stderr, "%s closed halfway through the response to %s\n",
+                    conn->origin, head->fs->url);
+            fetch_broke(head->fs, "connection closed halfway through the response");
+        }
+        return -1;
+    }
+}
+
+/**
+ * The reader that wakes CONN up on FD made some room, so hand it more rows, or it
+ * hung up. Either way, let it go once it has everything it's getting.
+ */
+static void conn_drained(struct h1_conn *conn, int fd) {
+    for (struct h1_req *req = conn->inflight; req; req = req->next) {
+        if (handoff_fd(req->fs->out) != fd)
+            continue;
+
+        // see h1_run() for what happens to a response nobody reads
+        fetch_reader_gone(req->fs);
+        req_drain(conn, req);
+        return;
+    }
+
+    for (struct h1_req **link = &conn->finishing; *link; link = &(*link)->next) {
+        struct h1_req *req = *link;
+        if (handoff_fd(req->fs->out) != fd)
+            continue;
+
+        fetch_reader_gone(req->fs);
+        req_drain(conn, req);
+        if (req->fs->out_ended || req->fs->canceled) {
+            *link = req->next;
+            req_free(conn, req);
+        }
+        break;
+    }
+}
+
+/**
+ * Hand every response left on CONN to its reader, waiting on them for as long as
+ * it takes. They're waited on together, since their readers may take them in any
+ * order.
+ */
+static void conn_finish(struct h1_conn *conn) {
+    epoll_ctl(conn->ep, EPOLL_CTL_DEL, conn->sockfd, NULL);
+    epoll_ctl(conn->ep, EPOLL_CTL_DEL, conn->wakefd, NULL);
+
+    for (struct h1_req **link = &conn->finishing; *link;) {
+        struct h1_req *req = *link;
+        req->fs->http_done = true;
+        req_drain(conn, req);
+        if (req->fs->out_ended || req->fs->canceled) {
+            *link = req->next;
+            req_free(conn, req);
+        } else {
+            link = &req->next;
+        }
+    }
+
+    struct epoll_event events[16];
+    while (conn->finishing) {
+        int n = epoll_wait(conn->ep, events, 16, -1);
+        if (n < 0 && errno != EINTR)
+            break;
+        for (int i = 0; i < n; i++)
+            conn_drained(conn, events[i].data.fd);
+    }
+
+    while (conn->finishing) {
+        struct h1_req *req = conn->finishing;
+        conn->finishing = req->next;
+        req_free(conn, req);
+    }
+}
+
+/**
+ * Close CONN, handing every request the server never started answering to REQUEUE,
+ * along with any cut short that can be tried again. Those go first: a reader still
+ * draining an answered response may be waiting on one of them before it gets back
+ * to reading.
+ */
+static void conn_free(struct h1_conn *conn, void (*requeue)(struct fetch_state *fs)) {
+    while (conn->inflight) {
+        struct h1_req *req = inflight_pop(conn);
+        struct fetch_state *fs = req->fs;
+        bool again = requeue && !fs->canceled && (fs->head.len == 0 || fetch_retry(fs));
+        if (!again) {
+            // cut short halfway through its response, or nobody wants it anymore
+            fs->retrying = false;
+            req->next = conn->finishing;
+            conn->finishing = req;
+            continue;
+        }
+        fetch_unwatch_reader(fs, conn->ep);
+        free(req);
+        requeue(fs);
+    }
+    conn_finish(conn);
+
+    tcp_tls_free(conn->ssl, conn->ctx);
+    if (conn->sockfd >= 0)
+        close(conn->sockfd);
+    if (conn->ep >= 0)
+        close(conn->ep);
+    if (conn->wakefd >= 0)
+        close(conn->wakefd);
+    pthread_mutex_destroy(&conn->lock);
+    free(conn->origin);
+    free(conn);
+}
+
+/** Milliseconds until the next request in flight on CONN runs out of time, -1 for never. */
+static int conn_deadline_ms(struct h1_conn *conn) {
+    long long now = stats_now_us();
+    int next = -1;
+    for (struct h1_req *req = conn->inflight; req; req = req->next) {
+        int ms = fetch_deadline_ms(req->fs, now);
+        if (ms >= 0 && (next < 0 || ms < next))
+            next = ms;
+    }
+    return next;
+}
+
+/**
+ * Cut short every request in flight on CONN that ran out of time. One further down
+ * the pipeline has its response read and dropped when it comes.
+ */
+static void conn_expire(struct h1_conn *conn) {
+    long long now = stats_now_us();
+    for (struct h1_req *req = conn->inflight; req; req = req->next)
+        fetch_expire(req->fs, now);
+}
+
+void h1_run(struct h1_conn *conn, void (*requeue)(struct fetch_state *fs)) {
+    struct epoll_event events[16];
+    conn->requeue = requeue;
+
+    // a server that closes early fails the next write, which mustn't kill the process
+    sigset_t sigpipe;
+    sigemptyset(&sigpipe);
+    sigaddset(&sigpipe, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &sigpipe, NULL);
+
+    for (;;) {
+        if (take_submissions(conn) < 0)
+            break;
+
+        bool busy = conn->inflight || conn->finishing;
+        int n = epoll_wait(conn->ep, events, 16, busy ? conn_deadline_ms(conn) : H1_IDLE_MS);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (n == 0 && !busy) {
+            if (conn_retire(conn, true))
+                break;
+            continue;
+        }
+
+        bool broken = false;
+        for (int i = 0; i < n && !broken; i++) {
+            int fd = events[i].data.fd;
+
+            if (fd == conn->wakefd) {
+                eventfd_t count;
+                eventfd_read(conn->wakefd, &count);
+            } else if (fd == conn->sockfd) {
+                broken = conn_recv(conn) < 0;
+            } else {
+                conn_drained(conn, fd);
+            }
+        }
+
+        conn_expire(conn);
+
+        // nobody reads the response coming in, so drop the connection rather than
+        // the rest of it, and fetch whatever's queued behind it again elsewhere
+        if (conn->inflight && conn->inflight->fs->canceled)
+            broken = true;
+        if (broken)
+            break;
+    }
+
+    conn_retire(conn, false);
+    conn_free(conn, requeue);
+}
+
+/** Queue REQ on CONN. The caller holds registry_lock. */
+static bool conn_submit(struct h1_conn *conn, struct h1_req *req) {
+    pthread_mutex_lock(&conn->lock);
+    bool ok = conn->accepting && conn->active < conn->depth;
+    if (ok) {
+        // keep submission order, responses come back in the order requests went out
+        struct h1_req **tail = &conn->submitted;
+        while (*tail)
+            tail = &(*tail)->next;
+        *tail = req;
+        conn->active += 1;
+        stats_peak(STAT_PIPELINE_DEPTH, conn->active);
+        eventfd_write(conn->wakefd, 1);
+    }
+    pthread_mutex_unlock(&conn->lock);
+    return ok;
+}
+
+bool h1_fetch(struct fetch_state *fs) {
+    if (!fs->url || !h1_pipelinable(fs))
+        return false;
+
+    char *origin = origin_of(fs->url);
+    struct h1_req *req = origin ? calloc(1, sizeof(struct h1_req)) : NULL;
+    if (!req) {
+        free(origin);
+        return false;
+    }
+    req->fs = fs;
+
+    bool ok = false;
+    pthread_mutex_lock(&registry_lock);
+    for (struct h1_conn *conn = registry; conn && !ok; conn = conn->next) {
+        if (strcmp(conn->origin, origin) == 0)
+            ok = conn_submit(conn, req);
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    if (!ok)
+        free(req); // FS is still the caller's
+    free(origin);
+    return ok;
+}
+
+struct h1_conn *h1_adopt(struct fetch_state *fs) {
+    struct h1_conn *conn = calloc(1, sizeof(struct h1_conn));
+    struct h1_req *req = calloc(1, sizeof(struct h1_req));
+    if (!conn || !req) {
+        free(conn);
+        free(req);
+        return enomem(NULL);
+    }
+    conn->sockfd = -1;
+    conn->wakefd = -1;
+    conn->origin = origin_of(fs->url);
+    conn->ep = epoll_create1(0);
+    conn->wakefd = eventfd(0, EFD_NONBLOCK);
+    conn->inflight_tail = &conn->inflight;
+    conn->depth = pipeline_depth() > 0 ? pipeline_depth() : 1;
+    conn->accepting = true;
+    pthread_mutex_init(&conn->lock, NULL);
+
+    struct epoll_event wake_ev = { .events = EPOLLIN, .data.fd = conn->wakefd };
+    struct epoll_event sock_ev = { .events = EPOLLIN, .data.fd = fs->netfd };
+    if (!conn->origin || conn->ep < 0 || conn->wakefd < 0
+        || epoll_ctl(conn->ep, EPOLL_CTL_ADD, conn->wakefd, &wake_ev)
+        || epoll_ctl(conn->ep, EPOLL_CTL_ADD, fs->netfd, &sock_ev))
+    {
+        free(req);
+        conn_free(conn, NULL);
+        return NULL;
+    }
+
+    // CONN owns the connection from here on
+    conn->sockfd = fs->netfd, fs->netfd = -1;
+    conn->ssl = fs->ssl, fs->ssl = NULL;
+    conn->ctx = fs->ssl_ctx, fs->ssl_ctx = NULL;
+    close(fs->ep);
+    fs->ep = -1;
+
+    req->fs = fs;
+    inflight_push(conn, req);
+    fetch_watch_reader(fs, conn->ep);
+    conn->active = 1;
+
+    pthread_mutex_lock(&registry_lock);
+    conn->next = registry;
+    registry = conn;
+    pthread_mutex_unlock(&registry_lock);
+    return conn;
+}
+
+#undef H1_READ_BUF
+#undef H1_IDLE_MS
@@ -0,0 +1,59 @@
+/**
+ * @file h1.h
+ * @brief HTTP/1.1 pipelining, so fetches to an origin without HTTP/2 queue up
+ * on one keep-alive connection instead of each opening their own.
+ *
+ * Only `GET` and `HEAD` without a body are pipelined, since they're safe to send
+ * again on a new connection if the server closes this one before answering them.
+ * Requests go out back to back, and their responses are split apart by their
+ * framing as they come back in the same order.
+ *
+ * Pipelining is off unless #H1_PIPELINE_ENV says how deep to go.
+ */
+#pragma once
+#include "fetch.h"
+#include <stdbool.h>
+
+/**
+ * @brief Environment variable with the most requests in flight on one pipelined
+ * connection, e.g. `VTTP_PIPELINE=8`. Unset or 0 never pipelines.
+ */
+#define H1_PIPELINE_ENV "VTTP_PIPELINE"
+
+/**
+ * @brief Could FS be pipelined: a `GET` or `HEAD` without a body, with pipelining on?
+ */
+bool h1_pipelinable(const struct fetch_state *fs);
+
+/**
+ * @brief Queue FS behind the requests on a pipelined connection that's already
+ * open to its URL's origin.
+ *
+ * @retval false No pipelined connection to the origin can take FS, so FS still
+ * belongs to the caller, untouched.
+ * @retval true OK - the connection owns FS now and hands its rows to its reader.
+ */
+bool h1_fetch(struct fetch_state *fs);
+
+/**
+ * @brief A pipelined connection to one origin.
+ */
+struct h1_conn;
+
+/**
+ * @brief Take over the connection of FS, whose request #use_fetch() sent with
+ * `keep_alive`, and share it with later #h1_fetch() calls to the same origin.
+ *
+ * @retval NULL Error, out of memory. FS and its connection are untouched.
+ * @retval NOT_NULL OK - run it with #h1_run(), which owns FS from here on.
+ */
+struct h1_conn *h1_adopt(struct fetch_state *fs);
+
+/**
+ * @brief Send the requests queued on CONN and read their responses back, on the
+ * calling thread, until CONN closes after going idle or on error. Frees CONN.
+ *
+ * Requests the server never answered are handed to REQUEUE to be fetched again,
+ * and so are the ones to try again after a transient error, see #fetch_retry().
+ */
+void h1_run(struct h1_conn *conn, void (*requeue)(struct fetch_state *fs));
@@ -0,0 +1,840 @@
+#define _GNU_SOURCE
+
+#include "debug.h"
+#include "stats.h"
+#include "tcp.h"
+#include "h2.h"
+
+#include <errno.h>
+#include <nghttp2/nghttp2.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/** Bytes the server may send on one stream before its reader drains them. */
+#define H2_STREAM_WINDOW (256 * 1024)
+
+/** Bytes the server may send across every stream on a connection. */
+#define H2_CONN_WINDOW (16 * 1024 * 1024)
+
+/** Concurrent streams we assume until the server's SETTINGS say otherwise. */
+#define H2_MAX_STREAMS 100
+
+/** How long a connection with no streams stays open for the next fetch to its origin. */
+#define H2_IDLE_MS 30000
+
+#define MAKE_NV(__name, __value, __value_len) \
+    ((nghttp2_nv) { \
+        .name = (uint8_t *) (__name), .value = (uint8_t *) (__value), \
+        .namelen = sizeof(__name) - 1, .valuelen = (__value_len), \
+        .flags = NGHTTP2_NV_FLAG_NONE \
+    })
+
+struct h2_conn;
+
+struct h2_stream {
+    struct h2_conn *conn;
+    int32_t id;
+    struct fetch_state *fs;
+
+    size_t body_off;        // request body bytes nghttp2 has taken so far
+    size_t unconsumed;      // DATA bytes parsed but not yet handed to the reader
+    bool closed;            // server is done with this stream
+    bool reset;             // we sent RST_STREAM, once is enough
+
+    char *authority;
+    char *path;
+
+    struct h2_stream *next;
+};
+
+struct h2_conn {
+    char *origin;           // "hostname:port", same as url.host
+    int sockfd;
+    SSL *ssl;
+    SSL_CTX *ctx;
+    int ep;
+    int wakefd;             // eventfd signaled for every new submission
+    bool polling_write;     // is sockfd in the epoll set for EPOLLOUT?
+
+    /* only touched by the connection thread */
+    nghttp2_session *session;
+    struct h2_stream *streams;
+
+    void (*requeue)(struct fetch_state *fs);   // from #h2_adopt(), NULL until then
+
+    pthread_mutex_t lock;           // guards everything below
+    struct h2_stream *submitted;    // streams waiting for the connection thread
+    size_t active;                  // submitted + open streams
+    size_t max_streams;             // server's SETTINGS_MAX_CONCURRENT_STREAMS
+    bool accepting;                 // false after GOAWAY or once retired
+
+    struct h2_conn *next;           // registry link, guarded by registry_lock
+};
+
+/** Every live or connecting connection. Lock order is registry_lock, then h2_conn.lock. */
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct h2_conn *registry = NULL;
+
+/** Origins whose server picked HTTP/1.1, so nobody waits on #h2_reserve() for them. */
+struct h1_origin {
+    char *origin;
+    struct h1_origin *next;
+};
+static struct h1_origin *h1_origins = NULL;
+
+static void stream_free(struct h2_stream *st) {
+    if (!st)
+        return;
+
+    fetch_state_free(st->fs);
+    free(st->authority);
+    free(st->path);
+    free(st);
+}
+
+/** Wrap FS, a response to URL, in a stream. FS is only adopted on success. */
+static struct h2_stream *stream_new(struct url *URL, struct fetch_state *fs) {
+    struct h2_stream *st = calloc(1, sizeof(struct h2_stream));
+    if (!st)
+        return enomem(NULL);
+
+    st->authority = strdup(URL->host);
+    if (asprintf(&st->path, "%s%s", URL->pathname && *URL->pathname ? URL->pathname : "/",
+                 URL->search ? URL->search : "") < 0)
+    {
+        st->path = NULL;
+    }
+    if (!st->authority || !st->path) {
+        stream_free(st);
+        return enomem(NULL);
+    }
+    st->fs = fs;
+    return st;
+}
+
+/** The stream on CONN whose reader wakes it up on FD, NULL if there's none. */
+static struct h2_stream *find_stream(struct h2_conn *conn, int fd) {
+    for (struct h2_stream *st = conn->streams; st; st = st->next) {
+        if (handoff_fd(st->fs->out) == fd)
+            return st;
+    }
+    return NULL;
+}
+
+/** Drop ST from CONN once both the server and the reader are done with it. */
+static void stream_retire(struct h2_conn *conn, struct h2_stream *st) {
+    struct h2_stream **link = &conn->streams;
+    while (*link && *link != st)
+        link = &(*link)->next;
+    if (*link)
+        *link = st->next;
+
+    if (st->fs)
+        fetch_unwatch_reader(st->fs, conn->ep);
+
+    // the stream is gone, but the connection window still has to be paid back
+    if (st->unconsumed > 0 && conn->session)
+        nghttp2_session_consume_connection(conn->session, st->unconsumed);
+
+    stream_free(st);
+
+    pthread_mutex_lock(&conn->lock);
+    conn->active -= 1;
+    pthread_mutex_unlock(&conn->lock);
+}
+
+/**
+ * Drop ST from CONN and hand its fetch to be tried again, if it's to be.
+ *
+ * @retval false ST isn't tried again, and it's left as is.
+ */
+static bool stream_retry(struct h2_conn *conn, struct h2_stream *st) {
+    struct fetch_state *fs = st->fs;
+    if (!conn->requeue || !fetch_retry(fs))
+        return false;
+
+    fetch_unwatch_reader(fs, conn->ep);
+    st->fs = NULL;
+    stream_retire(conn, st);
+    conn->requeue(fs);
+    return true;
+}
+
+/**
+ * Hand parsed rows in ST to its reader, and give the server back as much window
+ * as the reader has taken off our hands.
+ */
+static void stream_drain(struct h2_conn *conn, struct h2_stream *st) {
+    struct fetch_state *fs = st->fs;
+    if (!fs->out_ended && !fs->canceled)
+        fetch_drain(fs);
+
+    if (fs->canceled && !st->closed && !st->reset) {
+        nghttp2_submit_rst_stream(conn->session, NGHTTP2_FLAG_NONE, st->id, NGHTTP2_CANCEL);
+        st->reset = true;
+    }
+
+    bool backlogged = fs->backlogged && !fs->out_ended && !fs->canceled;
+    if (!backlogged && st->unconsumed > 0 && !st->closed) {
+        nghttp2_session_consume(conn->session, st->id, st->unconsumed);
+        st->unconsumed = 0;
+    }
+
+    fetch_watch_reader(fs, conn->ep);
+
+    if (st->closed && (fs->out_ended || fs->canceled)) {
+        stream_retire(conn, st);
+    }
+}
+
+static ssize_t on_send(nghttp2_session *session, const uint8_t *data,
+                       size_t length, int flags, void *user_data)
+{
+    (void) session, (void) flags;
+    struct h2_conn *conn = user_data;
+    ERR_clear_error();
+    int n = SSL_write(conn->ssl, data, length);
+    if (n > 0)
+        return n;
+
+    int err = SSL_get_error(conn->ssl, n);
+    if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ)
+        return NGHTTP2_ERR_WOULDBLOCK;
+    return NGHTTP2_ERR_CALLBACK_FAILURE;
+}
+
+static int on_data_chunk_recv(nghttp2_session *session, uint8_t flags,
+                              int32_t stream_id, const uint8_t *data,
+                              size_t len, void *user_data)
+{
+    (void) flags;
+    struct h2_conn *conn = user_data;
+    struct h2_stream *st = nghttp2_session_get_stream_user_data(session, stream_id);
+    if (!st || st->fs->canceled) {
+        // nobody is reading this anymore
+        nghttp2_session_consume_connection(session, len);
+        return 0;
+    }
+
+    fetch_body_write(st->fs, (const char *) data, len);
+    st->unconsumed += len;
+    stream_drain(conn, st);
+    return 0;
+}
+
+static int on_header(nghttp2_session *session, const nghttp2_frame *frame,
+                     const uint8_t *name, size_t namelen,
+                     const uint8_t *value, size_t valuelen,
+                     uint8_t flags, void *user_data)
+{
+    (void) flags, (void) user_data;
+    if (frame->hd.type != NGHTTP2_HEADERS)
+        return 0;
+
+    struct h2_stream *st = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+    // the final response after an interim one comes as HCAT_HEADERS, and so do trailers
+    if (!st || (frame->headers.cat != NGHTTP2_HCAT_RESPONSE && st->fs->head.done))
+        return 0;
+
+    fetch_add_header(st->fs, (const char *) name, namelen, (const char *) value, valuelen);
+
+    // names always come in lowercase over h2
+    if (!st->fs->decoder && namelen == 16 && memcmp(name, "content-encoding", 16) == 0)
+        st->fs->decoder = decoder((const char *) value, valuelen);
+    return 0;
+}
+
+static int on_stream_close(nghttp2_session *session, int32_t stream_id,
+                           uint32_t error_code, void *user_data)
+{
+    struct h2_conn *conn = user_data;
+    struct h2_stream *st = nghttp2_session_get_stream_user_data(session, stream_id);
+    if (!st)
+        return 0;
+
+    if (error_code != NGHTTP2_NO_ERROR && !st->fs->canceled) {
+        fprintf(stderr, "h2 stream %d for %s closed: %s\n",
+                stream_id, conn->origin, nghttp2_http2_strerror(error_code));
+        fetch_broke(st->fs, "stream reset halfway through the response");
+    }
+    nghttp2_session_set_stream_user_data(session, stream_id, NULL);
+    st->closed = true;
+    if (stream_retry(conn, st))
+        return 0;
+    st->fs->retrying = false;
+    st->fs->http_done = true;
+    stream_drain(conn, st);
+    return 0;
+}
+
+static int on_frame_recv(nghttp2_session *session, const nghttp2_frame *frame,
+                         void *user_data)
+{
+    struct h2_conn *conn = user_data;
+
+    if (frame->hd.type == NGHTTP2_HEADERS) {
+        // only called once the whole header block is in, CONTINUATIONs and all
+        struct h2_stream *st = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+        if (st && !st->fs->head.done)
+            fetch_end_headers(st->fs);
+    }
+
+    if (frame->hd.type == NGHTTP2_SETTINGS && !(frame->hd.flags & NGHTTP2_FLAG_ACK)) {
+        uint32_t max_streams = nghttp2_session_get_remote_settings(
+            session, NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS);
+        pthread_mutex_lock(&conn->lock);
+        conn->max_streams = max_streams;
+        pthread_mutex_unlock(&conn->lock);
+    }
+
+    if (frame->hd.type == NGHTTP2_GOAWAY) {
+        // finish what's open, but new fetches go somewhere else
+        pthread_mutex_lock(&conn->lock);
+        conn->accepting = false;
+        pthread_mutex_unlock(&conn->lock);
+    }
+    return 0;
+}
+
+static nghttp2_session *session_new(struct h2_conn *conn) {
+    nghttp2_session_callbacks *cbs = NULL;
+    nghttp2_option *opt = NULL;
+    nghttp2_session *session = NULL;
+
+    if (nghttp2_session_callbacks_new(&cbs) != 0)
+        return NULL;
+    nghttp2_session_callbacks_set_send_callback(cbs, on_send);
+    nghttp2_session_callbacks_set_on_data_chunk_recv_callback(cbs, on_data_chunk_recv);
+    nghttp2_session_callbacks_set_on_header_callback(cbs, on_header);
+    nghttp2_session_callbacks_set_on_stream_close_callback(cbs, on_stream_close);
+    nghttp2_session_callbacks_set_on_frame_recv_callback(cbs, on_frame_recv);
+
+    if (nghttp2_option_new(&opt) != 0) {
+        nghttp2_session_callbacks_del(cbs);
+        return NULL;
+    }
+    // windows only reopen once a reader drains its rows, see stream_drain()
+    nghttp2_option_set_no_auto_window_update(opt, 1);
+
+    int rc = nghttp2_session_client_new2(&session, cbs, conn, opt);
+    nghttp2_session_callbacks_del(cbs);
+    nghttp2_option_del(opt);
+    if (rc != 0)
+        return NULL;
+
+    nghttp2_settings_entry settings[] = {
+        { NGHTTP2_SETTINGS_ENABLE_PUSH, 0 },
+        { NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, H2_MAX_STREAMS },
+        { NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE, H2_STREAM_WINDOW },
+    };
+    if (nghttp2_submit_settings(session, NGHTTP2_FLAG_NONE, settings,
+                                sizeof(settings) / sizeof(settings[0])) != 0
+        || nghttp2_session_set_local_window_size(session, NGHTTP2_FLAG_NONE,
+                                                 0, H2_CONN_WINDOW) != 0)
+    {
+        nghttp2_session_del(session);
+        return NULL;
+    }
+    return session;
+}
+
+/** Hand nghttp2 the next piece of the request body, straight out of the stream's state. */
+static ssize_t on_read_body(nghttp2_session *session, int32_t stream_id, uint8_t *buf,
+                            size_t length, uint32_t *data_flags,
+                            nghttp2_data_source *source, void *user_data)
+{
+    (void) session, (void) stream_id, (void) user_data;
+    struct h2_stream *st = source->ptr;
+    struct fetch_state *fs = st->fs;
+
+    size_t n = fs->body_len - st->body_off;
+    if (n > length)
+        n = length;
+    memcpy(buf, fs->body + st->body_off, n);
+    st->body_off += n;
+    if (st->body_off == fs->body_len)
+        *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+    return n;
+}
+
+/** Headers that only mean something to an HTTP/1.1 connection, and break HTTP/2. */
+static bool is_connection_header(const char *name, size_t name_len) {
+    static const char *const names[] = {
+        "connection", "host", "keep-alive", "proxy-connection", "te",
+        "transfer-encoding", "upgrade", "content-length",
+    };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strlen(names[i]) == name_len && memcmp(names[i], name, name_len) == 0)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Fill NV with ST's request headers, and CONTENT_LENGTH with the text of its
+ * content-length if it has a body.
+ *
+ * @retval NULL Error, out of memory.
+ * @retval NOT_NULL OK - the number of headers is written to N, free NV with `free()`.
+ */
+static nghttp2_nv *request_nv(struct h2_stream *st, char content_length[32], size_t *n) {
+    struct fetch_state *fs = st->fs;
+    const char *name, *value;
+    size_t name_len, value_len;
+
+    size_t user = 0;
+    bool user_agent = false, accept = false;
+    for (const char *cur = fs->headers; fetch_next_header(&cur, &name, &name_len, &value, &value_len); ) {
+        user += 1;
+        user_agent |= name_len == 10 && memcmp(name, "user-agent", 10) == 0;
+        accept |= name_len == 6 && memcmp(name, "accept", 6) == 0;
+    }
+
+    nghttp2_nv *nv = calloc(8 + user, sizeof(nghttp2_nv));
+    if (!nv)
+        return enomem(NULL);
+
+    size_t i = 0;
+    nv[i++] = MAKE_NV(":method", fs->method, strlen(fs->method));
+    nv[i++] = MAKE_NV(":scheme", "https", 5);
+    nv[i++] = MAKE_NV(":authority", st->authority, strlen(st->authority));
+    nv[i++] = MAKE_NV(":path", st->path, strlen(st->path));
+    if (!user_agent)
+        nv[i++] = MAKE_NV("user-agent", "vttp/1.0", 8);
+    if (!accept)
+        nv[i++] = MAKE_NV("accept", "*/*", 3);
+    nv[i++] = MAKE_NV("accept-encoding", DECODE_ACCEPT_ENCODING, sizeof(DECODE_ACCEPT_ENCODING) - 1);
+    if (fs->body) {
+        int len = snprintf(content_length, 32, "%zu", fs->body_len);
+        nv[i++] = MAKE_NV("content-length", content_length, len);
+    }
+
+    // names are already lowercase, see fetch_state_new()
+    for (const char *cur = fs->headers; fetch_next_header(&cur, &name, &name_len, &value, &value_len); ) {
+        if (is_connection_header(name, name_len))
+            continue;
+        nv[i++] = (nghttp2_nv) {
+            .name = (uint8_t *) name, .value = (uint8_t *) value,
+            .namelen = name_len, .valuelen = value_len,
+            .flags = NGHTTP2_NV_FLAG_NONE
+        };
+    }
+    *n = i;
+    return nv;
+}
+
+/** Submit every queued stream in CONN. Runs on the connection thread. */
+static void take_submissions(struct h2_conn *conn) {
+    pthread_mutex_lock(&conn->lock);
+    struct h2_stream *queued = conn->submitted;
+    conn->submitted = NULL;
+    pthread_mutex_unlock(&conn->lock);
+
+    while (queued) {
+        struct h2_stream *st = queued;
+        queued = queued->next;
+        st->next = conn->streams;
+        conn->streams = st;
+        st->fs->sent_us = stats_now_us();
+        fetch_watch_reader(st->fs, conn->ep);
+
+        // nghttp2 copies the headers, but reads the body out of st as it goes
+        char content_length[32];
+        size_t nheaders = 0;
+        nghttp2_nv *headers = request_nv(st, content_length, &nheaders);
+        nghttp2_data_provider body = {
+            .source.ptr = st,
+            .read_callback = on_read_body,
+        };
+        st->id = headers
+            ? nghttp2_submit_request(conn->session, NULL, headers, nheaders,
+                                     st->fs->body ? &body : NULL, st)
+            : NGHTTP2_ERR_NOMEM;
+        free(headers);
+
+        if (st->id < 0) {
+            fprintf(stderr, "h2 submit to %s: %s\n", conn->origin, nghttp2_strerror(st->id));
+            st->closed = true;
+            st->fs->http_done = true;
+            stream_drain(conn, st);
+        }
+    }
+}
+
+/** Write out everything nghttp2 has queued for CONN, waiting on EPOLLOUT if the socket is full. */
+static int flush_session(struct h2_conn *conn) {
+    if (nghttp2_session_send(conn->session) != 0)
+        return -1;
+
+    bool want_write = nghttp2_session_want_write(conn->session);
+    if (want_write != conn->polling_write) {
+        struct epoll_event ev = {
+            .events = EPOLLIN | (want_write ? EPOLLOUT : 0),
+            .data.fd = conn->sockfd
+        };
+        epoll_ctl(conn->ep, EPOLL_CTL_MOD, conn->sockfd, &ev);
+        conn->polling_write = want_write;
+    }
+    return 0;
+}
+
+/** Feed everything readable on CONN's socket to nghttp2. */
+static int session_recv(struct h2_conn *conn) {
+    char buf[16384];
+
+    for (;;) {
+        ERR_clear_error();
+        int n = SSL_read(conn->ssl, buf, sizeof(buf));
+        if (n > 0) {
+            if (nghttp2_session_mem_recv(conn->session, (const uint8_t *) buf, n) < 0)
+                return -1;
+            continue;
+        }
+
+        int err = SSL_get_error(conn->ssl, n);
+        if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+            return 0;
+        return -1; // closed or broken
+    }
+}
+
+/**
+ * Take CONN out of the registry so no new streams land on it. With ONLY_IF_IDLE,
+ * this is a no-op unless CONN has no streams at all.
+ *
+ * @retval true CONN is retired, and the submissions it had left are appended to its streams.
+ */
+static bool conn_retire(struct h2_conn *conn, bool only_if_idle) {
+    pthread_mutex_lock(&registry_lock);
+    pthread_mutex_lock(&conn->lock);
+
+    if (only_if_idle && conn->active > 0) {
+        pthread_mutex_unlock(&conn->lock);
+        pthread_mutex_unlock(&registry_lock);
+        return false;
+    }
+
+    struct h2_conn **link = &registry;
+    while (*link && *link != conn)
+        link = &(*link)->next;
+    if (*link)
+        *link = conn->next;
+
+    conn->accepting = false;
+    struct h2_stream *queued = conn->submitted;
+    conn->submitted = NULL;
+
+    pthread_mutex_unlock(&conn->lock);
+    pthread_mutex_unlock(&registry_lock);
+
+    while (queued) {
+        struct h2_stream *st = queued;
+        queued = queued->next;
+        st->next = conn->streams;
+        conn->streams = st;
+        st->fs->sent_us = stats_now_us();
+        fetch_watch_reader(st->fs, conn->ep);
+    }
+    return true;
+}
+
+static void conn_free(struct h2_conn *conn) {
+    // whatever is still open gets tried again, or else cut short
+    while (conn->streams) {
+        struct h2_stream *st = conn->streams;
+        if (!st->closed)
+            fetch_broke(st->fs, "connection closed halfway through the response");
+        st->closed = true;
+        if (stream_retry(conn, st))
+            continue;
+        st->fs->retrying = false;
+        st->fs->http_done = true;
+        if (!st->fs->out_ended)
+            fetch_drain(st->fs);
+        stream_retire(conn, st);
+    }
+
+    if (conn->session)
+        nghttp2_session_del(conn->session);
+    tcp_tls_free(conn->ssl, conn->ctx);
+    close(conn->sockfd);
+    close(conn->ep);
+    close(conn->wakefd);
+    pthread_mutex_destroy(&conn->lock);
+    free(conn->origin);
+    free(conn);
+}
+
+/** Milliseconds until the next stream on CONN runs out of time, -1 for never. */
+static int conn_deadline_ms(struct h2_conn *conn) {
+    long long now = stats_now_us();
+    int next = -1;
+    for (struct h2_stream *st = conn->streams; st; st = st->next) {
+        int ms = st->closed ? -1 : fetch_deadline_ms(st->fs, now);
+        if (ms >= 0 && (next < 0 || ms < next))
+            next = ms;
+    }
+    return next;
+}
+
+/** Reset every stream on CONN that ran out of time. */
+static void conn_expire(struct h2_conn *conn) {
+    long long now = stats_now_us();
+    for (struct h2_stream *st = conn->streams, *next; st; st = next) {
+        next = st->next; // draining may retire it
+        if (!st->closed && fetch_expire(st->fs, now))
+            stream_drain(conn, st);
+    }
+}
+
+static void *h2_loop(void *arg) {
+    struct h2_conn *conn = arg;
+    struct epoll_event events[16];
+
+    for (;;) {
+        take_submissions(conn);
+        if (flush_session(conn) < 0)
+            break;
+
+        if (!nghttp2_session_want_read(conn->session)
+            && !nghttp2_session_want_write(conn->session))
+        {
+            break; // both sides said GOAWAY
+        }
+
+        int n = epoll_wait(conn->ep, events, 16,
+                           conn->streams ? conn_deadline_ms(conn) : H2_IDLE_MS);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (n == 0 && !conn->streams) {
+            if (conn_retire(conn, true))
+                break;
+            continue;
+        }
+
+        bool broken = false;
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+
+            if (fd == conn->wakefd) {
+                eventfd_t count;
+                eventfd_read(conn->wakefd, &count);
+            } else if (fd == conn->sockfd) {
+                if ((events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                    && session_recv(conn) < 0)
+                {
+                    broken = true;
+                }
+            } else {
+                // a backlogged reader made some room, or a reader hung up
+                struct h2_stream *st = find_stream(conn, fd);
+                if (st) {
+                    fetch_reader_gone(st->fs);
+                    stream_drain(conn, st);
+                }
+            }
+        }
+        if (broken)
+            break;
+        conn_expire(conn);
+    }
+
+    conn_retire(conn, false);
+    flush_session(conn); // best effort RST_STREAM / GOAWAY
+    conn_free(conn);
+    return NULL;
+}
+
+/** Queue ST on CONN. The caller holds registry_lock. */
+static bool conn_submit(struct h2_conn *conn, struct h2_stream *st) {
+    pthread_mutex_lock(&conn->lock);
+    bool ok = conn->accepting && conn->active < conn->max_streams;
+    if (ok) {
+        st->conn = conn;
+
+        // keep submission order, so streams open in the order they were fetched
+        struct h2_stream **tail = &conn->submitted;
+        while (*tail)
+            tail = &(*tail)->next;
+        *tail = st;
+        conn->active += 1;
+        stats_peak(STAT_H2_STREAMS, conn->active);
+        eventfd_write(conn->wakefd, 1);
+    }
+    pthread_mutex_unlock(&conn->lock);
+    return ok;
+}
+
+bool h2_fetch(struct fetch_state *fs) {
+    if (!fs->url || strncmp(fs->url, "https://", 8) != 0)
+        return false;
+
+    struct url *URL = url_of_string(fs->url);
+    if (!URL)
+        return false;
+
+    struct h2_stream *st = NULL;
+    bool ok = false;
+    pthread_mutex_lock(&registry_lock);
+    for (struct h2_conn *conn = registry; conn && !ok; conn = conn->next) {
+        if (strcmp(conn->origin, URL->host) != 0)
+            continue;
+        if (!st && !(st = stream_new(URL, fs)))
+            break;
+        ok = conn_submit(conn, st);
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    if (!ok && st) {
+        st->fs = NULL; // not ours to free
+        stream_free(st);
+    }
+    url_free(URL);
+    free(URL);
+    return ok;
+}
+
+/** Allocate an unconnected CONN to ORIGIN that can already queue streams. */
+static struct h2_conn *conn_new(const char *origin) {
+    struct h2_conn *conn = calloc(1, sizeof(struct h2_conn));
+    if (!conn)
+        return enomem(NULL);
+
+    conn->sockfd = -1;
+    conn->origin = strdup(origin);
+    conn->max_streams = H2_MAX_STREAMS;
+    conn->accepting = true;
+    pthread_mutex_init(&conn->lock, NULL);
+    conn->ep = epoll_create1(0);
+    conn->wakefd = eventfd(0, EFD_NONBLOCK);
+
+    struct epoll_event wake_ev = { .events = EPOLLIN, .data.fd = conn->wakefd };
+    if (!conn->origin || conn->ep < 0 || conn->wakefd < 0
+        || epoll_ctl(conn->ep, EPOLL_CTL_ADD, conn->wakefd, &wake_ev))
+    {
+        conn_free(conn);
+        return NULL;
+    }
+    return conn;
+}
+
+struct h2_conn *h2_reserve(const char *url) {
+    if (!url || strncmp(url, "https://", 8) != 0)
+        return NULL;
+
+    struct url *URL = url_of_string(url);
+    if (!URL)
+        return NULL;
+
+    struct h2_conn *conn = NULL;
+    pthread_mutex_lock(&registry_lock);
+    bool known = false;
+    for (struct h2_conn *c = registry; c && !known; c = c->next)
+        known = strcmp(c->origin, URL->host) == 0;
+    for (struct h1_origin *h1 = h1_origins; h1 && !known; h1 = h1->next)
+        known = strcmp(h1->origin, URL->host) == 0;
+
+    if (!known && (conn = conn_new(URL->host))) {
+        conn->next = registry;
+        registry = conn;
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    url_free(URL);
+    free(URL);
+    return conn;
+}
+
+void h2_release(struct h2_conn *conn, bool spoke_h1, void (*requeue)(struct fetch_state *fs)) {
+    if (!conn)
+        return;
+
+    if (spoke_h1) {
+        struct h1_origin *h1 = malloc(sizeof(struct h1_origin));
+        char *origin = strdup(conn->origin);
+        if (h1 && origin) {
+            h1->origin = origin;
+            pthread_mutex_lock(&registry_lock);
+            h1->next = h1_origins;
+            h1_origins = h1;
+            pthread_mutex_unlock(&registry_lock);
+        } else {
+            free(h1);
+            free(origin);
+        }
+    }
+
+    conn_retire(conn, false);
+
+    // everyone who queued up behind us needs their own connection after all
+    while (conn->streams) {
+        struct h2_stream *st = conn->streams;
+        conn->streams = st->next;
+        struct fetch_state *fs = st->fs;
+        st->fs = NULL;
+        stream_free(st);
+        requeue(fs);
+    }
+    conn_free(conn);
+}
+
+void h2_adopt(struct h2_conn *conn, struct dispatch *dispatch, struct fetch_state *fs,
+              void (*requeue)(struct fetch_state *fs))
+{
+    if (!conn && (conn = conn_new(dispatch->url.host))) {
+        pthread_mutex_lock(&registry_lock);
+        conn->next = registry;
+        registry = conn;
+        pthread_mutex_unlock(&registry_lock);
+    }
+    struct h2_stream *st = conn ? stream_new(&dispatch->url, fs) : NULL;
+    if (!st) {
+        // nothing queued behind FS went out, so it's all fetched again elsewhere
+        h2_release(conn, false, requeue);
+        fetch_state_free(fs);
+        dispatch_free(dispatch);
+        return;
+    }
+
+    conn->sockfd = dispatch->sockfd, dispatch->sockfd = -1;
+    conn->ssl = dispatch->ssl, dispatch->ssl = NULL;
+    conn->ctx = dispatch->ctx, dispatch->ctx = NULL;
+    conn->requeue = requeue;
+    dispatch_free(dispatch);
+
+    SSL_set_mode(conn->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE
+                            | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    struct epoll_event sock_ev = { .events = EPOLLIN, .data.fd = conn->sockfd };
+    conn->session = session_new(conn);
+    if (!conn->session || epoll_ctl(conn->ep, EPOLL_CTL_ADD, conn->sockfd, &sock_ev)) {
+        stream_free(st);
+        h2_release(conn, false, requeue);
+        return;
+    }
+
+    // the stream that opened the connection goes ahead of anyone who queued behind it
+    pthread_mutex_lock(&conn->lock);
+    st->conn = conn;
+    st->next = conn->submitted;
+    conn->submitted = st;
+    conn->active += 1;
+    pthread_mutex_unlock(&conn->lock);
+
+    h2_loop(conn);
+}
+
+#undef MAKE_NV
+#undef H2_IDLE_MS
+#undef H2_MAX_STREAMS
+#undef H2_CONN_WINDOW
+#undef H2_STREAM_WINDOW
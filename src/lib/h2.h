@@ -0,0 +1,60 @@
+/**
+ * @file h2.h
+ * @brief HTTP/2 transport that multiplexes concurrent fetches to the same origin
+ * over a single shared TLS connection.
+ *
+ * Every connection is driven by the fetch worker that opened it. Fetches to an origin that already
+ * has a connection open become new streams on it instead of new sockets, and each
+ * stream's receive window only opens back up as its reader drains the rows.
+ */
+#pragma once
+#include "fetch.h"
+#include <stdbool.h>
+
+/**
+ * @brief Queue FS as a new stream on an HTTP/2 connection that's already open to
+ * its URL's origin.
+ *
+ * @retval false No shared connection to the origin can take another stream, so
+ * FS still belongs to the caller, untouched.
+ * @retval true OK - the connection owns FS now and hands its rows to its reader.
+ */
+bool h2_fetch(struct fetch_state *fs);
+
+/**
+ * @brief A shared connection to one origin.
+ */
+struct h2_conn;
+
+/**
+ * @brief Claim URL's origin while its first connection is still being made, so
+ * #h2_fetch() calls to it queue up behind this one instead of opening their own.
+ *
+ * @retval NULL Nothing to claim: URL isn't https, its origin is already claimed, or
+ * its server is known to pick HTTP/1.1. Connect like usual.
+ * @retval NOT_NULL OK - pass it to exactly one of #h2_adopt() or #h2_release().
+ */
+struct h2_conn *h2_reserve(const char *url);
+
+/**
+ * @brief Give back a CONN from #h2_reserve() that never became an HTTP/2 connection,
+ * handing every fetch that queued on it to REQUEUE to be fetched on its own.
+ *
+ * SPOKE_H1 remembers that the server picked HTTP/1.1, so its origin isn't reserved
+ * again. A NULL CONN is a no-op.
+ */
+void h2_release(struct h2_conn *conn, bool spoke_h1, void (*requeue)(struct fetch_state *fs));
+
+/**
+ * @brief Take over DISPATCH after #use_fetch() returned #FETCH_H2, open FS as its
+ * first stream, and share the connection with later #h2_fetch() calls.
+ *
+ * CONN is the nullable reservation from #h2_reserve(), whose queued fetches become
+ * streams right after FS.
+ *
+ * This runs the connection on the calling thread and only returns once it's closed,
+ * after going idle or on error. DISPATCH and FS are freed either way. Streams that
+ * are to be tried again, see #fetch_retry(), are handed to REQUEUE instead.
+ */
+void h2_adopt(struct h2_conn *conn, struct dispatch *dispatch, struct fetch_state *fs,
+              void (*requeue)(struct fetch_state *fs));
@@ -0,0 +1,197 @@
+#define _GNU_SOURCE
+#include "handoff.h"
+#include "debug.h"
+#include "pyc.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/** Most bytes of rows in one record of the ring, as much as the worker reads at once. */
+#define HANDOFF_CHUNK (16 * 1024)
+
+struct handoff {
+    struct ring *rows;          // chunks of rows, put in by the worker and taken by the reader
+    size_t front_off;           // bytes of the front chunk the reader took already
+    int ready_fd;               // eventfd the worker wakes the reader with
+    int room_fd;                // eventfd the reader wakes the worker with
+    atomic_bool ended;          // the worker put in its last row
+    atomic_bool gone;           // the reader hung up
+    atomic_bool stalled;        // the worker waits for room
+    atomic_int refs;
+};
+
+static void handoff_free(struct handoff *h) {
+    if (h->rows)
+        done(h->rows);
+    if (h->ready_fd >= 0)
+        close(h->ready_fd);
+    if (h->room_fd >= 0)
+        close(h->room_fd);
+    free(h);
+}
+
+static void handoff_unref(struct handoff *h) {
+    if (atomic_fetch_sub(&h->refs, 1) == 1)
+        handoff_free(h);
+}
+
+struct handoff *handoff_new(void) {
+    struct handoff *h = calloc(1, sizeof(struct handoff));
+    if (!h)
+        return enomem(NULL);
+
+    h->ready_fd = eventfd(0, EFD_NONBLOCK);
+    h->room_fd = eventfd(0, EFD_NONBLOCK);
+    h->rows = ring(HANDOFF_CAP);
+    if (h->ready_fd < 0 || h->room_fd < 0 || !h->rows) {
+        int err = h->rows ? errno : ENOMEM;
+        handoff_free(h);
+        errno = err;
+        return NULL;
+    }
+    atomic_init(&h->ended, false);
+    atomic_init(&h->gone, false);
+    atomic_init(&h->stalled, false);
+    atomic_init(&h->refs, 2);
+    return h;
+}
+
+/** Copy up to N bytes off the front of H's ring into BUF, telling a stalled worker about the room. */
+static size_t take(struct handoff *h, char *buf, size_t n) {
+    size_t copied = 0;
+    bool popped = false;
+    while (copied < n) {
+        struct str front = hd(h->rows);
+        if (!front.hd)
+            break;
+
+        size_t left = front.length - h->front_off;
+        size_t k = left < n - copied ? left : n - copied;
+        memcpy(buf + copied, front.hd + h->front_off, k);
+        copied += k;
+        h->front_off += k;
+        if (h->front_off == front.length) {
+            ring_pop(h->rows);
+            h->front_off = 0;
+            popped = true;
+        }
+    }
+
+    if (popped) {
+        // either the worker sees the room, or we see it waiting for room, see handoff_fill()
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_exchange(&h->stalled, false))
+            eventfd_write(h->room_fd, 1);
+    }
+    return copied;
+}
+
+ssize_t handoff_read(struct handoff *h, char *buf, size_t n) {
+    size_t got = take(h, buf, n);
+    if (got > 0 || n == 0)
+        return got;
+
+    // reset the wakeup before looking again, so one for rows that come in after
+    // this can't be lost
+    eventfd_t count;
+    eventfd_read(h->ready_fd, &count);
+    bool ended = atomic_load(&h->ended);
+    got = take(h, buf, n);
+    if (got == 0 && !ended) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return got;
+}
+
+int handoff_ready_fd(const struct handoff *h) {
+    return h->ready_fd;
+}
+
+void handoff_close(struct handoff *h) {
+    atomic_store(&h->gone, true);
+    eventfd_write(h->room_fd, 1);
+    handoff_unref(h);
+}
+
+static ssize_t reader_read(void *cookie, char *buf, size_t size) {
+    struct handoff *h = cookie;
+    for (;;) {
+        ssize_t n = handoff_read(h, buf, size);
+        if (n >= 0 || errno != EAGAIN)
+            return n;
+
+        struct pollfd pfd = { .fd = h->ready_fd, .events = POLLIN };
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+            return -1;
+    }
+}
+
+static int reader_close(void *cookie) {
+    handoff_close(cookie);
+    return 0;
+}
+
+FILE *handoff_reader(struct handoff *h) {
+    cookie_io_functions_t io = { .read = reader_read, .close = reader_close };
+    return fopencookie(h, "r", io);
+}
+
+bool handoff_fill(struct handoff *h, FILE *stream) {
+    bool moved = false, drained = false;
+    for (;;) {
+        char *slot = ring_reserve(h->rows, HANDOFF_CHUNK);
+        if (!slot) {
+            // say we're waiting before looking again, see take()
+            atomic_store(&h->stalled, true);
+            atomic_thread_fence(memory_order_seq_cst);
+            if (!(slot = ring_reserve(h->rows, HANDOFF_CHUNK)))
+                break;
+            atomic_store(&h->stalled, false);
+        }
+
+        // the stream is unbuffered, so this reads straight into the ring
+        size_t got = fread(slot, 1, HANDOFF_CHUNK, stream);
+        if (got > 0) {
+            ring_commit(h->rows, got);
+            moved = true;
+        }
+        if (got < HANDOFF_CHUNK) {
+            drained = true;
+            break;
+        }
+    }
+
+    if (moved)
+        eventfd_write(h->ready_fd, 1);
+    return drained;
+}
+
+void handoff_end(struct handoff *h) {
+    if (!atomic_exchange(&h->ended, true))
+        eventfd_write(h->ready_fd, 1);
+}
+
+int handoff_fd(const struct handoff *h) {
+    return h->room_fd;
+}
+
+bool handoff_gone(struct handoff *h) {
+    eventfd_t count;
+    eventfd_read(h->room_fd, &count);
+    return atomic_load(&h->gone);
+}
+
+void handoff_release(struct handoff *h) {
+    if (!h)
+        return;
+    handoff_end(h);
+    handoff_unref(h);
+}
+
+#undef HANDOFF_CHUNK
@@ -0,0 +1,86 @@
+/**
+ * @file handoff.h
+ * @brief How a fetch's rows get from the thread parsing its response to the one
+ * reading them: a bounded #ring the reader takes them straight out of.
+ *
+ * The worker fills the ring in batches, one wakeup per batch on the reader's
+ * eventfd. When the ring is full it waits on its own eventfd, which the reader
+ * signals once it made room, or once it hung up.
+ */
+#pragma once
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/**
+ * @brief Bytes of rows a #handoff holds before its worker waits on the reader.
+ */
+#define HANDOFF_CAP (256 * 1024)
+
+struct handoff;
+
+/**
+ * @brief Allocate a #handoff with one reference for the worker and one for the reader.
+ *
+ * @retval NULL Error, check `errno`.
+ */
+struct handoff *handoff_new(void);
+
+/**
+ * @brief **Reader**: a blocking `FILE` reading H's rows, which holds the reader's
+ * reference. Closing it tells the worker its reader hung up.
+ *
+ * @retval NULL Error, the reader's reference is left as is.
+ */
+FILE *handoff_reader(struct handoff *h);
+
+/**
+ * @brief **Reader**: copy up to N bytes of H's rows into BUF without waiting.
+ *
+ * @return The number of bytes copied, 0 once the worker ended H and every row is
+ * read, or -1 with `errno` EAGAIN if there's nothing to read yet.
+ */
+ssize_t handoff_read(struct handoff *h, char *buf, size_t n);
+
+/**
+ * @brief **Reader**: an eventfd that's readable once #handoff_read() may have
+ * something new to say.
+ */
+int handoff_ready_fd(const struct handoff *h);
+
+/**
+ * @brief **Reader**: hang up on H and drop the reader's reference.
+ */
+void handoff_close(struct handoff *h);
+
+/**
+ * @brief **Worker**: move what STREAM has to read into H, waking the reader once if
+ * anything moved.
+ *
+ * @retval true STREAM is drained.
+ * @retval false H is full, and #handoff_fd() turns readable once it has room.
+ */
+bool handoff_fill(struct handoff *h, FILE *stream);
+
+/**
+ * @brief **Worker**: tell the reader there are no more rows after the ones in H.
+ */
+void handoff_end(struct handoff *h);
+
+/**
+ * @brief **Worker**: an eventfd for `epoll` that turns readable once the reader
+ * made room after #handoff_fill() came up short, or once it hung up.
+ */
+int handoff_fd(const struct handoff *h);
+
+/**
+ * @brief **Worker**: whether H's reader hung up. Resets #handoff_fd() too, so
+ * call it whenever that turned readable.
+ */
+bool handoff_gone(struct handoff *h);
+
+/**
+ * @brief **Worker**: drop the worker's reference, ending H first if it isn't yet.
+ * NULL is ignored.
+ */
+void handoff_release(struct handoff *h);
@@ -0,0 +1,216 @@
+#define _GNU_SOURCE
+#include "headers.h"
+#include "debug.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/** First size of a header buffer, enough for most responses. */
+#define HEADERS_MIN 1024
+
+/** Make room in H for N more bytes, within #HEADERS_MAX. */
+static bool reserve(struct headers *h, size_t n) {
+    if (h->len + n <= h->cap)
+        return true;
+    if (h->len + n > HEADERS_MAX) {
+        errno = EMSGSIZE;
+        return false;
+    }
+
+    size_t cap = h->cap ? h->cap : HEADERS_MIN;
+    while (cap < h->len + n)
+        cap *= 2;
+    char *buf = realloc(h->buf, cap);
+    if (!buf)
+        return enomem(false);
+    h->buf = buf;
+    h->cap = cap;
+    return true;
+}
+
+static bool push(struct headers *h, size_t name, size_t value) {
+    if (h->n == h->n_cap) {
+        size_t cap = h->n_cap ? h->n_cap * 2 : 16;
+        struct header *hd = realloc(h->hd, cap * sizeof(struct header));
+        if (!hd)
+            return enomem(false);
+        h->hd = hd;
+        h->n_cap = cap;
+    }
+    h->hd[h->n++] = (struct header) { .name = name, .value = value };
+    return true;
+}
+
+static bool is_ows(char c) {
+    return c == ' ' || c == '\t';
+}
+
+/**
+ * Parse the line of H that just ended with the `\n` at the end of its buffer, then
+ * terminate it in place.
+ */
+static int parse_line(struct headers *h) {
+    char *line = h->buf + h->line;
+    char *end = h->buf + h->len - 1;
+    if (end > line && end[-1] == '\r')
+        end--;
+    *end = '\0';
+
+    if (h->status == 0) {
+        int status = 0;
+        if (sscanf(line, "HTTP/1.%d %3d", &h->minor, &status) != 2 || status < 100) {
+            errno = EPROTO;
+            return -1;
+        }
+        h->status = status;
+        return 0;
+    }
+
+    if (end == line) {
+        h->done = true;
+        return 0;
+    }
+
+    // obsolete line folding and lines without a name are dropped
+    char *colon = memchr(line, ':', end - line);
+    if (is_ows(*line) || !colon || colon == line)
+        return 0;
+
+    *colon = '\0';
+    char *value = colon + 1;
+    while (value < end && is_ows(*value))
+        value++;
+    while (end > value && is_ows(end[-1]))
+        end--;
+    *end = '\0';
+    return push(h, line - h->buf, value - h->buf) ? 0 : -1;
+}
+
+long headers_feed(struct headers *h, const char *data, size_t len) {
+    size_t used = 0;
+    while (!h->done && used < len) {
+        const char *nl = memchr(data + used, '\n', len - used);
+        size_t n = nl ? (size_t) (nl - data) + 1 - used : len - used;
+        if (!reserve(h, n))
+            return -1;
+
+        memcpy(h->buf + h->len, data + used, n);
+        h->len += n;
+        used += n;
+        if (!nl)
+            break;
+
+        if (parse_line(h) < 0)
+            return -1;
+        h->line = h->len;
+    }
+    return used;
+}
+
+const char *headers_get(const struct headers *h, const char *name) {
+    for (size_t i = 0; i < h->n; i++) {
+        if (strcasecmp(h->buf + h->hd[i].name, name) == 0)
+            return h->buf + h->hd[i].value;
+    }
+    return NULL;
+}
+
+/** Is TOKEN one of the comma separated items in VALUE? */
+static bool list_has(const char *value, const char *token) {
+    size_t token_len = strlen(token);
+    while (*value) {
+        while (is_ows(*value) || *value == ',')
+            value++;
+        size_t n = strcspn(value, ",");
+        size_t item = n;
+        while (item > 0 && is_ows(value[item - 1]))
+            item--;
+        if (item == token_len && strncasecmp(value, token, token_len) == 0)
+            return true;
+        value += n;
+    }
+    return false;
+}
+
+bool headers_has_token(const struct headers *h, const char *name, const char *token) {
+    for (size_t i = 0; i < h->n; i++) {
+        if (strcasecmp(h->buf + h->hd[i].name, name) == 0
+            && list_has(h->buf + h->hd[i].value, token))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/** Write S to OUT escaped for the inside of a JSON string, lowercased if LOWER. */
+static void json_chars(FILE *out, const char *s, bool lower) {
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\')
+            fprintf(out, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(out, "\\u%04x", c);
+        else
+            fputc(lower ? tolower(c) : c, out);
+    }
+}
+
+char *headers_json(const struct headers *h) {
+    char *json = NULL;
+    size_t json_len = 0;
+    FILE *out = open_memstream(&json, &json_len);
+    if (!out)
+        return enomem(NULL);
+
+    fputc('{', out);
+    for (size_t i = 0; i < h->n; i++) {
+        const char *name = h->buf + h->hd[i].name;
+        bool seen = false;
+        for (size_t j = 0; j < i && !seen; j++)
+            seen = strcasecmp(h->buf + h->hd[j].name, name) == 0;
+        if (seen)
+            continue;
+
+        fputs(i > 0 ? ",\"" : "\"", out);
+        json_chars(out, name, true);
+        fputs("\":\"", out);
+        json_chars(out, h->buf + h->hd[i].value, false);
+        // repeats are folded into the first, the way a list header would be
+        for (size_t j = i + 1; j < h->n; j++) {
+            if (strcasecmp(h->buf + h->hd[j].name, name) == 0) {
+                fputs(", ", out);
+                json_chars(out, h->buf + h->hd[j].value, false);
+            }
+        }
+        fputc('"', out);
+    }
+    fputc('}', out);
+
+    if (fclose(out) != 0) {
+        free(json);
+        return enomem(NULL);
+    }
+    return json;
+}
+
+void headers_reset(struct headers *h) {
+    h->len = 0;
+    h->line = 0;
+    h->minor = 0;
+    h->status = 0;
+    h->n = 0;
+    h->done = false;
+}
+
+void headers_free(struct headers *h) {
+    free(h->buf);
+    free(h->hd);
+    *h = (struct headers) {0};
+}
+
+#undef HEADERS_MIN
@@ -0,0 +1,93 @@
+/**
+ * @file headers.h
+ * @brief Streaming parser for the status line and header block of an HTTP/1.x
+ * response.
+ *
+ * Bytes go in as they come off the wire, split anywhere. Each line is scanned
+ * once, when its `\n` arrives, so a block that trickles in over many reads is never
+ * searched again from the start. Only the block itself is buffered, never the
+ * body after it.
+ *
+ * Parsed names and values point into that buffer, NUL terminated in place, so
+ * later stages can read them without another copy.
+ */
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * @brief Biggest header block a response may have, status line included.
+ */
+#define HEADERS_MAX (256 * 1024)
+
+/**
+ * @brief One `Name: value` line, as offsets into #headers.buf so they survive it
+ * growing. Both are NUL terminated, the value with its surrounding whitespace
+ * trimmed.
+ */
+struct header {
+    size_t name;
+    size_t value;
+};
+
+/**
+ * @brief A response's header block, parsed as it arrives. Zero it to start.
+ */
+struct headers {
+    char *buf;              // the block so far, names and values terminated in place
+    size_t len;
+    size_t cap;
+    size_t line;            // where the line that's still coming in starts
+
+    int minor;              // the "1" of "HTTP/1.1"
+    int status;             // 0 until the status line is in
+
+    struct header *hd;      // every header line, in order
+    size_t n;
+    size_t n_cap;
+
+    bool done;              // the blank line that ends the block is in
+};
+
+/**
+ * @brief Feed LEN bytes of DATA to H, up to the end of the header block.
+ *
+ * @retval -1 Error: the block is malformed (EPROTO), too big (EMSGSIZE) or out of
+ * memory (ENOMEM). H can't take any more.
+ * @retval N The first N bytes of DATA were part of the block. H is done if N < LEN,
+ * or if the block ended exactly at LEN.
+ */
+long headers_feed(struct headers *h, const char *data, size_t len);
+
+/**
+ * @brief The value of the first header NAME in H, matched case insensitively.
+ *
+ * @retval NULL H doesn't have NAME.
+ * @retval NOT_NULL OK - it lives as long as H, until #headers_reset().
+ */
+const char *headers_get(const struct headers *h, const char *name);
+
+/**
+ * @brief Does a header NAME in H list TOKEN among its comma separated values?
+ * Matched case insensitively, across every header NAME.
+ */
+bool headers_has_token(const struct headers *h, const char *name, const char *token);
+
+/**
+ * @brief H's headers as a JSON object of lowercase names to values. Repeated names
+ * are folded into one, their values joined with `", "`.
+ *
+ * @retval NULL Error, out of memory.
+ * @retval NOT_NULL OK - free with `free()`.
+ */
+char *headers_json(const struct headers *h);
+
+/**
+ * @brief Forget H's block to parse another one, keeping its memory.
+ */
+void headers_reset(struct headers *h);
+
+/**
+ * @brief Free what H holds, leaving it zeroed to start over.
+ */
+void headers_free(struct headers *h);
@@ -0,0 +1,100 @@
+#include "headers.h"
+#include <criterion/criterion.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char RESPONSE[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: application/json\r\n"
+    "ETag:   \"abc\"  \r\n"
+    "Transfer-Encoding: gzip\r\n"
+    "transfer-encoding: Chunked\r\n"
+    "\r\n"
+    "{\"body\": 1}";
+
+Test(headers, one_read) {
+    struct headers h = {0};
+    long n = headers_feed(&h, RESPONSE, sizeof(RESPONSE) - 1);
+
+    cr_assert(h.done);
+    cr_assert_eq(n, strstr(RESPONSE, "{") - RESPONSE, "the body isn't part of the block");
+    cr_assert_eq(h.status, 200);
+    cr_assert_eq(h.minor, 1);
+    cr_assert_str_eq(headers_get(&h, "content-type"), "application/json");
+    cr_assert_str_eq(headers_get(&h, "ETag"), "\"abc\"", "whitespace is trimmed");
+    cr_assert_null(headers_get(&h, "Link"));
+    headers_free(&h);
+}
+
+Test(headers, byte_by_byte) {
+    struct headers h = {0};
+    size_t used = 0;
+    while (!h.done) {
+        long n = headers_feed(&h, RESPONSE + used, 1);
+        cr_assert_eq(n, 1);
+        used += n;
+    }
+
+    cr_assert_eq(RESPONSE[used], '{');
+    cr_assert_str_eq(headers_get(&h, "ETag"), "\"abc\"");
+    headers_free(&h);
+}
+
+Test(headers, tokens_across_repeats) {
+    struct headers h = {0};
+    headers_feed(&h, RESPONSE, sizeof(RESPONSE) - 1);
+
+    cr_assert(headers_has_token(&h, "Transfer-Encoding", "chunked"));
+    cr_assert(headers_has_token(&h, "Transfer-Encoding", "gzip"));
+    cr_assert_not(headers_has_token(&h, "Transfer-Encoding", "chunk"));
+    headers_free(&h);
+}
+
+Test(headers, as_json) {
+    struct headers h = {0};
+    const char block[] =
+        "HTTP/1.1 200 OK\r\n"
+        "Vary: Accept\r\n"
+        "X-Quote: say \"hi\"\\\r\n"
+        "vary: Origin\r\n"
+        "\r\n";
+    headers_feed(&h, block, sizeof(block) - 1);
+
+    char *json = headers_json(&h);
+    cr_assert_str_eq(json, "{\"vary\":\"Accept, Origin\",\"x-quote\":\"say \\\"hi\\\"\\\\\"}");
+    free(json);
+    headers_free(&h);
+}
+
+Test(headers, reset_for_interim) {
+    struct headers h = {0};
+    const char interim[] = "HTTP/1.1 100 Continue\r\n\r\nHTTP/1.0 204 No Content\r\n\r\n";
+    long n = headers_feed(&h, interim, sizeof(interim) - 1);
+    cr_assert_eq(h.status, 100);
+
+    headers_reset(&h);
+    headers_feed(&h, interim + n, sizeof(interim) - 1 - n);
+    cr_assert(h.done);
+    cr_assert_eq(h.status, 204);
+    cr_assert_eq(h.minor, 0);
+    headers_free(&h);
+}
+
+Test(headers, malformed_status) {
+    struct headers h = {0};
+    cr_assert_eq(headers_feed(&h, "SSH-2.0-OpenSSH\r\n", 17), -1);
+    cr_assert_eq(errno, EPROTO);
+    headers_free(&h);
+}
+
+Test(headers, too_big) {
+    struct headers h = {0};
+    headers_feed(&h, "HTTP/1.1 200 OK\r\nSet-Cookie: ", 29);
+
+    static char cookie[HEADERS_MAX];
+    memset(cookie, 'x', sizeof(cookie));
+    cr_assert_eq(headers_feed(&h, cookie, sizeof(cookie)), -1);
+    cr_assert_eq(errno, EMSGSIZE);
+    headers_free(&h);
+}
@@ -0,0 +1,216 @@
+#define _GNU_SOURCE
+
+#include "limit.h"
+#include "debug.h"
+#include "stats.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/** The limits and what's counted against them for one origin. Never freed. */
+struct limit_origin {
+    char *origin;               // "protocol//hostname:port", so http and https stay apart
+    pthread_cond_t changed;     // a place in flight opened up
+    double rate;                // the strictest asked for, 0 for none
+    double burst;
+    int max_in_flight;          // the strictest asked for, 0 for none
+    int in_flight;
+    double tokens;              // requests that can go out right now, refilling at RATE up to BURST
+    long long refilled_us;      // when TOKENS was last brought up to date
+    long long held_until_us;    // nothing goes out before then, after a 429
+    struct limit_origin *next;
+};
+
+// one lock for every origin, it's only ever held for a few instructions
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct limit_origin *registry = NULL;
+
+static bool limited(const struct fetch_state *fs) {
+    return fs->limit.rate > 0 || fs->limit.max_in_flight > 0;
+}
+
+/** Tighten O's limits to LIMIT where it's stricter. */
+static void tighten(struct limit_origin *o, const struct fetch_limit *limit) {
+    if (limit->rate > 0 && (!o->rate || limit->rate < o->rate)) {
+        o->rate = limit->rate;
+        double burst = limit->burst > 0 ? limit->burst : limit->rate < 1 ? 1 : limit->rate;
+        if (!o->burst || burst < o->burst)
+            o->burst = burst;
+        if (o->tokens > o->burst)
+            o->tokens = o->burst;
+    }
+    if (limit->max_in_flight > 0 && (!o->max_in_flight || limit->max_in_flight < o->max_in_flight))
+        o->max_in_flight = limit->max_in_flight;
+}
+
+/**
+ * The origin FS's limits are counted in, added with them if it's new. The caller
+ * holds the registry lock.
+ *
+ * @retval NULL Error, out of memory or FS's URL doesn't parse.
+ */
+static struct limit_origin *origin_get(struct fetch_state *fs) {
+    if (fs->origin)
+        return fs->origin;
+
+    struct url *URL = url_of_string(fs->url);
+    if (!URL)
+        return NULL;
+    char *key = NULL;
+    if (asprintf(&key, "%s//%s", hd(URL->protocol), URL->host) < 0)
+        key = NULL;
+    url_free(URL);
+    free(URL);
+    if (!key)
+        return enomem(NULL);
+
+    struct limit_origin *o = registry;
+    while (o && strcmp(o->origin, key) != 0)
+        o = o->next;
+    if (o) {
+        free(key);
+    } else {
+        if (!(o = calloc(1, sizeof(struct limit_origin)))) {
+            free(key);
+            return enomem(NULL);
+        }
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&o->changed, &attr);
+        pthread_condattr_destroy(&attr);
+        o->origin = key;
+        o->refilled_us = stats_now_us();
+        o->tokens = -1; // filled up to the burst below
+        o->next = registry;
+        registry = o;
+    }
+    tighten(o, &fs->limit);
+    if (o->tokens < 0)
+        o->tokens = o->burst;
+    fs->origin = o;
+    return o;
+}
+
+/**
+ * Take a request off O's rate at NOW_US, and a place in flight for FS if SLOT.
+ * Nothing's taken unless both are there.
+ *
+ * @retval true OK
+ * @retval false Not yet. *WAIT_US is how long until there might be, -1 for until a
+ * place in flight opens up.
+ */
+static bool admit(struct limit_origin *o, struct fetch_state *fs, bool slot,
+                  long long now_us, long long *wait_us)
+{
+    if (o->held_until_us > now_us) {
+        *wait_us = o->held_until_us - now_us;
+        return false;
+    }
+    slot = slot && !fs->in_flight;
+    if (slot && o->max_in_flight && o->in_flight >= o->max_in_flight) {
+        *wait_us = -1;
+        return false;
+    }
+    if (o->rate) {
+        o->tokens += (now_us - o->refilled_us) * o->rate / 1e6;
+        if (o->tokens > o->burst)
+            o->tokens = o->burst;
+        o->refilled_us = now_us;
+        if (o->tokens < 1) {
+            *wait_us = (long long) ((1 - o->tokens) / o->rate * 1e6) + 1;
+            return false;
+        }
+        o->tokens -= 1;
+    }
+    if (slot) {
+        o->in_flight += 1;
+        fs->in_flight = true;
+    }
+    return true;
+}
+
+bool limit_try(struct fetch_state *fs) {
+    if (fs->cleared || !limited(fs))
+        return fs->cleared = true;
+
+    long long wait_us = 0;
+    pthread_mutex_lock(&registry_lock);
+    struct limit_origin *o = origin_get(fs);
+    // an origin that can't be counted isn't limited
+    fs->cleared = !o || admit(o, fs, true, stats_now_us(), &wait_us);
+    pthread_mutex_unlock(&registry_lock);
+    return fs->cleared;
+}
+
+/** Did FS's reader hang up? Marks FS canceled if so. */
+static bool hung_up(struct fetch_state *fs) {
+    return fetch_reader_gone(fs) || fs->canceled;
+}
+
+bool limit_wait(struct fetch_state *fs) {
+    if (limit_try(fs))
+        return true;
+
+    long long started_us = stats_now_us();
+    pthread_mutex_lock(&registry_lock);
+    for (;;) {
+        long long now_us = stats_now_us(), wait_us = 0;
+        if ((fs->cleared = admit(fs->origin, fs, true, now_us, &wait_us)))
+            break;
+        if (hung_up(fs) || fetch_expire(fs, now_us))
+            break;
+
+        if (wait_us < 0 || wait_us > LIMIT_POLL_MS * 1000LL)
+            wait_us = LIMIT_POLL_MS * 1000LL;
+        struct timespec until;
+        clock_gettime(CLOCK_MONOTONIC, &until);
+        long long ns = until.tv_nsec + wait_us * 1000;
+        until.tv_sec += ns / 1000000000;
+        until.tv_nsec = ns % 1000000000;
+        pthread_cond_timedwait(&fs->origin->changed, &registry_lock, &until);
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    stats_time(STAT_THROTTLE_MS, (stats_now_us() - started_us) / 1000);
+    return fs->cleared;
+}
+
+bool limit_try_copy(struct fetch_state *fs) {
+    if (!fs->origin)
+        return true;
+
+    long long wait_us = 0;
+    pthread_mutex_lock(&registry_lock);
+    bool ok = admit(fs->origin, fs, false, stats_now_us(), &wait_us);
+    pthread_mutex_unlock(&registry_lock);
+    return ok;
+}
+
+void limit_hold(struct fetch_state *fs, long delay_ms) {
+    if (!fs->origin || delay_ms <= 0)
+        return;
+
+    pthread_mutex_lock(&registry_lock);
+    long long until_us = stats_now_us() + delay_ms * 1000LL;
+    if (until_us > fs->origin->held_until_us)
+        fs->origin->held_until_us = until_us;
+    // whatever built up before the 429 was too much already
+    fs->origin->tokens = 0;
+    pthread_mutex_unlock(&registry_lock);
+}
+
+void limit_release(struct fetch_state *fs) {
+    if (!fs->in_flight)
+        return;
+
+    pthread_mutex_lock(&registry_lock);
+    fs->origin->in_flight -= 1;
+    fs->in_flight = false;
+    pthread_cond_broadcast(&fs->origin->changed);
+    pthread_mutex_unlock(&registry_lock);
+}
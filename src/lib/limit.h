@@ -0,0 +1,59 @@
+/**
+ * @file limit.h
+ * @brief Client-side rate limits and caps on requests in flight, per origin and
+ * shared by every fetch in the process, so parallel scans stay under an API's quota
+ * instead of running into 429s.
+ *
+ * Only fetches with a #fetch_limit are held back, and they're counted together by
+ * origin. When fetches to the same origin ask for different limits, the strictest
+ * of each that any of them asked for holds for all of them.
+ */
+#pragma once
+#include "fetch.h"
+#include <stdbool.h>
+
+/**
+ * @brief How often a fetch waiting on its origin's limits checks whether its reader
+ * hung up or it ran out of time.
+ */
+#define LIMIT_POLL_MS 100
+
+/**
+ * @brief Let FS's try go out now if its origin's limits allow it, taking one of the
+ * origin's places in flight if FS doesn't hold one yet and one request off its rate.
+ * A try that was let go before is let go again.
+ *
+ * @retval true OK - FS has no limits, or is `cleared` now.
+ * @retval false Not yet, FS is left as is, see #limit_wait().
+ */
+bool limit_try(struct fetch_state *fs);
+
+/**
+ * @brief Wait until #limit_try() lets FS go out, timed into `throttle_ms`.
+ *
+ * @retval true OK - FS is `cleared`.
+ * @retval false Its reader hung up, or one of its #fetch_timeouts ran out, so FS
+ * is canceled.
+ */
+bool limit_wait(struct fetch_state *fs);
+
+/**
+ * @brief Take one request off the rate of FS's origin for a copy of FS's request,
+ * without waiting. The copy doesn't take a place in flight of its own.
+ *
+ * @retval true OK - the copy can go out.
+ * @retval false The origin is out of requests for now.
+ */
+bool limit_try_copy(struct fetch_state *fs);
+
+/**
+ * @brief Hold back every request to FS's origin for DELAY_MS, after it answered
+ * FS with a 429. A no-op unless FS has limits.
+ */
+void limit_hold(struct fetch_state *fs, long delay_ms);
+
+/**
+ * @brief Give back FS's place in flight, if it holds one, to the next fetch
+ * waiting on it.
+ */
+void limit_release(struct fetch_state *fs);
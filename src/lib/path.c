@@ -0,0 +1,68 @@
+#include "path.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+/** Take step S from VAL, other than #PATH_FIRST. */
+static yyjson_val *step_into(const struct path_step *s, yyjson_val *val) {
+    if (s->op == PATH_INDEX && yyjson_is_arr(val)) {
+        long long n = yyjson_arr_size(val);
+        long long i = s->index < 0 ? n + s->index : s->index;
+        if (i < 0 || i >= n)
+            return NULL;
+        return i == n - 1 ? yyjson_arr_get_last(val) : yyjson_arr_get(val, i);
+    }
+    // an index into an object is the member with that name
+    return yyjson_is_obj(val) ? yyjson_obj_getn(val, hd(s->key), len(s->key)) : NULL;
+}
+
+/** Is VAL equal to the literal of #PATH_FIRST step S? */
+static bool literal_eq(const struct path_step *s, yyjson_val *val) {
+    switch (s->type) {
+    case PATH_STR:
+        return yyjson_is_str(val) && yyjson_get_len(val) == len(s->str)
+            && memcmp(yyjson_get_str(val), hd(s->str), len(s->str)) == 0;
+    case PATH_NUM:
+        return yyjson_is_num(val) && yyjson_get_num(val) == s->num;
+    case PATH_TRUE:
+        return yyjson_is_true(val);
+    case PATH_FALSE:
+        return yyjson_is_false(val);
+    case PATH_NULL:
+        return yyjson_is_null(val);
+    }
+    return false;
+}
+
+/** Run the N STEPS from VAL. */
+static yyjson_val *run(const struct path_step *steps, size_t n, yyjson_val *val) {
+    for (size_t i = 0; i < n && val; i++) {
+        const struct path_step *s = &steps[i];
+        if (s->op != PATH_FIRST) {
+            val = step_into(s, val);
+            continue;
+        }
+
+        yyjson_val *found = NULL, *el = NULL;
+        size_t idx = 0, max = 0;
+        if (yyjson_is_arr(val)) {
+            yyjson_arr_foreach(val, idx, max, el) {
+                // a value that's missing is neither equal nor unequal to anything
+                yyjson_val *tested = run(s + 1, s->num_steps, el);
+                bool pass = tested && (s->cmp == PATH_EXISTS
+                    || (s->cmp == PATH_EQ) == literal_eq(s, tested));
+                if (pass) {
+                    found = el;
+                    break;
+                }
+            }
+        }
+        val = found;
+        i += s->num_steps;
+    }
+    return val;
+}
+
+yyjson_val *path_eval(const struct json_path *path, yyjson_val *row) {
+    return run(path->steps, path->len, row);
+}
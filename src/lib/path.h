@@ -0,0 +1,68 @@
+/**
+ * @file path.h
+ * @brief The JSON paths of `GENERATED ALWAYS AS (...)` columns, compiled once when
+ * the table is declared into a flat program of steps that's run over every row.
+ *
+ * A path starts at a key of the row, and every step after it goes one level down:
+ *
+ * - `->'key'`, `->"key"` or `->key`: a member of an object.
+ * - `->0` or `->-1`: an element of an array, from the end if it's negative. On an
+ *   object it's the member with that name.
+ * - `[?(@.system == 'http://loinc.org')]`: the first element of an array with a
+ *   match. The `@` path can have `.key`, `['key']` and `[0]` steps, and compares to
+ *   a string, number, `true`, `false` or `null` with `==` or `!=`. Without a
+ *   comparison the path only has to lead somewhere, `[?(@.code)]`.
+ *
+ * `->>` is the same as `->`.
+ */
+#pragma once
+#include "pyc.h"
+#include <stddef.h>
+#include <yyjson.h>
+
+enum path_op {
+    PATH_KEY,           // the member KEY of an object
+    PATH_INDEX,         // element INDEX of an array, or the member KEY of an object
+    PATH_FIRST,         // the first element of an array that passes the test in the NUM_STEPS steps after this one
+};
+
+enum path_cmp {
+    PATH_EXISTS,        // the test's path leads somewhere
+    PATH_EQ,            // to a value equal to the literal
+    PATH_NE,            // to a value that isn't
+};
+
+enum path_literal {
+    PATH_STR,
+    PATH_NUM,
+    PATH_TRUE,
+    PATH_FALSE,
+    PATH_NULL,
+};
+
+struct path_step {
+    enum path_op op;
+    struct str key;             // PATH_KEY and PATH_INDEX
+    long long index;            // PATH_INDEX
+
+    /* --- PATH_FIRST --- */
+    size_t num_steps;           // steps after this one from the element to the value tested
+    enum path_cmp cmp;
+    enum path_literal type;     // of the literal compared to, unless PATH_EXISTS
+    struct str str;             // PATH_STR
+    double num;                 // PATH_NUM
+};
+
+/**
+ * @brief A compiled path, in one allocation with the text of its keys and strings,
+ * so it's freed with a single `free()`.
+ */
+struct json_path {
+    size_t len;
+    struct path_step steps[];
+};
+
+/**
+ * @brief The value PATH leads to from the object ROW, NULL if there isn't one.
+ */
+yyjson_val *path_eval(const struct json_path *path, yyjson_val *row);
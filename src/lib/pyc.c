@@ -4,6 +4,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
 
 int min(int a, int b) {
     return a < b ? a : b;
@@ -31,6 +33,26 @@ struct queue {
     size_t cap;
 };
 
+/**
+ * Records are laid out as [u32 length][payload][pad to 4 bytes]. A record never
+ * straddles the end of the buffer: the producer leaves a RING_WRAP marker and
+ * restarts at offset 0 instead, so the consumer always gets a contiguous view.
+ *
+ * HEAD and TAIL are free running byte counters, masked on access.
+ */
+struct ring {
+    char *buffer;
+    size_t cap;
+
+    /* consumer owned */
+    _Alignas(64) _Atomic size_t head;
+
+    /* producer owned */
+    _Alignas(64) _Atomic size_t tail;
+    size_t reserved_at;     // tail offset the pending record's header goes to
+    size_t reserved_len;    // size passed to ring_reserve()
+};
+
 char *dsnprintf(size_t *n, const char *fmt, ...) {
     if (!n)
         return NULL;
@@ -264,6 +286,13 @@ struct str __str_slice(const struct str s, uint start, uint end) {
     return (struct str) {.hd=buf, .length=len};
 }
 
+struct list *list(struct str s) {
+    struct list *ls = calloc(1, sizeof(struct list));
+    if (ls)
+        ls->val = s;
+    return ls;
+}
+
 struct list *__list_next(struct list *ls) {
     if (!ls) {
         return NULL;
@@ -391,13 +420,17 @@ struct list *__list_filter(struct list **ls, bool f (struct str s, uint i)) {
     return keep_head;
 }
 
+struct queue *queue(void) {
+    return calloc(1, sizeof(struct queue));
+}
+
 struct str __queue_next(struct queue *q) {
     if (!q || q->size == 0) {
         return empty(struct str);
     }
 
     struct str popped = q->buffer[q->hd]; // pop
-    q->hd += 1;
+    q->hd = (q->hd + 1) % q->cap;
     q->size -= 1;
     return popped;
 }
@@ -477,3 +510,174 @@ bool __queue_insert(struct queue *q, struct str s) {
 }
 #undef QUEUE_INIT_SIZE
 
+#define RING_WRAP UINT32_MAX
+#define RING_HDR sizeof(uint32_t)
+#define RING_ALIGN(n) (((n) + (RING_HDR - 1)) & ~(RING_HDR - 1))
+
+static size_t ring_cap_of(size_t cap) {
+    size_t pow2 = 64;
+    while (pow2 < cap)
+        pow2 <<= 1;
+    return pow2;
+}
+
+struct ring *ring(size_t cap) {
+    struct ring *r = calloc(1, sizeof(struct ring));
+    if (!r)
+        return NULL;
+
+    r->cap = ring_cap_of(cap);
+    r->buffer = malloc(r->cap);
+    if (!r->buffer) {
+        free(r);
+        return NULL;
+    }
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    return r;
+}
+
+char *ring_reserve(struct ring *r, size_t n) {
+    if (!r || n > UINT32_MAX - RING_HDR)
+        return NULL;
+
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+    size_t need = RING_HDR + RING_ALIGN(n);
+    size_t off = tail & (r->cap - 1);
+    size_t contiguous = r->cap - off;
+
+    // skip the buffer tail if the record can't fit before wrapping around
+    size_t skip = need > contiguous ? contiguous : 0;
+    if (need > r->cap || tail + skip + need - head > r->cap)
+        return NULL;
+
+    r->reserved_at = tail + skip;
+    r->reserved_len = n;
+    return r->buffer + ((tail + skip) & (r->cap - 1)) + RING_HDR;
+}
+
+bool ring_commit(struct ring *r, size_t n) {
+    if (!r || n > r->reserved_len)
+        return false;
+
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    if (r->reserved_at != tail) {
+        uint32_t wrap = RING_WRAP;
+        memcpy(r->buffer + (tail & (r->cap - 1)), &wrap, RING_HDR);
+    }
+
+    uint32_t length = n;
+    memcpy(r->buffer + (r->reserved_at & (r->cap - 1)), &length, RING_HDR);
+
+    r->reserved_len = 0;
+    atomic_store_explicit(
+        &r->tail,
+        r->reserved_at + RING_HDR + RING_ALIGN(n),
+        memory_order_release
+    );
+    return true;
+}
+
+/**
+ * Resolve the offset of the front record in R, or -1 if R is empty.
+ * Also hands back a wrapped around region to the producer.
+ */
+static ssize_t ring_front(struct ring *r, uint32_t *length) {
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    if (head == tail)
+        return -1;
+
+    size_t off = head & (r->cap - 1);
+    memcpy(length, r->buffer + off, RING_HDR);
+    if (*length == RING_WRAP) {
+        head += r->cap - off;
+        atomic_store_explicit(&r->head, head, memory_order_release);
+        off = 0;
+        memcpy(length, r->buffer, RING_HDR);
+    }
+    return off;
+}
+
+struct str __ring_get(struct ring *r) {
+    uint32_t length = 0;
+    ssize_t off = r ? ring_front(r, &length) : -1;
+    if (off < 0)
+        return empty(struct str);
+
+    return strn(r->buffer + off + RING_HDR, length);
+}
+
+bool ring_pop(struct ring *r) {
+    uint32_t length = 0;
+    if (!r || ring_front(r, &length) < 0)
+        return false;
+
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    atomic_store_explicit(
+        &r->head,
+        head + RING_HDR + RING_ALIGN(length),
+        memory_order_release
+    );
+    return true;
+}
+
+size_t __ring_len(struct ring *r) {
+    if (!r) {
+        fprintf(stderr, "Can't read len of a NULL ring\n");
+        abort();
+    }
+    return atomic_load_explicit(&r->tail, memory_order_acquire)
+        - atomic_load_explicit(&r->head, memory_order_acquire);
+}
+
+bool __ring_insert(struct ring *r, struct str s) {
+    char *slot = ring_reserve(r, s.length);
+    if (!slot)
+        return false;
+
+    if (s.length > 0)
+        memcpy(slot, s.hd, s.length);
+    return ring_commit(r, s.length);
+}
+
+bool ring_grow(struct ring *r, size_t cap) {
+    if (!r)
+        return false;
+
+    struct ring *grown = ring(cap);
+    if (!grown)
+        return false;
+
+    for (struct str front = hd(r); front.hd; front = hd(r)) {
+        if (!insert(grown, front)) {
+            // CAP is too small for what R already holds
+            done(grown);
+            return false;
+        }
+        ring_pop(r);
+    }
+
+    free(r->buffer);
+    r->buffer = grown->buffer;
+    r->cap = grown->cap;
+    atomic_store(&r->head, atomic_load(&grown->head));
+    atomic_store(&r->tail, atomic_load(&grown->tail));
+    free(grown);
+    return true;
+}
+
+bool __ring_done(struct ring *r) {
+    if (!r)
+        return false;
+
+    free(r->buffer);
+    free(r);
+    return true;
+}
+
+#undef RING_ALIGN
+#undef RING_HDR
+#undef RING_WRAP
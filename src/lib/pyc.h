@@ -103,6 +103,11 @@ char *__str_to_string(const struct str s);
  */
 struct list;
 
+/**
+ * @brief Allocate a list of the one node S.
+ */
+struct list *list(struct str s);
+
 /**
  * @brief Get the next node in the list in LS, if it exists.
  */
@@ -147,6 +152,11 @@ struct list *__list_filter(struct list **ls, bool f (struct str s, uint i));
  */
 struct queue;
 
+/**
+ * @brief Allocate an empty queue.
+ */
+struct queue *queue(void);
+
 /**
  * @brief Pops the front string of Q.
  */
@@ -172,6 +182,72 @@ bool __queue_done(struct queue *q);
  */
 bool __queue_insert(struct queue *q, struct str s);
 
+/* RING */
+
+/**
+ * @brief Lock-free single-producer / single-consumer ring of variable-length byte records.
+ *
+ * One thread may produce (#ring_reserve, #ring_commit, #insert) while another
+ * consumes (#hd, #ring_pop) without locks. Records are stored inline, so
+ * nothing is allocated per record.
+ */
+struct ring;
+
+/**
+ * @brief Allocate a ring holding at least CAP bytes of records (rounded up to a power of two).
+ */
+struct ring *ring(size_t cap);
+
+/**
+ * @brief **Producer**: reserve N contiguous bytes for the next record in R.
+ *
+ * Returns NULL when R doesn't have room for N bytes right now. Nothing is visible
+ * to the consumer until #ring_commit().
+ */
+char *ring_reserve(struct ring *r, size_t n);
+
+/**
+ * @brief **Producer**: publish the last reserved record in R with its final length N.
+ *
+ * N must be at most the size passed to #ring_reserve().
+ */
+bool ring_commit(struct ring *r, size_t n);
+
+/**
+ * @brief **Consumer**: release the front record of R back to the producer.
+ */
+bool ring_pop(struct ring *r);
+
+/**
+ * @brief Resize R to hold at least CAP bytes, keeping its records in order.
+ *
+ * This is NOT safe while another thread is touching R. It's meant for rings
+ * owned by a single thread that would rather grow than drop records.
+ */
+bool ring_grow(struct ring *r, size_t cap);
+
+/**
+ * @brief Read the number of unread bytes (record headers included) in R.
+ */
+size_t __ring_len(struct ring *r);
+
+/**
+ * @brief **Consumer**: peek the front record of R.
+ *
+ * The returned view points into R and stays valid until #ring_pop().
+ */
+struct str __ring_get(struct ring *r);
+
+/**
+ * @brief Cleanup dynamically allocated R.
+ */
+bool __ring_done(struct ring *r);
+
+/**
+ * @brief **Producer**: copy S into R as a single record. False if R is full.
+ */
+bool __ring_insert(struct ring *r, struct str s);
+
 /**
  * @brief Get the empty value for **type** T.
  */
@@ -179,7 +255,8 @@ bool __queue_insert(struct queue *q, struct str s);
     _Generic((T *)0, \
         struct str *: STR_EMPTY, \
         struct list **: NULL, \
-        struct queue **: NULL \
+        struct queue **: NULL, \
+        struct ring **: NULL \
     )
 
 /**
@@ -199,7 +276,8 @@ bool __queue_insert(struct queue *q, struct str s);
     _Generic((iter), \
         struct str: __str_len, \
         struct list *: __list_len, \
-        struct queue *: __queue_len \
+        struct queue *: __queue_len, \
+        struct ring *: __ring_len \
     )(iter)
 
 /**
@@ -209,7 +287,8 @@ bool __queue_insert(struct queue *q, struct str s);
     _Generic((iter), \
         struct str: __str_get, \
         struct list *: __list_get, \
-        struct queue *: __queue_get \
+        struct queue *: __queue_get, \
+        struct ring *: __ring_get \
     )(iter)
 
 /**
@@ -219,7 +298,8 @@ bool __queue_insert(struct queue *q, struct str s);
     _Generic((iter), \
         struct str: __str_done, \
         struct list *: __list_done, \
-        struct queue *: __queue_done \
+        struct queue *: __queue_done, \
+        struct ring *: __ring_done \
     )(iter)
 
 /**
@@ -229,7 +309,8 @@ bool __queue_insert(struct queue *q, struct str s);
     _Generic((iter), \
         struct str: __str_insert, \
         struct list *: __list_insert, \
-        struct queue *: __queue_insert \
+        struct queue *: __queue_insert, \
+        struct ring *: __ring_insert \
     )((iter), (value))
 
 /**
@@ -1,19 +1,97 @@
 #include "pyc.h"
 #include <criterion/criterion.h>
+#include <stdio.h>
 #include <string.h>
 
 Test(next, str) {
     struct str stack = STR("hello world\n");
 }
 
-Test(ss, length_copy) {
+Test(strn, length_copy) {
     char greeting[] = "hello world";
-    struct string s = ss(greeting, sizeof(greeting) - 1);
+    struct str s = strn(greeting, sizeof(greeting) - 1);
 
     cr_assert_eq(
         s.length,
         sizeof(greeting) - 1,
-        "ss() should copy length"
+        "strn() should copy length"
     );
 }
 
+
+Test(ring, fifo_records) {
+    struct ring *r = ring(64);
+    cr_assert(insert(r, STR("hello")));
+    cr_assert(insert(r, STR("world!")));
+
+    struct str front = hd(r);
+    cr_assert_eq(front.length, 5);
+    cr_assert(strncmp(front.hd, "hello", 5) == 0);
+    cr_assert(ring_pop(r));
+
+    front = hd(r);
+    cr_assert_eq(front.length, 6);
+    cr_assert(strncmp(front.hd, "world!", 6) == 0);
+    cr_assert(ring_pop(r));
+
+    cr_assert_null(hd(r).hd, "ring should be empty");
+    cr_assert_eq(len(r), 0);
+    done(r);
+}
+
+Test(ring, wraps_without_splitting) {
+    struct ring *r = ring(64);
+    for (int i = 0; i < 100; i++) {
+        char buf[24];
+        int n = snprintf(buf, sizeof(buf), "record-%d", i);
+        cr_assert(insert(r, strn(buf, n)), "insert %d should fit", i);
+
+        struct str front = hd(r);
+        cr_assert_eq(front.length, (size_t) n);
+        cr_assert(strncmp(front.hd, buf, n) == 0);
+        ring_pop(r);
+    }
+    done(r);
+}
+
+Test(ring, full_then_grow) {
+    struct ring *r = ring(64);
+    int count = 0;
+    while (insert(r, STR("abcdefgh")))
+        count++;
+    cr_assert_gt(count, 0);
+
+    cr_assert(ring_grow(r, 1024));
+    cr_assert(insert(r, STR("tail")));
+
+    int seen = 0;
+    for (struct str front = hd(r); front.hd; front = hd(r)) {
+        seen++;
+        ring_pop(r);
+    }
+    cr_assert_eq(seen, count + 1, "grow should keep every record in order");
+    done(r);
+}
+
+Test(queue, pop_and_refill_past_capacity) {
+    // the queue keeps the strs it's given, not copies
+    static char rows[100][16];
+    struct queue *q = queue();
+    for (int i = 0; i < 6; i++)
+        cr_assert(insert(q, STR("old")));
+
+    // each pop moves the head one on, so it walks around the 8 slot buffer many times
+    for (int i = 0; i < 100; i++) {
+        int n = snprintf(rows[i], sizeof(rows[i]), "row-%d", i);
+        cr_assert(insert(q, strn(rows[i], n)));
+
+        struct str front = next(q);
+        cr_assert_not_null(front.hd, "pop %d should have a row", i);
+        if (i < 6)
+            continue;
+        cr_assert_eq(front.length, strlen(rows[i - 6]));
+        cr_assert(strncmp(front.hd, rows[i - 6], front.length) == 0, "pop %d should be FIFO", i);
+    }
+    cr_assert_eq(len(q), 6);
+    done(q);
+}
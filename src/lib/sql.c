@@ -1,246 +1,747 @@
+#define _GNU_SOURCE
+
 #include "sql.h"
+#include "debug.h"
+#include "path.h"
 #include <asm-generic/errno-base.h>
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
-#define MAX_COL_COUNT 64
 #define FETCH_ARGS_OFFSET 3
 
-enum {
-    // id
-    TOK_NAME = 0,
-    // int
-    TOK_TYPE,
-    // generated
-    TOK_CST,
-    // always
-    TOK_CST_VAL,
-    // as
-    TOK_CST_VAL2,
-    // (generated_val)
-    TOK_CST_GEN_VAL
+/*
+ * Every argument after the table name is one column definition or table option,
+ * as SQLite split the declaration on its top level commas. Each is read a token at
+ * a time, in one pass, straight out of the argument.
+ */
+
+enum token_kind {
+    TOKEN_WORD,         // a bare word: keyword, name, type or number
+    TOKEN_IDENT,        // a "double quoted", `backticked` or [bracketed] name
+    TOKEN_STRING,       // a 'single quoted' string
+    TOKEN_GROUP,        // a (parenthesized group), nested ones and all
+    TOKEN_EQ,           // =
+    TOKEN_ARROW,        // -> or ->>
+    TOKEN_FILTER,       // a [?(filter)] of a JSON path, see path.h
+};
+
+struct token {
+    enum token_kind kind;
+    const char *hd;     // quotes and parentheses included
+    size_t length;
 };
 
-static int resolve_column_index(struct str *tokens, size_t tokens_len, size_t current_index) {
-    bool is_url_column = (
-        tokens_len > 0 &&
-        len(tokens[TOK_NAME]) == 3 &&
-        strncmp(hd(tokens[TOK_NAME]), "url", 3) == 0
-    );
-    if (is_url_column) {
-        // check that type is TEXT before returning the index
-        if (tokens_len < 2 || len(tokens[TOK_TYPE]) != 4
-            || strncmp(hd(tokens[TOK_TYPE]), "text", 4) != 0)
-        {
-            fprintf(
-                stderr,
-                "Column \"url\" was expected to be type TEXT,"
-                " "
-                "not %s",
-                hd(map(tokens[TOK_TYPE], toupper))
-            );
-            return -1;
+struct lexer {
+    const char *p;
+    const char *end;
+    const char *bad;    // why the last token didn't lex, NULL if it did
+};
+
+static struct lexer lexer_of(const char *text, size_t length) {
+    return (struct lexer) { .p = text, .end = text + length };
+}
+
+/** Where the quoted token at P that's closed by CLOSE ends, NULL if it doesn't. */
+static const char *quoted_end(const char *p, const char *end, char close) {
+    for (p++; p < end; p++) {
+        if (*p != close)
+            continue;
+        // a doubled quote is one quote inside
+        if (close != ']' && p + 1 < end && p[1] == close)
+            p++;
+        else
+            return p + 1;
+    }
+    return NULL;
+}
+
+/**
+ * Where the group at P that's opened by OPEN and closed by CLOSE ends, nested ones
+ * and all, NULL if it doesn't.
+ */
+static const char *group_end(const char *p, const char *end, char open, char close) {
+    int depth = 0;
+    while (p && p < end) {
+        if (*p == open) {
+            depth++, p++;
+        } else if (*p == close) {
+            p++;
+            if (--depth == 0)
+                return p;
+        } else if (*p == '\'' || *p == '"' || *p == '`') {
+            p = quoted_end(p, end, *p);
+        } else if (*p == '[') {
+            // a bracketed name or a path's filter, either way it's closed by ]
+            p = group_end(p, end, '[', ']');
+        } else {
+            p++;
         }
+    }
+    return NULL;
+}
 
-        return ICOL_URL;
+static bool is_word_char(const char *p, const char *end) {
+    return !isspace((unsigned char) *p) && !strchr("'\"`[()=", *p)
+        && !(*p == '-' && p + 1 < end && p[1] == '>');
+}
+
+/**
+ * Read the next token of LX into TOK.
+ *
+ * @retval true OK
+ * @retval false No more tokens, or one that isn't closed, if `LX->bad` says so.
+ */
+static bool lex(struct lexer *lx, struct token *tok) {
+    while (lx->p < lx->end && isspace((unsigned char) *lx->p))
+        lx->p++;
+    if (lx->p >= lx->end)
+        return false;
+
+    const char *p = lx->p, *end = lx->end, *next = NULL;
+    switch (*p) {
+    case '\'':
+        tok->kind = TOKEN_STRING;
+        if (!(next = quoted_end(p, end, '\'')))
+            lx->bad = "a string isn't closed";
+        break;
+    case '"': case '`':
+        tok->kind = TOKEN_IDENT;
+        if (!(next = quoted_end(p, end, *p)))
+            lx->bad = "a quoted name isn't closed";
+        break;
+    case '[':
+        if (p + 1 < end && p[1] == '?') {
+            tok->kind = TOKEN_FILTER;
+            if (!(next = group_end(p, end, '[', ']')))
+                lx->bad = "a filter isn't closed";
+            break;
+        }
+        tok->kind = TOKEN_IDENT;
+        if (!(next = quoted_end(p, end, ']')))
+            lx->bad = "a bracketed name isn't closed";
+        break;
+    case '(':
+        tok->kind = TOKEN_GROUP;
+        if (!(next = group_end(p, end, '(', ')')))
+            lx->bad = "a parenthesis isn't closed";
+        break;
+    case ')':
+        lx->bad = "a parenthesis isn't opened";
+        break;
+    case '=':
+        tok->kind = TOKEN_EQ;
+        next = p + 1;
+        break;
+    default:
+        if (*p == '-' && p + 1 < end && p[1] == '>') {
+            tok->kind = TOKEN_ARROW;
+            next = p + 2 < end && p[2] == '>' ? p + 3 : p + 2;
+            break;
+        }
+        tok->kind = TOKEN_WORD;
+        for (next = p; next < end && is_word_char(next, end); next++)
+            ;
+    }
+    if (!next)
+        return false;
+
+    tok->hd = p;
+    tok->length = next - p;
+    lx->p = next;
+    return true;
+}
+
+/** Is TOK the bare word KEYWORD, in any case? */
+static bool is_keyword(const struct token *tok, const char *keyword) {
+    size_t n = strlen(keyword);
+    return tok->kind == TOKEN_WORD && tok->length == n && strncasecmp(tok->hd, keyword, n) == 0;
+}
+
+/**
+ * Write TOK out to OUT as the text it stands for, without its quotes or escapes
+ * and NUL terminated: a group without its outer parentheses, a word as it is. OUT
+ * has room for `TOK->length + 1` bytes.
+ *
+ * @return The length written, not counting the NUL.
+ */
+static size_t token_copy(const struct token *tok, char *out) {
+    const char *p = tok->hd, *end = tok->hd + tok->length;
+    size_t n = 0;
+    if (tok->kind == TOKEN_IDENT || tok->kind == TOKEN_STRING || tok->kind == TOKEN_GROUP) {
+        char close = *p == '[' ? ']' : *p == '(' ? ')' : *p;
+        bool escapes = tok->kind != TOKEN_GROUP && close != ']';
+        for (p++, end--; p < end; p++) {
+            out[n++] = *p;
+            if (escapes && *p == close)
+                p++; // the second of a doubled quote
+        }
+    } else {
+        memcpy(out, p, tok->length);
+        n = tok->length;
     }
+    out[n] = '\0';
+    return n;
+}
 
-    return current_index;
+/** Allocate the text TOK stands for, see #token_copy(). Empty if out of memory. */
+static struct str token_text(const struct token *tok) {
+    char *text = malloc(tok->length + 1);
+    if (!text)
+        return empty(struct str);
+    size_t n = token_copy(tok, text);
+    return (struct str) { .hd = text, .length = n };
 }
 
 const struct column_def HIDDEN_URL = {
     .name = STR("url"),
     .typename = STR("text"),
     .default_value = STR(""),
-    .generated_always_as = NULL,
-    .generated_always_as_len = 0
+    .generated_always_as = NULL
 };
 
 const struct column_def HIDDEN_HEADERS = {
     .name = STR("headers"),
     .typename = STR("text"),
     .default_value = STR(""),
-    .generated_always_as = NULL,
-    .generated_always_as_len = 0
+    .generated_always_as = NULL
 };
 
 const struct column_def HIDDEN_BODY = {
     .name = STR("body"),
     .typename = STR("text"),
     .default_value = STR(""),
-    .generated_always_as = NULL,
-    .generated_always_as_len = 0
+    .generated_always_as = NULL
 };
 
-const struct column_def HIDDEN_COLUMNS[] = {
+const struct column_def HIDDEN_METHOD = {
+    .name = STR("method"),
+    .typename = STR("text"),
+    .default_value = STR(""),
+    .generated_always_as = NULL
+};
+
+const struct column_def HIDDEN_TIMEOUT = {
+    .name = STR("timeout"),
+    .typename = STR("text"),
+    .default_value = STR(""),
+    .generated_always_as = NULL
+};
+
+const struct column_def HIDDEN_COLUMNS[NUM_HIDDEN_COLUMNS] = {
     HIDDEN_URL,
     HIDDEN_HEADERS,
-    HIDDEN_BODY
+    HIDDEN_BODY,
+    HIDDEN_METHOD,
+    HIDDEN_TIMEOUT
 };
 
-static bool isnotdquo(int c, uint _i) {return c != '\"';}
-static bool isnotsquo(int c, uint _i) {return c != '\'';}
-
 /**
- * Do the given NUM_TOKENS TOKENS have a `GENERATED ALWAYS AS` clause in it?.
+ * Parse VALUE of option NAME as an integer of at least MIN, 0 or 1, into SIZE.
+ *
+ * @retval 0 OK
+ * @retval -1 Error, VALUE isn't such an integer.
  */
-static bool is_with_generated_always_as(struct str *tokens, size_t num_tokens) {
-    if (num_tokens < 6) {
-        return false;
+static int parse_size(const char *name, const char *value, long long min, size_t *size) {
+    char *end = NULL;
+    long long n = strtoll(value, &end, 10);
+    if (end == value || *end || n < min) {
+        fprintf(stderr, "%s must be a%s integer, not %s\n",
+                name, min > 0 ? " positive" : " non-negative", value);
+        return -1;
     }
-    if (len(tokens[TOK_CST]) + 1 != sizeof("generated")
-        && len(tokens[TOK_CST_VAL]) + 1 != sizeof("always")
-        && len(tokens[TOK_CST_VAL2]) + 1 != sizeof("as"))
-    {
-        return false;
-    }
-    struct str generated_token = map(tokens[TOK_CST], tolower);
-    struct str always_token = map(tokens[TOK_CST_VAL], tolower);
-    struct str as_token = map(tokens[TOK_CST_VAL2], tolower);
-    bool has_generated_always_as = (
-        strncmp(hd(generated_token), "generated", 9) == 0
-        &&
-        strncmp(hd(always_token), "always", 6) == 0
-        &&
-        strncmp(hd(as_token), "as", 2) == 0
-        &&
-        len(tokens[TOK_CST_GEN_VAL]) > 0
-    );
-
-    return has_generated_always_as;
+    *size = n;
+    return 0;
 }
 
-/**
- * Initialize column definitions and resolve the user's hidden column options, if any,
- * from the table declaration in ARGC and ARGV.
- */
-struct column_def *resolve_hidden_columns(int argc, const char *const *argv) {
-    struct column_def *cols = calloc(MAX_COL_COUNT, sizeof(struct column_def));
-    // static declarations
-    cols[0] = HIDDEN_URL;
-    cols[1] = HIDDEN_HEADERS;
-    cols[2] = HIDDEN_BODY;
+void table_options_free(struct table_options *opts) {
+    done(opts->batch);
+    done(opts->key);
+    done(opts->hedge);
+    done(opts->rate);
+    opts->batch = empty(struct str);
+    opts->key = empty(struct str);
+    opts->hedge = empty(struct str);
+    opts->rate = empty(struct str);
+}
 
-    for (int i = FETCH_ARGS_OFFSET; i < argc; i++) {
+int parse_table_options(int argc, const char *const *argv, struct table_options *opts) {
+    int rc = 0;
+    for (int i = FETCH_ARGS_OFFSET; i < argc && rc == 0; i++) {
+        struct lexer lx = lexer_of(argv[i], strlen(argv[i]));
+        struct token tokens[4];
         size_t num_tokens = 0;
-        struct str arg = str(argv[i]);
-        struct str *tokens = split(arg, STR(" "), &num_tokens);
-        done(arg);
-
-        // handle a default url value
-        if (len(tokens[0])== 3 
-            && strncmp(hd(tokens[0]), "url", 3) == 0
-            && num_tokens == 4
-            /* (url, 1), (text, 2), (default, 3), ('some-url', 4) is 4 tokens */
-        ) {
-            tokens[3] = filter(tokens[3], isnotsquo);
-
-            // TODO: Free default_value in xDisconnect()
-            cols[0].default_value = str(hd(tokens[3]));
+        while (num_tokens < 4 && lex(&lx, &tokens[num_tokens]))
+            num_tokens++;
+        // anything else is a column, see parse_column_defs()
+        if (num_tokens < 2 || tokens[1].kind != TOKEN_EQ)
+            continue;
+        if (num_tokens == 2) {
+            fprintf(stderr, "Table option has no value: %s\n", argv[i]);
+            rc = -1;
+            break;
+        }
+        if (num_tokens > 3) {
+            fprintf(stderr, "Table option has more than one value: %s\n", argv[i]);
+            rc = -1;
+            break;
+        }
+
+        struct str name = map(token_text(&tokens[0]), tolower);
+        struct str value = token_text(&tokens[2]);
+        if (!hd(name) || !hd(value)) {
+            rc = -1;
+        } else if (len(name) == 5 && strncmp(hd(name), "batch", 5) == 0) {
+            done(opts->batch);
+            opts->batch = str("%s", hd(value));
+        } else if (len(name) == 10 && strncmp(hd(name), "batch_size", 10) == 0) {
+            rc = parse_size(hd(name), hd(value), 1, &opts->batch_size);
+        } else if (len(name) == 3 && strncmp(hd(name), "key", 3) == 0) {
+            done(opts->key);
+            opts->key = str("%s", hd(value));
+        } else if (len(name) == 9 && strncmp(hd(name), "bulk_size", 9) == 0) {
+            rc = parse_size(hd(name), hd(value), 1, &opts->bulk_size);
+        } else if (len(name) == 7 && strncmp(hd(name), "retries", 7) == 0) {
+            // 0 turns retries off, and so do the rest below
+            rc = parse_size(hd(name), hd(value), 0, &opts->retries);
+        } else if (len(name) == 5 && strncmp(hd(name), "hedge", 5) == 0) {
+            done(opts->hedge);
+            opts->hedge = str("%s", hd(value));
+        } else if (len(name) == 4 && strncmp(hd(name), "rate", 4) == 0) {
+            done(opts->rate);
+            opts->rate = str("%s", hd(value));
+        } else if (len(name) == 5 && strncmp(hd(name), "burst", 5) == 0) {
+            rc = parse_size(hd(name), hd(value), 0, &opts->burst);
+        } else if (len(name) == 13 && strncmp(hd(name), "max_in_flight", 13) == 0) {
+            rc = parse_size(hd(name), hd(value), 0, &opts->max_in_flight);
+        } else {
+            fprintf(stderr, "Unknown table option: %s\n", argv[i]);
+            rc = -1;
         }
 
+        done(name);
+        done(value);
     }
+    return rc;
+}
 
-    return cols;
+/** Why a column definition couldn't be read when it wasn't the definition's fault. */
+static const char OOM[] = "out of memory";
+
+/**
+ * Returns the hidden column index NAME names, or -1 if it isn't a hidden column.
+ */
+static int hidden_column_index(struct str name) {
+    for (int i = 0; i < NUM_HIDDEN_COLUMNS; i++) {
+        struct str hidden = HIDDEN_COLUMNS[i].name;
+        if (len(name) == len(hidden) && strncasecmp(hd(name), hd(hidden), len(hidden)) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/**
+ * Does TOK start a column constraint, so it isn't part of the type name before it?
+ */
+static bool is_constraint(const struct token *tok) {
+    static const char *const KEYWORDS[] = {
+        "constraint", "primary", "not", "null", "unique", "check", "default",
+        "collate", "references", "generated", "as", "hidden",
+    };
+    for (size_t i = 0; i < sizeof(KEYWORDS) / sizeof(KEYWORDS[0]); i++) {
+        if (is_keyword(tok, KEYWORDS[i]))
+            return true;
+    }
+    return false;
 }
 
 /**
- * Returns whether or not COLNAME matches that of the hidden columns always included
- * in a fetch table.
+ * Copy the type name from START to END into DEF, with every run of whitespace in
+ * it made a single space.
  */
-static bool is_hidden_column(struct str colname) {
-    if (len(colname) + 1 != (sizeof("url"))
-        && len(colname) + 1 != sizeof("headers")
-        && len(colname) + 1 != sizeof("body")
-    ) {
-        // early exit if buffer size isn't one of the hidden column sizes
+static bool type_name(struct column_def *def, const char *start, const char *end) {
+    char *type = malloc(end - start + 1);
+    if (!type)
         return false;
+
+    size_t n = 0;
+    for (const char *p = start; p < end; p++) {
+        if (!isspace((unsigned char) *p))
+            type[n++] = *p;
+        else if (n > 0 && type[n - 1] != ' ')
+            type[n++] = ' ';
     }
+    while (n > 0 && type[n - 1] == ' ')
+        n--;
+    type[n] = '\0';
+    def->typename = (struct str) { .hd = type, .length = n };
+    return true;
+}
 
-    return (
-        (len(colname) == 3 && strncmp(hd(colname), "url", 3) == 0)
-        || (len(colname) == 7 && strncmp(hd(colname), "headers", 7) == 0)
-        || (len(colname) == 4 && strncmp(hd(colname), "body", 4) == 0)
-    );
+/** Why a `GENERATED ALWAYS AS` expression isn't a path it can follow. */
+static const char NOT_A_PATH[] = "GENERATED ALWAYS AS takes a path like (a->'b'->0)";
+
+/** Where a path's steps and the text of their keys go while it's compiled. */
+struct path_builder {
+    struct json_path *path;
+    char *text;                 // where the next key's text goes
+};
+
+/** Append a step OP to B. */
+static struct path_step *path_push(struct path_builder *b, enum path_op op) {
+    struct path_step *s = &b->path->steps[b->path->len++];
+    memset(s, 0, sizeof(struct path_step));
+    s->op = op;
+    return s;
+}
+
+/** Copy the text TOK stands for after the rest in B, see #token_copy(). */
+static struct str path_text(struct path_builder *b, const struct token *tok) {
+    size_t n = token_copy(tok, b->text);
+    struct str text = { .hd = b->text, .length = n };
+    b->text += n + 1;
+    return text;
 }
 
 /**
- * Remove the leading and trailing dquote at TOKENS[TOK_NAME], printing out
- * an error message with the original argument LINE_RAW in context if there is no
- * corresponding trailing dquote.
+ * Append the key TOK to B, or an index if it's a bare integer and INDEX_OK, so
+ * anywhere but at the row.
  */
-static int strip_colname_dquotes(struct str *tokens, const char *line_raw) {
-    struct str token = tokens[TOK_NAME];
-    char *token_name = hd(token);
-    if (token_name[len(token) - 1] != '\"') {
-        fprintf(stderr, "Open dquote line is missing closing dquote: %s\n", line_raw);
-        free(tokens);
-        return 1;
-    }
-    tokens[TOK_NAME] = filter(tokens[TOK_NAME], isnotdquo);
-    return 0;
+static void compile_key(struct path_builder *b, const struct token *tok, bool index_ok) {
+    struct path_step *s = path_push(b, PATH_KEY);
+    s->key = path_text(b, tok);
+
+    char *end = NULL;
+    long long index = strtoll(hd(s->key), &end, 10);
+    if (index_ok && tok->kind == TOKEN_WORD && end != hd(s->key) && !*end) {
+        s->op = PATH_INDEX;
+        s->index = index;
+    }
 }
 
-struct column_def *parse_column_defs(int argc, const char *const *argv,
-                                      size_t *num_columns)
-{
-    struct column_def *cols = resolve_hidden_columns(argc, argv);
+static const char *skip_space(const char *p, const char *end) {
+    while (p < end && isspace((unsigned char) *p))
+        p++;
+    return p;
+}
 
-    size_t n_columns = 3;
-    for (int i = FETCH_ARGS_OFFSET; i < argc; i++) {
-        size_t num_tokens = 0;
-        struct str arg = str(argv[i]);
-        struct str *tokens = split(arg, STR(" "), &num_tokens);
-        done(arg);
+/**
+ * Scan the quoted string at *P, before END, into TOK and move *P past it.
+ *
+ * @retval false It isn't closed.
+ */
+static bool scan_string(const char **p, const char *end, struct token *tok) {
+    const char *next = quoted_end(*p, end, **p);
+    if (!next)
+        return false;
+    *tok = (struct token) { .kind = TOKEN_STRING, .hd = *p, .length = next - *p };
+    *p = next;
+    return true;
+}
 
-        if (is_hidden_column(tokens[TOK_NAME])) {
-            continue; // we already handle this in resolve_hidden_columns()
+/**
+ * Append the filter TOK, `[?(@.a.b == 'x')]`, to B as a #PATH_FIRST step and the
+ * steps of its test after it.
+ *
+ * @return NULL if it compiled, or else why it didn't.
+ */
+static const char *compile_filter(struct path_builder *b, const struct token *tok) {
+    static const char BAD[] = "a filter is like [?(@.key == 'value')]";
+    const char *p = skip_space(tok->hd + 2, tok->hd + tok->length - 1);
+    const char *end = tok->hd + tok->length - 1;
+    while (end > p && isspace((unsigned char) end[-1]))
+        end--;
+    if (p >= end || *p != '(' || end[-1] != ')')
+        return BAD;
+    p = skip_space(p + 1, --end);
+    if (p >= end || *p++ != '@')
+        return BAD;
+
+    size_t first = b->path->len;
+    path_push(b, PATH_FIRST);
+    for (;;) {
+        struct token key = { .kind = TOKEN_WORD, .hd = p };
+        if (p < end && *p == '.') {
+            key.hd = ++p;
+            while (p < end && (isalnum((unsigned char) *p) || *p == '_' || *p == '$' || *p == '-'))
+                p++;
+            key.length = p - key.hd;
+            if (key.length == 0)
+                return BAD;
+            path_push(b, PATH_KEY)->key = path_text(b, &key);
+        } else if (p < end && *p == '[') {
+            p = skip_space(p + 1, end);
+            if (p < end && (*p == '\'' || *p == '"')) {
+                if (!scan_string(&p, end, &key))
+                    return "a string isn't closed";
+                path_push(b, PATH_KEY)->key = path_text(b, &key);
+            } else {
+                key.hd = p;
+                while (p < end && (isdigit((unsigned char) *p) || *p == '-'))
+                    p++;
+                key.length = p - key.hd;
+                if (key.length == 0)
+                    return BAD;
+                compile_key(b, &key, true);
+            }
+            p = skip_space(p, end);
+            if (p >= end || *p++ != ']')
+                return BAD;
+        } else {
+            break;
         }
+    }
+    struct path_step *s = &b->path->steps[first];
+    s->num_steps = b->path->len - first - 1;
+
+    p = skip_space(p, end);
+    if (p == end) {
+        s->cmp = PATH_EXISTS;
+        return NULL;
+    }
+    if (end - p < 2 || (p[0] != '=' && p[0] != '!') || p[1] != '=')
+        return "a filter compares with == or !=";
+    s->cmp = p[0] == '=' ? PATH_EQ : PATH_NE;
+    p = skip_space(p + 2, end);
+
+    struct token literal;
+    if (p < end && (*p == '\'' || *p == '"')) {
+        if (!scan_string(&p, end, &literal))
+            return "a string isn't closed";
+        s->type = PATH_STR;
+        s->str = path_text(b, &literal);
+    } else if (end - p >= 4 && strncmp(p, "true", 4) == 0) {
+        s->type = PATH_TRUE, p += 4;
+    } else if (end - p >= 5 && strncmp(p, "false", 5) == 0) {
+        s->type = PATH_FALSE, p += 5;
+    } else if (end - p >= 4 && strncmp(p, "null", 4) == 0) {
+        s->type = PATH_NULL, p += 4;
+    } else {
+        char *num_end = NULL;
+        s->type = PATH_NUM;
+        s->num = strtod(p, &num_end);
+        if (num_end == p || num_end > end)
+            return "a filter compares to a string, number, true, false or null";
+        p = num_end;
+    }
+    if (skip_space(p, end) != end)
+        return "a filter compares its @ path to one value";
+    return NULL;
+}
 
-        if (hd(tokens[TOK_NAME])[0] == '\"') {
-            if (strip_colname_dquotes(tokens, argv[i]) != 0)
-                return NULL;
+/**
+ * Compile the `GENERATED ALWAYS AS (...)` expression in GROUP into DEF, see path.h,
+ * its steps and the text of their keys all in one allocation.
+ *
+ * @retval 0 OK
+ * @retval -1 Error, out of memory or the expression isn't such a path, with WHY
+ * saying which.
+ */
+static int generated_path(struct column_def *def, const struct token *group, const char **why) {
+    const char *inner = group->hd + 1;
+    size_t inner_len = group->length - 2;
+
+    // every step after the first starts with one of these, and their text is shorter than INNER
+    size_t max_steps = 1;
+    for (size_t i = 0; i < inner_len; i++)
+        max_steps += inner[i] == '-' || inner[i] == '[' || inner[i] == '.';
+    struct json_path *path = malloc(sizeof(struct json_path)
+                                    + max_steps * sizeof(struct path_step)
+                                    + inner_len + max_steps + 1);
+    if (!path) {
+        *why = OOM;
+        return -1;
+    }
+    path->len = 0;
+    struct path_builder b = { .path = path, .text = (char *) (path->steps + max_steps) };
+
+    struct lexer lx = lexer_of(inner, inner_len);
+    struct token tok;
+    bool want_key = true;
+    *why = NULL;
+    while (!*why && lex(&lx, &tok)) {
+        if (want_key) {
+            if (tok.kind != TOKEN_WORD && tok.kind != TOKEN_IDENT && tok.kind != TOKEN_STRING)
+                *why = NOT_A_PATH;
+            else
+                compile_key(&b, &tok, path->len > 0);
+            want_key = false;
+        } else if (tok.kind == TOKEN_ARROW) {
+            want_key = true;
+        } else if (tok.kind == TOKEN_FILTER) {
+            *why = compile_filter(&b, &tok);
         } else {
-            map(tokens[TOK_NAME], tolower);
+            *why = NOT_A_PATH;
         }
+    }
+    if (!*why && (lx.bad || want_key))
+        *why = lx.bad ? lx.bad : NOT_A_PATH;
+    if (*why) {
+        free(path);
+        return -1;
+    }
+    def->generated_always_as = path;
+    return 0;
+}
 
-        // 5 tokens: id int generated always as (...)
-        if (is_with_generated_always_as(tokens, num_tokens)) {
-            char *expr_raw = hd(tokens[TOK_CST_GEN_VAL]);
-            size_t expr_len = tokens[TOK_CST_GEN_VAL].length;
-            if (expr_len >= 2 && expr_raw[0] == '(' && expr_raw[expr_len - 1] == ')') {
-                expr_raw++;           // move start
-                expr_len -= 2;        // remove both '(' and ')'
-                expr_raw[expr_len] = 0;
-            }
-            struct str adjusted = {.hd=expr_raw, .length=expr_len};
-            struct str arrow_pattern = {.hd = "->", .length = 2};
+/** Free the strings DEF owns that none of #HIDDEN_COLUMNS does. */
+static void column_def_free(struct column_def *def, const struct column_def *hidden) {
+    if (!hidden || hd(def->name) != hd(hidden->name))
+        done(def->name);
+    if (!hidden || hd(def->typename) != hd(hidden->typename))
+        done(def->typename);
+    if (!hidden || hd(def->default_value) != hd(hidden->default_value))
+        done(def->default_value);
+    free(def->generated_always_as);
+}
 
-            size_t npaths = 0;
-            struct str *paths = split(adjusted, arrow_pattern, &npaths);
+void column_defs_free(struct column_def *cols, size_t num_columns) {
+    if (!cols)
+        return;
+    for (size_t i = 0; i < num_columns; i++)
+        column_def_free(&cols[i], i < NUM_HIDDEN_COLUMNS ? &HIDDEN_COLUMNS[i] : NULL);
+    free(cols);
+}
 
-            for (int i = 0; i < npaths; i++) {
-                if (len(paths[i]) > 0 && hd(paths[i])[0] == '\'')
-                    paths[i] = filter(paths[i], isnotsquo);
-            }
+/**
+ * Read the column definition ARG into COLS, after the NUM_COLUMNS of it so far, or
+ * into its hidden column if it names one. A table option is skipped.
+ *
+ * @retval 0 OK
+ * @retval -1 Error, ARG is malformed (`errno` EINVAL) or out of memory, printed to
+ * stderr.
+ */
+static int parse_column_def(const char *arg, struct column_def *cols, size_t *num_columns) {
+    struct lexer lx = lexer_of(arg, strlen(arg));
+    struct token name, tok;
+    if (!lex(&lx, &name)) {
+        if (!lx.bad)
+            return 0;
+        fprintf(stderr, "Bad column definition, %s: %s\n", lx.bad, arg);
+        errno = EINVAL;
+        return -1;
+    }
+    bool more = lex(&lx, &tok);
+    if (more && tok.kind == TOKEN_EQ)
+        return 0; // see parse_table_options()
+
+    const char *why = NULL;
+    struct column_def def = {0};
+    if (name.kind != TOKEN_WORD && name.kind != TOKEN_IDENT) {
+        why = "expected a column name first";
+        goto fail;
+    }
+    def.name = token_text(&name);
+    if (!hd(def.name)) {
+        why = OOM;
+        goto fail;
+    }
+    // unquoted names are folded to lowercase, quoted ones match the row's keys as written
+    if (name.kind == TOKEN_WORD)
+        map(def.name, tolower);
+
+    // the type is every word up to the first constraint, with its (size) if it has one
+    const char *type_start = more ? tok.hd : lx.p, *type_end = type_start;
+    while (more && !lx.bad && tok.kind == TOKEN_WORD && !is_constraint(&tok)) {
+        type_end = tok.hd + tok.length;
+        more = lex(&lx, &tok);
+    }
+    if (more && tok.kind == TOKEN_GROUP && type_end > type_start) {
+        type_end = tok.hd + tok.length;
+        more = lex(&lx, &tok);
+    }
+    if (!type_name(&def, type_start, type_end)) {
+        why = OOM;
+        goto fail;
+    }
 
-            cols[n_columns].generated_always_as = paths;
-            cols[n_columns].generated_always_as_len = npaths;
+    for (; more; more = lex(&lx, &tok)) {
+        if (is_keyword(&tok, "default")) {
+            if (!lex(&lx, &tok) || tok.kind == TOKEN_EQ || tok.kind == TOKEN_ARROW) {
+                why = lx.bad ? lx.bad : "DEFAULT takes a value";
+                goto fail;
+            }
+            done(def.default_value);
+            def.default_value = token_text(&tok);
+            if (!hd(def.default_value)) {
+                why = OOM;
+                goto fail;
+            }
+        } else if (is_keyword(&tok, "generated")) {
+            struct token always, as;
+            if (!lex(&lx, &always) || !is_keyword(&always, "always")
+                || !lex(&lx, &as) || !is_keyword(&as, "as"))
+            {
+                why = lx.bad ? lx.bad : "expected GENERATED ALWAYS AS";
+                goto fail;
+            }
+            tok = as;
+        }
+        if (is_keyword(&tok, "as")) {
+            if (!lex(&lx, &tok) || tok.kind != TOKEN_GROUP) {
+                why = lx.bad ? lx.bad : "GENERATED ALWAYS AS takes a (path)";
+                goto fail;
+            }
+            free(def.generated_always_as);
+            def.generated_always_as = NULL;
+            if (generated_path(&def, &tok, &why) != 0)
+                goto fail;
         }
+        // anything else (NOT NULL, COLLATE NOCASE, ...) only matters to SQLite
+    }
+    if (lx.bad) {
+        why = lx.bad;
+        goto fail;
+    }
 
+    int icol = hidden_column_index(def.name);
+    if (icol < 0) {
+        cols[(*num_columns)++] = def;
+        return 0;
+    }
+    // a hidden column is only declared for its default
+    if (hd(def.default_value)) {
+        if (hd(cols[icol].default_value) != hd(HIDDEN_COLUMNS[icol].default_value))
+            done(cols[icol].default_value);
+        cols[icol].default_value = def.default_value;
+        def.default_value = empty(struct str);
+    }
+    column_def_free(&def, NULL);
+    return 0;
 
-        cols[n_columns].name = tokens[TOK_NAME];
-        cols[n_columns].typename = tokens[TOK_TYPE];
-        n_columns += 1;
+fail:
+    fprintf(stderr, "Bad column definition, %s: %s\n", why, arg);
+    column_def_free(&def, NULL);
+    errno = why == OOM ? ENOMEM : EINVAL;
+    return -1;
+}
 
+struct column_def *parse_column_defs(int argc, const char *const *argv,
+                                     size_t *num_columns)
+{
+    // every argument is a column at most
+    size_t cap = NUM_HIDDEN_COLUMNS + (argc > FETCH_ARGS_OFFSET ? argc - FETCH_ARGS_OFFSET : 0);
+    struct column_def *cols = calloc(cap, sizeof(struct column_def));
+    if (!cols)
+        return enomem(NULL);
+    for (int i = 0; i < NUM_HIDDEN_COLUMNS; i++)
+        cols[i] = HIDDEN_COLUMNS[i];
+
+    size_t n_columns = NUM_HIDDEN_COLUMNS;
+    for (int i = FETCH_ARGS_OFFSET; i < argc; i++) {
+        if (parse_column_def(argv[i], cols, &n_columns) != 0) {
+            int err = errno;
+            column_defs_free(cols, n_columns);
+            errno = err;
+            return NULL;
+        }
     }
 
     if (num_columns)
         *num_columns = n_columns;
-
     return cols;
 }
-
@@ -7,29 +7,88 @@
 
 #include "pyc.h"
 
+struct json_path;
+
 #define ICOL_URL 0
 #define ICOL_HEADERS 1
 #define ICOL_BODY 2
+#define ICOL_METHOD 3
+#define ICOL_TIMEOUT 4
+
+/** The hidden columns always come first, see #HIDDEN_COLUMNS. */
+#define NUM_HIDDEN_COLUMNS 5
 
 #define ICOL_BIT(i)  (1u << (i))
 
 struct column_def {
-    struct str name;
-    struct str typename;
-    struct str default_value;
+    struct str name;            // lowercase unless it was quoted
+    struct str typename;        // as declared, e.g. "varchar(20)", empty for none
+    struct str default_value;   // without its quotes, empty for none
+
+    /** The compiled path of `GENERATED ALWAYS AS (a->'b')`, see path.h, NULL for none. */
+    struct json_path *generated_always_as;
+};
+
+/**
+ * Table-wide `name = value` options in the table declaration, next to the columns.
+ */
+struct table_options {
+    /** `batch = 'array'`: how `body IN (...)` lookups are batched, empty for not at all. */
+    struct str batch;
+
+    /** `batch_size = 20`: lookups per batched request, 0 for the default. */
+    size_t batch_size;
+
+    /** `key = 'id'`: the column that addresses a row for UPDATE and DELETE, empty for none. */
+    struct str key;
+
+    /** `bulk_size = 500`: inserted rows per bulk request, 0 for the default. */
+    size_t bulk_size;
 
-    struct str *generated_always_as;
-    size_t generated_always_as_len;
+    /** `retries = 3`: tries after the first for a read that failed, 0 for none. */
+    size_t retries;
+
+    /** `hedge = 'p95'` or `hedge = 250`: when a slow read is sent again, empty for never. */
+    struct str hedge;
+
+    /** `rate = 10` or `rate = '600/m'`: requests per second or minute to an origin, empty for no limit. */
+    struct str rate;
+
+    /** `burst = 20`: requests that go out at once under a `rate`, 0 for the rate per second. */
+    size_t burst;
+
+    /** `max_in_flight = 4`: requests to an origin at once, 0 for no limit. */
+    size_t max_in_flight;
 };
 
 /**
- * Allocate the #column_def from user ARGC and ARGV, optionally writing out the number
- * resolved columns to NUM_COLUMNS if it isn't NULL.
+ * Free the strings in OPTS.
+ */
+void table_options_free(struct table_options *opts);
+
+/**
+ * Read the #table_options in user ARGC and ARGV into OPTS.
+ *
+ * @retval 0 OK
+ * @retval -1 Error, an unknown option or a bad value, printed to stderr.
+ */
+int parse_table_options(int argc, const char *const *argv, struct table_options *opts);
+
+/**
+ * Allocate the #column_def from user ARGC and ARGV, the hidden columns first,
+ * optionally writing out the number resolved columns to NUM_COLUMNS if it isn't NULL.
+ *
+ * Names can be quoted with `"`, backticks or brackets, and have spaces in them.
+ * Arguments that are table options are skipped, see #parse_table_options().
+ *
+ * @retval NULL Error, a malformed definition printed to stderr (`errno` EINVAL),
+ * or out of memory.
+ * @retval NOT_NULL OK - free it with #column_defs_free().
  */
 struct column_def *parse_column_defs(int argc, const char *const *argv,
                                      size_t *num_columns);
 
 /**
- * @brief 
+ * Free the NUM_COLUMNS COLS from #parse_column_defs(). NULL is ignored.
  */
-char *resolve_hidden_col(struct column_def *column_defs, uint icol, int plan_mask, char *arg_value);
+void column_defs_free(struct column_def *cols, size_t num_columns);
@@ -0,0 +1,205 @@
+#include "sql.h"
+#include "path.h"
+#include <criterion/criterion.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <yyjson.h>
+
+#define ARGC(argv) ((int) (sizeof(argv) / sizeof((argv)[0])))
+
+Test(column_defs, whitespace_and_quotes) {
+    const char *argv[] = {
+        "vttp", "main", "t",
+        "url \t text   default  'https://example.com/a?q=''x'''",
+        "id   INT",
+        "\"given name\" text not null",
+        "price decimal( 10, 2 )",
+        "\n  amount   double\n precision  ",
+    };
+    size_t n = 0;
+    struct column_def *cols = parse_column_defs(ARGC(argv), argv, &n);
+
+    cr_assert_not_null(cols);
+    cr_assert_eq(n, NUM_HIDDEN_COLUMNS + 4);
+    cr_assert_str_eq(hd(cols[ICOL_URL].default_value), "https://example.com/a?q='x'");
+    cr_assert_str_eq(hd(cols[NUM_HIDDEN_COLUMNS].name), "id");
+    cr_assert_str_eq(hd(cols[NUM_HIDDEN_COLUMNS].typename), "INT");
+    cr_assert_str_eq(hd(cols[NUM_HIDDEN_COLUMNS + 1].name), "given name", "quotes keep the spaces");
+    cr_assert_str_eq(hd(cols[NUM_HIDDEN_COLUMNS + 1].typename), "text", "constraints aren't the type");
+    cr_assert_str_eq(hd(cols[NUM_HIDDEN_COLUMNS + 2].typename), "decimal( 10, 2 )");
+    cr_assert_str_eq(hd(cols[NUM_HIDDEN_COLUMNS + 3].typename), "double precision");
+    column_defs_free(cols, n);
+}
+
+Test(column_defs, generated_path) {
+    const char *argv[] = {
+        "vttp", "main", "t",
+        "version text generated always as (meta -> 'versionId')",
+        "family text as (\"name\"->0->>'family')",
+    };
+    size_t n = 0;
+    struct column_def *cols = parse_column_defs(ARGC(argv), argv, &n);
+
+    cr_assert_not_null(cols);
+    const struct column_def *version = &cols[NUM_HIDDEN_COLUMNS];
+    const struct json_path *path = version->generated_always_as;
+    cr_assert_eq(path->len, 2);
+    cr_assert_str_eq(hd(path->steps[0].key), "meta");
+    cr_assert_str_eq(hd(path->steps[1].key), "versionId");
+
+    path = cols[NUM_HIDDEN_COLUMNS + 1].generated_always_as;
+    cr_assert_eq(path->len, 3);
+    cr_assert_eq(path->steps[1].op, PATH_INDEX);
+    cr_assert_eq(path->steps[1].index, 0);
+    cr_assert_eq(len(path->steps[2].key), 6);
+    column_defs_free(cols, n);
+}
+
+Test(column_defs, generated_filter) {
+    const char *argv[] = {
+        "vttp", "main", "t",
+        "loinc text as (code->'coding'[?( @.system == 'http://loinc.org' )]->'code')",
+        "last text as (note->-1[?(@['author'][0].id != 2.5)])",
+        "any text as (component[?(@.value)])",
+    };
+    size_t n = 0;
+    struct column_def *cols = parse_column_defs(ARGC(argv), argv, &n);
+
+    cr_assert_not_null(cols);
+    const struct json_path *path = cols[NUM_HIDDEN_COLUMNS].generated_always_as;
+    cr_assert_eq(path->len, 5);
+    cr_assert_eq(path->steps[2].op, PATH_FIRST);
+    cr_assert_eq(path->steps[2].num_steps, 1);
+    cr_assert_eq(path->steps[2].cmp, PATH_EQ);
+    cr_assert_str_eq(hd(path->steps[2].str), "http://loinc.org");
+    cr_assert_str_eq(hd(path->steps[3].key), "system");
+    cr_assert_str_eq(hd(path->steps[4].key), "code");
+
+    path = cols[NUM_HIDDEN_COLUMNS + 1].generated_always_as;
+    cr_assert_eq(path->len, 6);
+    cr_assert_eq(path->steps[1].index, -1);
+    cr_assert_eq(path->steps[2].num_steps, 3);
+    cr_assert_eq(path->steps[2].cmp, PATH_NE);
+    cr_assert_eq(path->steps[2].type, PATH_NUM);
+    cr_assert_eq(path->steps[4].op, PATH_INDEX);
+
+    path = cols[NUM_HIDDEN_COLUMNS + 2].generated_always_as;
+    cr_assert_eq(path->steps[1].cmp, PATH_EXISTS);
+    column_defs_free(cols, n);
+}
+
+static const char ROW[] =
+    "{\"name\": \"Ada\","
+    " \"note\": [{\"text\": \"first\"}, {\"text\": \"last\"}],"
+    " \"code\": {\"coding\": ["
+    "  {\"system\": \"http://snomed.info/sct\", \"code\": \"1\"},"
+    "  {\"system\": \"http://loinc.org\", \"code\": \"2\"},"
+    "  {\"system\": \"http://loinc.org\", \"code\": \"3\", \"display\": \"x\"}"
+    " ]}}";
+
+Test(path_eval, on_a_row) {
+    const char *argv[] = {
+        "vttp", "main", "t",
+        "last text as (note->-1->'text')",
+        "loinc text as (code->'coding'[?(@.system == 'http://loinc.org')]->'code')",
+        "shown text as (code->'coding'[?(@.display != 'y')]->'code')",
+        "hidden text as (code->'coding'[?(@.display != 'x')])",
+        "not_an_object text as (name->'first')",
+        "past_the_end text as (note->2)",
+        "before_the_start text as (note->-3)",
+    };
+    size_t n = 0;
+    struct column_def *cols = parse_column_defs(ARGC(argv), argv, &n);
+    yyjson_doc *doc = yyjson_read(ROW, sizeof(ROW) - 1, 0);
+    yyjson_val *row = yyjson_doc_get_root(doc);
+    cr_assert_not_null(cols);
+    cr_assert_not_null(doc);
+
+    const struct column_def *col = &cols[NUM_HIDDEN_COLUMNS];
+    cr_assert_str_eq(yyjson_get_str(path_eval(col[0].generated_always_as, row)), "last");
+    cr_assert_str_eq(yyjson_get_str(path_eval(col[1].generated_always_as, row)), "2",
+                     "the first match");
+    cr_assert_str_eq(yyjson_get_str(path_eval(col[2].generated_always_as, row)), "3",
+                     "a missing member isn't unequal to anything");
+    cr_assert_null(path_eval(col[3].generated_always_as, row), "nor is it equal");
+    cr_assert_null(path_eval(col[4].generated_always_as, row));
+    cr_assert_null(path_eval(col[5].generated_always_as, row));
+    cr_assert_null(path_eval(col[6].generated_always_as, row));
+
+    yyjson_doc_free(doc);
+    column_defs_free(cols, n);
+}
+
+Test(column_defs, no_column_limit) {
+    enum { COLUMNS = 150 };
+    const char *argv[3 + COLUMNS] = { "vttp", "main", "t" };
+    char names[COLUMNS][16];
+    for (int i = 0; i < COLUMNS; i++) {
+        snprintf(names[i], sizeof(names[i]), "c%d int", i);
+        argv[3 + i] = names[i];
+    }
+    size_t n = 0;
+    struct column_def *cols = parse_column_defs(ARGC(argv), argv, &n);
+
+    cr_assert_not_null(cols);
+    cr_assert_eq(n, NUM_HIDDEN_COLUMNS + COLUMNS);
+    cr_assert_str_eq(hd(cols[n - 1].name), "c149");
+    column_defs_free(cols, n);
+}
+
+Test(column_defs, malformed) {
+    const char *const bad[] = {
+        "\"name text",
+        "name text default",
+        "name text default (1",
+        "name text generated always as (a b)",
+        "name text generated always as (a->)",
+        "name text generated always as (a[?(@.b == )])",
+        "name text generated always as (a[?(@.b = 'x')])",
+        "name text generated always as (a[?(b == 1)])",
+        "name text generated always as (a[?(@.b == 'x')",
+    };
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        const char *argv[] = { "vttp", "main", "t", bad[i] };
+        errno = 0;
+        cr_assert_null(parse_column_defs(ARGC(argv), argv, NULL), "%s", bad[i]);
+        cr_assert_eq(errno, EINVAL, "%s", bad[i]);
+    }
+}
+
+Test(table_options, skipped_by_columns) {
+    const char *argv[] = {
+        "vttp", "main", "t",
+        "RATE='600/m'",
+        "id int default 'a = b'",
+        "batch_size =  20",
+    };
+    struct table_options opts = {0};
+    size_t n = 0;
+
+    cr_assert_eq(parse_table_options(ARGC(argv), argv, &opts), 0);
+    cr_assert_str_eq(hd(opts.rate), "600/m");
+    cr_assert_eq(opts.batch_size, 20);
+    struct column_def *cols = parse_column_defs(ARGC(argv), argv, &n);
+    cr_assert_eq(n, NUM_HIDDEN_COLUMNS + 1);
+    column_defs_free(cols, n);
+    table_options_free(&opts);
+}
+
+Test(table_options, zero_and_missing) {
+    const char *zero[] = { "vttp", "main", "t", "retries = 0", "max_in_flight=0" };
+    struct table_options opts = { .retries = 3 };
+    cr_assert_eq(parse_table_options(ARGC(zero), zero, &opts), 0);
+    cr_assert_eq(opts.retries, 0, "0 turns retries off");
+    table_options_free(&opts);
+
+    const char *const bad[] = { "retries =", "bulk_size = 0", "retries = ''", "burst = -1" };
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        const char *argv[] = { "vttp", "main", "t", bad[i] };
+        cr_assert_eq(parse_table_options(ARGC(argv), argv, &opts), -1, "%s", bad[i]);
+        table_options_free(&opts);
+    }
+}
+
+#undef ARGC
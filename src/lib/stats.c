@@ -0,0 +1,301 @@
+#include "stats.h"
+#include "debug.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+const char *const STAT_COUNTER_NAMES[NUM_STAT_COUNTERS] = {
+    [STAT_FETCHES] = "fetches",
+    [STAT_FETCH_ERRORS] = "fetch_errors",
+    [STAT_TIMEOUTS] = "timeouts",
+    [STAT_RETRIES] = "retries",
+    [STAT_HEDGES] = "hedges",
+    [STAT_HEDGE_WINS] = "hedge_wins",
+    [STAT_POOL_HITS] = "pool_hits",
+    [STAT_POOL_MISSES] = "pool_misses",
+    [STAT_DNS_HITS] = "dns_hits",
+    [STAT_DNS_MISSES] = "dns_misses",
+    [STAT_BODY_BYTES] = "body_bytes",
+    [STAT_ROWS] = "rows",
+};
+
+const char *const STAT_TIMER_NAMES[NUM_STAT_TIMERS] = {
+    [STAT_DNS_MS] = "dns_ms",
+    [STAT_CONNECT_MS] = "connect_ms",
+    [STAT_TLS_MS] = "tls_ms",
+    [STAT_TTFB_MS] = "ttfb_ms",
+    [STAT_TRANSFER_MS] = "transfer_ms",
+    [STAT_PARSE_US] = "parse_us",
+    [STAT_THROTTLE_MS] = "throttle_ms",
+};
+
+const char *const STAT_PEAK_NAMES[NUM_STAT_PEAKS] = {
+    [STAT_ROW_BACKLOG] = "row_backlog_bytes",
+    [STAT_PIPELINE_DEPTH] = "pipeline_depth",
+    [STAT_H2_STREAMS] = "h2_streams",
+};
+
+/** One thread's stats for one origin, linked into #live until the thread exits. */
+struct block {
+    struct stats stats;
+    char *origin;           // NULL for what the thread recorded before naming one
+    size_t origin_len;
+    struct block *prev;
+    struct block *next;
+    struct block *sibling;  // the thread's block before this one
+};
+
+static pthread_mutex_t blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct block *live;
+static struct block *retired;   // what exited threads left behind, one block per origin
+
+static pthread_key_t block_key;
+static pthread_once_t block_once = PTHREAD_ONCE_INIT;
+static __thread struct block *mine;     // the block the thread counts into
+static __thread struct block *owned;    // every block of the thread's, through SIBLING
+
+/*
+ * Only the owning thread writes a block, so an add doesn't need to be atomic, just
+ * untorn for the reader summing it from another thread.
+ */
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+
+/** Add every stat of FROM to INTO. */
+static void merge(struct stats *into, const struct stats *from) {
+    for (int i = 0; i < NUM_STAT_COUNTERS; i++)
+        into->counters[i] += LOAD(from->counters[i]);
+
+    for (int i = 0; i < NUM_STAT_TIMERS; i++) {
+        struct stat_histogram *h = &into->timers[i];
+        const struct stat_histogram *f = &from->timers[i];
+        h->count += LOAD(f->count);
+        h->sum += LOAD(f->sum);
+        long long max = LOAD(f->max);
+        if (max > h->max)
+            h->max = max;
+        for (int b = 0; b < STATS_BUCKETS; b++)
+            h->buckets[b] += LOAD(f->buckets[b]);
+    }
+
+    for (int i = 0; i < NUM_STAT_PEAKS; i++) {
+        long long peak = LOAD(from->peaks[i]);
+        if (peak > into->peaks[i])
+            into->peaks[i] = peak;
+    }
+}
+
+/** Is B the block for the origin LEN bytes long at ORIGIN, NULL for none? */
+static bool block_is(const struct block *b, const char *origin, size_t len) {
+    if (!b->origin || !origin)
+        return !b->origin && !origin;
+    return b->origin_len == len && memcmp(b->origin, origin, len) == 0;
+}
+
+/** The exiting thread's blocks, starting with the newest ARG, go into #retired. */
+static void block_retire(void *arg) {
+    pthread_mutex_lock(&blocks_lock);
+    for (struct block *b = arg, *sibling; b; b = sibling) {
+        sibling = b->sibling;
+        if (b->prev)
+            b->prev->next = b->next;
+        else
+            live = b->next;
+        if (b->next)
+            b->next->prev = b->prev;
+
+        struct block *into = retired;
+        while (into && !block_is(into, b->origin, b->origin_len))
+            into = into->next;
+        if (into) {
+            merge(&into->stats, &b->stats);
+            free(b->origin);
+            free(b);
+        } else {
+            b->next = retired;
+            retired = b;
+        }
+    }
+    pthread_mutex_unlock(&blocks_lock);
+}
+
+static void block_key_init(void) {
+    pthread_key_create(&block_key, block_retire);
+}
+
+/** A new block of the calling thread's for the origin LEN bytes long at ORIGIN. */
+static struct block *block_new(const char *origin, size_t len) {
+    pthread_once(&block_once, block_key_init);
+    struct block *b = calloc(1, sizeof(struct block));
+    if (!b)
+        return enomem(NULL);
+    if (origin && !(b->origin = strndup(origin, len))) {
+        free(b);
+        return enomem(NULL);
+    }
+    b->origin_len = len;
+
+    pthread_mutex_lock(&blocks_lock);
+    b->next = live;
+    if (live)
+        live->prev = b;
+    live = b;
+    pthread_mutex_unlock(&blocks_lock);
+
+    b->sibling = owned;
+    owned = b;
+    pthread_setspecific(block_key, b);
+    return b;
+}
+
+/** The calling thread's stats, NULL if there's no memory for them. */
+static struct stats *own(void) {
+    if (!mine)
+        mine = block_new(NULL, 0);
+    return mine ? &mine->stats : NULL;
+}
+
+void stats_origin(const char *url) {
+    // everything up to the path, "protocol//host"
+    const char *host = strstr(url, "//");
+    size_t len = host ? (size_t) (host + 2 - url) + strcspn(host + 2, "/?#") : strlen(url);
+    if (mine && block_is(mine, url, len))
+        return;
+
+    struct block *b = owned;
+    while (b && !block_is(b, url, len))
+        b = b->sibling;
+    if (b || (b = block_new(url, len)))
+        mine = b;
+}
+
+void stats_add(enum stat_counter counter, long long n) {
+    struct stats *s = own();
+    if (s)
+        STORE(s->counters[counter], s->counters[counter] + n);
+}
+
+/** The histogram bucket of VALUE. */
+static int bucket(long long value) {
+    if (value <= 0)
+        return 0;
+    int b = 64 - __builtin_clzll(value);
+    return b < STATS_BUCKETS ? b : STATS_BUCKETS - 1;
+}
+
+void stats_time(enum stat_timer timer, long long value) {
+    struct stats *s = own();
+    if (!s)
+        return;
+
+    struct stat_histogram *h = &s->timers[timer];
+    STORE(h->count, h->count + 1);
+    STORE(h->sum, h->sum + value);
+    if (value > h->max)
+        STORE(h->max, value);
+    int b = bucket(value);
+    STORE(h->buckets[b], h->buckets[b] + 1);
+}
+
+void stats_peak(enum stat_peak peak, long long value) {
+    struct stats *s = own();
+    if (s && value > s->peaks[peak])
+        STORE(s->peaks[peak], value);
+}
+
+long long stats_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void stats_read(struct stats *out) {
+    *out = (struct stats) {0};
+    pthread_mutex_lock(&blocks_lock);
+    for (struct block *b = retired; b; b = b->next)
+        merge(out, &b->stats);
+    for (struct block *b = live; b; b = b->next)
+        merge(out, &b->stats);
+    pthread_mutex_unlock(&blocks_lock);
+}
+
+/**
+ * Add B's stats to the entry for its origin among the N in ALL, which holds CAP,
+ * adding the entry if it's new.
+ *
+ * @retval false Out of memory.
+ */
+static bool merge_origin(struct origin_stats **all, size_t *n, size_t *cap,
+                         const struct block *b)
+{
+    size_t i = 0;
+    while (i < *n && strcmp((*all)[i].origin, b->origin) != 0)
+        i++;
+    if (i == *n) {
+        if (*n == *cap) {
+            size_t grown = *cap ? *cap * 2 : 8;
+            struct origin_stats *more = realloc(*all, grown * sizeof(struct origin_stats));
+            if (!more)
+                return false;
+            *all = more;
+            *cap = grown;
+        }
+        (*all)[i] = (struct origin_stats) { .origin = strdup(b->origin) };
+        if (!(*all)[i].origin)
+            return false;
+        (*n)++;
+    }
+    merge(&(*all)[i].stats, &b->stats);
+    return true;
+}
+
+ssize_t stats_read_origins(struct origin_stats **out) {
+    struct origin_stats *all = NULL;
+    size_t n = 0, cap = 0;
+    bool ok = true;
+
+    pthread_mutex_lock(&blocks_lock);
+    for (struct block *b = retired; ok && b; b = b->next)
+        ok = !b->origin || merge_origin(&all, &n, &cap, b);
+    for (struct block *b = live; ok && b; b = b->next)
+        ok = !b->origin || merge_origin(&all, &n, &cap, b);
+    pthread_mutex_unlock(&blocks_lock);
+
+    if (!ok) {
+        stats_origins_free(all, n);
+        return enomem(-1);
+    }
+    *out = all;
+    return n;
+}
+
+void stats_origins_free(struct origin_stats *origins, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        free(origins[i].origin);
+    free(origins);
+}
+
+long long stats_percentile(const struct stat_histogram *h, double p) {
+    if (h->count == 0)
+        return 0;
+
+    long long rank = (long long) (p * h->count + 0.5);
+    if (rank < 1)
+        rank = 1;
+    long long seen = 0;
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= rank) {
+            // the top of the bucket, but never past the biggest value seen
+            long long top = b == 0 ? 0 : (1LL << b) - 1;
+            return top < h->max ? top : h->max;
+        }
+    }
+    return h->max;
+}
+
+#undef LOAD
+#undef STORE
@@ -0,0 +1,143 @@
+/**
+ * @file stats.h
+ * @brief Counters, latency histograms and high-water marks of every fetch, read
+ * back by the `vttp_stats` table.
+ *
+ * Each thread counts into a block of its own for the origin it's working on, so
+ * recording is a plain add with no lock and no cache line shared with another
+ * thread. #stats_read() sums every live block with whatever the threads that
+ * already exited left behind, #stats_read_origins() does the same per origin.
+ */
+#pragma once
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * @brief Things that are counted.
+ */
+enum stat_counter {
+    STAT_FETCHES,           // requests started with #fetch()
+    STAT_FETCH_ERRORS,      // requests that couldn't connect or send
+    STAT_TIMEOUTS,          // requests cut short by one of their #fetch_timeouts
+    STAT_RETRIES,           // requests tried again after a broken connection or a transient error status
+    STAT_HEDGES,            // copies of a slow request sent over a second connection
+    STAT_HEDGE_WINS,        // copies that answered before the request they copied
+    STAT_POOL_HITS,         // requests that shared an open HTTP/2 or pipelined connection
+    STAT_POOL_MISSES,       // requests that opened a connection of their own
+    STAT_DNS_HITS,          // lookups answered by the DNS cache
+    STAT_DNS_MISSES,        // lookups that went out to a resolver
+    STAT_BODY_BYTES,        // response body bytes, before decompression
+    STAT_ROWS,              // rows parsed out of response bodies
+    NUM_STAT_COUNTERS
+};
+
+/**
+ * @brief Things that are timed, each into a histogram.
+ */
+enum stat_timer {
+    STAT_DNS_MS,            // resolving a hostname that wasn't cached
+    STAT_CONNECT_MS,        // TCP connect, every address family raced
+    STAT_TLS_MS,            // TLS handshake
+    STAT_TTFB_MS,           // from #fetch() to the response headers
+    STAT_TRANSFER_MS,       // from the response headers to the end of the body
+    STAT_PARSE_US,          // parsing one write of a body into rows
+    STAT_THROTTLE_MS,       // a request held back by its origin's limits, see limit.h
+    NUM_STAT_TIMERS
+};
+
+/**
+ * @brief Things whose highest value is kept.
+ */
+enum stat_peak {
+    STAT_ROW_BACKLOG,       // bytes of parsed rows waiting on the reader
+    STAT_PIPELINE_DEPTH,    // requests in flight on one pipelined HTTP/1.1 connection
+    STAT_H2_STREAMS,        // requests in flight on one HTTP/2 connection
+    NUM_STAT_PEAKS
+};
+
+/**
+ * @brief Histogram buckets: bucket 0 holds 0, bucket I holds `[2^(I-1), 2^I)`.
+ */
+#define STATS_BUCKETS 32
+
+struct stat_histogram {
+    long long count;
+    long long sum;
+    long long max;
+    long long buckets[STATS_BUCKETS];
+};
+
+/**
+ * @brief Every stat at once, as #stats_read() adds them up.
+ */
+struct stats {
+    long long counters[NUM_STAT_COUNTERS];
+    struct stat_histogram timers[NUM_STAT_TIMERS];
+    long long peaks[NUM_STAT_PEAKS];
+};
+
+/**
+ * @brief One origin's stats, as #stats_read_origins() adds them up.
+ */
+struct origin_stats {
+    char *origin;           // "protocol//host" of the URLs fetched, e.g. "https://example.com:8443"
+    struct stats stats;
+};
+
+/** @brief Names of the stats, as the `vttp_stats` table shows them. */
+extern const char *const STAT_COUNTER_NAMES[NUM_STAT_COUNTERS];
+extern const char *const STAT_TIMER_NAMES[NUM_STAT_TIMERS];
+extern const char *const STAT_PEAK_NAMES[NUM_STAT_PEAKS];
+
+/**
+ * @brief Count what the calling thread records from here on toward the origin of URL
+ * too. Call it with a fetch's URL whenever a thread starts working on one, it's a
+ * string compare if the origin didn't change.
+ */
+void stats_origin(const char *url);
+
+/**
+ * @brief Add N to COUNTER.
+ */
+void stats_add(enum stat_counter counter, long long n);
+
+/**
+ * @brief Record VALUE (milliseconds or microseconds, see its name) into TIMER.
+ */
+void stats_time(enum stat_timer timer, long long value);
+
+/**
+ * @brief Raise PEAK to VALUE if it's the highest seen yet.
+ */
+void stats_peak(enum stat_peak peak, long long value);
+
+/**
+ * @brief Microseconds on the monotonic clock, to time things with.
+ */
+long long stats_now_us(void);
+
+/**
+ * @brief Add up every thread's stats since the process started into OUT.
+ */
+void stats_read(struct stats *out);
+
+/**
+ * @brief Add up every thread's stats since the process started per origin, into a
+ * heap array written out to OUT. What a thread recorded before it named an origin
+ * with #stats_origin() is only in the totals of #stats_read().
+ *
+ * @return The number of origins in OUT, free it with #stats_origins_free().
+ * @retval -1 Error, out of memory.
+ */
+ssize_t stats_read_origins(struct origin_stats **out);
+
+/**
+ * @brief Free the N ORIGINS #stats_read_origins() wrote out.
+ */
+void stats_origins_free(struct origin_stats *origins, size_t n);
+
+/**
+ * @brief The value at fraction P (0.5 for the median) of histogram H, rounded up to
+ * the top of its bucket, so within a factor of 2. 0 if H is empty.
+ */
+long long stats_percentile(const struct stat_histogram *h, double p);
@@ -1,12 +1,24 @@
 #include "tcp.h"
+#include "stats.h"
 
 #include <asm-generic/errno-base.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <openssl/err.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+/** RFC 8305 "Connection Attempt Delay" between starting candidates. */
+#define TCP_ATTEMPT_DELAY_MS 250
+
+/** Most addresses we'll race for a single host. */
+#define TCP_MAX_CANDIDATES 16
+
 static void err_print() {
     unsigned long err = ERR_get_error();
     if (err != 0) {
@@ -16,23 +28,172 @@ static void err_print() {
     }
 }
 
-static int tls_connect(int sockfd, SSL **ssl,
-                       SSL_CTX **ctx, const char *hostname);
+static int tls_connect(int sockfd, SSL **ssl, SSL_CTX **ctx,
+                       const char *hostname, bool h2, long long deadline);
+
+static long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int until(long long deadline) {
+    long long left = deadline - now_ms();
+    return left < 0 ? 0 : (int) left;
+}
+
+/**
+ * Write ADDRINFO's candidates into ORDER alternating address families, keeping
+ * the order within each family. Returns how many were written.
+ */
+static size_t interleave(struct addrinfo *addrinfo, struct addrinfo **order) {
+    struct addrinfo *first[TCP_MAX_CANDIDATES], *second[TCP_MAX_CANDIDATES];
+    size_t nfirst = 0, nsecond = 0;
+    int family = addrinfo ? addrinfo->ai_family : AF_UNSPEC;
+
+    for (struct addrinfo *ai = addrinfo; ai; ai = ai->ai_next) {
+        if (ai->ai_family == family && nfirst < TCP_MAX_CANDIDATES)
+            first[nfirst++] = ai;
+        else if (ai->ai_family != family && nsecond < TCP_MAX_CANDIDATES)
+            second[nsecond++] = ai;
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; n < TCP_MAX_CANDIDATES && (i < nfirst || i < nsecond); i++) {
+        if (i < nfirst)
+            order[n++] = first[i];
+        if (i < nsecond && n < TCP_MAX_CANDIDATES)
+            order[n++] = second[i];
+    }
+    return n;
+}
+
+/**
+ * Start a nonblocking connect() to AI. Sets *DONE when it connected right away.
+ * Returns -1 if it failed right away.
+ */
+static int connect_start(struct addrinfo *ai, bool *done) {
+    int fd = tcp_socket(ai);
+    if (fd < 0)
+        return -1;
+
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    *done = connect(fd, ai->ai_addr, ai->ai_addrlen) == 0;
+    if (!*done && errno != EINPROGRESS) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+/** Race ADDRINFO's candidates, returning the first connected socket. */
+static int connect_any(struct addrinfo *addrinfo, long long deadline) {
+    struct addrinfo *order[TCP_MAX_CANDIDATES];
+    size_t n = interleave(addrinfo, order);
+
+    struct pollfd attempts[TCP_MAX_CANDIDATES];
+    size_t started = 0, live = 0;
+    long long next_start = now_ms();
+    int winner = -1;
+    int err = n == 0 ? EADDRNOTAVAIL : ECONNREFUSED;
+
+    while (winner < 0) {
+        long long now = now_ms();
+        if (now >= deadline) {
+            err = ETIMEDOUT;
+            break;
+        }
+
+        if (started < n && (live == 0 || now >= next_start)) {
+            bool done = false;
+            int fd = connect_start(order[started++], &done);
+            if (fd < 0) {
+                err = errno;
+                continue;
+            }
+            if (done) {
+                winner = fd;
+                break;
+            }
+            attempts[live++] = (struct pollfd) { .fd = fd, .events = POLLOUT };
+            next_start = now + TCP_ATTEMPT_DELAY_MS;
+            continue;
+        }
 
-int tcp_connect(int fd, struct sockaddr *addr, socklen_t len,
-                 SSL **ssl, SSL_CTX **ctx, const char *hostname)
+        if (live == 0)
+            break; // every candidate failed
+
+        long long wake = started < n && next_start < deadline ? next_start : deadline;
+        int rc = poll(attempts, live, until(wake));
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            err = errno;
+            break;
+        }
+
+        for (size_t i = 0; i < live && winner < 0; i++) {
+            if (!attempts[i].revents)
+                continue;
+
+            int so_error = 0;
+            socklen_t len = sizeof(so_error);
+            if (getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &so_error, &len) < 0)
+                so_error = errno;
+            if (so_error == 0) {
+                winner = attempts[i].fd;
+                attempts[i] = attempts[--live];
+                break;
+            }
+
+            // this one's out, so don't make the next candidate wait
+            err = so_error;
+            close(attempts[i].fd);
+            attempts[i--] = attempts[--live];
+            next_start = now_ms();
+        }
+    }
+
+    for (size_t i = 0; i < live; i++)
+        close(attempts[i].fd);
+    if (winner < 0)
+        errno = err;
+    return winner;
+}
+
+int tcp_connect(struct addrinfo *addrinfo, SSL **ssl, SSL_CTX **ctx,
+                const char *hostname, bool h2, int timeout_ms)
 {
-    if (connect(fd, addr, len) < 0) {
+    long long started = now_ms();
+    long long deadline = started + timeout_ms;
+
+    int fd = connect_any(addrinfo, deadline);
+    if (fd < 0) {
+        int err = errno;
         perror("connect()");
+        errno = err;
         return -1;
     }
+    long long connected = now_ms();
+    stats_time(STAT_CONNECT_MS, connected - started);
     if (ssl != NULL && ctx != NULL && hostname != NULL) {
-        if (tls_connect(fd, ssl, ctx, hostname) < 0) {
+        if (tls_connect(fd, ssl, ctx, hostname, h2, deadline) < 0) {
+            int err = errno;
             perror("tls_connect()");
+            close(fd);
+            errno = err;
             return -1;
-        } // else { ok! }
+        }
+        stats_time(STAT_TLS_MS, now_ms() - connected);
     }
-    return 0;
+    return fd;
 }
 
 ssize_t tcp_send(int fd, const char *bytes, size_t len, SSL *ssl) {
@@ -84,8 +245,9 @@ int tcp_getaddrinfo(const char *hostname, const char *port,
         return EINVAL;
     }
     struct addrinfo hints = {
-        .ai_family=AF_INET,
-        .ai_socktype=SOCK_STREAM
+        .ai_family=AF_UNSPEC,
+        .ai_socktype=SOCK_STREAM,
+        .ai_flags=AI_ADDRCONFIG
     };
     int rc = getaddrinfo(hostname, port, &hints, addr);
     if (rc != 0) {
@@ -108,8 +270,14 @@ int tcp_socket(struct addrinfo *addrinfo) {
     return sockfd;
 }
 
-static int tls_connect(int sockfd, SSL **ssl,
-                       SSL_CTX **ctx, const char *hostname)
+/** Is #TCP_KTLS_ENV set to anything but 0? */
+static bool ktls_wanted(void) {
+    const char *env = getenv(TCP_KTLS_ENV);
+    return env && *env && strcmp(env, "0") != 0;
+}
+
+static int tls_connect(int sockfd, SSL **ssl, SSL_CTX **ctx,
+                       const char *hostname, bool h2, long long deadline)
 {
     SSL_load_error_strings();
     OpenSSL_add_ssl_algorithms();
@@ -124,6 +292,9 @@ static int tls_connect(int sockfd, SSL **ssl,
         return -1;
     }
 
+    if (ktls_wanted())
+        SSL_CTX_set_options(*ctx, SSL_OP_ENABLE_KTLS);
+
     *ssl = SSL_new(*ctx);
     if (!*ssl) {
         err_print();
@@ -131,14 +302,56 @@ static int tls_connect(int sockfd, SSL **ssl,
         return -1;
     }
 
+    // offer HTTP/2 first if we may, the server picks
+    static const unsigned char alpn[] = "\x02h2\x08http/1.1";
+    const unsigned char *protos = h2 ? alpn : alpn + 3;
+    if (SSL_set_alpn_protos(*ssl, protos, sizeof(alpn) - 1 - (protos - alpn)) != 0) {
+        err_print();
+    }
+
     SSL_set_fd(*ssl, sockfd);
     SSL_set_tlsext_host_name(*ssl, hostname);
-    int rc = SSL_connect(*ssl);
+
+    // the socket is nonblocking, so wait out the handshake ourselves
+    int rc;
+    while ((rc = SSL_connect(*ssl)) <= 0) {
+        int err = SSL_get_error(*ssl, rc);
+        if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE)
+            break;
+
+        struct pollfd pfd = {
+            .fd = sockfd,
+            .events = err == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT
+        };
+        int ready = poll(&pfd, 1, until(deadline));
+        if (ready == 0) {
+            errno = ETIMEDOUT;
+            break;
+        }
+        if (ready < 0 && errno != EINTR)
+            break;
+    }
 
     if (rc <= 0) {
         err_print();
         SSL_free(*ssl);
         SSL_CTX_free(*ctx);
+        *ssl = NULL;
+        *ctx = NULL;
+        return -1;
     }
     return 0;
 }
+
+bool tcp_is_h2(SSL *ssl) {
+    if (!ssl)
+        return false;
+
+    const unsigned char *proto = NULL;
+    unsigned int proto_len = 0;
+    SSL_get0_alpn_selected(ssl, &proto, &proto_len);
+    return proto_len == 2 && memcmp(proto, "h2", 2) == 0;
+}
+
+#undef TCP_MAX_CANDIDATES
+#undef TCP_ATTEMPT_DELAY_MS
@@ -10,6 +10,16 @@
 
 #define MAX_HOSTNAME_LENGTH 255
 
+/**
+ * @brief Environment variable that turns on kernel TLS offload, e.g. `VTTP_KTLS=1`.
+ *
+ * Once the handshake is done, the kernel decrypts (and encrypts) the records itself
+ * and `SSL_read()` comes down to a `recvmsg()`. OpenSSL only hands a connection over
+ * when its build has kTLS, the kernel has the `tls` module loaded, and it supports
+ * the negotiated protocol version and cipher. Otherwise TLS stays in user space.
+ */
+#define TCP_KTLS_ENV "VTTP_KTLS"
+
 /**
  * @brief Write address info from HOSTNAME and PORT into ADDR.
  *
@@ -28,15 +38,20 @@ int tcp_getaddrinfo(const char *hostname, const char *port, struct addrinfo **ad
 int tcp_socket(struct addrinfo *addrinfo);
 
 /**
- * @brief \c connect() to socket FD using ADDR, optionally using TLS
- * if TLS is not NULL.
+ * @brief Connect to the first address in ADDRINFO that answers, racing IPv6
+ * and IPv4 candidates Happy Eyeballs style (RFC 8305), then handshake TLS
+ * over it if SSL and CTX aren't NULL, offering HTTP/2 over ALPN only if H2.
+ *
+ * Candidates alternate between address families in the order `getaddrinfo()`
+ * sorted them. A new attempt starts whenever the last one has had 250ms
+ * without connecting, or as soon as it fails, so a dead address family only
+ * costs one delay. Everything has to be done within TIMEOUT_MS.
  *
- * @retval 0 OK
- * @retval -1 Error connecting to socket
- * @retval -2 Error with TLS connection
+ * @retval -1 Error, check `errno` (ETIMEDOUT when TIMEOUT_MS ran out).
+ * @retval NONNEGATIVE OK, a connected *nonblocking* socket file descriptor.
  */
-int tcp_connect(int fd, struct sockaddr * addr, socklen_t len,
-                 SSL **ssl, SSL_CTX **ctx, const char *hostname);
+int tcp_connect(struct addrinfo *addrinfo, SSL **ssl, SSL_CTX **ctx,
+                const char *hostname, bool h2, int timeout_ms);
 
 /**
  * @brief Send LEN BYTES over tcp connection at FD, potentially writing
@@ -59,6 +74,13 @@ ssize_t tcp_send(int fd, const char *bytes, size_t len, SSL *ssl);
  */
 ssize_t tcp_recv(int fd, char *bytes, size_t len, SSL *ssl);
 
+/**
+ * @brief Did the TLS connection at SSL negotiate HTTP/2 ("h2") over ALPN?
+ *
+ * Always false for a NULL SSL, since we never speak cleartext HTTP/2.
+ */
+bool tcp_is_h2(SSL *ssl);
+
 /**
  * @brief Shutdown and free SSL and CTX.
  *
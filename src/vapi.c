@@ -1,57 +1,485 @@
+#include "vapi.h"
 #include "lib/cookie.h"
+#include "lib/debug.h"
 #include "lib/fetch.h"
+#include "lib/h1.h"
+#include "lib/h2.h"
+#include "lib/limit.h"
+#include "lib/pyc.h"
+#include "lib/stats.h"
 
 #include <asm-generic/errno-base.h>
+#include <errno.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
+#include <yyjson.h>
 
-FILE *fetch(const char *url, const char *init[4], FILE *response_cookie) {
-    int fds[4] = {0};
-    struct dispatch *dispatch = fetch_socket(url, init);
-    if (!dispatch)
-        return NULL;
-    char *hostname = strdup(dispatch->url.hostname.hd);
-    int rc = use_fetch(fds, dispatch);
-    if (rc != 0) {
-        perror("use_fetch()");
+static void fetch_spawn(struct fetch_state *fs);
+
+/**
+ * Fetch FS again, behind an open pipeline to its origin if there is one. One that's
+ * tried again after a failure waits out its backoff on a worker first.
+ */
+static void fetch_requeue(struct fetch_state *fs) {
+    if (!fs->retry_at_us && h1_fetch(fs))
+        stats_add(STAT_POOL_HITS, 1);
+    else
+        fetch_spawn(fs);
+}
+
+/**
+ * Connect FS's request and read its response. Runs on its own thread, so #fetch()
+ * can hand the reader's end back before the server has even been resolved, and
+ * so a fetch that waits out a backoff or its origin's limits waits here.
+ */
+static void *fetch_worker(void *arg) {
+    struct fetch_state *fs = arg;
+    stats_origin(fs->url);
+    bool waited = fs->retry_at_us || !fs->cleared;
+    if ((fs->retry_at_us && !fetch_backoff(fs)) || !limit_wait(fs)) {
+        fetch_state_free(fs);
         return NULL;
     }
-    struct fetch_state *fs = calloc(1, sizeof(struct fetch_state));
-    if (!fs) {
-        perror("calloc()");
+    // a connection to share may have opened in the meantime
+    if (waited && (h2_fetch(fs) || h1_fetch(fs))) {
+        stats_add(STAT_POOL_HITS, 1);
         return NULL;
     }
+    stats_add(STAT_POOL_MISSES, 1);
 
-    fs->ssl = dispatch->ssl, fs->ssl_ctx = dispatch->ctx;
-    fs->netfd = fds[0], fs->outfd = fds[2], fs->ep = fds[3];
-    int appfd = fds[1];
-    fs->headers_done = false;
-    fs->header_len = 0;
-    fs->hostname = hostname;
+    // fetches to the same origin wait for this connection in case it's HTTP/2
+    struct h2_conn *reserved = h2_reserve(fs->url);
 
-    // Initialize body parsing state
-    fs->chunked_mode = false;
-    fs->current_chunk_size = 0;
-    fs->reading_chunk_size = true;
-    fs->chunk_line_len = 0;
+    struct dispatch *dispatch = fetch_socket(fs->url, fs->timeouts.connect_ms);
+    fs->keep_alive = h1_pipelinable(fs);
+    int rc = use_fetch(fs, dispatch);
+    if (rc == FETCH_H2) {
+        h2_adopt(reserved, dispatch, fs, fetch_requeue);
+        return NULL;
+    }
+    int err = errno;
 
-    fs->stream = response_cookie;
+    // open the pipeline before anyone waiting on the reservation looks for it
+    struct h1_conn *pipeline = rc == 0 && fs->keep_alive ? h1_adopt(fs) : NULL;
+    h2_release(reserved, rc == 0, fetch_requeue);
+    dispatch_free(dispatch);
 
-    fs->http_done = false;
+    if (rc != 0) {
+        fetch_broke(fs, NULL);
+        if (fetch_retry(fs)) {
+            fetch_requeue(fs);
+            return NULL;
+        }
+        stats_add(STAT_FETCH_ERRORS, 1);
+        fprintf(stderr, "couldn't fetch %s: %s\n", fs->url, strerror(err));
+        // the reader just sees an empty response
+        fetch_state_free(fs);
+        return NULL;
+    }
+    if (pipeline) {
+        h1_run(pipeline, fetch_requeue);
+        return NULL;
+    }
+    struct fetch_state *again = fetcher(fs);
+    if (again)
+        fetch_requeue(again);
+    return NULL;
+}
 
-    // spawn background worker thread
+/** Run FS on a #fetch_worker() thread of its own. */
+static void fetch_spawn(struct fetch_state *fs) {
     pthread_t tid = 0;
-    pthread_create(&tid, NULL, fetcher, fs);
+    if (pthread_create(&tid, NULL, fetch_worker, fs) != 0) {
+        perror("pthread_create()");
+        fetch_state_free(fs);
+        return;
+    }
     pthread_detach(tid); // detach so it cleans up after finishing
+}
+
+/**
+ * Allocate the state for a request to URL, bounded by the TIMEOUTS spec, tried
+ * again as RETRY says and held to LIMIT if they aren't NULL, and with INFO set up
+ * if it isn't NULL. The reader's end of its response is its `out`. Nothing's
+ * started yet.
+ */
+static struct fetch_state *fetch_prepare(const char *url, const char *init[4],
+                                         FILE *response_cookie, const char *timeouts,
+                                         const struct fetch_retry *retry,
+                                         const struct fetch_limit *limit,
+                                         struct fetch_info **info)
+{
+    struct fetch_state *fs = fetch_state_new(url, init, response_cookie);
+    if (!fs)
+        return NULL;
+    if (!(fs->out = handoff_new())) {
+        fprintf(stderr, "couldn't hand off rows for url: %s\n", url);
+        fetch_state_free(fs);
+        return NULL;
+    }
+    if (fetch_timeouts_parse(timeouts, &fs->timeouts) < 0) {
+        handoff_close(fs->out);
+        fetch_state_free(fs);
+        errno = EINVAL;
+        return NULL;
+    }
+    if (retry)
+        fs->retry = *retry;
+    if (limit)
+        fs->limit = *limit;
+    if (!info)
+        return fs;
 
-    FILE *fetchfile = fdopen(appfd, "r");
+    if (!(*info = fetch_info_new())) {
+        handoff_close(fs->out);
+        fetch_state_free(fs);
+        return NULL;
+    }
+    // one reference for the caller and one for FS
+    (*info)->refs = 2;
+    fs->info = *info;
+    return fs;
+}
+
+/**
+ * Start FS, on a connection it can share or else on a worker of its own, which
+ * is also where it waits if its origin's limits hold it back.
+ */
+static void fetch_run(struct fetch_state *fs) {
+    // share an open HTTP/2 connection to the same origin if there is one
+    stats_origin(fs->url);
+    stats_add(STAT_FETCHES, 1);
+    if (limit_try(fs) && (h2_fetch(fs) || h1_fetch(fs)))
+        stats_add(STAT_POOL_HITS, 1);
+    else
+        fetch_spawn(fs);
+}
+
+FILE *fetch(const char *url, const char *init[4], FILE *response_cookie) {
+    return fetch_with_info(url, init, response_cookie, NULL, NULL, NULL, NULL);
+}
+
+FILE *fetch_with_info(const char *url, const char *init[4], FILE *response_cookie,
+                      const char *timeouts, const struct fetch_retry *retry,
+                      const struct fetch_limit *limit, struct fetch_info **info)
+{
+    struct fetch_state *fs = fetch_prepare(url, init, response_cookie, timeouts, retry,
+                                           limit, info);
+    if (!fs)
+        return NULL;
+
+    FILE *fetchfile = handoff_reader(fs->out);
     if (!fetchfile) {
-        close(appfd);
+        handoff_close(fs->out);
+        if (info) {
+            fetch_info_release(*info);
+            *info = NULL;
+        }
+        fetch_state_free(fs);
         return NULL;
     }
-    dispatch_free(dispatch);
+
+    fetch_run(fs);
     return fetchfile;
 }
+
+/** Fewest bytes #fetch_next_row() reads at once. */
+#define FETCH_HANDLE_READ (64 * 1024)
+
+/** Starting size of a handle's ring of parsed rows, it grows if a read outpaces it. */
+#define FETCH_HANDLE_DOCS (16 * 1024)
+
+struct fetch_handle {
+    struct fetch_state *fs;
+    int ep;                 // epoll set of READY_FD until FS is connected, then of its connection
+    int ready_fd;           // eventfd, readable once the thread connecting FS is done
+
+    pthread_mutex_t lock;
+    bool connecting;        // FS belongs to the thread connecting it
+    bool closed;            // closed while connecting, so that thread frees the handle
+    int err;                // why FS couldn't connect, 0 if it did
+    bool connected;         // FS's connection is in EP
+
+    struct ring *docs;      // rows FS's stream parsed, as documents, NULL for the caller's cookie
+    char *row;              // the last one #fetch_next_row() wrote out as text
+
+    char *buf;              // rows read off FS's stream that aren't returned yet
+    size_t off;             // where the next row starts in BUF
+    size_t len;
+    size_t cap;
+};
+
+/** Take the next parsed row off H's ring, NULL if there's none yet. */
+static yyjson_mut_doc *handle_pop(struct fetch_handle *h) {
+    struct str front = hd(h->docs);
+    if (!front.hd)
+        return NULL;
+    yyjson_mut_doc *doc;
+    memcpy(&doc, front.hd, sizeof(doc));
+    ring_pop(h->docs);
+    return doc;
+}
+
+static void handle_free(struct fetch_handle *h) {
+    fetch_state_free(h->fs);
+    if (h->ep >= 0)
+        close(h->ep);
+    if (h->ready_fd >= 0)
+        close(h->ready_fd);
+    pthread_mutex_destroy(&h->lock);
+    if (h->docs) {
+        for (yyjson_mut_doc *doc; (doc = handle_pop(h));)
+            yyjson_mut_doc_free(doc);
+        done(h->docs);
+    }
+    free(h->row);
+    free(h->buf);
+    free(h);
+}
+
+/**
+ * Resolve and connect the request of the #fetch_handle ARG and send it, then wake
+ * the caller up. Runs on a short-lived thread of its own, since resolving can't
+ * be waited for on the caller's loop. The response is read on that loop, see
+ * #handle_fill().
+ */
+static void *handle_connect(void *arg) {
+    struct fetch_handle *h = arg;
+    stats_origin(h->fs->url);
+    struct dispatch *dispatch = fetch_socket(h->fs->url, h->fs->timeouts.connect_ms);
+    int rc = use_fetch(h->fs, dispatch);
+    // HTTP/2 wasn't offered, so it can't be picked
+    int err = rc == 0 ? 0 : rc == FETCH_H2 ? EPROTO : errno;
+    dispatch_free(dispatch);
+    if (err) {
+        stats_add(STAT_FETCH_ERRORS, 1);
+        fprintf(stderr, "couldn't fetch %s: %s\n", h->fs->url, strerror(err));
+    }
+
+    // the caller may close H while this is going on
+    pthread_mutex_lock(&h->lock);
+    h->connecting = false;
+    h->err = err;
+    bool closed = h->closed;
+    if (!closed)
+        eventfd_write(h->ready_fd, 1);
+    pthread_mutex_unlock(&h->lock);
+    if (closed)
+        handle_free(h);
+    return NULL;
+}
+
+struct fetch_handle *fetch_start(const char *url, const char *init[4],
+                                 FILE *response_cookie)
+{
+    struct fetch_handle *h = calloc(1, sizeof(struct fetch_handle));
+    if (!h) {
+        if (response_cookie)
+            fclose(response_cookie);
+        return enomem(NULL);
+    }
+    pthread_mutex_init(&h->lock, NULL);
+    h->ep = -1;
+    h->ready_fd = -1;
+    // rows stay the documents they're parsed into, see fetch_next_rows()
+    if (!response_cookie && (!(h->docs = ring(FETCH_HANDLE_DOCS))
+                             || !(response_cookie = cookie(&COOKIE_JSON_DOCS, h->docs))))
+    {
+        handle_free(h);
+        return NULL;
+    }
+    if (!(h->fs = fetch_state_new(url, init, response_cookie))) {
+        handle_free(h);
+        return NULL;
+    }
+    // the connection is H's alone, read on the caller's loop
+    h->fs->h1_only = true;
+
+    h->ep = epoll_create1(EPOLL_CLOEXEC);
+    h->ready_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = h->ready_fd };
+    pthread_t tid = 0;
+    h->connecting = true;
+    if (h->ep < 0 || h->ready_fd < 0
+        || epoll_ctl(h->ep, EPOLL_CTL_ADD, h->ready_fd, &ev) != 0
+        || (errno = pthread_create(&tid, NULL, handle_connect, h)) != 0)
+    {
+        int err = errno;
+        handle_free(h);
+        errno = err;
+        return NULL;
+    }
+    pthread_detach(tid);
+    stats_origin(url);
+    stats_add(STAT_FETCHES, 1);
+    stats_add(STAT_POOL_MISSES, 1);
+    return h;
+}
+
+int fetch_fd(const struct fetch_handle *h) {
+    return h->ep;
+}
+
+/**
+ * Take H's connection over from the thread that made it, once it's done.
+ *
+ * @retval 0 OK
+ * @retval -1 Still connecting if `errno` is EAGAIN, otherwise why it couldn't.
+ */
+static int handle_connected(struct fetch_handle *h) {
+    if (h->connected)
+        return 0;
+    pthread_mutex_lock(&h->lock);
+    bool connecting = h->connecting;
+    int err = h->err;
+    pthread_mutex_unlock(&h->lock);
+    if (connecting || err) {
+        // READY_FD stays readable, so an error is seen again on the next wakeup
+        errno = connecting ? EAGAIN : err;
+        return -1;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = h->fs->netfd };
+    if (epoll_ctl(h->ep, EPOLL_CTL_ADD, h->fs->netfd, &ev) != 0)
+        return -1;
+    epoll_ctl(h->ep, EPOLL_CTL_DEL, h->ready_fd, NULL);
+    h->connected = true;
+    return 0;
+}
+
+/**
+ * Read and parse more of H's response off its connection, once the rows parsed so
+ * far are all taken.
+ *
+ * @retval 1 Read more.
+ * @retval 0 The response is over.
+ * @retval -1 Nothing to read if `errno` is EAGAIN, or an error.
+ */
+static int handle_more(struct fetch_handle *h) {
+    if (handle_connected(h) != 0)
+        return -1;
+    if (h->fs->http_done)
+        return 0;
+    // one thread of the caller's may read many origins, so count toward H's
+    stats_origin(h->fs->url);
+    if (!fetch_read(h->fs)) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * Read the rows of H's response the caller's cookie wrote out as text behind the
+ * ones not taken yet.
+ *
+ * @retval 1 Read more.
+ * @retval 0 The response is over.
+ * @retval -1 Nothing to read if `errno` is EAGAIN, or an error.
+ */
+static int handle_fill(struct fetch_handle *h) {
+    size_t rest = h->len - h->off;
+    if (h->cap < rest + FETCH_HANDLE_READ) {
+        size_t cap = h->cap ? h->cap * 2 : FETCH_HANDLE_READ;
+        while (cap < rest + FETCH_HANDLE_READ)
+            cap *= 2;
+        char *buf = realloc(h->buf, cap);
+        if (!buf)
+            return enomem(-1);
+        h->buf = buf;
+        h->cap = cap;
+    }
+    memmove(h->buf, h->buf + h->off, rest);
+    h->off = 0;
+    h->len = rest;
+
+    if (handle_connected(h) != 0)
+        return -1;
+    struct fetch_state *fs = h->fs;
+    for (;;) {
+        // the parser writes the stream and we read it, so switch it over first
+        fflush(fs->stream);
+        clearerr(fs->stream);
+        size_t got = fread(h->buf + h->len, 1, h->cap - h->len, fs->stream);
+        if (got > 0) {
+            h->len += got;
+            return 1;
+        }
+        int more = handle_more(h);
+        if (more <= 0)
+            return more;
+    }
+}
+
+int fetch_next_row(struct fetch_handle *h, const char **row, size_t *row_len) {
+    if (h->docs) {
+        // write the parsed row back out, for a caller that wants text after all
+        yyjson_mut_doc *doc = NULL;
+        ssize_t got = fetch_next_rows(h, &doc, 1);
+        if (got <= 0)
+            return got;
+        free(h->row);
+        h->row = yyjson_mut_write(doc, 0, row_len);
+        yyjson_mut_doc_free(doc);
+        if (!h->row)
+            return enomem(-1);
+        *row = h->row;
+        return 1;
+    }
+
+    for (;;) {
+        char *nl = h->buf ? memchr(h->buf + h->off, '\n', h->len - h->off) : NULL;
+        if (nl) {
+            *nl = '\0';
+            *row = h->buf + h->off;
+            *row_len = nl - *row;
+            h->off = nl + 1 - h->buf;
+            return 1;
+        }
+
+        // rows always end in a newline, so nothing's cut off at the end
+        int got = handle_fill(h);
+        if (got <= 0)
+            return got;
+    }
+}
+
+ssize_t fetch_next_rows(struct fetch_handle *h, yyjson_mut_doc **docs, size_t max) {
+    if (!h->docs) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t n = 0;
+    while (n < max) {
+        if ((docs[n] = handle_pop(h))) {
+            n++;
+            continue;
+        }
+        // hand over what's parsed already, an error or the end can wait for the next call
+        int more = handle_more(h);
+        if (more <= 0)
+            return n > 0 ? (ssize_t) n : more;
+    }
+    return n;
+}
+
+void fetch_close(struct fetch_handle *h) {
+    if (!h)
+        return;
+    // a thread that's still connecting frees it once it's done
+    pthread_mutex_lock(&h->lock);
+    bool connecting = h->connecting;
+    h->closed = true;
+    pthread_mutex_unlock(&h->lock);
+    if (!connecting)
+        handle_free(h);
+}
+
+#undef FETCH_HANDLE_READ
+#undef FETCH_HANDLE_DOCS
@@ -9,6 +9,9 @@
  */
 #pragma once
 #include <stdio.h>
+#include <sys/types.h>
+
+struct yyjson_mut_doc;
 
 /**
  * @brief \c send() HTTP Request over a TCP socket, wrapping the response socket over
@@ -18,19 +21,156 @@
  * to the request. It returns a readable FILE stream that separates the frames
  * by newlines, so you can read each logical frame one by one easier.
  *
+ * Resolving, connecting and the TLS handshake all happen on a worker thread,
+ * so this returns right away and the first read blocks only until the first
+ * frame is parsed. If the connection can't be made, the error is printed to
+ * stderr and the stream just ends without any frames.
+ *
+ * Closing the stream before it ends cancels the request: the worker drops the
+ * connection, or resets its HTTP/2 stream, as soon as it sees the hang up.
+ *
  * INIT slots are:
- *  - [0]: Method case insensitive
- *  - [1]: Headers
- *  - [2]: Body
+ *  - [0]: Method case insensitive, GET by default or POST if there's a body
+ *  - [1]: Headers, `Name: value` lines separated by `\n` or `\r\n`
+ *  - [2]: Body, sent straight from a copy as it's written out
  *  - [3]: *plain int* Body parser frame type.
  *
  * INIT[3] is the only slot that #fetch will read as a plain
- * `uint64`.
+ * `uint64`. INIT itself and any of its string slots may be NULL, and
+ * everything in it is copied before this returns.
  *
  * @retval NOT_0 OK - Anything not 0 means the response stream was successfully opened.
- * @retval NULL Error - Check `errno` to learn about the error (too many to list here).
+ * @retval NULL Error - Check `errno` to learn about the error (too many to list here),
+ * EINVAL means the method or a header in INIT is malformed.
  *
  * ### Typicode API Example
  * @snippet fetch_print.c fetch basic usage
  */
 FILE *fetch(const char *url, const char *init[4], FILE *response_cookie);
+
+/**
+ * @brief What #fetch_with_info() knows about a response, see lib/fetch.h.
+ */
+struct fetch_info;
+
+/**
+ * @brief How #fetch_with_info() tries a request again, see lib/fetch.h.
+ */
+struct fetch_retry;
+
+/**
+ * @brief How hard #fetch_with_info() may hit an origin, see lib/limit.h.
+ */
+struct fetch_limit;
+
+/**
+ * @brief #fetch(), bounded by TIMEOUTS, tried again as RETRY says, held to LIMIT
+ * along with every other fetch to the same origin, and also writing
+ * out to INFO the response's status, headers and timing as they come in, for as
+ * long as the caller holds on to it.
+ *
+ * TIMEOUTS is NULL or a list of limits in milliseconds like
+ * `connect=2000 first_byte=5000 idle=10000 total=60000`, see lib/fetch.h. A
+ * response that runs out of one just ends early, and INFO says why.
+ *
+ * RETRY is NULL to try once. Otherwise a `GET` or `HEAD` whose connection breaks,
+ * or that's answered with a 429, 502, 503 or 504, is sent again after a backoff,
+ * as long as none of its response reached the stream yet. One that broke halfway
+ * through for good ends early too, and INFO says so.
+ *
+ * LIMIT is NULL for no limits. Otherwise the request waits, without blocking the
+ * caller, until its origin's rate and cap on requests in flight let it go out.
+ *
+ * INFO has one reference for the caller, drop it with #fetch_info_release() once
+ * done, even after the stream is closed. It may be NULL.
+ *
+ * @retval NULL Error, same as #fetch(), EINVAL also for malformed TIMEOUTS. INFO
+ * isn't set.
+ * @retval NOT_0 OK
+ */
+FILE *fetch_with_info(const char *url, const char *init[4], FILE *response_cookie,
+                      const char *timeouts, const struct fetch_retry *retry,
+                      const struct fetch_limit *limit, struct fetch_info **info);
+
+/**
+ * @brief Drop a reference to INFO, freeing it with the last one. NULL is ignored.
+ */
+void fetch_info_release(struct fetch_info *info);
+
+/**
+ * @brief A fetch whose rows are read from the caller's own event loop, see
+ * #fetch_start().
+ */
+struct fetch_handle;
+
+/**
+ * @brief Start a request like #fetch() does, but hand back a nonblocking handle
+ * instead of a blocking stream, so one thread of the caller's can drive many of them.
+ *
+ * Wait for #fetch_fd() to be readable with `poll()`, `epoll` or any event loop,
+ * then take rows with #fetch_next_rows(), or one at a time as text with
+ * #fetch_next_row(), until it says there are no more for now. Those calls are what
+ * read the response off its connection and parse it, so a handle whose rows aren't
+ * taken doesn't read any further either.
+ *
+ * Resolving and connecting still happen on a short-lived thread of the library's,
+ * which is done once the request went out. The connection is the handle's own,
+ * HTTP/1.1 even if the server speaks HTTP/2, and it's neither shared nor kept
+ * alive. There are no timeouts, retries or limits either, see #fetch_with_info()
+ * for those.
+ *
+ * RESPONSE_COOKIE belongs to the handle from here on, even on error. NULL parses
+ * the response as JSON, one object per row, into documents for #fetch_next_rows().
+ *
+ * @retval NULL Error, same as #fetch().
+ * @retval NOT_NULL OK - close with #fetch_close().
+ *
+ * ### Event Loop Example
+ * @snippet async_print.c fetch_start usage
+ */
+struct fetch_handle *fetch_start(const char *url, const char *init[4],
+                                 FILE *response_cookie);
+
+/**
+ * @brief The file descriptor of H to wait on, an `epoll` one: it's readable whenever
+ * #fetch_next_row() has something to say, a row, the end or an error.
+ */
+int fetch_fd(const struct fetch_handle *h);
+
+/**
+ * @brief Take the next row of H's response without blocking, pointing ROW at it and
+ * writing its length out to ROW_LEN.
+ *
+ * ROW is NUL terminated without its newline, and only valid until the next call.
+ * Rows #fetch_start() parsed itself are written out as JSON here, one by one, so
+ * prefer #fetch_next_rows() for those.
+ *
+ * @retval 1 OK - ROW is set.
+ * @retval 0 The response is over, close H.
+ * @retval -1 No row yet if `errno` is EAGAIN, so wait on #fetch_fd() again.
+ * Anything else is an error.
+ */
+int fetch_next_row(struct fetch_handle *h, const char **row, size_t *row_len);
+
+/**
+ * @brief Take up to MAX rows of H's response at once without blocking, writing them
+ * out to DOCS as the documents the response was parsed into, one per row.
+ *
+ * Rows come back as soon as there is at least one, without waiting on the
+ * connection for MAX of them. None of them is ever written out as text and
+ * parsed again, unlike with #fetch_next_row().
+ *
+ * Only a handle #fetch_start() parses itself has them, one with a RESPONSE_COOKIE of
+ * the caller's doesn't.
+ *
+ * @retval x>0 OK - x rows in DOCS, free each with `yyjson_mut_doc_free()`.
+ * @retval 0 The response is over, close H.
+ * @retval -1 No rows yet if `errno` is EAGAIN, so wait on #fetch_fd() again.
+ * Anything else is an error, EINVAL for a handle with the caller's RESPONSE_COOKIE.
+ */
+ssize_t fetch_next_rows(struct fetch_handle *h, struct yyjson_mut_doc **docs, size_t max);
+
+/**
+ * @brief Close H, canceling its request if it's still running. NULL is ignored.
+ */
+void fetch_close(struct fetch_handle *h);
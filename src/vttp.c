@@ -1,15 +1,23 @@
 // Copyright 2025 Nathanael Oh. All Rights Reserved.
+#define _GNU_SOURCE
 #include "lib/cookie.h"
 #include <sqlite3ext.h>
 SQLITE_EXTENSION_INIT1
 
 #include "vapi.h"
+#include "lib/batch.h"
+#include "lib/bulk.h"
+#include "lib/fetch.h"
+#include "lib/path.h"
 #include "lib/sql.h"
+#include "lib/stats.h"
 
 // uncomment to remove all debug prints
 #define NDEBUG
 #include <assert.h>
 #include <asm-generic/errno.h>
+#include <errno.h>
+#include <limits.h>
 #include <unistd.h>
 #include <openssl/types.h>
 #include <yyjson.h>
@@ -19,6 +27,7 @@ SQLITE_EXTENSION_INIT1
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <wchar.h>
 
 yyjson_doc *next_json_obj(FILE *stream, char **errmsg) {
@@ -54,6 +63,25 @@ yyjson_doc *next_json_obj(FILE *stream, char **errmsg) {
     return doc;
 }
 
+/**
+ * Hidden columns after the declared ones, read off the response a row came in
+ * instead of out of its body. See xColumn().
+ */
+enum meta_column {
+    META_STATUS,
+    META_RESPONSE_HEADERS,
+    META_TTFB_MS,
+    META_BYTES,
+    NUM_META_COLUMNS
+};
+
+static const char *const META_COLUMNS[NUM_META_COLUMNS] = {
+    [META_STATUS] = "_status integer",
+    [META_RESPONSE_HEADERS] = "_response_headers text",
+    [META_TTFB_MS] = "_ttfb_ms integer",
+    [META_BYTES] = "_bytes integer",
+};
+
 /**
  * The SQLite virtual table
  */
@@ -72,7 +100,32 @@ typedef struct {
     /** Number of COLUMNS_DEFS in the allocated buffer. */
     size_t column_defs_count;
 
-    uint icol_to_arg_index[4];
+    /** How `body IN (...)` lookups are coalesced, #BATCH_NONE for one request each. */
+    enum batch_format batch;
+
+    /** Lookups per batched request. */
+    size_t batch_size;
+
+    /** Index into COLUMN_DEFS of the `key` column (the PRIMARY KEY), -1 for none. */
+    int key_col;
+
+    /** Inserted rows per bulk request. */
+    size_t bulk_size;
+
+    /** How reads are tried again, from the `retries` and `hedge` table options. */
+    struct fetch_retry retry;
+
+    /** How hard requests hit their origin, from the `rate`, `burst` and `max_in_flight` table options. */
+    struct fetch_limit limit;
+
+    /** Rows written during the open transaction, sent by xSync(). */
+    struct bulk pending;
+
+    /** Rowid of the last inserted row when there's no `key`. */
+    sqlite3_int64 inserted;
+
+    /** Column index of each #meta_column, -1 if a declared column took its name. */
+    int meta_col[NUM_META_COLUMNS];
 } vttp_vtab;
 
 /// Cursor
@@ -82,28 +135,207 @@ typedef struct vttp_cursor {
     unsigned int count;
     int eof;
 
+    // Has the first row been read off STREAM yet? See cursor_start().
+    bool started;
+
     // Completed row (a fully constructed immutable doc)
     yyjson_doc *next_doc;
+
+    // Values of the hidden columns this scan was fetched with, NULL if unset
+    char *hidden[NUM_HIDDEN_COLUMNS];
+
+    // Status, headers and timing of STREAM's response, for the #meta_column
+    struct fetch_info *info;
+
+    // Why a response was cut short, for the next xNext() or xColumn() to report
+    char *error;
+
+    /* --- BATCH MODE, see cursor_next_batch() --- */
+    bool batched;
+    char **bindings;            // every `body IN (...)` value, in request order
+    size_t bindings_len;
+    FILE **batches;             // one response per batch_size bindings
+    struct fetch_info **infos;  // and what's known about each of them
+    size_t batches_len;
+    size_t next_batch;          // index into BATCHES of the next one to read
+    yyjson_doc *batch_doc;      // current batch's response, NULL once all are read
+    size_t binding_off;         // index into BINDINGS of its first binding
+    struct batch_row *rows;
+    size_t rows_len;
+    size_t row;                 // index into ROWS of the current row
 } vttp_cursor_t;
 
+/** Read all of STREAM and close it, writing its length out to LEN. NULL if out of memory. */
+static char *read_all(FILE *stream, size_t *len) {
+    size_t cap = 64 * 1024, n = 0, got = 0;
+    char *buf = malloc(cap);
+    while (buf && (got = fread(buf + n, 1, cap - n, stream)) > 0) {
+        n += got;
+        if (n == cap) {
+            char *grown = realloc(buf, cap *= 2);
+            if (!grown)
+                free(buf);
+            buf = grown;
+        }
+    }
+    fclose(stream);
+    *len = n;
+    return buf;
+}
+
+/**
+ * Whether the response INFO is about was cut short, by one of its timeouts, keeping
+ * the reason in CUR's error for the next xNext() or xColumn() to report.
+ */
+static bool cursor_cut_short(vttp_cursor_t *cur, struct fetch_info *info) {
+    if (!info || cur->error)
+        return cur->error != NULL;
+    pthread_mutex_lock(&info->lock);
+    if (info->error)
+        cur->error = sqlite3_mprintf("(vttp) %s", info->error);
+    pthread_mutex_unlock(&info->lock);
+    return cur->error != NULL;
+}
+
+/**
+ * Hand CUR's error to SQLite as the error of the statement.
+ */
+static int cursor_error(vttp_cursor_t *cur) {
+    sqlite3_free(cur->base.pVtab->zErrMsg);
+    cur->base.pVtab->zErrMsg = sqlite3_mprintf("%s", cur->error);
+    return SQLITE_ERROR;
+}
+
+/**
+ * Move CUR on to the first row of the next batch that answered with any, waiting
+ * on its response. BATCH_DOC is left NULL once every batch is read.
+ */
+static void cursor_next_batch(vttp_cursor_t *cur) {
+    vttp_vtab *vtab = (vttp_vtab *) cur->base.pVtab;
+
+    free(cur->rows);
+    yyjson_doc_free(cur->batch_doc);
+    cur->rows = NULL, cur->rows_len = 0, cur->row = 0;
+    cur->batch_doc = NULL;
+
+    while (cur->next_batch < cur->batches_len) {
+        size_t ibatch = cur->next_batch++;
+        size_t off = ibatch * vtab->batch_size;
+        size_t n = cur->bindings_len - off < vtab->batch_size
+            ? cur->bindings_len - off : vtab->batch_size;
+
+        size_t json_len = 0;
+        char *json = read_all(cur->batches[ibatch], &json_len);
+        cur->batches[ibatch] = NULL;
+        if (cursor_cut_short(cur, cur->infos[ibatch])) {
+            free(json);
+            return;
+        }
+        yyjson_doc *doc = json ? yyjson_read(json, json_len, 0) : NULL;
+        free(json);
+
+        struct batch_row *rows = NULL;
+        ssize_t nrows = doc ? batch_rows(vtab->batch, doc, n, &rows) : -1;
+        if (nrows > 0) {
+            cur->batch_doc = doc;
+            cur->binding_off = off;
+            cur->rows = rows;
+            cur->rows_len = nrows;
+            return;
+        }
+        if (!doc)
+            fprintf(stderr, "(vttp) batch %zu answered with invalid json\n", ibatch);
+        free(rows);
+        yyjson_doc_free(doc);
+    }
+}
+
+/**
+ * Read CUR's first row, waiting on the response if it isn't here yet.
+ *
+ * xFilter() only starts the request, so the wait lands on whoever needs
+ * a row first instead.
+ */
+static void cursor_start(vttp_cursor_t *cur) {
+    if (cur->started)
+        return;
+    cur->started = true;
+    if (cur->batched)
+        cursor_next_batch(cur);
+    else if (!(cur->next_doc = next_json_obj(cur->stream, NULL)))
+        cursor_cut_short(cur, cur->info);
+}
+
+/** CUR's current row, or NULL past the last one. */
+static yyjson_val *cursor_row(vttp_cursor_t *cur) {
+    if (cur->batched)
+        return cur->batch_doc ? cur->rows[cur->row].val : NULL;
+    return cur->next_doc ? yyjson_doc_get_root(cur->next_doc) : NULL;
+}
+
+/** Close every response CUR still has open and free whatever it was holding. */
+static void cursor_reset(vttp_cursor_t *cur) {
+    if (cur->next_doc)
+        yyjson_doc_free(cur->next_doc);
+    if (cur->stream)
+        fclose(cur->stream);
+    fetch_info_release(cur->info);
+    sqlite3_free(cur->error);
+    for (uint i = 0; i < NUM_HIDDEN_COLUMNS; i++)
+        free(cur->hidden[i]);
+
+    for (size_t i = 0; i < cur->bindings_len; i++)
+        free(cur->bindings[i]);
+    free(cur->bindings);
+    for (size_t i = 0; i < cur->batches_len; i++) {
+        if (cur->batches[i])
+            fclose(cur->batches[i]);
+        fetch_info_release(cur->infos[i]);
+    }
+    free(cur->batches);
+    free(cur->infos);
+    yyjson_doc_free(cur->batch_doc);
+    free(cur->rows);
+
+    sqlite3_vtab_cursor base = cur->base;
+    memset(cur, 0, sizeof(vttp_cursor_t));
+    cur->base = base;
+}
+
 #define X_UPDATE_OFFSET 2
 
 // For tokens "vttp" (module name), "main" (schema), "patients" (vtable name), and
 // at least 1 argument for the url argument
 #define MIN_ARGC 4
 
-static vttp_vtab *vttp_vtab_init(sqlite3 *db, int argc,
-                          const char *const *argv, char **schema)
+static vttp_vtab *vttp_vtab_init(sqlite3 *db, int argc, const char *const *argv,
+                                 const struct table_options *opts, char **schema)
 {
     vttp_vtab *vtab = sqlite3_malloc(sizeof(vttp_vtab));
     if (!vtab) {
         fprintf(stderr, "sqlite3_malloc() out of memory\n");
+        errno = ENOMEM;
         return NULL;
     }
     memset(vtab, 0, sizeof(vttp_vtab));
+    vtab->key_col = -1;
 
-    // DELETEME
     vtab->column_defs = parse_column_defs(argc, argv, &vtab->column_defs_count);
+    if (!vtab->column_defs) {
+        int err = errno;
+        sqlite3_free(vtab);
+        errno = err;
+        return NULL;
+    }
+
+    for (int i = NUM_HIDDEN_COLUMNS; i < vtab->column_defs_count; i++) {
+        struct str name = vtab->column_defs[i].name;
+        if (len(opts->key) > 0 && len(name) == len(opts->key)
+            && strncmp(hd(name), hd(opts->key), len(name)) == 0)
+        {
+            vtab->key_col = i;
+        }
+    }
 
     /* max number of tokens valid inside a single xCreate argument for the table declaration */
     struct str first_line = str("create table %s(", argv[2]);
@@ -111,22 +343,42 @@ static vttp_vtab *vttp_vtab_init(sqlite3 *db, int argc,
     sqlite3_str_appendall(s, first_line.hd);
 
     for (int i = 0; i < vtab->column_defs_count; i++) {
+        // quoted, since a name can be anything its definition quoted
         sqlite3_str_appendf(
             s,
-            "%s %s",
+            "\"%w\" %s",
             vtab->column_defs[i].name.hd,
             vtab->column_defs[i].typename.hd
         );
 
-        if (i < 3) {
+        if (i < NUM_HIDDEN_COLUMNS) {
             // hidden column_defs come first in declaration
             sqlite3_str_appendf(s, " %s", "hidden");
         }
+        if (i == vtab->key_col) {
+            // rows are written back by key, see xUpdate()
+            sqlite3_str_appendall(s, " primary key");
+        }
 
         if (i + 1 < vtab->column_defs_count)
             sqlite3_str_appendall(s, ",");
     }
-    sqlite3_str_appendall(s, ")");
+
+    int ncols = vtab->column_defs_count;
+    for (int k = 0; k < NUM_META_COLUMNS; k++) {
+        size_t name_len = strcspn(META_COLUMNS[k], " ");
+        vtab->meta_col[k] = ncols;
+        for (int i = 0; i < vtab->column_defs_count; i++) {
+            struct str name = vtab->column_defs[i].name;
+            if (len(name) == name_len && strncmp(hd(name), META_COLUMNS[k], name_len) == 0)
+                vtab->meta_col[k] = -1;
+        }
+        if (vtab->meta_col[k] < 0)
+            continue;
+        sqlite3_str_appendf(s, ", %s hidden", META_COLUMNS[k]);
+        ncols++;
+    }
+    sqlite3_str_appendall(s, vtab->key_col >= 0 ? ") without rowid" : ")");
     if (schema) {
         *schema = sqlite3_str_finish(s);
     }
@@ -134,6 +386,8 @@ static vttp_vtab *vttp_vtab_init(sqlite3 *db, int argc,
     return vtab;
 }
 
+static int vttpDisconnect(sqlite3_vtab *pvtab);
+
 static int vttpConnect(sqlite3 *pdb, void *paux, int argc,
                      const char *const *argv, sqlite3_vtab **pp_vtab,
                      char **pz_err)
@@ -144,12 +398,80 @@ static int vttpConnect(sqlite3 *pdb, void *paux, int argc,
     }
     int rc = SQLITE_OK;
     char *schema = NULL;
-    *pp_vtab = (sqlite3_vtab *) vttp_vtab_init(pdb, argc, argv, &schema);
+    struct table_options opts = {0};
+    if (parse_table_options(argc, argv, &opts) != 0) {
+        *pz_err = sqlite3_mprintf("(vttp) bad table option, see stderr");
+        table_options_free(&opts);
+        return SQLITE_ERROR;
+    }
+
+    *pp_vtab = (sqlite3_vtab *) vttp_vtab_init(pdb, argc, argv, &opts, &schema);
     vttp_vtab *vtab = (vttp_vtab *) *pp_vtab;
+    if (!vtab && errno == EINVAL) {
+        *pz_err = sqlite3_mprintf("(vttp) bad column definition, see stderr");
+        table_options_free(&opts);
+        return SQLITE_ERROR;
+    }
     if (!vtab) {
+        table_options_free(&opts);
         return SQLITE_NOMEM;
     }
 
+    if (len(opts.batch) > 0) {
+        int batch = batch_format_of(hd(opts.batch), len(opts.batch));
+        if (batch < 0) {
+            *pz_err = sqlite3_mprintf(
+                "(vttp) unknown batch format '%s', expected 'array' or 'fhir'", hd(opts.batch));
+            rc = SQLITE_ERROR;
+        }
+        vtab->batch = batch;
+    }
+    if (len(opts.key) > 0 && vtab->key_col < 0) {
+        *pz_err = sqlite3_mprintf("(vttp) key '%s' isn't a column", hd(opts.key));
+        rc = SQLITE_ERROR;
+    }
+    vtab->batch_size = opts.batch_size ? opts.batch_size : BATCH_SIZE_DEFAULT;
+    vtab->bulk_size = opts.bulk_size ? opts.bulk_size : BULK_SIZE_DEFAULT;
+    vtab->retry.retries = opts.retries;
+    if (len(opts.hedge) > 0) {
+        char *end = NULL;
+        long long ms = strtoll(hd(opts.hedge), &end, 10);
+        if (strcasecmp(hd(opts.hedge), "p95") == 0) {
+            vtab->retry.hedge_ms = FETCH_HEDGE_P95;
+        } else if (end != hd(opts.hedge) && !*end && ms > 0 && ms <= INT_MAX) {
+            vtab->retry.hedge_ms = ms;
+        } else {
+            *pz_err = sqlite3_mprintf(
+                "(vttp) bad hedge '%s', expected 'p95' or milliseconds", hd(opts.hedge));
+            rc = SQLITE_ERROR;
+        }
+    }
+    if (len(opts.rate) > 0) {
+        char *end = NULL;
+        double rate = strtod(hd(opts.rate), &end);
+        if (end != hd(opts.rate) && (strcasecmp(end, "/m") == 0 || strcasecmp(end, "/min") == 0))
+            rate /= 60, end = "";
+        else if (end != hd(opts.rate) && strcasecmp(end, "/s") == 0)
+            end = "";
+        if (end != hd(opts.rate) && !*end && rate > 0 && rate <= INT_MAX) {
+            vtab->limit.rate = rate;
+        } else {
+            *pz_err = sqlite3_mprintf(
+                "(vttp) bad rate '%s', expected requests per second or like '600/m'", hd(opts.rate));
+            rc = SQLITE_ERROR;
+        }
+    }
+    vtab->limit.burst = opts.burst < INT_MAX ? opts.burst : INT_MAX;
+    vtab->limit.max_in_flight = opts.max_in_flight < INT_MAX ? opts.max_in_flight : INT_MAX;
+    table_options_free(&opts);
+
+    if (rc != SQLITE_OK) {
+        sqlite3_free(schema);
+        vttpDisconnect(*pp_vtab);
+        *pp_vtab = NULL;
+        return rc;
+    }
+
     rc += sqlite3_declare_vtab(pdb, schema);
 
     sqlite3_free(schema);
@@ -213,38 +535,62 @@ static int check_plan_mask(struct sqlite3_index_info *index_info,
 }
 #undef REQUIRED_BITS
 
+/**
+ * idxNum bit for a plan that takes every `body IN (...)` value at once, to look
+ * them up in batches. See sqlite3_vtab_in().
+ */
+#define PLAN_BATCH ICOL_BIT(NUM_HIDDEN_COLUMNS)
+
 /**
  * Fetch vtab's sqlite_module->xBestIndex() callback
+ *
+ * Every hidden column with a usable `=` constraint sets its #ICOL_BIT in idxNum,
+ * and their values are passed to xFilter() in hidden column order, so the plan
+ * alone says which argument is which.
  */
 static int vttpBestIndex(sqlite3_vtab *pVTab, sqlite3_index_info *pIdxInfo) {
     int argPos = 1;
     int planMask = 0;
-    vttp_vtab *vtab = (vttp_vtab *)pVTab;
-
-    for (int i = 0; i < pIdxInfo->nConstraint; i++) {
-        struct sqlite3_index_constraint *cst = &pIdxInfo->aConstraint[i];
+    int cst_of_icol[NUM_HIDDEN_COLUMNS];
+    vttp_vtab *vtab = (vttp_vtab *) pVTab;
+
+    for (uint icol = 0; icol < NUM_HIDDEN_COLUMNS; icol++) {
+        cst_of_icol[icol] = -1;
+        for (int i = 0; i < pIdxInfo->nConstraint; i++) {
+            if (!is_usable_eq_cst(&pIdxInfo->aConstraint[i], icol))
+                continue;
+            // a single body beats a whole batch of them, so only settle for an IN
+            bool is_in = icol == ICOL_BODY && vtab->batch
+                && sqlite3_vtab_in(pIdxInfo, i, -1);
+            if (cst_of_icol[icol] < 0 || !is_in)
+                cst_of_icol[icol] = i;
+            if (!is_in)
+                break;
+        }
+    }
 
-        if (!cst->usable || cst->op != SQLITE_INDEX_CONSTRAINT_EQ)
+    for (uint icol = 0; icol < NUM_HIDDEN_COLUMNS; icol++) {
+        if (cst_of_icol[icol] < 0)
             continue;
 
         struct sqlite3_index_constraint_usage *usage =
-            &pIdxInfo->aConstraintUsage[i];
-
-        if (is_usable_eq_cst(cst, ICOL_URL)) {
-            vtab->icol_to_arg_index[ICOL_URL] = argPos - 1;
-            usage->omit = 1;
-            usage->argvIndex = argPos++;
-            planMask |= ICOL_BIT(ICOL_URL);
-        } 
-
-        if (is_usable_eq_cst(cst, ICOL_BODY)) {
-            vtab->icol_to_arg_index[ICOL_BODY] = argPos - 1;
-            usage->omit = 1;
-            usage->argvIndex = argPos++;
-            planMask |= ICOL_BIT(ICOL_BODY);
-        } 
+            &pIdxInfo->aConstraintUsage[cst_of_icol[icol]];
+        usage->omit = 1;
+        usage->argvIndex = argPos++;
+        planMask |= ICOL_BIT(icol);
+
+        if (icol == ICOL_BODY && vtab->batch
+            && sqlite3_vtab_in(pIdxInfo, cst_of_icol[icol], 1))
+        {
+            planMask |= PLAN_BATCH;
+        }
     }
 
+    // a batch is one round trip per batch_size bodies instead of one per body,
+    // so have the planner scan it first and join the bodies back onto it
+    if (planMask & PLAN_BATCH)
+        pIdxInfo->estimatedCost = 1000;
+
     pIdxInfo->idxNum = planMask;
     return check_plan_mask(pIdxInfo, pVTab);
 }
@@ -256,14 +602,10 @@ static int vttpBestIndex(sqlite3_vtab *pVTab, sqlite3_index_info *pIdxInfo) {
 static int vttpDisconnect(sqlite3_vtab *pvtab) {
     vttp_vtab *vtab = (vttp_vtab *) pvtab;
 
-    for (uint i = 3; i < vtab->column_defs_count; i++) {
-        done(vtab->column_defs[i].default_value);
-        done(vtab->column_defs[i].name);
-        done(vtab->column_defs[i].typename);
-    }
-    free(vtab->column_defs);
+    column_defs_free(vtab->column_defs, vtab->column_defs_count);
     vtab->column_defs = 0;
     vtab->column_defs_count = 0;
+    bulk_free(&vtab->pending);
 
     sqlite3_free(pvtab);
     return SQLITE_OK;
@@ -290,12 +632,7 @@ static int vttpOpen(sqlite3_vtab *pvtab, sqlite3_vtab_cursor **pp_cursor) {
 static int vttpClose(sqlite3_vtab_cursor *cur) {
     vttp_cursor_t *cursor = (vttp_cursor_t *)cur;
     if (cursor) {
-        if (cursor->next_doc) {
-            yyjson_doc_free(cursor->next_doc);
-        }
-        if (cursor->stream) {
-            fclose(cursor->stream);
-        }
+        cursor_reset(cursor);
         sqlite3_free(cur);
     }
     return SQLITE_OK;
@@ -304,7 +641,15 @@ static int vttpClose(sqlite3_vtab_cursor *cur) {
 static int vttpNext(sqlite3_vtab_cursor *cur0) {
     vttp_cursor_t *cur = (vttp_cursor_t*)cur0;
     vttp_vtab *vtab = (void*) cur->base.pVtab;
+    cursor_start(cur);
 
+    if (cur->batched) {
+        if (cur->batch_doc && ++cur->row >= cur->rows_len)
+            cursor_next_batch(cur);
+        return cur->error ? cursor_error(cur) : SQLITE_OK;
+    }
+    if (cur->error)
+        return cursor_error(cur);
 
     // Sanity: next_doc must always contain the row returned previously.
     if (!cur->next_doc) {
@@ -318,7 +663,10 @@ static int vttpNext(sqlite3_vtab_cursor *cur0) {
     char *errmsg = NULL;
     cur->next_doc = next_json_obj(cur->stream, &errmsg);
     yyjson_doc_free(prev);
+    sqlite3_free(errmsg);
 
+    if (!cur->next_doc && cursor_cut_short(cur, cur->info))
+        return cursor_error(cur);
     return SQLITE_OK;
 }
 
@@ -334,25 +682,32 @@ static void json_bool_result(
         sqlite3_result_text(pctx, yyjson_get_bool(column_val) ? "true" : "false", -1, SQLITE_TRANSIENT);
 }
 
-static yyjson_val *follow_generated_path(
-    yyjson_val *root,
-    struct str *keys,
-    size_t count
-) {
-    if (count == 0)
-        return NULL;
-    yyjson_val *cur = root;
-
-    for (size_t i = 0; i < count; i++) {
-        if (!cur || yyjson_get_type(cur) != YYJSON_TYPE_OBJ)
-            return NULL;
-
-        /* Pass exact byte count to yyjson */
-        cur = yyjson_obj_getn(cur, keys[i].hd, keys[i].length);
-        char *json = yyjson_val_write(cur, YYJSON_WRITE_PRETTY, NULL);
+/**
+ * Set PCTX to #meta_column ICOL of the response CURSOR's row came in. Bytes are
+ * the ones received so far, since rows are read while the body is still coming.
+ */
+static void meta_result(vttp_cursor_t *cursor, sqlite3_context *pctx, int icol) {
+    vttp_vtab *vtab = (void *) cursor->base.pVtab;
+    struct fetch_info *info = cursor->batched
+        ? cursor->infos[cursor->next_batch - 1]
+        : cursor->info;
+    if (!info) {
+        sqlite3_result_null(pctx);
+        return;
     }
 
-    return cur;
+    pthread_mutex_lock(&info->lock);
+    if (icol == vtab->meta_col[META_BYTES])
+        sqlite3_result_int64(pctx, info->bytes);
+    else if (!info->headers)
+        sqlite3_result_null(pctx);
+    else if (icol == vtab->meta_col[META_STATUS])
+        sqlite3_result_int(pctx, info->status);
+    else if (icol == vtab->meta_col[META_RESPONSE_HEADERS])
+        sqlite3_result_text(pctx, info->headers, -1, SQLITE_TRANSIENT);
+    else if (icol == vtab->meta_col[META_TTFB_MS])
+        sqlite3_result_int64(pctx, info->ttfb_ms);
+    pthread_mutex_unlock(&info->lock);
 }
 
 /** Populates the Fetch row */
@@ -362,31 +717,40 @@ static int xColumn(sqlite3_vtab_cursor *pcursor,
 {
     vttp_cursor_t *cursor = (vttp_cursor_t *)pcursor;
     vttp_vtab *vtab = (void *) cursor->base.pVtab;
+    cursor_start(cursor);
+    if (cursor->error)
+        return cursor_error(cursor);
 
-    if (!cursor->next_doc) {
+    yyjson_val *val = cursor_row(cursor);
+    if (!val) {
         fprintf(stderr, "expected a JSON pointer in next_doc but got 0\n");
         return SQLITE_ERROR;
     }
 
-    if (icol < 3) // Skip hidden column_defs
+    if (icol >= (int) vtab->column_defs_count) {
+        // left out of an UPDATE, which is how xUpdate() tells it from an INSERT
+        if (!sqlite3_vtab_nochange(pctx))
+            meta_result(cursor, pctx, icol);
         return SQLITE_OK;
+    }
 
-    struct column_def def = vtab->column_defs[icol];
-
-    yyjson_val *val = yyjson_doc_get_root(cursor->next_doc);
-
-    char *json = yyjson_val_write(val, YYJSON_WRITE_PRETTY, NULL);
-
-    if (def.generated_always_as_len > 0) {
-        val = follow_generated_path(
-            val,
-            def.generated_always_as,
-            def.generated_always_as_len
-        );
-    } else {
-        val = yyjson_obj_getn(val, def.name.hd, def.name.length);
+    if (icol < NUM_HIDDEN_COLUMNS) {
+        // what the row was fetched with, so joins on them can find their rows
+        const char *hidden = cursor->hidden[icol];
+        if (cursor->batched && icol == ICOL_BODY) {
+            size_t ibinding = cursor->binding_off + cursor->rows[cursor->row].binding;
+            hidden = cursor->bindings[ibinding];
+        }
+        if (hidden)
+            sqlite3_result_text(pctx, hidden, -1, SQLITE_TRANSIENT);
+        return SQLITE_OK;
     }
 
+    struct column_def def = vtab->column_defs[icol];
+    if (def.generated_always_as)
+        val = path_eval(def.generated_always_as, val);
+    else
+        val = yyjson_obj_getn(val, def.name.hd, def.name.length);
 
     if (!val) {
         sqlite3_result_null(pctx);
@@ -428,7 +792,10 @@ static int xColumn(sqlite3_vtab_cursor *pcursor,
 
 static int xEof(sqlite3_vtab_cursor *cur) {
     vttp_cursor_t *c = (vttp_cursor_t*)cur;
-    int rc = c->next_doc == NULL;
+    cursor_start(c);
+    // xEof() can't fail, so a response cut short is one more row whose xColumn() or
+    // xNext() does
+    int rc = cursor_row(c) == NULL && !c->error;
     return rc;
 }
 
@@ -437,22 +804,129 @@ static int xRowid(sqlite3_vtab_cursor *pcursor, sqlite3_int64 *prowid) {
     return SQLITE_OK;
 }
 
+/**
+ * The value of hidden column ICOL: its `=` constraint from xBestIndex()'s
+ * PLAN_MASK if it has one, or else its default.
+ */
 static inline char *
 resolve_hidden_col_text(
     const vttp_vtab *vtab,
     uint icol,
+    int plan_mask,
     int argc,
     sqlite3_value **argv
 ) {
-    int ai = vtab->icol_to_arg_index[icol];
-
-    if (ai >= 0 && ai < argc) {
-        return (char *) sqlite3_value_text(argv[ai]);
+    if (plan_mask & ICOL_BIT(icol)) {
+        // arguments come in hidden column order, one per constrained column
+        int ai = __builtin_popcount(plan_mask & (ICOL_BIT(icol) - 1));
+        if (ai < argc)
+            return (char *) sqlite3_value_text(argv[ai]);
     }
 
     return hd(vtab->column_defs[icol].default_value);
 }
 
+/**
+ * HEADERS with a `Content-Type: TYPE` line added if it doesn't have one, or NULL
+ * if it already does, written out to OUT.
+ *
+ * @retval false Error, out of memory.
+ */
+static bool with_content_type(const char *headers, const char *type, char **out) {
+    *out = NULL;
+    for (const char *line = headers; line && *line; line += strcspn(line, "\n")) {
+        line += *line == '\n';
+        // fetch() only takes a header name at the start of its line, right up to the colon
+        if (strncasecmp(line, "content-type:", 13) == 0)
+            return true;
+    }
+
+    bool has_headers = headers && *headers;
+    return asprintf(out, "%s%sContent-Type: %s", has_headers ? headers : "",
+                    has_headers ? "\n" : "", type) >= 0;
+}
+
+/**
+ * Start one request per batch_size values of the `body IN (...)` list in BODIES,
+ * each to URL with the method and headers in INIT and bounded by TIMEOUTS, reading
+ * them back in order with cursor_next_batch().
+ */
+static int filter_batched(vttp_cursor_t *cur, const char *url, const char *init[4],
+                          const char *timeouts, sqlite3_value *bodies)
+{
+    vttp_vtab *vtab = (vttp_vtab *) cur->base.pVtab;
+    cur->batched = true;
+
+    size_t cap = 0;
+    sqlite3_value *val = NULL;
+    for (int rc = sqlite3_vtab_in_first(bodies, &val);
+         rc == SQLITE_OK && val;
+         rc = sqlite3_vtab_in_next(bodies, &val))
+    {
+        const char *body = (const char *) sqlite3_value_text(val);
+        if (!body)
+            continue; // NULL never equals anything
+
+        if (cur->bindings_len == cap) {
+            cap = cap ? cap * 2 : 64;
+            char **grown = realloc(cur->bindings, cap * sizeof(char *));
+            if (!grown)
+                return SQLITE_NOMEM;
+            cur->bindings = grown;
+        }
+        if (!(cur->bindings[cur->bindings_len] = strdup(body)))
+            return SQLITE_NOMEM;
+        cur->bindings_len += 1;
+    }
+
+    size_t nbatches = (cur->bindings_len + vtab->batch_size - 1) / vtab->batch_size;
+    if (nbatches == 0)
+        return SQLITE_OK;
+    cur->batches = calloc(nbatches, sizeof(FILE *));
+    cur->infos = calloc(nbatches, sizeof(struct fetch_info *));
+    if (!cur->batches || !cur->infos)
+        return SQLITE_NOMEM;
+    cur->batches_len = nbatches;
+
+    char *with_type = NULL;
+    if (!with_content_type(init[1], batch_content_type(vtab->batch), &with_type))
+        return SQLITE_NOMEM;
+    const char *headers = with_type ? with_type : init[1];
+
+    int rc = SQLITE_OK;
+    for (size_t i = 0; i < nbatches && rc == SQLITE_OK; i++) {
+        size_t off = i * vtab->batch_size;
+        size_t n = cur->bindings_len - off < vtab->batch_size
+            ? cur->bindings_len - off : vtab->batch_size;
+
+        size_t body_len = 0;
+        char *body = batch_request(vtab->batch, (const char *const *) cur->bindings + off,
+                                   n, &body_len);
+        FILE *response = body ? cookie(&COOKIE_PASSTHROUGH, NULL) : NULL;
+        if (!response) {
+            free(body);
+            rc = SQLITE_NOMEM;
+            break;
+        }
+
+        // every batch is in flight before the first one is read
+        const char *batch_init[4] = { init[0], headers, body, NULL };
+        cur->batches[i] = fetch_with_info(url, batch_init, response, timeouts,
+                                          &vtab->retry, &vtab->limit, &cur->infos[i]);
+        free(body);
+        if (!cur->batches[i]) {
+            cur->base.pVtab->zErrMsg = sqlite3_mprintf("(vttp) couldn't fetch %s", url);
+            rc = SQLITE_ERROR;
+        }
+    }
+    free(with_type);
+    return rc;
+}
+
+static char *strdup_or_null(const char *s) {
+    return s ? strdup(s) : NULL;
+}
+
 static int xFilter(sqlite3_vtab_cursor *_cur,
                     int idxNum, const char *idxStr,
                     int argc, sqlite3_value **argv)
@@ -460,7 +934,7 @@ static int xFilter(sqlite3_vtab_cursor *_cur,
     vttp_vtab *vtab = (vttp_vtab*)_cur->pVtab;
     vttp_cursor_t *cur = (vttp_cursor_t*)_cur;
 
-    cur->eof = 0, cur->count = 0, cur->next_doc = NULL;
+    cursor_reset(cur);
 
     // Extract URL
     if (argc == 0 && !vtab->column_defs[ICOL_URL].default_value.hd) {
@@ -469,22 +943,347 @@ static int xFilter(sqlite3_vtab_cursor *_cur,
         return SQLITE_ERROR;
     }
 
-    char *url = resolve_hidden_col_text(vtab, ICOL_URL, argc, argv);
-    // char *headers = resolve_hidden_col_text(vtab, ICOL_HEADERS, argc, argv);
-    char *body = resolve_hidden_col_text(vtab, ICOL_BODY, argc, argv);
+    char *url = resolve_hidden_col_text(vtab, ICOL_URL, idxNum, argc, argv);
+    bool batched = idxNum & PLAN_BATCH;
+    const char *init[4] = {
+        resolve_hidden_col_text(vtab, ICOL_METHOD, idxNum, argc, argv),
+        resolve_hidden_col_text(vtab, ICOL_HEADERS, idxNum, argc, argv),
+        // in a batch, the body constraint is the whole IN list and not a value
+        batched ? NULL : resolve_hidden_col_text(vtab, ICOL_BODY, idxNum, argc, argv),
+        NULL
+    };
+
+    const char *timeouts = resolve_hidden_col_text(vtab, ICOL_TIMEOUT, idxNum, argc, argv);
+    struct fetch_timeouts parsed = {0};
+    if (fetch_timeouts_parse(timeouts, &parsed) < 0) {
+        _cur->pVtab->zErrMsg = sqlite3_mprintf(
+            "(vttp) bad timeout '%s', expected milliseconds like "
+            "'connect=2000 first_byte=5000 idle=10000 total=60000'", timeouts);
+        return SQLITE_MISUSE;
+    }
 
+    cur->hidden[ICOL_URL] = strdup_or_null(url);
+    cur->hidden[ICOL_METHOD] = strdup_or_null(init[0]);
+    cur->hidden[ICOL_HEADERS] = strdup_or_null(init[1]);
+    cur->hidden[ICOL_BODY] = strdup_or_null(init[2]);
+    cur->hidden[ICOL_TIMEOUT] = strdup_or_null(timeouts);
+
+    if (batched) {
+        int ai = __builtin_popcount(idxNum & (ICOL_BIT(ICOL_BODY) - 1));
+        return filter_batched(cur, url, init, timeouts, argv[ai]);
+    }
 
     FILE *json_response = cookie(&COOKIE_JSON, NULL);
-    cur->stream = fetch(url, (const char *[]){0}, json_response);
+    if (!json_response)
+        return SQLITE_NOMEM;
 
-    char *errmsg = NULL;
-    cur->next_doc = next_json_obj(cur->stream, &errmsg);
+    // only start the request, the first row is read once it's asked for
+    cur->stream = fetch_with_info(url, init, json_response, timeouts, &vtab->retry,
+                                  &vtab->limit, &cur->info);
+    if (!cur->stream) {
+        if (errno == EINVAL) {
+            _cur->pVtab->zErrMsg = sqlite3_mprintf(
+                "(vttp) bad method or headers for %s", url);
+            return SQLITE_MISUSE;
+        }
+        _cur->pVtab->zErrMsg = sqlite3_mprintf("(vttp) couldn't fetch %s", url);
+        return SQLITE_ERROR;
+    }
 
-    if (!cur->next_doc) {
-        _cur->pVtab->zErrMsg = errmsg;
+    return SQLITE_OK;
+}
+
+/** COL as a JSON value in DOC: text that's a JSON object or array is embedded as one. */
+static yyjson_mut_val *column_json(yyjson_mut_doc *doc, sqlite3_value *col) {
+    switch (sqlite3_value_type(col)) {
+    case SQLITE_INTEGER:
+        return yyjson_mut_sint(doc, sqlite3_value_int64(col));
+    case SQLITE_FLOAT:
+        return yyjson_mut_real(doc, sqlite3_value_double(col));
+    case SQLITE_NULL:
+        return yyjson_mut_null(doc);
+    }
+
+    const char *text = (const char *) sqlite3_value_text(col);
+    size_t n = sqlite3_value_bytes(col);
+    if (!text)
+        return NULL;
+
+    // the inverse of xColumn(), which reads objects and arrays out as JSON text
+    yyjson_doc *parsed = yyjson_read(text, n, 0);
+    yyjson_val *root = yyjson_doc_get_root(parsed);
+    yyjson_mut_val *val = yyjson_is_obj(root) || yyjson_is_arr(root)
+        ? yyjson_val_mut_copy(doc, root)
+        : yyjson_mut_strncpy(doc, text, n);
+    yyjson_doc_free(parsed);
+    return val;
+}
+
+/**
+ * The row in COLS (one value per column) as a JSON object of its visible columns.
+ * Generated columns are left out, they're read from elsewhere in the row.
+ *
+ * @retval NULL Error, out of memory.
+ * @retval NOT_NULL OK - free with `free()`.
+ */
+static char *row_json(const vttp_vtab *vtab, sqlite3_value **cols) {
+    yyjson_mut_doc *doc = yyjson_mut_doc_new(NULL);
+    yyjson_mut_val *row = doc ? yyjson_mut_obj(doc) : NULL;
+    if (!row) {
+        yyjson_mut_doc_free(doc);
+        return NULL;
+    }
+    yyjson_mut_doc_set_root(doc, row);
+
+    bool ok = true;
+    for (size_t i = NUM_HIDDEN_COLUMNS; ok && i < vtab->column_defs_count; i++) {
+        const struct column_def *def = &vtab->column_defs[i];
+        if (def->generated_always_as)
+            continue;
+
+        yyjson_mut_val *key = yyjson_mut_strncpy(doc, hd(def->name), len(def->name));
+        yyjson_mut_val *val = column_json(doc, cols[i]);
+        ok = key && val && yyjson_mut_obj_add(row, key, val);
+    }
+
+    char *json = ok ? yyjson_mut_write(doc, 0, NULL) : NULL;
+    yyjson_mut_doc_free(doc);
+    return json;
+}
+
+/** The text of hidden column ICOL in COLS if it's set, or else its default. */
+static const char *hidden_col_value(const vttp_vtab *vtab, uint icol, sqlite3_value **cols) {
+    if (cols && sqlite3_value_type(cols[icol]) != SQLITE_NULL)
+        return (const char *) sqlite3_value_text(cols[icol]);
+    return hd(vtab->column_defs[icol].default_value);
+}
+
+/**
+ * Is the xUpdate() of ARGV, which isn't a DELETE, an UPDATE? One of a row whose key
+ * is NULL comes in with ARGV[0] and ARGV[1] NULL just like an INSERT, so it's told
+ * apart by the #meta_column xColumn() was asked not to bother with.
+ */
+static bool is_update(const vttp_vtab *vtab, sqlite3_value **argv) {
+    if (sqlite3_value_type(argv[0]) != SQLITE_NULL)
+        return true;
+    for (int k = 0; k < NUM_META_COLUMNS; k++) {
+        int icol = vtab->meta_col[k];
+        if (icol >= 0 && sqlite3_value_nochange(argv[X_UPDATE_OFFSET + icol]))
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Queue an INSERT, UPDATE or DELETE of one row until the transaction commits, see
+ * xSync(). UPDATE and DELETE address the row by the `key` column, which makes the
+ * table WITHOUT ROWID, so ARGV[0] is the key and not a rowid.
+ */
+static int xUpdate(sqlite3_vtab *pvtab, int argc, sqlite3_value **argv,
+                   sqlite3_int64 *prowid)
+{
+    vttp_vtab *vtab = (vttp_vtab *) pvtab;
+    bool insert = argc > 1 && !is_update(vtab, argv);
+    if (!insert && vtab->key_col < 0) {
+        pvtab->zErrMsg = sqlite3_mprintf("(vttp) UPDATE and DELETE need a key table option");
+        return SQLITE_ERROR;
+    }
+
+    const char *key = insert ? NULL : (const char *) sqlite3_value_text(argv[0]);
+    if (!insert && !key) {
+        pvtab->zErrMsg = sqlite3_mprintf("(vttp) can't %s a row whose key is NULL",
+                                         argc == 1 ? "DELETE" : "UPDATE");
         return SQLITE_ERROR;
     }
 
+    // a DELETE only has the key, so it goes to the default url with the default headers
+    sqlite3_value **cols = argc > 1 ? argv + X_UPDATE_OFFSET : NULL;
+    const char *url = hidden_col_value(vtab, ICOL_URL, cols);
+    const char *headers = hidden_col_value(vtab, ICOL_HEADERS, cols);
+    if (!url) {
+        pvtab->zErrMsg = sqlite3_mprintf("(vttp) need a url or default url to write to");
+        return SQLITE_ERROR;
+    }
+
+    enum bulk_op op = insert ? BULK_INSERT : argc == 1 ? BULK_DELETE : BULK_UPDATE;
+    char *json = NULL;
+    if (op != BULK_DELETE && !(json = row_json(vtab, cols)))
+        return SQLITE_NOMEM;
+
+    if (!bulk_push(&vtab->pending, op, url, headers, key, json))
+        return SQLITE_NOMEM;
+
+    if (insert && vtab->key_col < 0)
+        *prowid = ++vtab->inserted;
+    return SQLITE_OK;
+}
+
+/** A request of xSync() in flight, and what it was for. */
+struct write_flight {
+    FILE *response;
+    struct fetch_info *info;
+    size_t off;                 // into the pending transaction, of its first write
+    char *url;
+};
+
+/**
+ * Read the rest of FLIGHT's response, close it and let go of FLIGHT. Unless
+ * VTAB has an error already, it gets one if the API didn't answer with a 2xx.
+ *
+ * @retval SQLITE_OK The write went through.
+ * @retval SQLITE_ERROR It didn't, or we can't tell that it did.
+ */
+static int finish_write(vttp_vtab *vtab, struct write_flight *flight) {
+    char buf[16 * 1024];
+    while (fread(buf, 1, sizeof(buf), flight->response) > 0)
+        ;
+    fclose(flight->response);
+
+    const char *method = bulk_method(vtab->pending.hd[flight->off].op);
+    struct fetch_info *info = flight->info;
+    char *why = NULL;
+    pthread_mutex_lock(&info->lock);
+    if (info->error)
+        why = sqlite3_mprintf("(vttp) %s %s failed: %s", method, flight->url, info->error);
+    else if (!info->status)
+        why = sqlite3_mprintf("(vttp) %s %s got no response", method, flight->url);
+    else if (info->status < 200 || info->status > 299)
+        why = sqlite3_mprintf("(vttp) %s %s answered %d", method, flight->url, info->status);
+    pthread_mutex_unlock(&info->lock);
+    fetch_info_release(info);
+    free(flight->url);
+
+    if (!why)
+        return SQLITE_OK;
+    if (vtab->base.zErrMsg)
+        sqlite3_free(why);
+    else
+        vtab->base.zErrMsg = why;
+    return SQLITE_ERROR;
+}
+
+/** #finish_write() the N writes in FLIGHT, returning the first error. */
+static int finish_writes(vttp_vtab *vtab, struct write_flight *flight, size_t n) {
+    int rc = SQLITE_OK;
+    for (size_t i = 0; i < n; i++) {
+        int done_rc = finish_write(vtab, &flight[i]);
+        if (rc == SQLITE_OK)
+            rc = done_rc;
+    }
+    return rc;
+}
+
+/**
+ * Can the write at OFF of PENDING be sent while the N writes at FLIGHT are still in
+ * flight? Only if they're all the same kind to the same URL, and none of them is
+ * for the same key, so nothing can overtake a write it depends on.
+ */
+static bool joins_flight(const struct bulk *pending, const struct write_flight *flight,
+                         size_t n, size_t off)
+{
+    const struct bulk_write *next = &pending->hd[off];
+    for (size_t i = 0; i < n; i++) {
+        const struct bulk_write *sent = &pending->hd[flight[i].off];
+        if (sent->op != next->op || strcmp(sent->url, next->url) != 0)
+            return false;
+        if (next->key && strcmp(sent->key, next->key) == 0)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Start the request for the N writes at OFF of the pending transaction into FLIGHT,
+ * for #finish_write().
+ */
+static int send_writes(vttp_vtab *vtab, size_t off, size_t n, struct write_flight *flight) {
+    const struct bulk_write *first = &vtab->pending.hd[off];
+    char *url = NULL, *body = NULL, *with_type = NULL;
+    size_t body_len = 0;
+    if (!bulk_request(&vtab->pending, off, n, &url, &body, &body_len))
+        return SQLITE_NOMEM;
+    if (body && !with_content_type(first->headers, "application/json", &with_type)) {
+        free(url);
+        free(body);
+        return SQLITE_NOMEM;
+    }
+
+    int rc = SQLITE_OK;
+    const char *init[4] = {
+        bulk_method(first->op), with_type ? with_type : first->headers, body, NULL
+    };
+    // writes count against the origin's limits as much as reads
+    FILE *passthrough = cookie(&COOKIE_PASSTHROUGH, NULL);
+    *flight = (struct write_flight) { .off = off };
+    flight->response = passthrough
+        ? fetch_with_info(url, init, passthrough, NULL, NULL, &vtab->limit, &flight->info)
+        : NULL;
+    if (!passthrough) {
+        rc = SQLITE_NOMEM;
+    } else if (!flight->response && errno == EINVAL) {
+        vtab->base.zErrMsg = sqlite3_mprintf("(vttp) bad headers for %s", url);
+        rc = SQLITE_MISUSE;
+    } else if (!flight->response) {
+        vtab->base.zErrMsg = sqlite3_mprintf("(vttp) couldn't %s %s", init[0], url);
+        rc = SQLITE_ERROR;
+    }
+    if (rc == SQLITE_OK)
+        flight->url = url;
+    else
+        free(url);
+    free(body);
+    free(with_type);
+    return rc;
+}
+
+static int xBegin(sqlite3_vtab *pvtab) {
+    bulk_clear(&((vttp_vtab *) pvtab)->pending);
+    return SQLITE_OK;
+}
+
+/**
+ * Send every write of the transaction: inserts in bulk_size arrays, updates and
+ * deletes one per row, with up to #BULK_IN_FLIGHT of them in flight at once. A
+ * write is only sent once everything before it that it could depend on is done.
+ *
+ * The first write that isn't answered with a 2xx stops the rest, and fails the
+ * commit so the transaction is rolled back.
+ */
+static int xSync(sqlite3_vtab *pvtab) {
+    vttp_vtab *vtab = (vttp_vtab *) pvtab;
+    const struct bulk *pending = &vtab->pending;
+
+    struct write_flight flight[BULK_IN_FLIGHT];
+    size_t n_flight = 0;
+
+    int rc = SQLITE_OK;
+    for (size_t off = 0, n = 0; off < pending->len && rc == SQLITE_OK; off += n) {
+        n = bulk_run(pending, off, vtab->bulk_size);
+        if (n_flight == BULK_IN_FLIGHT
+            || !joins_flight(pending, flight, n_flight, off))
+        {
+            rc = finish_writes(vtab, flight, n_flight);
+            n_flight = 0;
+            if (rc != SQLITE_OK)
+                break;
+        }
+
+        rc = send_writes(vtab, off, n, &flight[n_flight]);
+        if (rc == SQLITE_OK)
+            n_flight++;
+    }
+
+    int done_rc = finish_writes(vtab, flight, n_flight);
+    return rc != SQLITE_OK ? rc : done_rc;
+}
+
+static int xCommit(sqlite3_vtab *pvtab) {
+    bulk_clear(&((vttp_vtab *) pvtab)->pending);
+    return SQLITE_OK;
+}
+
+static int xRollback(sqlite3_vtab *pvtab) {
+    bulk_clear(&((vttp_vtab *) pvtab)->pending);
     return SQLITE_OK;
 }
 
@@ -502,19 +1301,230 @@ static sqlite3_module vttp = {
     .xEof=xEof,
     .xColumn=xColumn,
     .xRowid=xRowid,
-    .xUpdate=NULL,
-    .xBegin=NULL,
-    .xSync=NULL,
-    .xCommit=NULL,
-    .xRollback=NULL,
+    .xUpdate=xUpdate,
+    .xBegin=xBegin,
+    .xSync=xSync,
+    .xCommit=xCommit,
+    .xRollback=xRollback,
     .xFindFunction=NULL
 };
 
+/*
+ * vttp_stats: one row per lib/stats.h counter, timer and peak, as they stand when
+ * the scan starts. SELECT from it by name, it's eponymous and can't be created.
+ *
+ * Those are the totals, with a NULL origin. A scan with a condition on the hidden
+ * origin column has another set of rows for every origin, for the condition to
+ * pick from.
+ */
+
+#define STATS_COL_NAME 0
+#define STATS_COL_KIND 1
+#define STATS_COL_VALUE 2
+#define STATS_COL_COUNT 3
+#define STATS_COL_P50 4
+#define STATS_COL_P90 5
+#define STATS_COL_P99 6
+#define STATS_COL_MAX 7
+#define STATS_COL_ORIGIN 8
+
+#define NUM_STATS_ROWS (NUM_STAT_COUNTERS + NUM_STAT_TIMERS + NUM_STAT_PEAKS)
+
+typedef struct {
+    sqlite3_vtab_cursor base;
+    struct stats stats;
+    struct origin_stats *origins;   // every origin's, after the totals in STATS
+    ssize_t num_origins;
+    int row;
+} stats_cursor_t;
+
+static int statsConnect(sqlite3 *db, void *paux, int argc, const char *const *argv,
+                        sqlite3_vtab **pp_vtab, char **pz_err)
+{
+    (void) paux, (void) argc, (void) argv, (void) pz_err;
+    int rc = sqlite3_declare_vtab(db, "create table x(name text, kind text, "
+        "value integer, count integer, p50 integer, p90 integer, p99 integer, max integer, "
+        "origin text hidden)");
+    if (rc != SQLITE_OK)
+        return rc;
+
+    *pp_vtab = sqlite3_malloc(sizeof(sqlite3_vtab));
+    if (!*pp_vtab)
+        return SQLITE_NOMEM;
+    memset(*pp_vtab, 0, sizeof(sqlite3_vtab));
+    return SQLITE_OK;
+}
+
+static int statsDisconnect(sqlite3_vtab *pvtab) {
+    sqlite3_free(pvtab);
+    return SQLITE_OK;
+}
+
+static int statsBestIndex(sqlite3_vtab *pvtab, sqlite3_index_info *info) {
+    (void) pvtab;
+    // SQLite still checks the condition on every row, we just add the ones it picks from
+    info->idxNum = 0;
+    for (int i = 0; i < info->nConstraint; i++) {
+        if (info->aConstraint[i].iColumn == STATS_COL_ORIGIN && info->aConstraint[i].usable)
+            info->idxNum = 1;
+    }
+    info->estimatedCost = NUM_STATS_ROWS;
+    info->estimatedRows = NUM_STATS_ROWS;
+    return SQLITE_OK;
+}
+
+static int statsOpen(sqlite3_vtab *pvtab, sqlite3_vtab_cursor **pp_cursor) {
+    (void) pvtab;
+    stats_cursor_t *cur = sqlite3_malloc(sizeof(stats_cursor_t));
+    if (!cur)
+        return SQLITE_NOMEM;
+    memset(cur, 0, sizeof(stats_cursor_t));
+    *pp_cursor = &cur->base;
+    return SQLITE_OK;
+}
+
+static void statsClear(stats_cursor_t *cur) {
+    if (cur->origins)
+        stats_origins_free(cur->origins, cur->num_origins);
+    cur->origins = NULL;
+    cur->num_origins = 0;
+}
+
+static int statsClose(sqlite3_vtab_cursor *cur) {
+    statsClear((stats_cursor_t *) cur);
+    sqlite3_free(cur);
+    return SQLITE_OK;
+}
+
+static int statsFilter(sqlite3_vtab_cursor *pcursor, int idxNum, const char *idxStr,
+                       int argc, sqlite3_value **argv)
+{
+    (void) idxStr, (void) argc, (void) argv;
+    stats_cursor_t *cur = (stats_cursor_t *) pcursor;
+    statsClear(cur);
+    stats_read(&cur->stats);
+    if (idxNum == 1 && (cur->num_origins = stats_read_origins(&cur->origins)) < 0) {
+        cur->num_origins = 0;
+        return SQLITE_NOMEM;
+    }
+    cur->row = 0;
+    return SQLITE_OK;
+}
+
+static int statsNext(sqlite3_vtab_cursor *pcursor) {
+    ((stats_cursor_t *) pcursor)->row++;
+    return SQLITE_OK;
+}
+
+static int statsEof(sqlite3_vtab_cursor *pcursor) {
+    stats_cursor_t *cur = (stats_cursor_t *) pcursor;
+    return cur->row >= NUM_STATS_ROWS * (1 + cur->num_origins);
+}
+
+static int statsColumn(sqlite3_vtab_cursor *pcursor, sqlite3_context *pctx, int icol) {
+    stats_cursor_t *cur = (stats_cursor_t *) pcursor;
+    // the totals come first, then each origin's
+    int set = cur->row / NUM_STATS_ROWS;
+    int row = cur->row % NUM_STATS_ROWS;
+    const struct stats *stats = set == 0 ? &cur->stats : &cur->origins[set - 1].stats;
+    if (icol == STATS_COL_ORIGIN) {
+        if (set > 0)
+            sqlite3_result_text(pctx, cur->origins[set - 1].origin, -1, SQLITE_TRANSIENT);
+        return SQLITE_OK;
+    }
+
+    if (row < NUM_STAT_COUNTERS) {
+        if (icol == STATS_COL_NAME)
+            sqlite3_result_text(pctx, STAT_COUNTER_NAMES[row], -1, SQLITE_STATIC);
+        else if (icol == STATS_COL_KIND)
+            sqlite3_result_text(pctx, "counter", -1, SQLITE_STATIC);
+        else if (icol == STATS_COL_VALUE)
+            sqlite3_result_int64(pctx, stats->counters[row]);
+        return SQLITE_OK;
+    }
+
+    row -= NUM_STAT_COUNTERS;
+    if (row < NUM_STAT_TIMERS) {
+        const struct stat_histogram *h = &stats->timers[row];
+        switch (icol) {
+        case STATS_COL_NAME:
+            sqlite3_result_text(pctx, STAT_TIMER_NAMES[row], -1, SQLITE_STATIC);
+            break;
+        case STATS_COL_KIND:
+            sqlite3_result_text(pctx, "timer", -1, SQLITE_STATIC);
+            break;
+        case STATS_COL_VALUE:
+            sqlite3_result_int64(pctx, h->sum);
+            break;
+        case STATS_COL_COUNT:
+            sqlite3_result_int64(pctx, h->count);
+            break;
+        case STATS_COL_P50:
+            sqlite3_result_int64(pctx, stats_percentile(h, 0.5));
+            break;
+        case STATS_COL_P90:
+            sqlite3_result_int64(pctx, stats_percentile(h, 0.9));
+            break;
+        case STATS_COL_P99:
+            sqlite3_result_int64(pctx, stats_percentile(h, 0.99));
+            break;
+        case STATS_COL_MAX:
+            sqlite3_result_int64(pctx, h->max);
+            break;
+        }
+        return SQLITE_OK;
+    }
+
+    row -= NUM_STAT_TIMERS;
+    if (icol == STATS_COL_NAME)
+        sqlite3_result_text(pctx, STAT_PEAK_NAMES[row], -1, SQLITE_STATIC);
+    else if (icol == STATS_COL_KIND)
+        sqlite3_result_text(pctx, "peak", -1, SQLITE_STATIC);
+    else if (icol == STATS_COL_VALUE || icol == STATS_COL_MAX)
+        sqlite3_result_int64(pctx, stats->peaks[row]);
+    return SQLITE_OK;
+}
+
+static int statsRowid(sqlite3_vtab_cursor *pcursor, sqlite3_int64 *prowid) {
+    *prowid = ((stats_cursor_t *) pcursor)->row;
+    return SQLITE_OK;
+}
+
+static sqlite3_module vttp_stats = {
+    .iVersion=0,
+    .xCreate=NULL, // eponymous only
+    .xConnect=statsConnect,
+    .xBestIndex=statsBestIndex,
+    .xDisconnect=statsDisconnect,
+    .xDestroy=statsDisconnect,
+    .xOpen=statsOpen,
+    .xClose=statsClose,
+    .xFilter=statsFilter,
+    .xNext=statsNext,
+    .xEof=statsEof,
+    .xColumn=statsColumn,
+    .xRowid=statsRowid,
+};
+
 // Runtime loadable entry
 int sqlite3_vttp_init(sqlite3 *db, char **pzErrMsg,
                        const sqlite3_api_routines *pApi) {
     SQLITE_EXTENSION_INIT2(pApi);
     // oh yeah baby
     int rc = sqlite3_create_module(db, "vttp", &vttp, 0);
+    if (rc == SQLITE_OK)
+        rc = sqlite3_create_module(db, "vttp_stats", &vttp_stats, 0);
     return rc;
 }
+
+#undef PLAN_BATCH
+#undef NUM_STATS_ROWS
+#undef STATS_COL_NAME
+#undef STATS_COL_KIND
+#undef STATS_COL_VALUE
+#undef STATS_COL_COUNT
+#undef STATS_COL_P50
+#undef STATS_COL_P90
+#undef STATS_COL_P99
+#undef STATS_COL_MAX
+#undef STATS_COL_ORIGIN
@@ -0,0 +1,67 @@
+import { expect, describe, it, beforeAll, afterAll } from "vitest";
+import Database from "better-sqlite3";
+import { createServer } from "node:http";
+import { checkExtensionExists } from "./common.js";
+
+describe("batched lookups", () => {
+    beforeAll(checkExtensionExists);
+
+    // answers each id in the posted array with that many rows
+    let requests = 0;
+    const server = createServer((req, res) => {
+        requests++;
+        let body = "";
+        req.on("data", (chunk) => body += chunk);
+        req.on("end", () => {
+            const ids = JSON.parse(body);
+            res.setHeader("content-type", "application/json");
+            res.end(JSON.stringify(ids.map((id) =>
+                Array.from({ length: id }, (_, n) => ({ name: `user ${id}.${n}` })))));
+        });
+    });
+
+    let db;
+    beforeAll(() => new Promise((resolve) => {
+        server.listen(0, "127.0.0.1", () => {
+            db = new Database().loadExtension("./libvttp");
+            db.exec(`create virtual table users using vttp (
+                url text default 'http://127.0.0.1:${server.address().port}/lookup',
+                batch = 'array',
+                batch_size = 2,
+                name text
+            );
+            create table orders (id int, user_id text);
+            insert into orders values (10, '1'), (11, '3'), (12, '2'), (13, '3');`);
+            resolve();
+        });
+    }));
+
+    afterAll(() => server.close());
+
+    it("looks up batch_size bodies per request", () => {
+        requests = 0;
+        const rows = db.prepare(`select body, name from users
+            where body in ('1', '2', '3') order by name`).all();
+        expect(rows).toEqual([
+            { body: "1", name: "user 1.0" },
+            { body: "2", name: "user 2.0" },
+            { body: "2", name: "user 2.1" },
+            { body: "3", name: "user 3.0" },
+            { body: "3", name: "user 3.1" },
+            { body: "3", name: "user 3.2" },
+        ]);
+        expect(requests).toBe(2);
+    });
+
+    it("joins rows back onto the bodies they answer", () => {
+        requests = 0;
+        const rows = db.prepare(`select orders.id, count(*) as n
+            from users join orders on users.body = orders.user_id
+            where users.body in (select user_id from orders)
+            group by orders.id order by orders.id`).all();
+        expect(rows).toEqual([
+            { id: 10, n: 1 }, { id: 11, n: 3 }, { id: 12, n: 2 }, { id: 13, n: 3 },
+        ]);
+        expect(requests).toBe(2);
+    });
+});
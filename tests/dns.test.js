@@ -0,0 +1,58 @@
+import { expect, describe, it, beforeAll, afterAll } from "vitest";
+import Database from "better-sqlite3";
+import { mkdtempSync, rmSync, writeFileSync } from "node:fs";
+import { createServer } from "node:http";
+import { tmpdir } from "node:os";
+import path from "node:path";
+import { checkExtensionExists } from "./common.js";
+
+const listen = (host, port, rows) => new Promise((resolve) => {
+    const server = createServer((req, res) => {
+        res.setHeader("content-type", "application/json");
+        res.end(JSON.stringify(Array.from({ length: rows }, (_, id) => ({ id }))));
+    });
+    server.listen(port, host, () => resolve(server));
+});
+
+describe("DNS cache", () => {
+    beforeAll(checkExtensionExists);
+
+    // resolve vttp.test through a hosts file instead of a real nameserver
+    const dir = mkdtempSync(path.join(tmpdir(), "vttp-dns-"));
+    const hosts = path.join(dir, "hosts");
+    process.env.VTTP_HOSTS = hosts;
+
+    // same port on both addresses, so only the resolved address tells them apart
+    let first, second;
+    beforeAll(async () => {
+        first = await listen("127.0.0.1", 0, 3);
+        second = await listen("127.0.0.2", first.address().port, 5);
+    });
+
+    afterAll(() => {
+        first.close();
+        second.close();
+        rmSync(dir, { recursive: true, force: true });
+        delete process.env.VTTP_HOSTS;
+    });
+
+    it("caches answers until they expire", async () => {
+        const port = first.address().port;
+        const db = new Database().loadExtension("./libvttp");
+        db.exec(`create virtual table rows using vttp (
+            id int,
+            url text default 'http://vttp.test:${port}/'
+        );`);
+        const count = () => db.prepare(`select count(*) as n from rows`).get().n;
+
+        writeFileSync(hosts, "127.0.0.1 vttp.test\n");
+        expect(count()).toBe(3);
+
+        // still cached, the hosts file isn't read again yet
+        writeFileSync(hosts, "127.0.0.2 vttp.test\n");
+        expect(count()).toBe(3);
+
+        await new Promise((resolve) => setTimeout(resolve, 1500));
+        expect(count()).toBe(5);
+    });
+});
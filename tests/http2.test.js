@@ -0,0 +1,62 @@
+import { expect, describe, it, beforeAll, afterAll } from "vitest";
+import Database from "better-sqlite3";
+import { execSync } from "node:child_process";
+import { mkdtempSync, readFileSync, rmSync } from "node:fs";
+import { createSecureServer } from "node:http2";
+import { tmpdir } from "node:os";
+import path from "node:path";
+import { checkExtensionExists } from "./common.js";
+
+const ROWS = 500;
+
+describe("HTTP/2", () => {
+    beforeAll(checkExtensionExists);
+
+    const dir = mkdtempSync(path.join(tmpdir(), "vttp-h2-"));
+    execSync(
+        `openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=localhost \
+            -keyout key.pem -out cert.pem`,
+        { cwd: dir, stdio: "ignore" },
+    );
+
+    let sessions = 0;
+    const server = createSecureServer({
+        key: readFileSync(path.join(dir, "key.pem")),
+        cert: readFileSync(path.join(dir, "cert.pem")),
+        allowHTTP1: true,
+    });
+    server.on("session", () => sessions++);
+    server.on("stream", (stream) => {
+        stream.respond({ ":status": 200, "content-type": "application/json" });
+        const rows = Array.from({ length: ROWS }, (_, id) => ({ id, title: `row ${id}` }));
+        stream.end(JSON.stringify(rows));
+    });
+
+    let url;
+    beforeAll(() => new Promise((resolve) => {
+        server.listen(0, "127.0.0.1", () => {
+            url = `https://127.0.0.1:${server.address().port}/rows`;
+            resolve();
+        });
+    }));
+
+    afterAll(() => {
+        server.close();
+        rmSync(dir, { recursive: true, force: true });
+    });
+
+    it("shares one connection across queries to the same origin", () => {
+        const db = new Database().loadExtension("./libvttp");
+        db.exec(`create virtual table rows using vttp (
+            id int,
+            title text,
+            url text default '${url}'
+        );`);
+        for (let i = 0; i < 5; i++) {
+            const rows = db.prepare(`select * from rows`).all();
+            expect(rows.length).toBe(ROWS);
+            expect(rows[ROWS - 1]).toEqual({ id: ROWS - 1, title: `row ${ROWS - 1}` });
+        }
+        expect(sessions).toBe(1);
+    });
+});
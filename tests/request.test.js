@@ -0,0 +1,176 @@
+import { expect, describe, it, beforeAll, afterAll } from "vitest";
+import Database from "better-sqlite3";
+import { createServer } from "node:http";
+import { checkExtensionExists } from "./common.js";
+
+describe("request method, headers and body", () => {
+    beforeAll(checkExtensionExists);
+
+    // answers with what it was sent, except for the first try of each /flaky url
+    const flaked = new Set();
+    const server = createServer((req, res) => {
+        let length = 0;
+        req.on("data", (chunk) => length += chunk.length);
+        req.on("end", () => {
+            if (req.url.startsWith("/slow"))
+                return;
+            if (req.url.startsWith("/flaky") && !flaked.has(req.url)) {
+                flaked.add(req.url);
+                res.writeHead(503, { "retry-after": "0" }).end();
+                return;
+            }
+            res.statusCode = req.url.startsWith("/missing") ? 404 : 200;
+            res.setHeader("content-type", "application/json");
+            res.end(JSON.stringify({
+                verb: req.method,
+                path: req.url,
+                length,
+                type: req.headers["content-type"] ?? null,
+                token: req.headers["x-token"] ?? null,
+            }));
+        });
+    });
+
+    let db;
+    beforeAll(() => new Promise((resolve) => {
+        server.listen(0, "127.0.0.1", () => {
+            db = new Database().loadExtension("./libvttp");
+            db.exec(`create virtual table echo using vttp (
+                url text default 'http://127.0.0.1:${server.address().port}/search?q=1',
+                verb text,
+                path text,
+                length int,
+                type text,
+                token text
+            );`);
+            db.exec(`create virtual table retried using vttp (
+                retries = 2,
+                verb text,
+                path text
+            );`);
+            db.exec(`create virtual table limited using vttp (
+                url text default 'http://127.0.0.1:${server.address().port}/limited',
+                rate = 2,
+                burst = 1,
+                max_in_flight = 1,
+                path text
+            );`);
+            resolve();
+        });
+    }));
+
+    afterAll(() => server.close());
+
+    it("sends a GET by default", () => {
+        const row = db.prepare(`select verb, path, length from echo`).get();
+        expect(row).toEqual({ verb: "GET", path: "/search?q=1", length: 0 });
+    });
+
+    it("POSTs the body with its headers", () => {
+        const row = db.prepare(`select verb, length, type, token from echo
+            where headers = 'Content-Type: application/json' || char(10) || 'X-Token: abc'
+              and body = ?`).get(JSON.stringify({ q: "title" }));
+        expect(row).toEqual({ verb: "POST", length: 13, type: "application/json", token: "abc" });
+    });
+
+    it("streams out a large body with the given method", () => {
+        const body = "x".repeat(4 * 1024 * 1024);
+        const row = db.prepare(`select verb, length from echo
+            where method = 'put' and body = ?`).get(body);
+        expect(row).toEqual({ verb: "PUT", length: body.length });
+    });
+
+    it("reads the status, headers and timing of the response", () => {
+        const port = server.address().port;
+        const rows = db.prepare(`select path, _status as status,
+                json_extract(_response_headers, '$.content-type') as type,
+                _ttfb_ms >= 0 as timed, _bytes > 0 as counted
+            from echo where url in (?, ?)`)
+            .all(`http://127.0.0.1:${port}/found`, `http://127.0.0.1:${port}/missing`);
+        expect(rows).toEqual([
+            { path: "/found", status: 200, type: "application/json", timed: 1, counted: 1 },
+            { path: "/missing", status: 404, type: "application/json", timed: 1, counted: 1 },
+        ]);
+    });
+
+    it("leaves the response columns out of select *", () => {
+        const row = db.prepare(`select * from echo`).get();
+        expect(Object.keys(row)).toEqual(["verb", "path", "length", "type", "token"]);
+    });
+
+    it("counts and times every fetch in vttp_stats", () => {
+        const before = db.prepare(`select value from vttp_stats where name = 'fetches'`).pluck().get();
+        db.prepare(`select * from echo`).all();
+
+        const stats = Object.fromEntries(db.prepare(`select name, value, count from vttp_stats`)
+            .all().map((row) => [row.name, row]));
+        expect(stats.fetches.value).toBe(before + 1);
+        expect(stats.rows.value).toBeGreaterThan(0);
+        expect(stats.ttfb_ms.count).toBeGreaterThan(0);
+    });
+
+    it("splits vttp_stats by origin", () => {
+        const origin = `http://127.0.0.1:${server.address().port}`;
+        const fetches = db.prepare(`select value from vttp_stats where origin = ? and name = 'fetches'`).pluck();
+        const before = fetches.get(origin) ?? 0;
+        db.prepare(`select * from echo`).all();
+
+        expect(fetches.get(origin)).toBe(before + 1);
+        const origins = db.prepare(`select distinct origin from vttp_stats where origin is not null`)
+            .pluck().all();
+        expect(origins).toContain(origin);
+        // without a condition on the origin it's just the totals
+        expect(db.prepare(`select count(*) from vttp_stats where name = 'fetches'`).pluck().get()).toBe(1);
+    });
+
+    it("rejects a malformed header", () => {
+        expect(() => db.prepare(`select * from echo where headers = 'no colon'`).all())
+            .toThrow();
+    });
+
+    it("gives up on a response slower than its timeout", () => {
+        const port = server.address().port;
+        const timeouts = db.prepare(`select value from vttp_stats where name = 'timeouts'`).pluck();
+        const before = timeouts.get();
+        expect(() => db.prepare(`select * from echo where url = ? and timeout = 'first_byte=200'`)
+            .all(`http://127.0.0.1:${port}/slow`)).toThrow(/first byte timeout of 200ms/);
+        expect(timeouts.get()).toBe(before + 1);
+    });
+
+    it("rejects a malformed timeout", () => {
+        expect(() => db.prepare(`select * from echo where timeout = 'soon'`).all())
+            .toThrow(/bad timeout/);
+    });
+
+    it("tries a GET again after a 503", () => {
+        const port = server.address().port;
+        const retries = db.prepare(`select value from vttp_stats where name = 'retries'`).pluck();
+        const before = retries.get();
+        const rows = db.prepare(`select verb, path, _status as status from retried where url = ?`)
+            .all(`http://127.0.0.1:${port}/flaky?q=1`);
+        expect(rows).toEqual([{ verb: "GET", path: "/flaky?q=1", status: 200 }]);
+        expect(retries.get()).toBe(before + 1);
+    });
+
+    it("leaves a 503 alone without retries", () => {
+        const port = server.address().port;
+        const rows = db.prepare(`select _status as status from echo where url = ?`)
+            .all(`http://127.0.0.1:${port}/flaky?q=2`);
+        expect(rows).toEqual([]);
+    });
+
+    it("holds requests to an origin to its rate", () => {
+        const throttled = db.prepare(`select count from vttp_stats where name = 'throttle_ms'`).pluck();
+        const before = throttled.get();
+        const started = Date.now();
+        const paths = [1, 2, 3].map(() => db.prepare(`select path from limited`).pluck().get());
+        expect(paths).toEqual(["/limited", "/limited", "/limited"]);
+        expect(Date.now() - started).toBeGreaterThanOrEqual(900);
+        expect(throttled.get()).toBe(before + 2);
+    });
+
+    it("rejects a malformed rate", () => {
+        expect(() => db.exec(`create virtual table badrate using vttp (rate = 'lots', id int)`))
+            .toThrow(/bad rate/);
+    });
+});
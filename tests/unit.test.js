@@ -29,10 +29,10 @@ describe("C unit tests", () => {
     console.log("Deleted test binaries");
   });
 
-  it("cfns.c", () => {
+  it("pyc.c", () => {
     // compile
     runQuiet(
-      "gcc cfns.test.c cfns.c -lcriterion -o cfns.test.out",
+      "gcc pyc.test.c pyc.c -lcriterion -o pyc.test.out",
       {
         cwd: ROOT,
       }
@@ -40,14 +40,64 @@ describe("C unit tests", () => {
 
     // run
     runQuiet(
-      "./cfns.test.out --verbose",
+      "./pyc.test.out --verbose",
       {
         cwd: ROOT,
       }
     );
 
     runQuiet(
-      "valgrind --leak-check=full --show-leak-kinds=all --error-exitcode=1 ./cfns.test.out --verbose",
+      "valgrind --leak-check=full --show-leak-kinds=all --error-exitcode=1 ./pyc.test.out --verbose",
+      {
+        cwd: ROOT,
+      }
+    );
+  });
+
+  it("headers.c", () => {
+    // compile
+    runQuiet(
+      "gcc headers.test.c headers.c -lcriterion -o headers.test.out",
+      {
+        cwd: ROOT,
+      }
+    );
+
+    // run
+    runQuiet(
+      "./headers.test.out --verbose",
+      {
+        cwd: ROOT,
+      }
+    );
+
+    runQuiet(
+      "valgrind --leak-check=full --show-leak-kinds=all --error-exitcode=1 ./headers.test.out --verbose",
+      {
+        cwd: ROOT,
+      }
+    );
+  });
+
+  it("sql.c", () => {
+    // compile
+    runQuiet(
+      "gcc sql.test.c sql.c path.c pyc.c -lcriterion -lyyjson -o sql.test.out",
+      {
+        cwd: ROOT,
+      }
+    );
+
+    // run
+    runQuiet(
+      "./sql.test.out --verbose",
+      {
+        cwd: ROOT,
+      }
+    );
+
+    runQuiet(
+      "valgrind --leak-check=full --show-leak-kinds=all --error-exitcode=1 ./sql.test.out --verbose",
       {
         cwd: ROOT,
       }
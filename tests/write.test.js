@@ -0,0 +1,141 @@
+import { expect, describe, it, beforeAll, afterAll } from "vitest";
+import Database from "better-sqlite3";
+import { createServer } from "node:http";
+import { checkExtensionExists } from "./common.js";
+
+describe("write-through", () => {
+    beforeAll(checkExtensionExists);
+
+    // a todo list that records every write it's sent
+    let requests = [];
+    let contentType;
+    const todos = new Map();
+    const server = createServer((req, res) => {
+        let body = "";
+        req.on("data", (chunk) => body += chunk);
+        req.on("end", () => {
+            const row = body ? JSON.parse(body) : null;
+            const id = Number(new URL(req.url, "http://x").pathname.split("/")[2]);
+            if (req.method !== "GET") {
+                requests.push({ verb: req.method, path: req.url, body: row });
+                contentType = req.headers["content-type"];
+            }
+            if (req.method === "PUT" && id === 13) {
+                res.statusCode = 422;
+                res.end(JSON.stringify({ error: "unlucky" }));
+                return;
+            }
+            if (req.method === "POST")
+                row.forEach((todo) => todos.set(todo.id, todo));
+            if (req.method === "PUT")
+                todos.set(id, row);
+            if (req.method === "DELETE")
+                todos.delete(id);
+            res.setHeader("content-type", "application/json");
+            res.end(JSON.stringify([...todos.values()]));
+        });
+    });
+
+    let db;
+    beforeAll(() => new Promise((resolve) => {
+        server.listen(0, "127.0.0.1", () => {
+            db = new Database().loadExtension("./libvttp");
+            db.exec(`create virtual table todos using vttp (
+                url text default 'http://127.0.0.1:${server.address().port}/todos',
+                key = 'id',
+                bulk_size = 100,
+                id int,
+                title text,
+                tags text
+            );`);
+            db.exec(`create virtual table sniffed_todos using vttp (
+                url text default 'http://127.0.0.1:${server.address().port}/todos',
+                headers text default 'X-Content-Type-Options: nosniff',
+                key = 'id',
+                id int,
+                title text
+            );`);
+            db.exec(`create virtual table home_todos using vttp (
+                url text default 'http://127.0.0.1:${server.address().port}/todos?list=home',
+                key = 'id',
+                id int,
+                title text
+            );`);
+            resolve();
+        });
+    }));
+
+    afterAll(() => server.close());
+
+    it("inserts rows in bulk once the transaction commits", () => {
+        requests = [];
+        const insert = db.prepare(`insert into todos (id, title, tags) values (?, ?, ?)`);
+        db.transaction(() => {
+            for (let id = 0; id < 250; id++)
+                insert.run(id, `todo ${id}`, JSON.stringify(["a"]));
+            expect(requests).toHaveLength(0);
+        })();
+
+        expect(requests.map((r) => r.body.length)).toEqual([100, 100, 50]);
+        expect(requests.every((r) => r.verb === "POST" && r.path === "/todos")).toBe(true);
+        expect(requests[0].body[1]).toEqual({ id: 1, title: "todo 1", tags: ["a"] });
+    });
+
+    it("updates and deletes by key", () => {
+        requests = [];
+        db.prepare(`update todos set title = 'done' where id = 7`).run();
+        expect(requests).toEqual([
+            { verb: "PUT", path: "/todos/7", body: { id: 7, title: "done", tags: ["a"] } },
+        ]);
+
+        requests = [];
+        db.prepare(`delete from todos where id >= 200`).run();
+        expect(requests).toHaveLength(50);
+        expect(requests.every((r) => r.verb === "DELETE")).toBe(true);
+        expect(todos.size).toBe(200);
+    });
+
+    it("drops the writes of a rolled back transaction", () => {
+        requests = [];
+        expect(() => db.transaction(() => {
+            db.prepare(`insert into todos (id, title) values (1, 'x')`).run();
+            throw new Error("rollback");
+        })()).toThrow("rollback");
+        expect(requests).toHaveLength(0);
+    });
+
+    it("fails the commit when a write isn't answered with a 2xx", () => {
+        requests = [];
+        expect(() => db.prepare(`update todos set title = 'x' where id = 13`).run())
+            .toThrow(/PUT http:\/\/127\.0\.0\.1:\d+\/todos\/13 answered 422/);
+        expect(requests).toHaveLength(1);
+        expect(todos.get(13).title).toBe("todo 13");
+    });
+
+    it("only counts a header named content-type as one", () => {
+        requests = [];
+        db.prepare(`insert into sniffed_todos (id, title) values (300, 'x')`).run();
+        expect(requests).toHaveLength(1);
+        expect(contentType).toBe("application/json");
+    });
+
+    it("puts the key ahead of the url's query string", () => {
+        requests = [];
+        db.prepare(`update home_todos set title = 'home' where id = 8`).run();
+        expect(requests.map((r) => [r.verb, r.path])).toEqual([["PUT", "/todos/8?list=home"]]);
+        expect(todos.get(8).title).toBe("home");
+    });
+
+    it("won't update or delete a row whose key is NULL", () => {
+        db.prepare(`insert into todos (id, title) values (null, 'no key')`).run();
+        expect(todos.get(null).title).toBe("no key");
+
+        requests = [];
+        expect(() => db.prepare(`update todos set title = 'x' where title = 'no key'`).run())
+            .toThrow("(vttp) can't UPDATE a row whose key is NULL");
+        expect(() => db.prepare(`delete from todos where title = 'no key'`).run())
+            .toThrow("(vttp) can't DELETE a row whose key is NULL");
+        expect(requests).toHaveLength(0);
+        todos.delete(null);
+    });
+});